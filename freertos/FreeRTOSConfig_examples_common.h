@@ -85,9 +85,21 @@
 #define configUSE_DAEMON_TASK_STARTUP_HOOK      0
 
 /* Run time and task stats gathering related definitions. */
+#ifndef configGENERATE_RUN_TIME_STATS
 #define configGENERATE_RUN_TIME_STATS           0
+#endif
 #define configUSE_TRACE_FACILITY                1
 #define configUSE_STATS_FORMATTING_FUNCTIONS    0
+#if configGENERATE_RUN_TIME_STATS
+/* Count in microseconds with the 64 bit timer, which doesn't wrap and is already running */
+#ifndef __ASSEMBLER__
+#include <stdint.h>
+extern uint64_t time_us_64(void);
+#endif
+#define configRUN_TIME_COUNTER_TYPE             uint64_t
+#define portCONFIGURE_TIMER_FOR_RUN_TIME_STATS()
+#define portGET_RUN_TIME_COUNTER_VALUE()        time_us_64()
+#endif
 
 /* Co-routine related definitions. */
 #define configUSE_CO_ROUTINES                   0
@@ -156,6 +168,9 @@ to exclude the API function. */
 #endif
 
 /* A header file that defines trace macro can be included here. */
+#if FREERTOS_PROFILER
+#include "freertos_profiler_trace.h"
+#endif
 
 #endif /* FREERTOS_CONFIG_H */
 
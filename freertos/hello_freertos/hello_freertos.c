@@ -16,6 +16,12 @@
 #include "FreeRTOS.h"
 #include "task.h"
 
+#if FREERTOS_PROFILER
+#include "freertos_profiler.h"
+// Time between profiler snapshots, use profiler_report.py to make sense of them
+#define PROFILER_PERIOD_MS 5000
+#endif
+
 // Which core to run on if configNUMBER_OF_CORES==1
 #ifndef RUN_FREE_RTOS_ON_CORE
 #define RUN_FREE_RTOS_ON_CORE 0
@@ -129,6 +135,9 @@ void main_task(__unused void *params) {
     async_context_t *context = create_async_context();
     // start the worker running
     async_context_add_at_time_worker_in_ms(context, &worker_timeout, 0);
+#if FREERTOS_PROFILER
+    freertos_profiler_start(PROFILER_PERIOD_MS);
+#endif
 #if USE_LED
     // start the led blinking
 #if configSUPPORT_STATIC_ALLOCATION
@@ -0,0 +1,176 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "pico/stdlib.h"
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "freertos_profiler.h"
+
+#if !configGENERATE_RUN_TIME_STATS || !configUSE_TRACE_FACILITY
+#error freertos_profiler needs configGENERATE_RUN_TIME_STATS and configUSE_TRACE_FACILITY
+#endif
+
+// Each task is given a slot the first time it's switched in, and its task number is set to the
+// slot number plus one so it can be found again quickly. The slots are only written from the
+// context switch on the core concerned, so the cores don't need to share anything but next_slot,
+// which is only changed with the kernel's lock held
+typedef struct profiler_slot_t_ {
+    uint32_t time_us[configNUMBER_OF_CORES];
+    uint32_t switches;
+} profiler_slot_t;
+
+#define NO_SLOT (FREERTOS_PROFILER_MAX_TASKS + 1)
+
+#if configNUMBER_OF_CORES > 1
+#define current_core() portGET_CORE_ID()
+#else
+#define current_core() 0
+#endif
+
+static profiler_slot_t slots[FREERTOS_PROFILER_MAX_TASKS];
+static UBaseType_t next_slot;
+
+static TaskHandle_t switched_out[configNUMBER_OF_CORES];
+static uint32_t switched_in_us[configNUMBER_OF_CORES];
+static bool started[configNUMBER_OF_CORES];
+
+static uint32_t period_ms;
+
+static profiler_slot_t *get_slot(TaskHandle_t task, bool assign) {
+    UBaseType_t number = uxTaskGetTaskNumber(task);
+    if (number == 0) {
+        if (!assign) {
+            return NULL;
+        }
+        number = next_slot < FREERTOS_PROFILER_MAX_TASKS ? ++next_slot : NO_SLOT;
+        vTaskSetTaskNumber(task, number);
+    }
+    return number == NO_SLOT ? NULL : &slots[number - 1];
+}
+
+// Called by the kernel, with its lock held, just before it picks the task to run next on this core
+void freertos_profiler_switched_out(void) {
+    switched_out[current_core()] = xTaskGetCurrentTaskHandle();
+}
+
+// Called by the kernel just after it has picked the task to run next, which may be the same one
+void freertos_profiler_switched_in(void) {
+    uint core = current_core();
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    if (started[core] && task == switched_out[core]) {
+        return;
+    }
+    uint32_t now_us = time_us_32();
+    if (started[core]) {
+        profiler_slot_t *slot = get_slot(switched_out[core], true);
+        if (slot) {
+            slot->time_us[core] += now_us - switched_in_us[core];
+        }
+    }
+    profiler_slot_t *slot = get_slot(task, true);
+    if (slot) {
+        slot->switches++;
+    }
+    switched_in_us[core] = now_us;
+    started[core] = true;
+}
+
+static char state_char(eTaskState state) {
+    switch (state) {
+        case eRunning: return 'X';
+        case eReady: return 'R';
+        case eBlocked: return 'B';
+        case eSuspended: return 'S';
+        case eDeleted: return 'D';
+        default: return '?';
+    }
+}
+
+static void append(char *buf, size_t size, size_t *len, const char *format, ...) {
+    if (*len >= size - 1) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buf + *len, size - *len, format, args);
+    va_end(args);
+    if (n > 0) {
+        *len = MIN(*len + n, size - 1);
+    }
+}
+
+void freertos_profiler_snapshot(void) {
+    static TaskStatus_t status[FREERTOS_PROFILER_MAX_TASKS];
+    static char line[64 + FREERTOS_PROFILER_MAX_TASKS * (configMAX_TASK_NAME_LEN + 16 + 11 * (configNUMBER_OF_CORES + 7))];
+    size_t len = 0;
+
+    // Stop the tasks from being deleted while we look at them
+    vTaskSuspendAll();
+    uint64_t now_us = time_us_64();
+    UBaseType_t count = uxTaskGetSystemState(status, FREERTOS_PROFILER_MAX_TASKS, NULL);
+
+#if configSUPPORT_DYNAMIC_ALLOCATION
+    HeapStats_t heap;
+    vPortGetHeapStats(&heap);
+    append(line, sizeof(line), &len, "PROF %d %llu %d %u %u %u %u %u %u", FREERTOS_PROFILER_VERSION,
+           (unsigned long long)now_us, configNUMBER_OF_CORES, (unsigned)heap.xAvailableHeapSpaceInBytes,
+           (unsigned)heap.xMinimumEverFreeBytesRemaining, (unsigned)heap.xSizeOfLargestFreeBlockInBytes,
+           (unsigned)heap.xNumberOfFreeBlocks, (unsigned)heap.xNumberOfSuccessfulAllocations,
+           (unsigned)heap.xNumberOfSuccessfulFrees);
+#else
+    append(line, sizeof(line), &len, "PROF %d %llu %d 0 0 0 0 0 0", FREERTOS_PROFILER_VERSION,
+           (unsigned long long)now_us, configNUMBER_OF_CORES);
+#endif
+
+    for (UBaseType_t i = 0; i < count; i++) {
+        const TaskStatus_t *task = &status[i];
+#if configUSE_CORE_AFFINITY && configNUMBER_OF_CORES > 1
+        UBaseType_t affinity = task->uxCoreAffinityMask;
+#else
+        UBaseType_t affinity = (1 << configNUMBER_OF_CORES) - 1;
+#endif
+        append(line, sizeof(line), &len, " %u:", (unsigned)task->xTaskNumber);
+        for (const char *c = task->pcTaskName; *c && len < sizeof(line) - 1; c++) {
+            line[len++] = *c == ' ' ? '_' : *c;
+        }
+        append(line, sizeof(line), &len, ":%u:%c:%x:%u:%llu:", (unsigned)task->uxBasePriority,
+               state_char(task->eCurrentState), (unsigned)affinity, (unsigned)task->usStackHighWaterMark,
+               (unsigned long long)task->ulRunTimeCounter);
+        const profiler_slot_t *slot = get_slot(task->xHandle, false);
+        for (int core = 0; core < configNUMBER_OF_CORES; core++) {
+            append(line, sizeof(line), &len, core ? ",%u" : "%u", slot ? (unsigned)slot->time_us[core] : 0);
+        }
+        append(line, sizeof(line), &len, ":%u", slot ? (unsigned)slot->switches : 0);
+    }
+    xTaskResumeAll();
+    printf("%s\n", line);
+}
+
+static void profiler_task(__unused void *params) {
+    TickType_t wake_time = xTaskGetTickCount();
+    while (true) {
+        vTaskDelayUntil(&wake_time, pdMS_TO_TICKS(period_ms));
+        freertos_profiler_snapshot();
+    }
+}
+
+bool freertos_profiler_start(uint32_t ms) {
+    period_ms = ms;
+#if configSUPPORT_STATIC_ALLOCATION
+    static StackType_t profiler_stack[FREERTOS_PROFILER_TASK_STACK_SIZE];
+    static StaticTask_t profiler_buf;
+    return xTaskCreateStatic(profiler_task, "Profiler", FREERTOS_PROFILER_TASK_STACK_SIZE, NULL,
+                             FREERTOS_PROFILER_TASK_PRIORITY, profiler_stack, &profiler_buf) != NULL;
+#else
+    return xTaskCreate(profiler_task, "Profiler", FREERTOS_PROFILER_TASK_STACK_SIZE, NULL,
+                       FREERTOS_PROFILER_TASK_PRIORITY, NULL) == pdPASS;
+#endif
+}
@@ -0,0 +1,46 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _FREERTOS_PROFILER_H_
+#define _FREERTOS_PROFILER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Samples how the tasks are using the cores and memory, and prints a snapshot every period as a
+// single line starting "PROF", which profiler_report.py turns into a report. Link with the
+// freertos_profiler library, which enables configGENERATE_RUN_TIME_STATS and the trace hooks.
+//
+// A snapshot is
+//   PROF <version> <time_us> <cores> <heap free> <heap min free> <largest free block> <free blocks> <allocs> <frees>
+// followed by a field for each task of
+//   <task number>:<name>:<priority>:<state>:<core affinity>:<stack high water mark>:<run time>:<run time on each core>:<switches>
+// The times are in microseconds. The run time on each core is comma separated and, like the switch
+// count, is 32 bit and wraps. The stack high water mark is the least free stack there has been, in
+// words. Spaces in the names are printed as underscores.
+
+#define FREERTOS_PROFILER_VERSION 1
+
+// Most tasks to report on. Tasks after this are left out
+#ifndef FREERTOS_PROFILER_MAX_TASKS
+#define FREERTOS_PROFILER_MAX_TASKS 16
+#endif
+
+#ifndef FREERTOS_PROFILER_TASK_PRIORITY
+#define FREERTOS_PROFILER_TASK_PRIORITY (tskIDLE_PRIORITY + 1UL)
+#endif
+
+#ifndef FREERTOS_PROFILER_TASK_STACK_SIZE
+#define FREERTOS_PROFILER_TASK_STACK_SIZE configMINIMAL_STACK_SIZE
+#endif
+
+// Start a task which prints a snapshot every period_ms
+bool freertos_profiler_start(uint32_t period_ms);
+
+// Print a snapshot now
+void freertos_profiler_snapshot(void);
+
+#endif
@@ -0,0 +1,20 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _FREERTOS_PROFILER_TRACE_H_
+#define _FREERTOS_PROFILER_TRACE_H_
+
+// Included by FreeRTOSConfig.h when FREERTOS_PROFILER is set, to hook the context switches
+
+#ifndef __ASSEMBLER__
+void freertos_profiler_switched_out(void);
+void freertos_profiler_switched_in(void);
+#endif
+
+#define traceTASK_SWITCHED_OUT() freertos_profiler_switched_out()
+#define traceTASK_SWITCHED_IN() freertos_profiler_switched_in()
+
+#endif
@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Turns the snapshots printed by freertos_profiler into a report, see freertos_profiler.h for the
+# format. Other output is ignored, so the whole serial log can be given, e.g.
+#   ./profiler_report.py minicom.log
+#   ./profiler_report.py --each < /dev/ttyACM0
+#
+
+import argparse
+import sys
+
+FREERTOS_PROFILER_VERSION = 1
+MASK32 = 0xffffffff
+
+
+class Task:
+    def __init__(self, field, cores):
+        number, name, priority, state, affinity, stack, run_time, core_times, switches = field.split(':')
+        self.number = int(number)
+        self.name = name
+        self.priority = int(priority)
+        self.state = state
+        self.affinity = int(affinity, 16)
+        self.stack = int(stack)
+        self.run_time = int(run_time)
+        self.core_times = [int(t) for t in core_times.split(',')][:cores]
+        self.switches = int(switches)
+
+
+class Snapshot:
+    def __init__(self, fields):
+        self.time_us = int(fields[0])
+        self.cores = int(fields[1])
+        (self.heap_free, self.heap_min_free, self.heap_largest, self.heap_blocks, self.allocs,
+         self.frees) = (int(f) for f in fields[2:8])
+        self.tasks = {}
+        for field in fields[8:]:
+            task = Task(field, self.cores)
+            self.tasks[task.number] = task
+
+
+def read_snapshots(lines):
+    for line in lines:
+        fields = line.split()
+        if len(fields) < 10 or fields[0] != 'PROF' or fields[1] != str(FREERTOS_PROFILER_VERSION):
+            continue
+        try:
+            yield Snapshot(fields[2:])
+        except ValueError:
+            # most likely a line that was cut short
+            pass
+
+
+def affinity_str(mask, cores):
+    if mask == (1 << cores) - 1:
+        return 'any'
+    return ','.join(str(c) for c in range(cores) if mask & (1 << c))
+
+
+def report(first, last):
+    secs = (last.time_us - first.time_us) / 1e6
+    if secs <= 0:
+        return
+    cores = last.cores
+    print('%.1f s from %.1f s to %.1f s' % (secs, first.time_us / 1e6, last.time_us / 1e6))
+    header = '%-16s %4s %-5s %-3s' % ('task', 'prio', 'cores', 'st')
+    header += ''.join(' %6s' % ('core%d' % c) for c in range(cores))
+    header += ' %6s %9s %10s' % ('total', 'switch/s', 'stack free')
+    print(header)
+
+    busy = [0.0] * cores
+    rows = []
+    for number, task in last.tasks.items():
+        before = first.tasks.get(number)
+        shares = []
+        for c in range(cores):
+            delta = (task.core_times[c] - (before.core_times[c] if before else 0)) & MASK32
+            shares.append(100 * delta / 1e6 / secs)
+        run_time = task.run_time - (before.run_time if before else 0)
+        switches = (task.switches - (before.switches if before else 0)) & MASK32
+        if not task.name.startswith('IDLE'):
+            for c in range(cores):
+                busy[c] += shares[c]
+        rows.append((100 * run_time / 1e6 / secs, task, shares, switches / secs))
+
+    for total, task, shares, switch_rate in sorted(rows, key=lambda r: -r[0]):
+        row = '%-16s %4d %-5s %-3s' % (task.name, task.priority, affinity_str(task.affinity, cores), task.state)
+        row += ''.join(' %5.1f%%' % s for s in shares)
+        row += ' %5.1f%% %9.1f %10d' % (total, switch_rate, task.stack)
+        print(row)
+
+    print('busy ' + ' '.join('core%d %.1f%%' % (c, b) for c, b in enumerate(busy)))
+    if last.heap_free or last.heap_min_free:
+        fragmentation = 100 * (1 - last.heap_largest / last.heap_free) if last.heap_free else 0
+        print('heap free %d bytes, least ever %d, largest block %d in %d free blocks (%.0f%% fragmented), '
+              '%d allocations and %d frees' % (last.heap_free, last.heap_min_free, last.heap_largest,
+                                                last.heap_blocks, fragmentation, last.allocs - first.allocs,
+                                                last.frees - first.frees))
+    print()
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Report on freertos_profiler snapshots')
+    parser.add_argument('log', nargs='?', type=argparse.FileType('r', errors='replace'), default=sys.stdin,
+                        help='serial output, rather than stdin')
+    parser.add_argument('-e', '--each', action='store_true', help='report on each interval as it arrives')
+    args = parser.parse_args()
+
+    first = previous = last = None
+    for snapshot in read_snapshots(args.log):
+        if first is None or snapshot.time_us < last.time_us:
+            # the first one, or the device was reset
+            first = previous = snapshot
+        elif args.each:
+            report(previous, snapshot)
+            previous = snapshot
+        last = snapshot
+    if first is None:
+        sys.exit('No snapshots found')
+    if not args.each:
+        report(first, last)
+
+
+if __name__ == '__main__':
+    main()
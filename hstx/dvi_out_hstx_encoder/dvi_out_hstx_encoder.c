@@ -17,6 +17,9 @@
 #include "hardware/structs/sio.h"
 #include "pico/multicore.h"
 #include "pico/sem.h"
+#include "pico/stdlib.h"
+
+#include "event_trace.h"
 
 #include "mountains_640x480_rgb332.h"
 #define framebuf mountains_640x480
@@ -118,6 +121,7 @@ static uint v_scanline = 2;
 static bool vactive_cmdlist_posted = false;
 
 void __scratch_x("") dma_irq_handler() {
+    EVENT_TRACE_BEGIN("dma_irq");
     // dma_pong indicates the channel that just finished, which is the one
     // we're about to reload.
     uint ch_num = dma_pong ? DMACH_PONG : DMACH_PING;
@@ -143,7 +147,11 @@ void __scratch_x("") dma_irq_handler() {
 
     if (!vactive_cmdlist_posted) {
         v_scanline = (v_scanline + 1) % MODE_V_TOTAL_LINES;
+        if (!v_scanline) {
+            EVENT_TRACE_INSTANT("frame");
+        }
     }
+    EVENT_TRACE_END("dma_irq");
 }
 
 // ----------------------------------------------------------------------------
@@ -160,6 +168,11 @@ static __force_inline uint8_t colour_rgb332(uint8_t r, uint8_t g, uint8_t b) {
 void scroll_framebuffer(void);
 
 int main(void) {
+#if EVENT_TRACE
+    stdio_init_all();
+    event_trace_init();
+#endif
+
     // Configure HSTX's TMDS encoder for RGB332
     hstx_ctrl_hw->expand_tmds =
         2  << HSTX_CTRL_EXPAND_TMDS_L2_NBITS_LSB |
@@ -259,6 +272,18 @@ int main(void) {
 
     dma_channel_start(DMACH_PING);
 
+#if EVENT_TRACE
+    // Every few seconds, record the last few frames' worth of interrupts and print them, to be
+    // turned into a Chrome trace with system/event_trace/event_trace_to_json.py
+    while (1) {
+        sleep_ms(5000);
+        event_trace_start();
+        sleep_ms(100);
+        event_trace_stop();
+        event_trace_drain();
+    }
+#else
     while (1)
         __wfi();
+#endif
 }
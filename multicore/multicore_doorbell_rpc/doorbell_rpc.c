@@ -0,0 +1,148 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "pico/multicore.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+
+#include "doorbell_rpc.h"
+
+// A slot is only moved from FREE to REQUESTED and from DONE to FREE by core 0, and from REQUESTED to
+// DONE by core 1, so the cores never need a lock to share them. The rest of a slot is written
+// before its state moves on, with a barrier in between so the other core sees them in that order.
+enum {
+    SLOT_FREE,
+    SLOT_REQUESTED,
+    SLOT_DONE,
+};
+
+typedef struct {
+    volatile uint8_t state;
+    doorbell_rpc_func_t func;
+    uint32_t arg;
+    uint32_t result;
+    doorbell_rpc_callback_t callback;
+    void *user_data;
+} rpc_slot_t;
+
+static rpc_slot_t slots[DOORBELL_RPC_SLOTS];
+static uint next_slot;
+
+// rung by core 0 when it has made a call, and by core 1 when a call with a callback has finished
+static uint request_doorbell;
+static uint response_doorbell;
+
+static void __not_in_flash_func(core1_doorbell_irq)(void) {
+    if (!multicore_doorbell_is_set_current_core(request_doorbell)) {
+        return;
+    }
+    // clear it before looking at the slots, so a call made while we do is seen next time
+    multicore_doorbell_clear_current_core(request_doorbell);
+    __mem_fence_acquire();
+    bool notify = false;
+    for (uint i = 0; i < DOORBELL_RPC_SLOTS; i++) {
+        rpc_slot_t *slot = &slots[i];
+        if (slot->state == SLOT_REQUESTED) {
+            // core 0 may reuse the slot as soon as it's done
+            notify |= slot->callback != NULL;
+            slot->result = slot->func(slot->arg);
+            __mem_fence_release();
+            slot->state = SLOT_DONE;
+        }
+    }
+    if (notify) {
+        __dmb();
+        multicore_doorbell_set_other_core(response_doorbell);
+    }
+}
+
+static void __not_in_flash_func(core0_doorbell_irq)(void) {
+    if (!multicore_doorbell_is_set_current_core(response_doorbell)) {
+        return;
+    }
+    multicore_doorbell_clear_current_core(response_doorbell);
+    __mem_fence_acquire();
+    for (uint i = 0; i < DOORBELL_RPC_SLOTS; i++) {
+        rpc_slot_t *slot = &slots[i];
+        // calls without a callback are left for doorbell_rpc_wait
+        if (slot->state == SLOT_DONE && slot->callback) {
+            slot->callback(slot->result, slot->user_data);
+            slot->state = SLOT_FREE;
+        }
+    }
+}
+
+void doorbell_rpc_init(void) {
+    request_doorbell = (uint)multicore_doorbell_claim_unused((1 << NUM_CORES) - 1, true);
+    response_doorbell = (uint)multicore_doorbell_claim_unused((1 << NUM_CORES) - 1, true);
+    multicore_doorbell_clear_current_core(response_doorbell);
+    // clear core 1's doorbell here rather than on core 1, where it would throw away a call made
+    // before core 1 got round to its init. A call made early just waits until core 1 enables the irq
+    multicore_doorbell_clear_other_core(request_doorbell);
+
+    // both cores share the doorbell interrupt and the vector table, so each core's handler is added
+    // to the one chain and ignores the interrupt on the other core, where its doorbell is never rung
+    uint irq = multicore_doorbell_irq_num(response_doorbell);
+    irq_add_shared_handler(irq, core0_doorbell_irq, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+    irq_set_enabled(irq, true);
+}
+
+void doorbell_rpc_init_core1(void) {
+    uint irq = multicore_doorbell_irq_num(request_doorbell);
+    irq_add_shared_handler(irq, core1_doorbell_irq, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+    irq_set_enabled(irq, true);
+}
+
+static int __not_in_flash_func(start_call)(doorbell_rpc_func_t func, uint32_t arg, doorbell_rpc_callback_t callback,
+                                           void *user_data) {
+    for (uint n = 0; n < DOORBELL_RPC_SLOTS; n++) {
+        uint i = next_slot;
+        next_slot = (next_slot + 1) % DOORBELL_RPC_SLOTS;
+        rpc_slot_t *slot = &slots[i];
+        if (slot->state == SLOT_FREE) {
+            slot->func = func;
+            slot->arg = arg;
+            slot->callback = callback;
+            slot->user_data = user_data;
+            __mem_fence_release();
+            slot->state = SLOT_REQUESTED;
+            // make sure the slot is written before core 1 is interrupted
+            __dmb();
+            multicore_doorbell_set_other_core(request_doorbell);
+            return (int)i;
+        }
+    }
+    return DOORBELL_RPC_NO_HANDLE;
+}
+
+uint32_t __not_in_flash_func(doorbell_rpc_call)(doorbell_rpc_func_t func, uint32_t arg) {
+    int handle;
+    while ((handle = start_call(func, arg, NULL, NULL)) == DOORBELL_RPC_NO_HANDLE) {
+        tight_loop_contents();
+    }
+    return doorbell_rpc_wait(handle);
+}
+
+doorbell_rpc_handle_t doorbell_rpc_call_async(doorbell_rpc_func_t func, uint32_t arg,
+                                              doorbell_rpc_callback_t callback, void *user_data) {
+    return start_call(func, arg, callback, user_data);
+}
+
+bool doorbell_rpc_is_done(doorbell_rpc_handle_t handle) {
+    return slots[handle].state == SLOT_DONE;
+}
+
+uint32_t __not_in_flash_func(doorbell_rpc_wait)(doorbell_rpc_handle_t handle) {
+    rpc_slot_t *slot = &slots[handle];
+    // spin rather than wait for an interrupt, which is quickest for the small jobs this is meant for
+    while (slot->state != SLOT_DONE) {
+        tight_loop_contents();
+    }
+    __mem_fence_acquire();
+    uint32_t result = slot->result;
+    slot->state = SLOT_FREE;
+    return result;
+}
@@ -0,0 +1,56 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _DOORBELL_RPC_H_
+#define _DOORBELL_RPC_H_
+
+#include "pico/types.h"
+
+// Calls functions on core 1 from core 0. Each call is written to one of a fixed set of slots in
+// shared memory and a doorbell tells core 1 to look at them. Core 1 runs the calls from its doorbell
+// interrupt and writes the results back into the slots. A synchronous call just watches its slot
+// for the result, and an asynchronous one can either be waited for later or have a callback which
+// core 0 runs from a second doorbell's interrupt.
+//
+// Calls must only be made from core 0 and not from an interrupt handler.
+
+// Number of calls that can be in progress at once
+#ifndef DOORBELL_RPC_SLOTS
+#define DOORBELL_RPC_SLOTS 8
+#endif
+
+typedef uint32_t (*doorbell_rpc_func_t)(uint32_t arg);
+
+// Called on core 0, from an interrupt handler, when an asynchronous call has finished
+typedef void (*doorbell_rpc_callback_t)(uint32_t result, void *user_data);
+
+// Identifies an asynchronous call until it's been waited for
+typedef int doorbell_rpc_handle_t;
+
+#define DOORBELL_RPC_NO_HANDLE (-1)
+
+// Claim the doorbells and set up the interrupt handler on core 0. Call before launching core 1
+void doorbell_rpc_init(void);
+
+// Set up the interrupt handler on core 1, which then runs the calls. Call from core 1
+void doorbell_rpc_init_core1(void);
+
+// Call func(arg) on core 1 and wait for the result
+uint32_t doorbell_rpc_call(doorbell_rpc_func_t func, uint32_t arg);
+
+// Start a call of func(arg) on core 1 without waiting for it, or return DOORBELL_RPC_NO_HANDLE if
+// all the slots are in use. If callback is NULL the call must be waited for with doorbell_rpc_wait,
+// otherwise the callback gets the result and the slot is freed afterwards
+doorbell_rpc_handle_t doorbell_rpc_call_async(doorbell_rpc_func_t func, uint32_t arg,
+                                              doorbell_rpc_callback_t callback, void *user_data);
+
+// Check whether an asynchronous call without a callback has finished
+bool doorbell_rpc_is_done(doorbell_rpc_handle_t handle);
+
+// Wait for an asynchronous call without a callback to finish, free its slot and return the result
+uint32_t doorbell_rpc_wait(doorbell_rpc_handle_t handle);
+
+#endif
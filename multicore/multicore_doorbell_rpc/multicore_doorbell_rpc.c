@@ -0,0 +1,150 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "hardware/clocks.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+
+#include "doorbell_rpc.h"
+
+// Offloads small jobs to core 1 with doorbell_rpc, then compares the round trip time and calls per
+// second with passing the calls through the SIO FIFOs from an interrupt handler, as in
+// multicore_fifo_irqs
+
+#define ITERATIONS 100000
+
+static uint32_t square(uint32_t n) {
+    return n * n;
+}
+
+// Does nothing, so the benchmarks measure the cost of the call
+static uint32_t __not_in_flash_func(increment)(uint32_t n) {
+    return n + 1;
+}
+
+static volatile uint32_t callback_count;
+static volatile uint32_t callback_sum;
+
+static void __not_in_flash_func(increment_done)(uint32_t result, __unused void *user_data) {
+    callback_sum += result;
+    callback_count++;
+}
+
+// Runs a call pushed into the FIFO as a function pointer and argument, and pushes back the result
+static void __not_in_flash_func(core1_sio_irq)(void) {
+    while (multicore_fifo_rvalid()) {
+        doorbell_rpc_func_t func = (doorbell_rpc_func_t)(uintptr_t)multicore_fifo_pop_blocking();
+        uint32_t arg = multicore_fifo_pop_blocking();
+        multicore_fifo_push_blocking(func(arg));
+    }
+    multicore_fifo_clear_irq();
+}
+
+static uint32_t __not_in_flash_func(fifo_call)(doorbell_rpc_func_t func, uint32_t arg) {
+    multicore_fifo_push_blocking((uintptr_t)func);
+    multicore_fifo_push_blocking(arg);
+    return multicore_fifo_pop_blocking();
+}
+
+static void core1_entry() {
+    doorbell_rpc_init_core1();
+
+    // We MUST start the other core before we enable FIFO interrupts, see multicore_fifo_irqs
+    multicore_fifo_clear_irq();
+    irq_set_exclusive_handler(SIO_FIFO_IRQ_NUM(1), core1_sio_irq);
+    irq_set_enabled(SIO_FIFO_IRQ_NUM(1), true);
+
+    // Everything happens in the interrupt handlers
+    while (true) {
+        __wfi();
+    }
+}
+
+static void report(const char *name, uint64_t start_us, uint32_t sum) {
+    uint64_t elapsed_us = time_us_64() - start_us;
+    // the sum of n + 1 for n in 0..ITERATIONS-1
+    uint32_t expected = (uint32_t)((uint64_t)ITERATIONS * (ITERATIONS + 1) / 2);
+    printf("%-24s %6.3f us, %5u cycles per call, %7u calls/s%s\n", name, (float)elapsed_us / ITERATIONS,
+           (uint32_t)((elapsed_us * (clock_get_hz(clk_sys) / 1000000)) / ITERATIONS),
+           (uint32_t)((uint64_t)ITERATIONS * 1000000 / elapsed_us), sum == expected ? "" : " WRONG RESULTS");
+}
+
+// Each call is finished before the next one starts, so this is the round trip time
+static void benchmark_rpc_sync(void) {
+    uint32_t sum = 0;
+    uint64_t start_us = time_us_64();
+    for (uint32_t i = 0; i < ITERATIONS; i++) {
+        sum += doorbell_rpc_call(increment, i);
+    }
+    report("doorbell rpc, sync", start_us, sum);
+}
+
+// Keep all the slots busy, so core 1 can work through several calls per interrupt
+static void benchmark_rpc_async(void) {
+    uint32_t sum = 0;
+    doorbell_rpc_handle_t handles[DOORBELL_RPC_SLOTS];
+    uint64_t start_us = time_us_64();
+    for (uint32_t i = 0; i < ITERATIONS; i += DOORBELL_RPC_SLOTS) {
+        for (uint j = 0; j < DOORBELL_RPC_SLOTS; j++) {
+            handles[j] = doorbell_rpc_call_async(increment, i + j, NULL, NULL);
+        }
+        for (uint j = 0; j < DOORBELL_RPC_SLOTS; j++) {
+            sum += doorbell_rpc_wait(handles[j]);
+        }
+    }
+    report("doorbell rpc, async", start_us, sum);
+}
+
+// The results come back to core 0 in its doorbell interrupt
+static void benchmark_rpc_callback(void) {
+    callback_count = 0;
+    callback_sum = 0;
+    uint64_t start_us = time_us_64();
+    for (uint32_t i = 0; i < ITERATIONS; i++) {
+        while (doorbell_rpc_call_async(increment, i, increment_done, NULL) == DOORBELL_RPC_NO_HANDLE) {
+            tight_loop_contents();
+        }
+    }
+    while (callback_count < ITERATIONS) {
+        tight_loop_contents();
+    }
+    report("doorbell rpc, callback", start_us, callback_sum);
+}
+
+static void benchmark_fifo(void) {
+    uint32_t sum = 0;
+    uint64_t start_us = time_us_64();
+    for (uint32_t i = 0; i < ITERATIONS; i++) {
+        sum += fifo_call(increment, i);
+    }
+    report("SIO FIFO irq, sync", start_us, sum);
+}
+
+static_assert(ITERATIONS % DOORBELL_RPC_SLOTS == 0, "");
+
+int main() {
+    stdio_init_all();
+    printf("Hello, multicore_doorbell_rpc!\n");
+
+    doorbell_rpc_init();
+    multicore_launch_core1(core1_entry);
+
+    printf("Square of 12 on core 1 is %u\n", doorbell_rpc_call(square, 12));
+
+    doorbell_rpc_handle_t handle = doorbell_rpc_call_async(square, 34, NULL, NULL);
+    // We could now do a load of stuff on core 0 and get our result later
+    printf("Square of 34 on core 1 is %u\n", doorbell_rpc_wait(handle));
+
+    printf("\nTime to call a function on core 1 %d times, at %u MHz\n", ITERATIONS, clock_get_hz(clk_sys) / 1000000);
+    benchmark_rpc_sync();
+    benchmark_rpc_async();
+    benchmark_rpc_callback();
+    benchmark_fifo();
+    return 0;
+}
@@ -0,0 +1,111 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _MULTICORE_PARALLEL_H_
+#define _MULTICORE_PARALLEL_H_
+
+#include "pico/multicore.h"
+
+// Helpers for sharing loops between the two cores. Core 1 runs a worker which is handed jobs from
+// core 0 through the SIO FIFO, so it sleeps while it has nothing to do and a job costs little more
+// than a FIFO round trip. The jobs live on core 0's stack, which is fine as core 0 always waits for
+// core 1 to finish one before it returns.
+//
+// Call parallel_init once from core 0, then parallel_for and parallel_pipeline from core 0 only.
+// Core 1 and its FIFO are then used by the worker, so can't be used for anything else.
+
+// Runs the indexes from start up to, but not including, end
+typedef void (*parallel_for_fn_t)(uint start, uint end, void *user_data);
+
+// Fills or consumes the buffer for one item of a pipeline
+typedef void (*parallel_stage_fn_t)(uint index, void *buffer, void *user_data);
+
+typedef struct parallel_job {
+    void (*run)(const struct parallel_job *job);
+    union {
+        parallel_for_fn_t for_fn;
+        parallel_stage_fn_t stage_fn;
+    };
+    uint start;
+    uint end;
+    void *buffer;
+    void *user_data;
+} parallel_job_t;
+
+static void parallel_core1_worker(void) {
+    while (true) {
+        const parallel_job_t *job = (const parallel_job_t *)(uintptr_t)multicore_fifo_pop_blocking();
+        job->run(job);
+        multicore_fifo_push_blocking((uintptr_t)job);
+    }
+}
+
+static inline void parallel_init(void) {
+    multicore_launch_core1(parallel_core1_worker);
+}
+
+static inline void parallel_start_core1(const parallel_job_t *job) {
+    multicore_fifo_push_blocking((uintptr_t)job);
+}
+
+static inline void parallel_wait_core1(void) {
+    multicore_fifo_pop_blocking();
+}
+
+static void parallel_run_for(const parallel_job_t *job) {
+    job->for_fn(job->start, job->end, job->user_data);
+}
+
+// Split the indexes from start to end between the cores, with core1_share / 256 of them going to
+// core 1, and return when both have finished
+static inline void parallel_for_share(uint start, uint end, uint core1_share, parallel_for_fn_t fn, void *user_data) {
+    uint split = end - (uint)(((uint64_t)(end - start) * core1_share) >> 8);
+    parallel_job_t job = {
+        .run = parallel_run_for,
+        .for_fn = fn,
+        .start = split,
+        .end = end,
+        .user_data = user_data,
+    };
+    parallel_start_core1(&job);
+    fn(start, split, user_data);
+    parallel_wait_core1();
+}
+
+// Split the indexes from start to end evenly between the cores, and return when both have finished
+static inline void parallel_for(uint start, uint end, parallel_for_fn_t fn, void *user_data) {
+    parallel_for_share(start, end, 128, fn, user_data);
+}
+
+static void parallel_run_stage(const parallel_job_t *job) {
+    job->stage_fn(job->start, job->buffer, job->user_data);
+}
+
+// Run count items through two stages, with core 0 producing each item into one of two buffers while
+// core 1 consumes the previous item from the other one
+static inline void parallel_pipeline(uint count, void *buffers[2], parallel_stage_fn_t produce,
+                                     parallel_stage_fn_t consume, void *user_data) {
+    if (!count) {
+        return;
+    }
+    produce(0, buffers[0], user_data);
+    for (uint i = 0; i < count; i++) {
+        parallel_job_t job = {
+            .run = parallel_run_stage,
+            .stage_fn = consume,
+            .start = i,
+            .buffer = buffers[i & 1],
+            .user_data = user_data,
+        };
+        parallel_start_core1(&job);
+        if (i + 1 < count) {
+            produce(i + 1, buffers[(i + 1) & 1], user_data);
+        }
+        parallel_wait_core1();
+    }
+}
+
+#endif
@@ -0,0 +1,175 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "pico/util/queue.h"
+#include "pico/multicore.h"
+#include "hardware/clocks.h"
+
+#include "task_pool.h"
+
+// Runs the same functions on core 1 as multicore_runner_queue, but through a task pool, then
+// measures how long it takes to get small tasks run on core 1 with queue_t and with the pool
+
+#define TEST_NUM 10
+
+// Number of tasks to time in each benchmark
+#define BENCHMARK_TASKS 20000
+
+// How many tasks are in flight at once in the batched benchmarks
+#define BATCH_SIZE 16
+
+typedef struct
+{
+    int32_t (*func)(int32_t);
+    int32_t data;
+} queue_entry_t;
+
+static queue_t call_queue;
+static queue_t results_queue;
+
+static void queue_core1_entry() {
+    while (1) {
+        queue_entry_t entry;
+        queue_remove_blocking(&call_queue, &entry);
+        int32_t result = entry.func(entry.data);
+        queue_add_blocking(&results_queue, &result);
+    }
+}
+
+int32_t factorial(int32_t n) {
+    int32_t f = 1;
+    for (int i = 2; i <= n; i++) {
+        f *= i;
+    }
+    return f;
+}
+
+int32_t fibonacci(int32_t n) {
+    if (n == 0) return 0;
+    if (n == 1) return 1;
+
+    int n1 = 0, n2 = 1, n3 = 0;
+
+    for (int i = 2; i <= n; i++) {
+        n3 = n1 + n2;
+        n1 = n2;
+        n2 = n3;
+    }
+    return n3;
+}
+
+// Does next to nothing, so the benchmarks measure the cost of getting it run
+static int32_t increment(int32_t n) {
+    return n + 1;
+}
+
+static void report(const char *name, uint64_t start_us, int64_t sum) {
+    uint64_t elapsed_us = time_us_64() - start_us;
+    // the sum of n + 1 for n in 0..BENCHMARK_TASKS-1
+    int64_t expected = (int64_t)BENCHMARK_TASKS * (BENCHMARK_TASKS + 1) / 2;
+    uint32_t cycles = (uint32_t)((elapsed_us * (clock_get_hz(clk_sys) / 1000000)) / BENCHMARK_TASKS);
+    printf("%-28s %6.2f us, %5u cycles per task, %7u tasks/s%s\n", name, (float)elapsed_us / BENCHMARK_TASKS,
+           cycles, (uint32_t)((uint64_t)BENCHMARK_TASKS * 1000000 / elapsed_us), sum == expected ? "" : " WRONG RESULTS");
+}
+
+// One task at a time, waiting for each result, as multicore_runner_queue does
+static void benchmark_queue_one_at_a_time(void) {
+    int64_t sum = 0;
+    uint64_t start_us = time_us_64();
+    for (int i = 0; i < BENCHMARK_TASKS; i++) {
+        queue_entry_t entry = {increment, i};
+        queue_add_blocking(&call_queue, &entry);
+        int32_t result;
+        queue_remove_blocking(&results_queue, &result);
+        sum += result;
+    }
+    report("queue_t, one at a time", start_us, sum);
+}
+
+// Keep the queues full, so core 1 always has something to do
+static void benchmark_queue_batched(void) {
+    int64_t sum = 0;
+    uint64_t start_us = time_us_64();
+    for (int i = 0; i < BENCHMARK_TASKS; i += BATCH_SIZE) {
+        for (int j = 0; j < BATCH_SIZE; j++) {
+            queue_entry_t entry = {increment, i + j};
+            queue_add_blocking(&call_queue, &entry);
+        }
+        for (int j = 0; j < BATCH_SIZE; j++) {
+            int32_t result;
+            queue_remove_blocking(&results_queue, &result);
+            sum += result;
+        }
+    }
+    report("queue_t, batches", start_us, sum);
+}
+
+static void benchmark_pool_one_at_a_time(void) {
+    int64_t sum = 0;
+    task_future_t future;
+    uint64_t start_us = time_us_64();
+    for (int i = 0; i < BENCHMARK_TASKS; i++) {
+        task_pool_submit_one(increment, i, &future);
+        sum += task_future_wait(&future);
+    }
+    report("task pool, one at a time", start_us, sum);
+}
+
+static void benchmark_pool_batched(void) {
+    int64_t sum = 0;
+    task_pool_task_t tasks[BATCH_SIZE];
+    task_future_t futures[BATCH_SIZE];
+    uint64_t start_us = time_us_64();
+    for (int i = 0; i < BENCHMARK_TASKS; i += BATCH_SIZE) {
+        for (int j = 0; j < BATCH_SIZE; j++) {
+            tasks[j] = (task_pool_task_t) { increment, i + j, &futures[j] };
+        }
+        task_pool_submit(tasks, BATCH_SIZE);
+        task_pool_wait_all();
+        for (int j = 0; j < BATCH_SIZE; j++) {
+            sum += futures[j].result;
+        }
+    }
+    report("task pool, batches", start_us, sum);
+}
+
+static_assert(BENCHMARK_TASKS % BATCH_SIZE == 0, "");
+static_assert(BATCH_SIZE <= TASK_POOL_RING_SIZE, "");
+
+int main() {
+    stdio_init_all();
+    printf("Hello, multicore_task_pool!\n");
+
+    // This example dispatches functions to run on the second core through a task pool, which
+    // passes them over in lock free rings rather than with queue_t, and hands back futures to
+    // get the results with
+    task_pool_init();
+
+    task_future_t factorial_result, fibonacci_result;
+    task_pool_submit_one(factorial, TEST_NUM, &factorial_result);
+    task_pool_submit_one(fibonacci, TEST_NUM, &fibonacci_result);
+
+    // We could now do a load of stuff on core 0 and get our results later
+
+    printf("Factorial %d is %d\n", TEST_NUM, task_future_wait(&factorial_result));
+    printf("Fibonacci %d is %d\n", TEST_NUM, task_future_wait(&fibonacci_result));
+
+    printf("\nTime to run %d tasks on core 1, at %u MHz\n", BENCHMARK_TASKS, clock_get_hz(clk_sys) / 1000000);
+    benchmark_pool_one_at_a_time();
+    benchmark_pool_batched();
+
+    // Now the same with queue_t, so core 1 needs to run a different dispatcher
+    multicore_reset_core1();
+    queue_init(&call_queue, sizeof(queue_entry_t), BATCH_SIZE);
+    queue_init(&results_queue, sizeof(int32_t), BATCH_SIZE);
+    multicore_launch_core1(queue_core1_entry);
+
+    benchmark_queue_one_at_a_time();
+    benchmark_queue_batched();
+    return 0;
+}
@@ -0,0 +1,151 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "pico/multicore.h"
+#include "hardware/sync.h"
+
+#include "task_pool.h"
+
+static_assert((TASK_POOL_RING_SIZE & (TASK_POOL_RING_SIZE - 1)) == 0, "TASK_POOL_RING_SIZE must be a power of 2");
+#define RING_MASK (TASK_POOL_RING_SIZE - 1)
+
+// The head is only written by the producer and the tail only by the consumer. They count up forever
+// and are masked to index the entries, so the ring is empty when they're equal and full when they
+// differ by the size. The producer writes an entry before it moves the head on, and the consumer
+// reads it before it moves the tail on, with a barrier in between so the other core sees them in
+// that order.
+typedef struct {
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    task_pool_task_t entries[TASK_POOL_RING_SIZE];
+} task_ring_t;
+
+typedef struct {
+    task_future_t *future;
+    int32_t result;
+} task_result_t;
+
+typedef struct {
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    task_result_t entries[TASK_POOL_RING_SIZE];
+} result_ring_t;
+
+// core 0 -> core 1
+static task_ring_t task_ring;
+// core 1 -> core 0
+static result_ring_t result_ring;
+
+static void task_pool_core1_entry(void) {
+    uint32_t tail = task_ring.tail;
+    while (true) {
+        uint32_t head = task_ring.head;
+        if (tail == head) {
+            // woken by core 0 when it submits a task
+            __wfe();
+            continue;
+        }
+        __mem_fence_acquire();
+        do {
+            const task_pool_task_t *task = &task_ring.entries[tail & RING_MASK];
+            int32_t result = task->func(task->arg);
+            if (task->future) {
+                uint32_t result_head = result_ring.head;
+                while (result_head - result_ring.tail == TASK_POOL_RING_SIZE) {
+                    // woken by core 0 when it collects results
+                    __wfe();
+                }
+                result_ring.entries[result_head & RING_MASK] = (task_result_t) { task->future, result };
+                __mem_fence_release();
+                result_ring.head = result_head + 1;
+                // core 0 may be waiting for this one
+                __sev();
+            }
+            __mem_fence_release();
+            task_ring.tail = ++tail;
+        } while (tail != head);
+        // let core 0 know there is room for more tasks
+        __sev();
+    }
+}
+
+void task_pool_init(void) {
+    multicore_launch_core1(task_pool_core1_entry);
+}
+
+uint task_pool_try_submit(const task_pool_task_t *tasks, uint count) {
+    uint32_t head = task_ring.head;
+    uint32_t space = TASK_POOL_RING_SIZE - (head - task_ring.tail);
+    if (count > space) {
+        count = space;
+    }
+    if (!count) {
+        return 0;
+    }
+    for (uint i = 0; i < count; i++) {
+        if (tasks[i].future) {
+            tasks[i].future->done = false;
+        }
+        task_ring.entries[(head + i) & RING_MASK] = tasks[i];
+    }
+    __mem_fence_release();
+    task_ring.head = head + count;
+    __sev();
+    return count;
+}
+
+void task_pool_submit(const task_pool_task_t *tasks, uint count) {
+    while (true) {
+        uint done = task_pool_try_submit(tasks, count);
+        tasks += done;
+        count -= done;
+        if (!count) {
+            break;
+        }
+        // core 1 may be waiting for us to take results before it can free up any room
+        if (!task_pool_poll()) {
+            __wfe();
+        }
+    }
+}
+
+uint task_pool_poll(void) {
+    uint32_t tail = result_ring.tail;
+    uint32_t head = result_ring.head;
+    if (tail == head) {
+        return 0;
+    }
+    __mem_fence_acquire();
+    uint count = head - tail;
+    do {
+        const task_result_t *result = &result_ring.entries[tail & RING_MASK];
+        result->future->result = result->result;
+        result->future->done = true;
+    } while (++tail != head);
+    __mem_fence_release();
+    result_ring.tail = tail;
+    // core 1 may be waiting for room
+    __sev();
+    return count;
+}
+
+int32_t task_future_wait(task_future_t *future) {
+    while (!future->done) {
+        if (!task_pool_poll()) {
+            __wfe();
+        }
+    }
+    return future->result;
+}
+
+void task_pool_wait_all(void) {
+    while (task_ring.tail != task_ring.head) {
+        if (!task_pool_poll()) {
+            __wfe();
+        }
+    }
+    task_pool_poll();
+}
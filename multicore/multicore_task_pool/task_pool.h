@@ -0,0 +1,73 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _TASK_POOL_H_
+#define _TASK_POOL_H_
+
+#include "pico/types.h"
+
+// Runs functions on core 1 for core 0. Tasks are passed over in a lock free single producer, single
+// consumer ring, and results come back in another one, so neither core ever takes a spin lock or
+// waits for the other to let go of one. A core with nothing to do waits for an event rather than
+// spinning, and the other core sends one (SEV) when it has added to a ring.
+//
+// All the functions here must be called from core 0, as it is the only producer of tasks and the
+// only consumer of results.
+
+// Number of entries in each ring, must be a power of 2
+#ifndef TASK_POOL_RING_SIZE
+#define TASK_POOL_RING_SIZE 32
+#endif
+
+typedef int32_t (*task_pool_func_t)(int32_t);
+
+// Tracks a task submitted to the pool, and gets its result
+typedef struct task_future {
+    volatile bool done;
+    int32_t result;
+} task_future_t;
+
+typedef struct task_pool_task {
+    task_pool_func_t func;
+    int32_t arg;
+    // Where to put the result, or NULL if it isn't wanted
+    task_future_t *future;
+} task_pool_task_t;
+
+// Launch the task pool worker on core 1
+void task_pool_init(void);
+
+// Submit up to count tasks without waiting, returning how many were submitted. Core 1 is only woken
+// once for the lot
+uint task_pool_try_submit(const task_pool_task_t *tasks, uint count);
+
+// Submit count tasks, waiting for room if need be
+void task_pool_submit(const task_pool_task_t *tasks, uint count);
+
+// Submit a single task
+static inline void task_pool_submit_one(task_pool_func_t func, int32_t arg, task_future_t *future) {
+    task_pool_task_t task = { .func = func, .arg = arg, .future = future };
+    task_pool_submit(&task, 1);
+}
+
+// Collect any results core 1 has sent back, marking their futures done. Returns how many there were
+uint task_pool_poll(void);
+
+// Check whether a task has finished
+static inline bool task_future_is_done(task_future_t *future) {
+    if (!future->done) {
+        task_pool_poll();
+    }
+    return future->done;
+}
+
+// Wait for a task to finish, and return its result
+int32_t task_future_wait(task_future_t *future);
+
+// Wait for all the tasks that have been submitted to finish
+void task_pool_wait_all(void);
+
+#endif
@@ -42,6 +42,9 @@
  *
  *  Implementation of btstack_audio.h using pico_i2s
  *
+ *  The buffers are refilled whenever the I2S DMA completes a transfer rather than from a timer, and
+ *  only as many are kept queued as are needed to avoid underruns, to keep the latency down
+ *
  */
 
 #include "btstack_config.h"
@@ -49,19 +52,43 @@
 #include "btstack_debug.h"
 #include "btstack_audio.h"
 #include "btstack_run_loop.h"
+#include "btstack_util.h"
 
 #include <stddef.h>
+#include <stdio.h>
 #include <hardware/dma.h>
+#include <hardware/irq.h>
 
 #include "pico/audio_i2s.h"
 
-#define DRIVER_POLL_INTERVAL_MS          5
-#define SAMPLES_PER_BUFFER 512
+#ifndef PICO_AUDIO_I2S_DMA_IRQ
+#define PICO_AUDIO_I2S_DMA_IRQ 0
+#endif
+
+// samples per buffer, and per I2S DMA transfer, which sets how often the buffers are refilled
+#define SAMPLES_PER_BUFFER 128
+
+// number of buffers queued for output (including the one playing), adapted between these limits
+#define MIN_BUFFERS_QUEUED 2
+#define MAX_BUFFERS_QUEUED 12
+
+// drop a buffer if there have been no underruns for this long with at least one spare queued
+#define BUFFERS_QUEUED_SHRINK_INTERVAL_MS 5000
+
+// print latency and underrun counters this often while streaming, 0 to disable
+#ifndef BTSTACK_AUDIO_PICO_REPORT_INTERVAL_MS
+#define BTSTACK_AUDIO_PICO_REPORT_INTERVAL_MS 10000
+#endif
+
+#define VOLUME_GAIN_UNITY 32768
 
 // client
 static void (*playback_callback)(int16_t * buffer, uint16_t num_samples);
 
-// timer to fill output ring buffer
+// polled from the I2S DMA interrupt to fill output buffers
+static btstack_data_source_t   btstack_audio_pico_data_source;
+
+// timer to report latency and underruns
 static btstack_timer_source_t  driver_timer_sink;
 
 
@@ -73,6 +100,33 @@ static audio_format_t        btstack_audio_pico_audio_format;
 static audio_buffer_format_t btstack_audio_pico_producer_format;
 static audio_buffer_pool_t * btstack_audio_pico_audio_buffer_pool;
 static uint8_t               btstack_audio_pico_channel_count;
+static uint                  btstack_audio_pico_dma_channel;
+static int32_t               btstack_audio_pico_volume_gain = VOLUME_GAIN_UNITY;
+
+// free buffers taken back from the pool but not needed yet
+static audio_buffer_t *      btstack_audio_pico_spare_buffers[MAX_BUFFERS_QUEUED];
+static uint8_t               btstack_audio_pico_spare_count;
+
+// Every DMA completion starts the next buffer, or silence if none is queued, so underruns show up
+// as completions that didn't use up a buffer
+static volatile uint32_t     btstack_audio_pico_dma_completions;
+static uint32_t              btstack_audio_pico_buffers_given;
+static int32_t               btstack_audio_pico_missed;
+static bool                  btstack_audio_pico_missed_valid;
+
+static uint8_t               btstack_audio_pico_buffers_target;
+static uint8_t               btstack_audio_pico_buffers_queued;
+static uint8_t               btstack_audio_pico_buffers_min_queued;
+static uint32_t              btstack_audio_pico_last_change_ms;
+static uint32_t              btstack_audio_pico_underruns;
+
+static void __isr btstack_audio_pico_dma_irq_handler(void){
+    // runs before the audio_i2s handler, which acknowledges the interrupt and starts the next buffer
+    if (dma_irqn_get_channel_status(PICO_AUDIO_I2S_DMA_IRQ, btstack_audio_pico_dma_channel)){
+        btstack_audio_pico_dma_completions++;
+        btstack_run_loop_poll_data_sources_from_irq();
+    }
+}
 
 static audio_buffer_pool_t *init_audio(uint32_t sample_frequency, uint8_t channel_count) {
 
@@ -87,13 +141,14 @@ static audio_buffer_pool_t *init_audio(uint32_t sample_frequency, uint8_t channe
     btstack_audio_pico_producer_format.format = &btstack_audio_pico_audio_format;
     btstack_audio_pico_producer_format.sample_stride = 2 * 2;
 
-    audio_buffer_pool_t * producer_pool = audio_new_producer_pool(&btstack_audio_pico_producer_format, 3, SAMPLES_PER_BUFFER); // todo correct size
+    audio_buffer_pool_t * producer_pool = audio_new_producer_pool(&btstack_audio_pico_producer_format, MAX_BUFFERS_QUEUED, SAMPLES_PER_BUFFER);
 
     audio_i2s_config_t config;
     config.data_pin       = PICO_AUDIO_I2S_DATA_PIN;
     config.clock_pin_base = PICO_AUDIO_I2S_CLOCK_PIN_BASE;
     config.dma_channel    = (int8_t) dma_claim_unused_channel(true);
     config.pio_sm         = 0;
+    btstack_audio_pico_dma_channel = (uint) config.dma_channel;
 
     // audio_i2s_setup claims the channel again https://github.com/raspberrypi/pico-extras/issues/48
     dma_channel_unclaim(config.dma_channel);
@@ -102,44 +157,144 @@ static audio_buffer_pool_t *init_audio(uint32_t sample_frequency, uint8_t channe
         panic("PicoAudio: Unable to open audio device.\n");
     }
 
-    bool ok = audio_i2s_connect(producer_pool);
+    // make each DMA transfer the same size as our buffers, so each one uses up exactly one buffer
+    bool ok = audio_i2s_connect_extra(producer_pool, false, 2, SAMPLES_PER_BUFFER, NULL);
     assert(ok);
     (void)ok;
 
+    irq_add_shared_handler(DMA_IRQ_0 + PICO_AUDIO_I2S_DMA_IRQ, btstack_audio_pico_dma_irq_handler, PICO_SHARED_IRQ_HANDLER_HIGHEST_ORDER_PRIORITY);
+
     return producer_pool;
 }
 
-static void btstack_audio_pico_sink_fill_buffers(void){
-    while (true){
+// Widen mono samples to stereo frames in place, applying the volume. Works backwards two samples at
+// a time, as the frames overwrite the samples, writing each frame with a single store
+static void btstack_audio_pico_mono_to_stereo(int16_t * buffer, uint16_t num_samples, int32_t gain){
+    uint32_t * frames = (uint32_t *) buffer;
+    if (num_samples & 1){
+        num_samples--;
+        uint32_t sample = (uint16_t) ((buffer[num_samples] * gain) >> 15);
+        frames[num_samples] = sample | (sample << 16);
+    }
+    const uint32_t * pairs = (const uint32_t *) buffer;
+    int i = num_samples / 2;
+    if (gain == VOLUME_GAIN_UNITY){
+        while (i--){
+            uint32_t pair = pairs[i];
+            uint32_t first = pair & 0xffff;
+            uint32_t second = pair >> 16;
+            frames[2*i+1] = second | (second << 16);
+            frames[2*i  ] = first  | (first  << 16);
+        }
+    } else {
+        while (i--){
+            uint32_t pair = pairs[i];
+            uint32_t first = (uint16_t) (((int16_t) pair * gain) >> 15);
+            uint32_t second = (uint16_t) ((((int32_t) pair >> 16) * gain) >> 15);
+            frames[2*i+1] = second | (second << 16);
+            frames[2*i  ] = first  | (first  << 16);
+        }
+    }
+}
+
+static void btstack_audio_pico_scale_stereo(int16_t * buffer, uint16_t num_frames, int32_t gain){
+    if (gain == VOLUME_GAIN_UNITY){
+        return;
+    }
+    uint32_t * frames = (uint32_t *) buffer;
+    for (uint16_t i = 0; i < num_frames; i++){
+        uint32_t frame = frames[i];
+        uint32_t left = (uint16_t) (((int16_t) frame * gain) >> 15);
+        uint32_t right = (uint16_t) ((((int32_t) frame >> 16) * gain) >> 15);
+        frames[i] = left | (right << 16);
+    }
+}
+
+static void btstack_audio_pico_adapt_buffers_queued(uint32_t missed){
+    uint32_t now_ms = btstack_run_loop_get_time_ms();
+    if (missed){
+        btstack_audio_pico_underruns += missed;
+        if (btstack_audio_pico_buffers_target < MAX_BUFFERS_QUEUED){
+            btstack_audio_pico_buffers_target++;
+        }
+        btstack_audio_pico_last_change_ms = now_ms;
+        btstack_audio_pico_buffers_min_queued = MAX_BUFFERS_QUEUED;
+    } else if ((now_ms - btstack_audio_pico_last_change_ms) >= BUFFERS_QUEUED_SHRINK_INTERVAL_MS){
+        // the minimum is taken before refilling, so one spare means the next buffer never ran short
+        if ((btstack_audio_pico_buffers_min_queued >= 2) && (btstack_audio_pico_buffers_target > MIN_BUFFERS_QUEUED)){
+            btstack_audio_pico_buffers_target--;
+        }
+        btstack_audio_pico_last_change_ms = now_ms;
+        btstack_audio_pico_buffers_min_queued = MAX_BUFFERS_QUEUED;
+    }
+}
+
+static void btstack_audio_pico_sink_fill_buffers(bool streaming){
+
+    // take back the buffers that have been played
+    uint32_t completions = btstack_audio_pico_dma_completions;
+    while (btstack_audio_pico_spare_count < MAX_BUFFERS_QUEUED){
         audio_buffer_t * audio_buffer = take_audio_buffer(btstack_audio_pico_audio_buffer_pool, false);
         if (audio_buffer == NULL){
             break;
         }
+        btstack_audio_pico_spare_buffers[btstack_audio_pico_spare_count++] = audio_buffer;
+    }
+    btstack_audio_pico_buffers_queued = MAX_BUFFERS_QUEUED - btstack_audio_pico_spare_count;
+
+    // skip the check if a transfer completed meanwhile, as the counts might not match
+    if (streaming && (completions == btstack_audio_pico_dma_completions)){
+        uint32_t played = btstack_audio_pico_buffers_given - btstack_audio_pico_buffers_queued;
+        int32_t missed = (int32_t) (completions - played);
+        if (btstack_audio_pico_buffers_queued < btstack_audio_pico_buffers_min_queued){
+            btstack_audio_pico_buffers_min_queued = btstack_audio_pico_buffers_queued;
+        }
+        btstack_audio_pico_adapt_buffers_queued(btstack_audio_pico_missed_valid && (missed > btstack_audio_pico_missed) ?
+                                                (uint32_t) (missed - btstack_audio_pico_missed) : 0);
+        btstack_audio_pico_missed = missed;
+        btstack_audio_pico_missed_valid = true;
+    }
+
+    while ((btstack_audio_pico_buffers_queued < btstack_audio_pico_buffers_target) && (btstack_audio_pico_spare_count > 0)){
+        audio_buffer_t * audio_buffer = btstack_audio_pico_spare_buffers[--btstack_audio_pico_spare_count];
 
         int16_t * buffer16 = (int16_t *) audio_buffer->buffer->bytes;
         (*playback_callback)(buffer16, audio_buffer->max_sample_count);
 
-        // duplicate samples for mono
         if (btstack_audio_pico_channel_count == 1){
-            int16_t i;
-            for (i = SAMPLES_PER_BUFFER - 1 ; i >= 0; i--){
-                buffer16[2*i  ] = buffer16[i];
-                buffer16[2*i+1] = buffer16[i];
-            }
+            btstack_audio_pico_mono_to_stereo(buffer16, audio_buffer->max_sample_count, btstack_audio_pico_volume_gain);
+        } else {
+            btstack_audio_pico_scale_stereo(buffer16, audio_buffer->max_sample_count, btstack_audio_pico_volume_gain);
         }
 
         audio_buffer->sample_count = audio_buffer->max_sample_count;
         give_audio_buffer(btstack_audio_pico_audio_buffer_pool, audio_buffer);
+        btstack_audio_pico_buffers_given++;
+        btstack_audio_pico_buffers_queued++;
+    }
+}
+
+static void btstack_audio_pico_data_source_handler(btstack_data_source_t * ds, btstack_data_source_callback_type_t callback_type){
+    UNUSED(ds);
+    if (callback_type == DATA_SOURCE_CALLBACK_POLL){
+        btstack_audio_pico_sink_fill_buffers(true);
     }
 }
 
+static void btstack_audio_pico_report(void){
+    // the queued buffers plus the one being copied to the I2S DMA, which is the same size
+    uint32_t latency_us = (uint32_t) (((uint64_t) (btstack_audio_pico_buffers_queued + 1) * SAMPLES_PER_BUFFER * 1000000) / btstack_audio_pico_audio_format.sample_freq);
+    printf("Audio latency %u.%u ms (%u buffers queued of %u samples), %u underruns\n",
+           (unsigned int) (latency_us / 1000), (unsigned int) ((latency_us % 1000) / 100),
+           btstack_audio_pico_buffers_queued, SAMPLES_PER_BUFFER, (unsigned int) btstack_audio_pico_underruns);
+}
+
 static void driver_timer_handler_sink(btstack_timer_source_t * ts){
 
-    // refill
-    btstack_audio_pico_sink_fill_buffers();
+    btstack_audio_pico_report();
 
     // re-set timer
-    btstack_run_loop_set_timer(ts, DRIVER_POLL_INTERVAL_MS);
+    btstack_run_loop_set_timer(ts, BTSTACK_AUDIO_PICO_REPORT_INTERVAL_MS);
     btstack_run_loop_add_timer(ts);
 }
 
@@ -160,18 +315,31 @@ static int btstack_audio_pico_sink_init(
 }
 
 static void btstack_audio_pico_sink_set_volume(uint8_t volume){
-    UNUSED(volume);
+    // 0..127
+    btstack_audio_pico_volume_gain = ((int32_t) btstack_min(volume, 127) * VOLUME_GAIN_UNITY) / 127;
 }
 
 static void btstack_audio_pico_sink_start_stream(void){
 
+    btstack_audio_pico_buffers_target = MIN_BUFFERS_QUEUED;
+    btstack_audio_pico_buffers_min_queued = MAX_BUFFERS_QUEUED;
+    btstack_audio_pico_last_change_ms = btstack_run_loop_get_time_ms();
+    btstack_audio_pico_missed_valid = false;
+
     // pre-fill HAL buffers
-    btstack_audio_pico_sink_fill_buffers();
+    btstack_audio_pico_sink_fill_buffers(false);
+
+    // refill when each DMA transfer completes
+    btstack_run_loop_set_data_source_handler(&btstack_audio_pico_data_source, &btstack_audio_pico_data_source_handler);
+    btstack_run_loop_enable_data_source_callbacks(&btstack_audio_pico_data_source, DATA_SOURCE_CALLBACK_POLL);
+    btstack_run_loop_add_data_source(&btstack_audio_pico_data_source);
 
     // start timer
-    btstack_run_loop_set_timer_handler(&driver_timer_sink, &driver_timer_handler_sink);
-    btstack_run_loop_set_timer(&driver_timer_sink, DRIVER_POLL_INTERVAL_MS);
-    btstack_run_loop_add_timer(&driver_timer_sink);
+    if (BTSTACK_AUDIO_PICO_REPORT_INTERVAL_MS > 0){
+        btstack_run_loop_set_timer_handler(&driver_timer_sink, &driver_timer_handler_sink);
+        btstack_run_loop_set_timer(&driver_timer_sink, BTSTACK_AUDIO_PICO_REPORT_INTERVAL_MS);
+        btstack_run_loop_add_timer(&driver_timer_sink);
+    }
 
     // state
     btstack_audio_pico_sink_active = true;
@@ -183,8 +351,15 @@ static void btstack_audio_pico_sink_stop_stream(void){
 
     audio_i2s_set_enabled(false);
 
+    // stop refilling
+    btstack_run_loop_remove_data_source(&btstack_audio_pico_data_source);
+
     // stop timer
     btstack_run_loop_remove_timer(&driver_timer_sink);
+    if (BTSTACK_AUDIO_PICO_REPORT_INTERVAL_MS > 0){
+        btstack_audio_pico_report();
+    }
+
     // state
     btstack_audio_pico_sink_active = false;
 }
@@ -29,6 +29,7 @@
 //  https://tools.ietf.org/html/rfc2132 -- DHCP Options and BOOTP Vendor Extensions
 
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
 
@@ -36,6 +37,12 @@
 #include "dhcpserver.h"
 #include "lwip/udp.h"
 
+#if DHCPS_LEASE_PERSIST
+#include "pico/cyw43_arch.h"
+#include "pico/flash.h"
+#include "hardware/flash.h"
+#endif
+
 #define DHCPDISCOVER    (1)
 #define DHCPOFFER       (2)
 #define DHCPREQUEST     (3)
@@ -68,6 +75,12 @@
 #define MAC_LEN (6)
 #define MAKE_IP4(a, b, c, d) ((a) << 24 | (b) << 16 | (c) << 8 | (d))
 
+#define LEASE_NONE (-1)
+
+#ifndef DHCPS_INFO_printf
+#define DHCPS_INFO_printf printf
+#endif
+
 typedef struct {
     uint8_t op; // message opcode
     uint8_t htype; // hardware address type
@@ -86,6 +99,9 @@ typedef struct {
     uint8_t options[312]; // optional parameters, variable, starts with magic
 } dhcp_msg_t;
 
+// The fixed part of the message plus the options magic cookie
+#define DHCP_OPT_OFFSET (offsetof(dhcp_msg_t, options) + 4)
+
 static int dhcp_socket_new_dgram(struct udp_pcb **udp, void *cb_data, udp_recv_fn cb_udp_recv) {
     // family is AF_INET
     // type is SOCK_DGRAM
@@ -118,12 +134,12 @@ static int dhcp_socket_sendto(struct udp_pcb **udp, struct netif *nif, const voi
         len = 0xffff;
     }
 
-    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+    // Send straight from buf; lwIP copies a PBUF_REF if it needs to queue it
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_REF);
     if (p == NULL) {
         return -ENOMEM;
     }
-
-    memcpy(p->payload, buf, len);
+    p->payload = (void *)buf;
 
     ip_addr_t dest;
     IP4_ADDR(ip_2_ip4(&dest), ip >> 24 & 0xff, ip >> 16 & 0xff, ip >> 8 & 0xff, ip & 0xff);
@@ -143,10 +159,14 @@ static int dhcp_socket_sendto(struct udp_pcb **udp, struct netif *nif, const voi
     return len;
 }
 
-static uint8_t *opt_find(uint8_t *opt, uint8_t cmd) {
-    for (int i = 0; i < 308 && opt[i] != DHCP_OPT_END;) {
+static const uint8_t *opt_find(const uint8_t *opt, size_t len, uint8_t cmd) {
+    for (size_t i = 0; i + 1 < len && opt[i] != DHCP_OPT_END;) {
+        if (opt[i] == DHCP_OPT_PAD) {
+            i++;
+            continue;
+        }
         if (opt[i] == cmd) {
-            return &opt[i];
+            return i + 2 + opt[i + 1] <= len ? &opt[i] : NULL;
         }
         i += 2 + opt[i + 1];
     }
@@ -180,32 +200,188 @@ static void opt_write_u32(uint8_t **opt, uint8_t cmd, uint32_t val) {
     *opt = o;
 }
 
+#if DHCPS_LEASE_PERSIST
+
+#ifndef DHCPS_LEASE_FLASH_OFFSET
+#define DHCPS_LEASE_FLASH_OFFSET (PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE)
+#endif
+
+#define DHCPS_PERSIST_MAGIC (0x32504844) // "DHP2"
+
+// The MAC address of each lease and how long it had left when it was saved. The time the server
+// was off isn't known, so a lease is never shorter after a reboot than it was when saved
+typedef struct {
+    uint8_t mac[MAC_LEN];
+    uint16_t reserved;
+    uint32_t remaining_s;
+} dhcp_server_persist_lease_t;
+
+typedef struct {
+    uint32_t magic;
+    uint8_t base_ip;
+    uint8_t max_ip;
+    uint16_t reserved;
+    dhcp_server_persist_lease_t lease[DHCPS_MAX_IP];
+} dhcp_server_persist_t;
+
+#define DHCPS_PERSIST_SIZE ((sizeof(dhcp_server_persist_t) + FLASH_PAGE_SIZE - 1) & ~(FLASH_PAGE_SIZE - 1))
+
+static void dhcp_server_load_leases(dhcp_server_t *d) {
+    const dhcp_server_persist_t *saved = (const dhcp_server_persist_t *)(XIP_BASE + DHCPS_LEASE_FLASH_OFFSET);
+    if (saved->magic != DHCPS_PERSIST_MAGIC || saved->base_ip != DHCPS_BASE_IP || saved->max_ip != DHCPS_MAX_IP) {
+        return;
+    }
+    uint32_t now = cyw43_hal_ticks_ms();
+    for (int i = 0; i < DHCPS_MAX_IP; ++i) {
+        memcpy(d->lease[i].mac, saved->lease[i].mac, MAC_LEN);
+        d->lease[i].expiry = now + MIN(saved->lease[i].remaining_s, DEFAULT_LEASE_TIME_S) * 1000;
+    }
+}
+
+// This function will be called when it's safe to write to flash
+static void call_flash_save_leases(void *param) {
+    flash_range_erase(DHCPS_LEASE_FLASH_OFFSET, FLASH_SECTOR_SIZE);
+    flash_range_program(DHCPS_LEASE_FLASH_OFFSET, param, DHCPS_PERSIST_SIZE);
+}
+
+// Run by the async context a while after the leases change, rather than while replying to a
+// client, so a burst of changes only erases the sector once
+static void dhcp_server_save_leases(async_context_t *context, async_at_time_worker_t *worker) {
+    (void)context;
+    dhcp_server_t *d = worker->user_data;
+    d->save_pending = false;
+    static union {
+        dhcp_server_persist_t persist;
+        uint8_t bytes[DHCPS_PERSIST_SIZE];
+    } buf;
+    memset(&buf, 0xff, sizeof(buf));
+    buf.persist.magic = DHCPS_PERSIST_MAGIC;
+    buf.persist.base_ip = DHCPS_BASE_IP;
+    buf.persist.max_ip = DHCPS_MAX_IP;
+    uint32_t now = cyw43_hal_ticks_ms();
+    for (int i = 0; i < DHCPS_MAX_IP; ++i) {
+        memcpy(buf.persist.lease[i].mac, d->lease[i].mac, MAC_LEN);
+        int32_t remaining_ms = (int32_t)(d->lease[i].expiry - now);
+        buf.persist.lease[i].remaining_s = remaining_ms > 0 ? remaining_ms / 1000 : 0;
+    }
+    int rc = flash_safe_execute(call_flash_save_leases, buf.bytes, UINT32_MAX);
+    if (rc != PICO_OK) {
+        printf("DHCPS: failed to save leases %d\n", rc);
+    }
+}
+#endif
+
+// Arrange for the leases to be saved, if they are being persisted
+static void dhcp_server_leases_changed(dhcp_server_t *d) {
+    #if DHCPS_LEASE_PERSIST
+    if (!d->save_pending) {
+        d->save_pending = true;
+        async_context_add_at_time_worker_in_ms(cyw43_arch_async_context(), &d->save_worker, DHCPS_LEASE_SAVE_DELAY_MS);
+    }
+    #else
+    (void)d;
+    #endif
+}
+
+static bool lease_is_free(const dhcp_server_lease_t *lease) {
+    return memcmp(lease->mac, "\x00\x00\x00\x00\x00\x00", MAC_LEN) == 0;
+}
+
+static bool lease_is_expired(const dhcp_server_lease_t *lease) {
+    return (int32_t)(lease->expiry - cyw43_hal_ticks_ms()) < 0;
+}
+
+// The server's own address may fall within the pool
+static bool lease_is_reserved(dhcp_server_t *d, int i) {
+    return DHCPS_BASE_IP + i == ip4_addr4(ip_2_ip4(&d->ip));
+}
+
+// The lease index for an address, or LEASE_NONE if it isn't one of ours. The pool is within the
+// server's /24
+static int dhcp_server_lease_index(dhcp_server_t *d, const uint8_t *addr) {
+    if (memcmp(addr, &ip4_addr_get_u32(ip_2_ip4(&d->ip)), 3) != 0) {
+        return LEASE_NONE;
+    }
+    int i = addr[3] - DHCPS_BASE_IP;
+    if (i < 0 || i >= DHCPS_MAX_IP || lease_is_reserved(d, i)) {
+        return LEASE_NONE;
+    }
+    return i;
+}
+
+// A client can REQUEST any address, so its lease may be anywhere in the pool and finding it is a
+// plain scan of at most 253 short compares
+static int dhcp_server_find_lease(dhcp_server_t *d, const uint8_t *mac) {
+    for (int i = 0; i < DHCPS_MAX_IP; ++i) {
+        if (memcmp(d->lease[i].mac, mac, MAC_LEN) == 0) {
+            return i;
+        }
+    }
+    return LEASE_NONE;
+}
+
+// Each MAC address has a preferred lease, from which a new one is looked for, so a client
+// usually gets the same address back after its lease has expired
+static int lease_hash(const uint8_t *mac) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < MAC_LEN; ++i) {
+        h = (h ^ mac[i]) * 16777619u;
+    }
+    return h % DHCPS_MAX_IP;
+}
+
+// Find the lease to offer to a client
+static int dhcp_server_choose_lease(dhcp_server_t *d, const uint8_t *mac) {
+    int yi = dhcp_server_find_lease(d, mac);
+    if (yi != LEASE_NONE) {
+        return yi;
+    }
+    int h = lease_hash(mac);
+    for (int n = 0; n < DHCPS_MAX_IP; ++n) {
+        int i = (h + n) % DHCPS_MAX_IP;
+        if (!lease_is_reserved(d, i) && (lease_is_free(&d->lease[i]) || lease_is_expired(&d->lease[i]))) {
+            return i;
+        }
+    }
+    return LEASE_NONE;
+}
+
 static void dhcp_server_process(void *arg, struct udp_pcb *upcb, struct pbuf *p, const ip_addr_t *src_addr, u16_t src_port) {
     dhcp_server_t *d = arg;
     (void)upcb;
     (void)src_addr;
     (void)src_port;
 
-    // This is around 548 bytes
-    dhcp_msg_t dhcp_msg;
+    // The reply is built in the server's buffer rather than on the stack
+    dhcp_msg_t *dhcp_msg = (dhcp_msg_t *)d->msg;
 
     #define DHCP_MIN_SIZE (240 + 3)
-    if (p->tot_len < DHCP_MIN_SIZE) {
+    size_t len = p->tot_len;
+    if (len < DHCP_MIN_SIZE) {
         goto ignore_request;
     }
+    if (len > sizeof(dhcp_msg_t)) {
+        len = sizeof(dhcp_msg_t);
+    }
 
-    size_t len = pbuf_copy_partial(p, &dhcp_msg, sizeof(dhcp_msg), 0);
-    if (len < DHCP_MIN_SIZE) {
-        goto ignore_request;
+    // Parse the request where it is if it's contiguous, which it normally is. It may not be aligned
+    const uint8_t *req = p->payload;
+    if (p->len < len) {
+        pbuf_copy_partial(p, dhcp_msg, len, 0);
+        req = (const uint8_t *)dhcp_msg;
+    } else {
+        // The reply starts with the same fixed fields
+        memcpy(dhcp_msg, req, DHCP_OPT_OFFSET);
     }
+    const uint8_t *req_opt = req + DHCP_OPT_OFFSET; // assume magic cookie: 99, 130, 83, 99
+    size_t req_opt_len = len - DHCP_OPT_OFFSET;
 
-    dhcp_msg.op = DHCPOFFER;
-    memcpy(&dhcp_msg.yiaddr, &ip4_addr_get_u32(ip_2_ip4(&d->ip)), 4);
+    dhcp_msg->op = DHCPOFFER;
+    memcpy(&dhcp_msg->yiaddr, &ip4_addr_get_u32(ip_2_ip4(&d->ip)), 4);
 
-    uint8_t *opt = (uint8_t *)&dhcp_msg.options;
-    opt += 4; // assume magic cookie: 99, 130, 83, 99
+    uint8_t *opt = (uint8_t *)dhcp_msg + DHCP_OPT_OFFSET;
 
-    uint8_t *msgtype = opt_find(opt, DHCP_OPT_MSG_TYPE);
+    const uint8_t *msgtype = opt_find(req_opt, req_opt_len, DHCP_OPT_MSG_TYPE);
     if (msgtype == NULL) {
         // A DHCP package without MSG_TYPE?
         goto ignore_request;
@@ -213,70 +389,66 @@ static void dhcp_server_process(void *arg, struct udp_pcb *upcb, struct pbuf *p,
 
     switch (msgtype[2]) {
         case DHCPDISCOVER: {
-            int yi = DHCPS_MAX_IP;
-            for (int i = 0; i < DHCPS_MAX_IP; ++i) {
-                if (memcmp(d->lease[i].mac, dhcp_msg.chaddr, MAC_LEN) == 0) {
-                    // MAC match, use this IP address
-                    yi = i;
-                    break;
-                }
-                if (yi == DHCPS_MAX_IP) {
-                    // Look for a free IP address
-                    if (memcmp(d->lease[i].mac, "\x00\x00\x00\x00\x00\x00", MAC_LEN) == 0) {
-                        // IP available
-                        yi = i;
-                    }
-                    uint32_t expiry = d->lease[i].expiry << 16 | 0xffff;
-                    if ((int32_t)(expiry - cyw43_hal_ticks_ms()) < 0) {
-                        // IP expired, reuse it
-                        memset(d->lease[i].mac, 0, MAC_LEN);
-                        yi = i;
-                    }
-                }
-            }
-            if (yi == DHCPS_MAX_IP) {
+            int yi = dhcp_server_choose_lease(d, dhcp_msg->chaddr);
+            if (yi == LEASE_NONE) {
                 // No more IP addresses left
                 goto ignore_request;
             }
-            dhcp_msg.yiaddr[3] = DHCPS_BASE_IP + yi;
+            dhcp_msg->yiaddr[3] = DHCPS_BASE_IP + yi;
             opt_write_u8(&opt, DHCP_OPT_MSG_TYPE, DHCPOFFER);
             break;
         }
 
         case DHCPREQUEST: {
-            uint8_t *o = opt_find(opt, DHCP_OPT_REQUESTED_IP);
-            if (o == NULL) {
-                // Should be NACK
+            const uint8_t *o = opt_find(req_opt, req_opt_len, DHCP_OPT_SERVER_ID);
+            if (o != NULL && (o[1] != 4 || memcmp(o + 2, &ip4_addr_get_u32(ip_2_ip4(&d->ip)), 4) != 0)) {
+                // Client has chosen another server
                 goto ignore_request;
             }
-            if (memcmp(o + 2, &ip4_addr_get_u32(ip_2_ip4(&d->ip)), 3) != 0) {
-                // Should be NACK
-                goto ignore_request;
+            // The address is in the options when selecting or rebooting, or ciaddr when renewing
+            const uint8_t *requested_ip = dhcp_msg->ciaddr;
+            o = opt_find(req_opt, req_opt_len, DHCP_OPT_REQUESTED_IP);
+            if (o != NULL && o[1] == 4) {
+                requested_ip = o + 2;
             }
-            uint8_t yi = o[5] - DHCPS_BASE_IP;
-            if (yi >= DHCPS_MAX_IP) {
-                // Should be NACK
-                goto ignore_request;
+            int yi = dhcp_server_lease_index(d, requested_ip);
+            if (yi == LEASE_NONE) {
+                goto nak_request;
             }
-            if (memcmp(d->lease[yi].mac, dhcp_msg.chaddr, MAC_LEN) == 0) {
+            if (memcmp(d->lease[yi].mac, dhcp_msg->chaddr, MAC_LEN) == 0) {
                 // MAC match, ok to use this IP address
-            } else if (memcmp(d->lease[yi].mac, "\x00\x00\x00\x00\x00\x00", MAC_LEN) == 0) {
-                // IP unused, ok to use this IP address
-                memcpy(d->lease[yi].mac, dhcp_msg.chaddr, MAC_LEN);
+            } else if (lease_is_free(&d->lease[yi]) || lease_is_expired(&d->lease[yi])) {
+                // IP unused, ok to use this IP address. Drop any other lease this client has, so
+                // it only ever has one
+                int old = dhcp_server_find_lease(d, dhcp_msg->chaddr);
+                if (old != LEASE_NONE) {
+                    memset(&d->lease[old], 0, sizeof(d->lease[old]));
+                }
+                memcpy(d->lease[yi].mac, dhcp_msg->chaddr, MAC_LEN);
             } else {
                 // IP already in use
-                // Should be NACK
-                goto ignore_request;
+                goto nak_request;
             }
-            d->lease[yi].expiry = (cyw43_hal_ticks_ms() + DEFAULT_LEASE_TIME_S * 1000) >> 16;
-            dhcp_msg.yiaddr[3] = DHCPS_BASE_IP + yi;
+            d->lease[yi].expiry = cyw43_hal_ticks_ms() + DEFAULT_LEASE_TIME_S * 1000;
+            dhcp_server_leases_changed(d);
+            dhcp_msg->yiaddr[3] = DHCPS_BASE_IP + yi;
             opt_write_u8(&opt, DHCP_OPT_MSG_TYPE, DHCPACK);
-            printf("DHCPS: client connected: MAC=%02x:%02x:%02x:%02x:%02x:%02x IP=%u.%u.%u.%u\n",
-                dhcp_msg.chaddr[0], dhcp_msg.chaddr[1], dhcp_msg.chaddr[2], dhcp_msg.chaddr[3], dhcp_msg.chaddr[4], dhcp_msg.chaddr[5],
-                dhcp_msg.yiaddr[0], dhcp_msg.yiaddr[1], dhcp_msg.yiaddr[2], dhcp_msg.yiaddr[3]);
+            DHCPS_INFO_printf("DHCPS: client connected: MAC=%02x:%02x:%02x:%02x:%02x:%02x IP=%u.%u.%u.%u\n",
+                dhcp_msg->chaddr[0], dhcp_msg->chaddr[1], dhcp_msg->chaddr[2], dhcp_msg->chaddr[3], dhcp_msg->chaddr[4], dhcp_msg->chaddr[5],
+                dhcp_msg->yiaddr[0], dhcp_msg->yiaddr[1], dhcp_msg->yiaddr[2], dhcp_msg->yiaddr[3]);
             break;
         }
 
+        case DHCPRELEASE: {
+            int yi = dhcp_server_lease_index(d, dhcp_msg->ciaddr);
+            if (yi != LEASE_NONE && memcmp(d->lease[yi].mac, dhcp_msg->chaddr, MAC_LEN) == 0) {
+                // Keep the MAC so the client gets the same address if it comes back
+                d->lease[yi].expiry = cyw43_hal_ticks_ms();
+                dhcp_server_leases_changed(d);
+            }
+            goto ignore_request;
+        }
+
         default:
             goto ignore_request;
     }
@@ -288,7 +460,18 @@ static void dhcp_server_process(void *arg, struct udp_pcb *upcb, struct pbuf *p,
     opt_write_u32(&opt, DHCP_OPT_IP_LEASE_TIME, DEFAULT_LEASE_TIME_S);
     *opt++ = DHCP_OPT_END;
     struct netif *nif = ip_current_input_netif();
-    dhcp_socket_sendto(&d->udp, nif, &dhcp_msg, opt - (uint8_t *)&dhcp_msg, 0xffffffff, PORT_DHCP_CLIENT);
+    dhcp_socket_sendto(&d->udp, nif, dhcp_msg, opt - (uint8_t *)dhcp_msg, 0xffffffff, PORT_DHCP_CLIENT);
+    goto ignore_request;
+
+nak_request:
+    // Tell the client to start again with a DISCOVER
+    opt = (uint8_t *)dhcp_msg + DHCP_OPT_OFFSET;
+    memset(dhcp_msg->ciaddr, 0, sizeof(dhcp_msg->ciaddr));
+    memset(dhcp_msg->yiaddr, 0, sizeof(dhcp_msg->yiaddr));
+    opt_write_u8(&opt, DHCP_OPT_MSG_TYPE, DHCPNACK);
+    opt_write_n(&opt, DHCP_OPT_SERVER_ID, 4, &ip4_addr_get_u32(ip_2_ip4(&d->ip)));
+    *opt++ = DHCP_OPT_END;
+    dhcp_socket_sendto(&d->udp, ip_current_input_netif(), dhcp_msg, opt - (uint8_t *)dhcp_msg, 0xffffffff, PORT_DHCP_CLIENT);
 
 ignore_request:
     pbuf_free(p);
@@ -298,6 +481,12 @@ void dhcp_server_init(dhcp_server_t *d, ip_addr_t *ip, ip_addr_t *nm) {
     ip_addr_copy(d->ip, *ip);
     ip_addr_copy(d->nm, *nm);
     memset(d->lease, 0, sizeof(d->lease));
+    #if DHCPS_LEASE_PERSIST
+    dhcp_server_load_leases(d);
+    d->save_worker.do_work = dhcp_server_save_leases;
+    d->save_worker.user_data = d;
+    d->save_pending = false;
+    #endif
     if (dhcp_socket_new_dgram(&d->udp, d, dhcp_server_process) != 0) {
         return;
     }
@@ -305,5 +494,12 @@ void dhcp_server_init(dhcp_server_t *d, ip_addr_t *ip, ip_addr_t *nm) {
 }
 
 void dhcp_server_deinit(dhcp_server_t *d) {
+    #if DHCPS_LEASE_PERSIST
+    if (d->save_pending) {
+        // Save now rather than lose the changes
+        async_context_remove_at_time_worker(cyw43_arch_async_context(), &d->save_worker);
+        dhcp_server_save_leases(cyw43_arch_async_context(), &d->save_worker);
+    }
+    #endif
     dhcp_socket_free(&d->udp);
 }
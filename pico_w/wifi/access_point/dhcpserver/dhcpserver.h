@@ -28,19 +28,52 @@
 
 #include "lwip/ip_addr.h"
 
+// The pool is DHCPS_MAX_IP addresses starting at x.x.x.DHCPS_BASE_IP. It can cover the whole
+// of a /24, e.g. with DHCPS_BASE_IP 2 and DHCPS_MAX_IP 253. The server's own address is never leased
+#ifndef DHCPS_BASE_IP
 #define DHCPS_BASE_IP (16)
+#endif
+#ifndef DHCPS_MAX_IP
 #define DHCPS_MAX_IP (8)
+#endif
+
+#if DHCPS_BASE_IP < 1 || DHCPS_MAX_IP < 1 || DHCPS_BASE_IP + DHCPS_MAX_IP > 255
+#error "DHCP pool must fit within x.x.x.1 to x.x.x.254"
+#endif
+
+// Set to 1 to save leases to the last sector of flash, so clients keep their
+// addresses after the server reboots
+#ifndef DHCPS_LEASE_PERSIST
+#define DHCPS_LEASE_PERSIST (0)
+#endif
+
+// Leases are saved this long after they change, so a burst of clients joining costs one flash write
+#ifndef DHCPS_LEASE_SAVE_DELAY_MS
+#define DHCPS_LEASE_SAVE_DELAY_MS (5000)
+#endif
+
+#if DHCPS_LEASE_PERSIST
+#include "pico/async_context.h"
+#endif
 
 typedef struct _dhcp_server_lease_t {
     uint8_t mac[6];
-    uint16_t expiry;
+    uint32_t expiry; // in ms, compared with cyw43_hal_ticks_ms()
 } dhcp_server_lease_t;
 
+// Size of a DHCP message, including 312 bytes of options
+#define DHCPS_MSG_SIZE (548)
+
 typedef struct _dhcp_server_t {
     ip_addr_t ip;
     ip_addr_t nm;
     dhcp_server_lease_t lease[DHCPS_MAX_IP];
     struct udp_pcb *udp;
+    #if DHCPS_LEASE_PERSIST
+    async_at_time_worker_t save_worker;
+    bool save_pending;
+    #endif
+    uint32_t msg[DHCPS_MSG_SIZE / sizeof(uint32_t)]; // replies are built and sent from here
 } dhcp_server_t;
 
 void dhcp_server_init(dhcp_server_t *d, ip_addr_t *ip, ip_addr_t *nm);
@@ -12,6 +12,7 @@
 
 #include "dnsserver.h"
 #include "lwip/udp.h"
+#include "lwip/sys.h"
 
 #define PORT_DNS_SERVER 53
 #define DUMP_DATA 0
@@ -19,6 +20,9 @@
 #define DEBUG_printf(...)
 #define ERROR_printf printf
 
+// The record table is indexed by masking the name's hash
+static_assert((DNS_SERVER_MAX_RECORDS & (DNS_SERVER_MAX_RECORDS - 1)) == 0, "DNS_SERVER_MAX_RECORDS must be a power of two");
+
 typedef struct dns_header_t_ {
     uint16_t id;
     uint16_t flags;
@@ -28,8 +32,6 @@ typedef struct dns_header_t_ {
     uint16_t additional_record_count;
 } dns_header_t;
 
-#define MAX_DNS_MSG_SIZE 300
-
 static int dns_socket_new_dgram(struct udp_pcb **udp, void *cb_data, udp_recv_fn cb_udp_recv) {
     *udp = udp_new();
     if (*udp == NULL) {
@@ -78,13 +80,13 @@ static int dns_socket_sendto(struct udp_pcb **udp, const void *buf, size_t len,
         len = 0xffff;
     }
 
-    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+    // Send straight from buf; lwIP copies a PBUF_REF if it needs to queue it
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_REF);
     if (p == NULL) {
         ERROR_printf("DNS: Failed to send message out of memory\n");
         return -ENOMEM;
     }
-
-    memcpy(p->payload, buf, len);
+    p->payload = (void *)buf;
     err_t err = udp_sendto(*udp, p, dest, port);
 
     pbuf_free(p);
@@ -100,24 +102,352 @@ static int dns_socket_sendto(struct udp_pcb **udp, const void *buf, size_t len,
     return len;
 }
 
+#define DNS_TYPE_A 1
+#define DNS_TYPE_AAAA 28
+#define DNS_CLASS_IN 1
+#define DNS_RCODE_NOERROR 0
+#define DNS_RCODE_NXDOMAIN 3
+
+#define DNS_RECORD_HAS_A 0x1
+#define DNS_RECORD_HAS_AAAA 0x2
+#define DNS_RECORD_NXDOMAIN 0x4
+
+#define DNS_DEFAULT_TTL_S 60
+#define DNS_NEGATIVE_TTL_S 60
+#define DNS_MAX_TTL_S 3600
+#define DNS_PENDING_TIMEOUT_MS 5000
+#define DNS_CACHE_PROBE 4
+
+static uint16_t get_u16(const uint8_t *ptr) {
+    return ptr[0] << 8 | ptr[1];
+}
+
+static uint8_t *put_u16(uint8_t *ptr, uint16_t val) {
+    *ptr++ = val >> 8;
+    *ptr++ = val;
+    return ptr;
+}
+
+static char name_char(char c) {
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+static uint32_t name_hash_char(uint32_t hash, char c) {
+    return (hash ^ (uint8_t)name_char(c)) * 16777619u;
+}
+
+static uint32_t name_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    while (*name) {
+        hash = name_hash_char(hash, *name++);
+    }
+    return hash;
+}
+
+static bool name_equal(const char *a, const char *b) {
+    while (*a && name_char(*a) == name_char(*b)) {
+        a++;
+        b++;
+    }
+    return !*a && !*b;
+}
+
+// Read a name from a question into lower case dotted form, returning a pointer to what follows it
+// or NULL if it's invalid. The name is set empty if it's too long to keep
+static const uint8_t *read_name(const uint8_t *ptr, const uint8_t *end, char *name, uint32_t *hash) {
+    const uint8_t *start = ptr;
+    size_t len = 0;
+    bool too_long = false;
+    *hash = 2166136261u;
+    while (ptr < end) {
+        int label_len = *ptr++;
+        if (label_len == 0) {
+            if (ptr - start > 255) {
+                DEBUG_printf("Invalid question length\n");
+                return NULL;
+            }
+            name[too_long ? 0 : len] = 0;
+            return ptr;
+        }
+        if (label_len > 63 || ptr + label_len > end) {
+            // Including compression, which isn't expected in a question
+            DEBUG_printf("Invalid label\n");
+            return NULL;
+        }
+        if (len + label_len + 1 >= DNS_SERVER_MAX_NAME) {
+            too_long = true;
+        }
+        for (int i = -1; i < label_len && !too_long; i++) {
+            char c = i < 0 ? '.' : name_char(ptr[i]);
+            if (i < 0 && len == 0) {
+                continue;
+            }
+            name[len++] = c;
+            *hash = name_hash_char(*hash, c);
+        }
+        ptr += label_len;
+    }
+    return NULL;
+}
+
+// Skip a name in an answer, which may be compressed
+static const uint8_t *skip_name(const uint8_t *ptr, const uint8_t *end) {
+    while (ptr < end) {
+        if ((*ptr & 0xc0) == 0xc0) {
+            return ptr + 2 <= end ? ptr + 2 : NULL;
+        }
+        if (*ptr == 0) {
+            return ptr + 1;
+        }
+        ptr += *ptr + 1;
+    }
+    return NULL;
+}
+
+static dns_server_record_t *dns_server_find_record(dns_server_t *d, const char *name, uint32_t hash) {
+    for (int n = 0; n < DNS_SERVER_MAX_RECORDS; n++) {
+        dns_server_record_t *record = &d->records[(hash + n) & (DNS_SERVER_MAX_RECORDS - 1)];
+        if (!record->name) {
+            break;
+        }
+        if (record->hash == hash && name_equal(record->name, name)) {
+            return record;
+        }
+    }
+    return NULL;
+}
+
+static dns_server_record_t *dns_server_get_record(dns_server_t *d, const char *name) {
+    if (strlen(name) >= DNS_SERVER_MAX_NAME) {
+        return NULL;
+    }
+    uint32_t hash = name_hash(name);
+    dns_server_record_t *record = dns_server_find_record(d, name, hash);
+    if (record) {
+        return record;
+    }
+    for (int n = 0; n < DNS_SERVER_MAX_RECORDS; n++) {
+        record = &d->records[(hash + n) & (DNS_SERVER_MAX_RECORDS - 1)];
+        if (!record->name) {
+            record->name = name;
+            record->hash = hash;
+            return record;
+        }
+    }
+    ERROR_printf("DNS: record table full\n");
+    return NULL;
+}
+
+bool dns_server_add_a(dns_server_t *d, const char *name, const ip4_addr_t *addr) {
+    dns_server_record_t *record = dns_server_get_record(d, name);
+    if (!record) {
+        return false;
+    }
+    memcpy(record->a, &ip4_addr_get_u32(addr), 4);
+    record->flags = (record->flags & ~DNS_RECORD_NXDOMAIN) | DNS_RECORD_HAS_A;
+    return true;
+}
+
+bool dns_server_add_aaaa(dns_server_t *d, const char *name, const uint8_t addr[16]) {
+    dns_server_record_t *record = dns_server_get_record(d, name);
+    if (!record) {
+        return false;
+    }
+    memcpy(record->aaaa, addr, 16);
+    record->flags = (record->flags & ~DNS_RECORD_NXDOMAIN) | DNS_RECORD_HAS_AAAA;
+    return true;
+}
+
+bool dns_server_add_nxdomain(dns_server_t *d, const char *name) {
+    dns_server_record_t *record = dns_server_get_record(d, name);
+    if (!record) {
+        return false;
+    }
+    record->flags = DNS_RECORD_NXDOMAIN;
+    return true;
+}
+
+void dns_server_set_upstream(dns_server_t *d, const ip_addr_t *upstream) {
+    d->has_upstream = upstream != NULL;
+    if (upstream) {
+        ip_addr_copy(d->upstream, *upstream);
+    }
+    memset(d->cache, 0, sizeof(d->cache));
+    memset(d->pending, 0, sizeof(d->pending));
+}
+
+static dns_server_cache_t *dns_server_find_cache(dns_server_t *d, const char *name, uint32_t hash, uint16_t type) {
+    for (int n = 0; n < DNS_CACHE_PROBE; n++) {
+        dns_server_cache_t *entry = &d->cache[(hash + n) % DNS_SERVER_CACHE_SIZE];
+        if (entry->expiry && entry->hash == hash && entry->type == type && name_equal(entry->name, name)) {
+            if ((int32_t)(entry->expiry - sys_now()) <= 0) {
+                entry->expiry = 0;
+                return NULL;
+            }
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static dns_server_cache_t *dns_server_new_cache(dns_server_t *d, uint32_t hash) {
+    // Use an empty or expired entry, else the one which expires first
+    dns_server_cache_t *best = NULL;
+    for (int n = 0; n < DNS_CACHE_PROBE; n++) {
+        dns_server_cache_t *entry = &d->cache[(hash + n) % DNS_SERVER_CACHE_SIZE];
+        if (!entry->expiry || (int32_t)(entry->expiry - sys_now()) <= 0) {
+            return entry;
+        }
+        if (!best || (int32_t)(entry->expiry - best->expiry) < 0) {
+            best = entry;
+        }
+    }
+    return best;
+}
+
+// Append an answer pointing at the question at offset name_offset
+static uint8_t *put_answer(uint8_t *ptr, size_t name_offset, uint16_t type, uint32_t ttl, const uint8_t *addr, uint8_t addr_len) {
+    ptr = put_u16(ptr, 0xc000 | name_offset); // pointer to question
+    ptr = put_u16(ptr, type);
+    ptr = put_u16(ptr, DNS_CLASS_IN);
+    ptr = put_u16(ptr, ttl >> 16);
+    ptr = put_u16(ptr, ttl);
+    ptr = put_u16(ptr, addr_len);
+    memcpy(ptr, addr, addr_len);
+    return ptr + addr_len;
+}
+
+static void dns_server_forward(dns_server_t *d, const uint8_t *req, size_t msg_len, const ip_addr_t *src_addr, u16_t src_port) {
+    // Reuse a free or timed out slot
+    dns_server_pending_t *pending = NULL;
+    for (int i = 0; i < DNS_SERVER_MAX_PENDING; i++) {
+        if (!d->pending[i].expiry || (int32_t)(d->pending[i].expiry - sys_now()) <= 0) {
+            pending = &d->pending[i];
+            break;
+        }
+    }
+    if (!pending) {
+        DEBUG_printf("Too many pending queries\n");
+        return;
+    }
+    uint8_t *dns_msg = (uint8_t *)d->msg;
+    if (req != dns_msg) {
+        memcpy(dns_msg, req, msg_len);
+    }
+    ip_addr_copy(pending->addr, *src_addr);
+    pending->port = src_port;
+    pending->id = get_u16(dns_msg);
+    pending->upstream_id = LWIP_RAND();
+    pending->expiry = sys_now() + DNS_PENDING_TIMEOUT_MS;
+    put_u16(dns_msg, pending->upstream_id);
+    dns_socket_sendto(&d->udp, dns_msg, msg_len, &d->upstream, PORT_DNS_SERVER);
+}
+
+// Cache the answer from the upstream server and pass it on
+static void dns_server_process_upstream(dns_server_t *d, const uint8_t *rsp, size_t msg_len) {
+    dns_server_pending_t *pending = NULL;
+    for (int i = 0; i < DNS_SERVER_MAX_PENDING; i++) {
+        if (d->pending[i].expiry && d->pending[i].upstream_id == get_u16(rsp)) {
+            pending = &d->pending[i];
+            break;
+        }
+    }
+    if (!pending || get_u16(rsp + 4) != 1) {
+        DEBUG_printf("Unexpected response\n");
+        return;
+    }
+
+    const uint8_t *end = rsp + msg_len;
+    char name[DNS_SERVER_MAX_NAME];
+    uint32_t hash;
+    const uint8_t *ptr = read_name(rsp + sizeof(dns_header_t), end, name, &hash);
+    if (ptr && ptr + 4 <= end && name[0]) {
+        uint16_t type = get_u16(ptr);
+        uint8_t rcode = get_u16(rsp + 2) & 0xf;
+        ptr += 4;
+
+        // Find the first address of the type asked for, and the smallest ttl on the way to it
+        uint32_t ttl = rcode == DNS_RCODE_NOERROR ? DNS_MAX_TTL_S : DNS_NEGATIVE_TTL_S;
+        const uint8_t *addr = NULL;
+        uint16_t addr_len = 0;
+        for (int i = 0; i < get_u16(rsp + 6) && ptr; i++) {
+            ptr = skip_name(ptr, end);
+            if (!ptr || ptr + 10 > end) {
+                break;
+            }
+            uint16_t rr_type = get_u16(ptr);
+            uint32_t rr_ttl = get_u16(ptr + 4) << 16 | get_u16(ptr + 6);
+            uint16_t rr_len = get_u16(ptr + 8);
+            ptr += 10;
+            if (ptr + rr_len > end) {
+                break;
+            }
+            if (rr_ttl < ttl) {
+                ttl = rr_ttl;
+            }
+            if (rr_type == type && rr_len <= 16) {
+                addr = ptr;
+                addr_len = rr_len;
+                break;
+            }
+            ptr += rr_len;
+        }
+        if (rcode == DNS_RCODE_NOERROR && !addr) {
+            ttl = DNS_NEGATIVE_TTL_S;
+        }
+        if ((rcode == DNS_RCODE_NOERROR || rcode == DNS_RCODE_NXDOMAIN) && ttl) {
+            dns_server_cache_t *entry = dns_server_new_cache(d, hash);
+            entry->hash = hash;
+            entry->type = type;
+            entry->rcode = rcode;
+            entry->addr_len = addr_len;
+            if (addr) {
+                memcpy(entry->addr, addr, addr_len);
+            }
+            strcpy(entry->name, name);
+            entry->expiry = sys_now() + ttl * 1000;
+        }
+    }
+
+    // Pass the answer back with the client's id
+    uint8_t *dns_msg = (uint8_t *)d->msg;
+    if (rsp != dns_msg) {
+        memcpy(dns_msg, rsp, msg_len);
+    }
+    put_u16(dns_msg, pending->id);
+    pending->expiry = 0;
+    dns_socket_sendto(&d->udp, dns_msg, msg_len, &pending->addr, pending->port);
+}
+
 static void dns_server_process(void *arg, struct udp_pcb *upcb, struct pbuf *p, const ip_addr_t *src_addr, u16_t src_port) {
     dns_server_t *d = arg;
     DEBUG_printf("dns_server_process %u\n", p->tot_len);
 
-    uint8_t dns_msg[MAX_DNS_MSG_SIZE];
+    // The reply is built in the server's buffer rather than on the stack
+    uint8_t *dns_msg = (uint8_t *)d->msg;
     dns_header_t *dns_hdr = (dns_header_t*)dns_msg;
 
-    size_t msg_len = pbuf_copy_partial(p, dns_msg, sizeof(dns_msg), 0);
+    size_t msg_len = p->tot_len;
+    if (msg_len > sizeof(d->msg)) {
+        msg_len = sizeof(d->msg);
+    }
     if (msg_len < sizeof(dns_header_t)) {
         goto ignore_request;
     }
 
+    // Parse the request where it is if it's contiguous, which it normally is. It may not be aligned
+    const uint8_t *req = p->payload;
+    if (p->len < msg_len) {
+        pbuf_copy_partial(p, dns_msg, msg_len, 0);
+        req = dns_msg;
+    }
+
 #if DUMP_DATA
-    dump_bytes(dns_msg, msg_len);
+    dump_bytes(req, msg_len);
 #endif
 
-    uint16_t flags = lwip_ntohs(dns_hdr->flags);
-    uint16_t question_count = lwip_ntohs(dns_hdr->question_count);
+    uint16_t flags = get_u16(req + 2);
+    uint16_t question_count = get_u16(req + 4);
 
     DEBUG_printf("len %d\n", msg_len);
     DEBUG_printf("dns flags 0x%x\n", flags);
@@ -130,7 +460,11 @@ static void dns_server_process(void *arg, struct udp_pcb *upcb, struct pbuf *p,
 
     // Check QR indicates a query
     if (((flags >> 15) & 0x1) != 0) {
-        DEBUG_printf("Ignoring non-query\n");
+        if (d->has_upstream && ip_addr_cmp(src_addr, &d->upstream) && src_port == PORT_DNS_SERVER) {
+            dns_server_process_upstream(d, req, msg_len);
+        } else {
+            DEBUG_printf("Ignoring non-query\n");
+        }
         goto ignore_request;
     }
 
@@ -146,78 +480,108 @@ static void dns_server_process(void *arg, struct udp_pcb *upcb, struct pbuf *p,
         goto ignore_request;
     }
 
-    // Print the question
-    DEBUG_printf("question: ");
-    const uint8_t *question_ptr_start = dns_msg + sizeof(dns_header_t);
-    const uint8_t *question_ptr_end = dns_msg + msg_len;
+    // Find all the questions first, as the answers go after them
+    const uint8_t *question_ptr_start = req + sizeof(dns_header_t);
+    const uint8_t *question_ptr_end = req + msg_len;
     const uint8_t *question_ptr = question_ptr_start;
-    while(question_ptr < question_ptr_end) {
-        if (*question_ptr == 0) {
-            question_ptr++;
-            break;
-        } else {
-            if (question_ptr > question_ptr_start) {
-                DEBUG_printf(".");
-            }
-            int label_len = *question_ptr++;
-            if (label_len > 63) {
-                DEBUG_printf("Invalid label\n");
-                goto ignore_request;
-            }
-            DEBUG_printf("%.*s", label_len, question_ptr);
-            question_ptr += label_len;
+    for (int i = 0; i < question_count; i++) {
+        char name[DNS_SERVER_MAX_NAME];
+        uint32_t hash;
+        question_ptr = read_name(question_ptr, question_ptr_end, name, &hash);
+        if (!question_ptr || question_ptr + 4 > question_ptr_end) {
+            DEBUG_printf("Invalid question\n");
+            goto ignore_request;
         }
-    }
-    DEBUG_printf("\n");
+        DEBUG_printf("question: %s type %u\n", name, get_u16(question_ptr));
 
-    // Check question length
-    if (question_ptr - question_ptr_start > 255) {
-        DEBUG_printf("Invalid question length\n");
-        goto ignore_request;
-    }
-
-    // Skip QNAME and QTYPE
-    question_ptr += 4;
+        // Forward a single question we don't know the answer to
+        if (d->has_upstream && question_count == 1 && !dns_server_find_record(d, name, hash) &&
+            !dns_server_find_cache(d, name, hash, get_u16(question_ptr))) {
+            dns_server_forward(d, req, msg_len, src_addr, src_port);
+            goto ignore_request;
+        }
 
-    // Generate answer
-    uint8_t *answer_ptr = dns_msg + (question_ptr - dns_msg);
-    *answer_ptr++ = 0xc0; // pointer
-    *answer_ptr++ = question_ptr_start - dns_msg; // pointer to question
-    
-    *answer_ptr++ = 0;
-    *answer_ptr++ = 1; // host address
+        // Skip QTYPE and QCLASS
+        question_ptr += 4;
+    }
 
-    *answer_ptr++ = 0;
-    *answer_ptr++ = 1; // Internet class
+    // Copy the header and questions to the reply
+    size_t question_end = question_ptr - req;
+    if (req != dns_msg) {
+        memcpy(dns_msg, req, question_end);
+    }
 
-    *answer_ptr++ = 0;
-    *answer_ptr++ = 0;
-    *answer_ptr++ = 0;
-    *answer_ptr++ = 60; // ttl 60s
+    // Generate answers
+    uint8_t *answer_ptr = dns_msg + question_end;
+    uint16_t answer_count = 0;
+    int nxdomain_count = 0;
+    bool authoritative = true;
+    question_ptr = dns_msg + sizeof(dns_header_t);
+    for (int i = 0; i < question_count; i++) {
+        size_t name_offset = question_ptr - dns_msg;
+        char name[DNS_SERVER_MAX_NAME];
+        uint32_t hash;
+        question_ptr = read_name(question_ptr, dns_msg + question_end, name, &hash);
+        uint16_t type = get_u16(question_ptr);
+        uint16_t class = get_u16(question_ptr + 2);
+        question_ptr += 4;
+        if (class != DNS_CLASS_IN || answer_ptr + 12 + 16 > dns_msg + sizeof(d->msg)) {
+            continue;
+        }
 
-    *answer_ptr++ = 0;
-    *answer_ptr++ = 4; // length
-    memcpy(answer_ptr, &d->ip.addr, 4); // use our address
-    answer_ptr += 4;
+        dns_server_record_t *record = name[0] ? dns_server_find_record(d, name, hash) : NULL;
+        dns_server_cache_t *entry = NULL;
+        if (!record && d->has_upstream && name[0]) {
+            entry = dns_server_find_cache(d, name, hash, type);
+        }
+        if (record) {
+            // An answer from our table
+            if (record->flags & DNS_RECORD_NXDOMAIN) {
+                nxdomain_count++;
+            } else if (type == DNS_TYPE_A && (record->flags & DNS_RECORD_HAS_A)) {
+                answer_ptr = put_answer(answer_ptr, name_offset, type, DNS_DEFAULT_TTL_S, record->a, 4);
+                answer_count++;
+            } else if (type == DNS_TYPE_AAAA && (record->flags & DNS_RECORD_HAS_AAAA)) {
+                answer_ptr = put_answer(answer_ptr, name_offset, type, DNS_DEFAULT_TTL_S, record->aaaa, 16);
+                answer_count++;
+            }
+        } else if (entry) {
+            // An answer from the upstream server's cache
+            authoritative = false;
+            if (entry->rcode == DNS_RCODE_NXDOMAIN) {
+                nxdomain_count++;
+            } else if (entry->addr_len) {
+                uint32_t ttl = (entry->expiry - sys_now()) / 1000;
+                answer_ptr = put_answer(answer_ptr, name_offset, type, ttl, entry->addr, entry->addr_len);
+                answer_count++;
+            }
+        } else if (type == DNS_TYPE_A) {
+            // Everything else is us. There's no answer for other types, so clients don't wait for them
+            answer_ptr = put_answer(answer_ptr, name_offset, type, DNS_DEFAULT_TTL_S, (const uint8_t *)&d->ip.addr, 4);
+            answer_count++;
+        }
+    }
 
     dns_hdr->flags = lwip_htons(
                 0x1 << 15 | // QR = response
-                0x1 << 10 | // AA = authoritative
-                0x1 << 7);   // RA = authenticated
-    dns_hdr->question_count = lwip_htons(1);
-    dns_hdr->answer_record_count = lwip_htons(1);
+                (authoritative ? 0x1 << 10 : 0) | // AA = authoritative
+                (flags & (0x1 << 8)) | // RD = copied from the query
+                0x1 << 7 | // RA = recursion available
+                (nxdomain_count == question_count ? DNS_RCODE_NXDOMAIN : DNS_RCODE_NOERROR));
+    dns_hdr->answer_record_count = lwip_htons(answer_count);
     dns_hdr->authority_record_count = 0;
     dns_hdr->additional_record_count = 0;
 
     // Send the reply
     DEBUG_printf("Sending %d byte reply to %s:%d\n", answer_ptr - dns_msg, ipaddr_ntoa(src_addr), src_port);
-    dns_socket_sendto(&d->udp, &dns_msg, answer_ptr - dns_msg, src_addr, src_port);
+    dns_socket_sendto(&d->udp, dns_msg, answer_ptr - dns_msg, src_addr, src_port);
 
 ignore_request:
     pbuf_free(p);
 }
 
 void dns_server_init(dns_server_t *d, ip_addr_t *ip) {
+    memset(d, 0, sizeof(*d));
     if (dns_socket_new_dgram(&d->udp, d, dns_server_process) != ERR_OK) {
         DEBUG_printf("dns server failed to start\n");
         return;
@@ -9,12 +9,76 @@
 
 #include "lwip/ip_addr.h"
 
+// Largest DNS message over UDP
+#define DNS_SERVER_MSG_SIZE 512
+
+// Longest name, in dotted form, that can be held in the record table or cache
+#define DNS_SERVER_MAX_NAME 64
+
+// Number of names that can be given fixed answers, must be a power of two
+#ifndef DNS_SERVER_MAX_RECORDS
+#define DNS_SERVER_MAX_RECORDS 16
+#endif
+
+// Number of answers from the upstream server to cache
+#ifndef DNS_SERVER_CACHE_SIZE
+#define DNS_SERVER_CACHE_SIZE 16
+#endif
+
+// Number of queries that can be waiting for the upstream server
+#ifndef DNS_SERVER_MAX_PENDING
+#define DNS_SERVER_MAX_PENDING 4
+#endif
+
+typedef struct dns_server_record_t_ {
+    const char *name;
+    uint32_t hash;
+    uint8_t flags;
+    uint8_t a[4];
+    uint8_t aaaa[16];
+} dns_server_record_t;
+
+typedef struct dns_server_cache_t_ {
+    uint32_t hash;
+    uint32_t expiry; // sys_now() in ms
+    uint16_t type;
+    uint8_t rcode;
+    uint8_t addr_len; // zero if the name has no address of this type
+    uint8_t addr[16];
+    char name[DNS_SERVER_MAX_NAME];
+} dns_server_cache_t;
+
+typedef struct dns_server_pending_t_ {
+    ip_addr_t addr;
+    uint16_t port;
+    uint16_t id;
+    uint16_t upstream_id;
+    uint32_t expiry; // sys_now() in ms, or zero if unused
+} dns_server_pending_t;
+
 typedef struct dns_server_t_ {
     struct udp_pcb *udp;
      ip_addr_t ip;
+    ip_addr_t upstream;
+    bool has_upstream;
+    dns_server_record_t records[DNS_SERVER_MAX_RECORDS];
+    dns_server_cache_t cache[DNS_SERVER_CACHE_SIZE];
+    dns_server_pending_t pending[DNS_SERVER_MAX_PENDING];
+    uint32_t msg[DNS_SERVER_MSG_SIZE / sizeof(uint32_t)]; // replies are built and sent from here
 } dns_server_t;
 
+// Without an upstream server, any name not in the record table resolves to ip. This clears the
+// record table and the upstream server, so call it before adding records or setting the upstream
 void dns_server_init(dns_server_t *d, ip_addr_t *ip);
 void dns_server_deinit(dns_server_t *d);
 
+// Add fixed answers for a name. The name is not copied. A name can have an A and an AAAA
+// record, or can be marked as not existing
+bool dns_server_add_a(dns_server_t *d, const char *name, const ip4_addr_t *addr);
+bool dns_server_add_aaaa(dns_server_t *d, const char *name, const uint8_t addr[16]);
+bool dns_server_add_nxdomain(dns_server_t *d, const char *name);
+
+// Forward and cache queries for names not in the record table, e.g. when there is an uplink. Pass NULL to stop
+void dns_server_set_upstream(dns_server_t *d, const ip_addr_t *upstream);
+
 #endif
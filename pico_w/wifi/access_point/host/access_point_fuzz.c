@@ -0,0 +1,169 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Feeds arbitrary packets to the DHCP and DNS servers. Build with the address and undefined
+// behaviour sanitizers to catch reads and writes outside the packet or the server's buffers.
+//
+// The first byte of each input picks the server, whether the packet comes from the upstream DNS
+// server and the time. The second is where to split the packet across two pbufs, and the rest is
+// the packet itself.
+//
+// Built with -DACCESS_POINT_LIBFUZZER=ON this is a libFuzzer target. Otherwise it mutates some
+// valid packets at random itself, or runs the inputs given on the command line
+//   access_point_fuzz [iterations [seed]]
+//   access_point_fuzz crash-file...
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host_lwip.h"
+#include "dhcpserver.h"
+#include "dnsserver.h"
+#include "packets.h"
+
+#define FUZZ_DNS 0x1
+#define FUZZ_FROM_UPSTREAM 0x2
+#define FUZZ_TIME_SHIFT 2
+
+static dhcp_server_t dhcp_server;
+static dns_server_t dns_server;
+static ip_addr_t client, upstream;
+
+static void fuzz_init(void) {
+    ip_addr_t ip, nm;
+    IP4_ADDR(&ip, 192, 168, 4, 1);
+    IP4_ADDR(&nm, 255, 255, 255, 0);
+    IP4_ADDR(&client, 192, 168, 4, 20);
+    IP4_ADDR(&upstream, 192, 168, 1, 1);
+    dhcp_server_init(&dhcp_server, &ip, &nm);
+    dns_server_init(&dns_server, &ip);
+    dns_server_add_a(&dns_server, "pico.local", ip_2_ip4(&ip));
+    dns_server_add_nxdomain(&dns_server, "blocked.example.com");
+    dns_server_set_upstream(&dns_server, &upstream);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static bool initialised;
+    if (!initialised) {
+        fuzz_init();
+        initialised = true;
+    }
+    if (size < 2) {
+        return 0;
+    }
+    uint8_t flags = data[0];
+    size_t split = data[1];
+    // Time moves on in big steps, so leases and cache entries expire
+    host_lwip_set_time((uint32_t)(flags >> FUZZ_TIME_SHIFT) * 60000u);
+    bool from_upstream = flags & FUZZ_FROM_UPSTREAM;
+    if (flags & FUZZ_DNS) {
+        host_lwip_deliver(PORT_DNS, data + 2, size - 2, split, from_upstream ? &upstream : &client,
+                          from_upstream ? PORT_DNS : 5353);
+    } else {
+        host_lwip_deliver(PORT_DHCP_SERVER, data + 2, size - 2, split, &client, PORT_DHCP_CLIENT);
+    }
+    if (host_lwip_pbufs_in_use()) {
+        printf("pbuf leaked\n");
+        abort();
+    }
+    return 0;
+}
+
+#if !ACCESS_POINT_LIBFUZZER
+
+#define MAX_INPUT (HOST_LWIP_MAX_PACKET + 2)
+
+static size_t read_file(const char *path, uint8_t *buf) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    size_t len = fread(buf, 1, MAX_INPUT, f);
+    fclose(f);
+    return len;
+}
+
+// Some valid inputs to start from
+static size_t make_seed(int n, uint8_t *buf) {
+    static const uint8_t mac[6] = { 0x02, 0, 0, 0, 0, 1 };
+    static const uint8_t server_ip[4] = { 192, 168, 4, 1 };
+    static const uint8_t offered[4] = { 192, 168, 4, 3 };
+    static const uint8_t addr[4] = { 10, 0, 0, 1 };
+    buf[1] = 0;
+    switch (n % 6) {
+        case 0:
+            buf[0] = 0;
+            return 2 + packet_dhcp(buf + 2, DHCP_DISCOVER, mac, NULL, NULL, NULL);
+        case 1:
+            buf[0] = 0;
+            return 2 + packet_dhcp(buf + 2, DHCP_REQUEST, mac, NULL, offered, server_ip);
+        case 2:
+            buf[0] = 0;
+            return 2 + packet_dhcp(buf + 2, DHCP_RELEASE, mac, offered, NULL, server_ip);
+        case 3:
+            buf[0] = FUZZ_DNS;
+            return 2 + packet_dns_query(buf + 2, 1, "pico.local", DNS_TYPE_A);
+        case 4:
+            buf[0] = FUZZ_DNS;
+            return 2 + packet_dns_query(buf + 2, 2, "www.example.com", DNS_TYPE_AAAA);
+        default: {
+            buf[0] = FUZZ_DNS | FUZZ_FROM_UPSTREAM;
+            size_t len = packet_dns_query(buf + 2, 3, "www.example.com", DNS_TYPE_A);
+            return 2 + packet_dns_answer(buf + 2, len, addr, 300);
+        }
+    }
+}
+
+static size_t mutate(uint8_t *buf, size_t len) {
+    int changes = 1 + rand() % 8;
+    for (int i = 0; i < changes; i++) {
+        switch (rand() % 4) {
+            case 0: // flip a bit
+                buf[rand() % len] ^= 1u << (rand() % 8);
+                break;
+            case 1: // an interesting byte
+                buf[rand() % len] = (const uint8_t[]){ 0, 1, 0x3f, 0x40, 0x7f, 0x80, 0xc0, 0xff }[rand() % 8];
+                break;
+            case 2: // truncate
+                len = 1 + rand() % len;
+                break;
+            default: // grow
+                if (len < MAX_INPUT) {
+                    size_t more = 1 + rand() % (MAX_INPUT - len);
+                    for (size_t j = 0; j < more; j++) {
+                        buf[len + j] = rand();
+                    }
+                    len += more;
+                }
+                break;
+        }
+    }
+    return len;
+}
+
+int main(int argc, char **argv) {
+    static uint8_t buf[MAX_INPUT];
+    if (argc > 1 && atoi(argv[1]) <= 0) {
+        for (int i = 1; i < argc; i++) {
+            size_t len = read_file(argv[i], buf);
+            LLVMFuzzerTestOneInput(buf, len);
+            printf("%s ok\n", argv[i]);
+        }
+        return 0;
+    }
+    int iterations = argc > 1 ? atoi(argv[1]) : 1000000;
+    srand(argc > 2 ? atoi(argv[2]) : 1);
+    for (int i = 0; i < iterations; i++) {
+        size_t len = mutate(buf, make_seed(i, buf));
+        LLVMFuzzerTestOneInput(buf, len);
+    }
+    printf("%d inputs ok, %u replies sent\n", iterations, host_lwip_sent.count);
+    return 0;
+}
+
+#endif
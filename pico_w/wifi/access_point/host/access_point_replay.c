@@ -0,0 +1,162 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Replays what a few hundred clients joining the access point would send: a DHCP DISCOVER, REQUEST
+// and RELEASE each, then DNS queries for a name in the record table and for names which are
+// forwarded upstream once and then answered from the cache. Every reply is checked, and the time
+// taken per packet is reported, with each packet in one pbuf and again split across two.
+//   access_point_replay [rounds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "host_lwip.h"
+#include "dhcpserver.h"
+#include "dnsserver.h"
+#include "packets.h"
+
+#define CLIENTS 200
+#define SPLIT 100 // where to split packets across pbufs
+
+static const uint8_t server_ip[4] = { 192, 168, 4, 1 };
+static const uint8_t upstream_ip[4] = { 192, 168, 1, 1 };
+static const uint8_t forwarded_addr[4] = { 93, 184, 215, 14 };
+
+static dhcp_server_t dhcp_server;
+static dns_server_t dns_server;
+static ip_addr_t upstream;
+
+typedef struct {
+    uint64_t ns;
+    uint32_t packets;
+} timing_t;
+
+static timing_t dhcp_timing, dns_timing;
+static uint32_t forwarded;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void fail(const char *what, int client) {
+    printf("FAIL: %s for client %d\n", what, client);
+    exit(1);
+}
+
+// Send a packet to the server on port and return the number of replies it sent
+static uint32_t deliver(timing_t *timing, u16_t port, const uint8_t *buf, size_t len, size_t split,
+                        const ip_addr_t *src, u16_t src_port) {
+    uint32_t sent = host_lwip_sent.count;
+    uint64_t start = now_ns();
+    host_lwip_deliver(port, buf, len, split, src, src_port);
+    timing->ns += now_ns() - start;
+    timing->packets++;
+    if (host_lwip_pbufs_in_use()) {
+        printf("FAIL: pbuf leaked\n");
+        exit(1);
+    }
+    return host_lwip_sent.count - sent;
+}
+
+static void client_round(int client, size_t split) {
+    uint8_t buf[HOST_LWIP_MAX_PACKET];
+    uint8_t mac[6] = { 0x02, 0, 0, 0, client >> 8, client };
+    ip_addr_t client_addr;
+    IP4_ADDR(&client_addr, 0, 0, 0, 0);
+
+    // Join
+    size_t len = packet_dhcp(buf, DHCP_DISCOVER, mac, NULL, NULL, NULL);
+    if (!deliver(&dhcp_timing, PORT_DHCP_SERVER, buf, len, split, &client_addr, PORT_DHCP_CLIENT) ||
+        packet_dhcp_type(host_lwip_sent.data, host_lwip_sent.len) != DHCP_OFFER) {
+        fail("no offer", client);
+    }
+    uint8_t offered[4];
+    memcpy(offered, packet_dhcp_yiaddr(host_lwip_sent.data), 4);
+    len = packet_dhcp(buf, DHCP_REQUEST, mac, NULL, offered, server_ip);
+    if (!deliver(&dhcp_timing, PORT_DHCP_SERVER, buf, len, split, &client_addr, PORT_DHCP_CLIENT) ||
+        packet_dhcp_type(host_lwip_sent.data, host_lwip_sent.len) != DHCP_ACK ||
+        memcmp(packet_dhcp_yiaddr(host_lwip_sent.data), offered, 4) != 0) {
+        fail("no ack", client);
+    }
+    IP4_ADDR(&client_addr, offered[0], offered[1], offered[2], offered[3]);
+
+    // Look things up
+    len = packet_dns_query(buf, client, "pico.local", DNS_TYPE_A);
+    if (!deliver(&dns_timing, PORT_DNS, buf, len, split, &client_addr, 5353) ||
+        packet_dns_answers(host_lwip_sent.data, host_lwip_sent.len) != 1 ||
+        memcmp(host_lwip_sent.data + host_lwip_sent.len - 4, server_ip, 4) != 0) {
+        fail("wrong record answer", client);
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "host%d.example.com", client % DNS_SERVER_CACHE_SIZE);
+    len = packet_dns_query(buf, client, name, DNS_TYPE_A);
+    if (!deliver(&dns_timing, PORT_DNS, buf, len, split, &client_addr, 5353)) {
+        fail("no dns reply", client);
+    }
+    if (host_lwip_sent.port == PORT_DNS) {
+        // It was forwarded, so answer it as the upstream server would
+        forwarded++;
+        memcpy(buf, host_lwip_sent.data, host_lwip_sent.len);
+        len = packet_dns_answer(buf, host_lwip_sent.len, forwarded_addr, 300);
+        if (!deliver(&dns_timing, PORT_DNS, buf, len, split, &upstream, PORT_DNS)) {
+            fail("answer not passed on", client);
+        }
+    }
+    if (packet_dns_answers(host_lwip_sent.data, host_lwip_sent.len) != 1 ||
+        memcmp(host_lwip_sent.data + host_lwip_sent.len - 4, forwarded_addr, 4) != 0 ||
+        host_lwip_sent.data[0] != (uint8_t)(client >> 8) || host_lwip_sent.data[1] != (uint8_t)client) {
+        fail("wrong forwarded answer", client);
+    }
+
+    // Leave
+    len = packet_dhcp(buf, DHCP_RELEASE, mac, offered, NULL, server_ip);
+    if (deliver(&dhcp_timing, PORT_DHCP_SERVER, buf, len, split, &client_addr, PORT_DHCP_CLIENT)) {
+        fail("reply to release", client);
+    }
+}
+
+static void report(const char *name, timing_t *timing) {
+    printf("  %s: %u packets, %.0f ns per packet\n", name, timing->packets,
+           timing->packets ? (double)timing->ns / timing->packets : 0.0);
+    memset(timing, 0, sizeof(*timing));
+}
+
+int main(int argc, char **argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 100;
+
+    ip_addr_t ip, nm;
+    IP4_ADDR(&ip, server_ip[0], server_ip[1], server_ip[2], server_ip[3]);
+    IP4_ADDR(&nm, 255, 255, 255, 0);
+    IP4_ADDR(&upstream, upstream_ip[0], upstream_ip[1], upstream_ip[2], upstream_ip[3]);
+    host_lwip_set_time(1000);
+
+    for (int pass = 0; pass < 2; pass++) {
+        size_t split = pass ? SPLIT : 0;
+        dhcp_server_init(&dhcp_server, &ip, &nm);
+        dns_server_init(&dns_server, &ip);
+        dns_server_add_a(&dns_server, "pico.local", ip_2_ip4(&ip));
+        dns_server_set_upstream(&dns_server, &upstream);
+
+        for (int round = 0; round < rounds; round++) {
+            for (int client = 0; client < CLIENTS; client++) {
+                client_round(client, split);
+            }
+        }
+        printf("%d rounds of %d clients, %s\n", rounds, CLIENTS, split ? "split across two pbufs" : "in one pbuf");
+        report("DHCP", &dhcp_timing);
+        report("DNS", &dns_timing);
+        printf("  %u of %d upstream lookups were forwarded rather than answered from the cache\n", forwarded, rounds * CLIENTS);
+        forwarded = 0;
+
+        dns_server_deinit(&dns_server);
+        dhcp_server_deinit(&dhcp_server);
+    }
+    return 0;
+}
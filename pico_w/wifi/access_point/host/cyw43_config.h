@@ -0,0 +1,17 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _HOST_CYW43_CONFIG_H_
+#define _HOST_CYW43_CONFIG_H_
+
+#include "lwip/sys.h"
+
+#define cyw43_hal_ticks_ms() sys_now()
+
+// Don't print every lease from the DHCP server
+#define DHCPS_INFO_printf(...)
+
+#endif
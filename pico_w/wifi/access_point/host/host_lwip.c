@@ -0,0 +1,180 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host_lwip.h"
+#include "lwip/sys.h"
+
+#define HOST_LWIP_MAX_PCBS 4
+
+struct udp_pcb {
+    bool used;
+    u16_t port;
+    udp_recv_fn recv;
+    void *recv_arg;
+};
+
+const ip_addr_t ip_addr_any;
+host_lwip_sent_t host_lwip_sent;
+
+static struct udp_pcb pcbs[HOST_LWIP_MAX_PCBS];
+static int pbufs_in_use;
+static u32_t now_ms;
+
+struct pbuf *pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type) {
+    (void)layer;
+    struct pbuf *p = calloc(1, sizeof(struct pbuf));
+    if (!p) {
+        return NULL;
+    }
+    if (type == PBUF_RAM && length) {
+        p->payload = malloc(length);
+        if (!p->payload) {
+            free(p);
+            return NULL;
+        }
+    }
+    p->tot_len = length;
+    p->len = length;
+    p->type = type;
+    pbufs_in_use++;
+    return p;
+}
+
+u8_t pbuf_free(struct pbuf *p) {
+    u8_t count = 0;
+    while (p) {
+        struct pbuf *next = p->next;
+        if (p->type == PBUF_RAM) {
+            free(p->payload);
+        }
+        free(p);
+        pbufs_in_use--;
+        count++;
+        p = next;
+    }
+    return count;
+}
+
+u16_t pbuf_copy_partial(const struct pbuf *p, void *dataptr, u16_t len, u16_t offset) {
+    u16_t copied = 0;
+    for (; p && copied < len; p = p->next) {
+        if (offset >= p->len) {
+            offset -= p->len;
+            continue;
+        }
+        u16_t n = p->len - offset;
+        if (n > len - copied) {
+            n = len - copied;
+        }
+        memcpy((uint8_t *)dataptr + copied, (const uint8_t *)p->payload + offset, n);
+        copied += n;
+        offset = 0;
+    }
+    return copied;
+}
+
+struct udp_pcb *udp_new(void) {
+    for (int i = 0; i < HOST_LWIP_MAX_PCBS; i++) {
+        if (!pcbs[i].used) {
+            memset(&pcbs[i], 0, sizeof(pcbs[i]));
+            pcbs[i].used = true;
+            return &pcbs[i];
+        }
+    }
+    return NULL;
+}
+
+void udp_remove(struct udp_pcb *pcb) {
+    pcb->used = false;
+}
+
+err_t udp_bind(struct udp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port) {
+    (void)ipaddr;
+    pcb->port = port;
+    return ERR_OK;
+}
+
+void udp_recv(struct udp_pcb *pcb, udp_recv_fn recv, void *recv_arg) {
+    pcb->recv = recv;
+    pcb->recv_arg = recv_arg;
+}
+
+err_t udp_sendto(struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *dst_ip, u16_t dst_port) {
+    (void)pcb;
+    if (p->tot_len > sizeof(host_lwip_sent.data)) {
+        return ERR_VAL;
+    }
+    host_lwip_sent.len = pbuf_copy_partial(p, host_lwip_sent.data, p->tot_len, 0);
+    host_lwip_sent.addr = *dst_ip;
+    host_lwip_sent.port = dst_port;
+    host_lwip_sent.count++;
+    return ERR_OK;
+}
+
+err_t udp_sendto_if(struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *dst_ip, u16_t dst_port, struct netif *netif) {
+    (void)netif;
+    return udp_sendto(pcb, p, dst_ip, dst_port);
+}
+
+struct netif *ip_current_input_netif(void) {
+    return NULL;
+}
+
+const char *ipaddr_ntoa(const ip_addr_t *addr) {
+    static char buf[16];
+    const uint8_t *b = (const uint8_t *)&addr->addr;
+    snprintf(buf, sizeof(buf), "%u.%u.%u.%u", b[0], b[1], b[2], b[3]);
+    return buf;
+}
+
+u32_t sys_now(void) {
+    return now_ms;
+}
+
+void host_lwip_set_time(u32_t ms) {
+    now_ms = ms;
+}
+
+int host_lwip_pbufs_in_use(void) {
+    return pbufs_in_use;
+}
+
+void host_lwip_deliver(u16_t port, const void *data, size_t len, size_t split, const ip_addr_t *src, u16_t src_port) {
+    struct udp_pcb *pcb = NULL;
+    for (int i = 0; i < HOST_LWIP_MAX_PCBS; i++) {
+        if (pcbs[i].used && pcbs[i].port == port && pcbs[i].recv) {
+            pcb = &pcbs[i];
+        }
+    }
+    if (!pcb || len > 0xffff) {
+        return;
+    }
+    if (!split || split >= len) {
+        split = len;
+    }
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, split, PBUF_RAM);
+    if (!p) {
+        return;
+    }
+    if (split) {
+        memcpy(p->payload, data, split);
+    }
+    p->tot_len = len;
+    if (split < len) {
+        p->next = pbuf_alloc(PBUF_TRANSPORT, len - split, PBUF_RAM);
+        if (!p->next) {
+            pbuf_free(p);
+            return;
+        }
+        memcpy(p->next->payload, (const uint8_t *)data + split, len - split);
+    }
+    // The callback owns the pbuf now
+    pcb->recv(pcb->recv_arg, pcb, p, src, src_port);
+}
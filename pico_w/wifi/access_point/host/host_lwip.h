@@ -0,0 +1,36 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _HOST_LWIP_H_
+#define _HOST_LWIP_H_
+
+#include "lwip/udp.h"
+
+#define HOST_LWIP_MAX_PACKET 1500
+
+// The last packet a server sent
+typedef struct host_lwip_sent_t_ {
+    uint8_t data[HOST_LWIP_MAX_PACKET];
+    size_t len;
+    ip_addr_t addr;
+    u16_t port;
+    uint32_t count; // packets sent so far
+} host_lwip_sent_t;
+
+extern host_lwip_sent_t host_lwip_sent;
+
+// Hand a packet to whatever is bound to port, as lwIP would from the network. If split is non-zero
+// and less than len, the packet is split into a chain of two pbufs after that many bytes.
+// The payload is allocated to exactly len bytes, so the address sanitizer catches reads beyond it
+void host_lwip_deliver(u16_t port, const void *data, size_t len, size_t split, const ip_addr_t *src, u16_t src_port);
+
+// Set the time returned by sys_now
+void host_lwip_set_time(u32_t ms);
+
+// Number of pbufs allocated and not yet freed
+int host_lwip_pbufs_in_use(void);
+
+#endif
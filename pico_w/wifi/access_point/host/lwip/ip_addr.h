@@ -0,0 +1,45 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Just enough of lwIP's IPv4 only addresses to build the DHCP and DNS servers on the host
+
+#ifndef _HOST_LWIP_IP_ADDR_H_
+#define _HOST_LWIP_IP_ADDR_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <arpa/inet.h>
+
+typedef uint8_t u8_t;
+typedef uint16_t u16_t;
+typedef uint32_t u32_t;
+typedef int8_t err_t;
+
+#define ERR_OK 0
+#define ERR_MEM -1
+#define ERR_VAL -6
+
+typedef struct ip4_addr {
+    uint32_t addr; // network order
+} ip4_addr_t;
+typedef ip4_addr_t ip_addr_t;
+
+extern const ip_addr_t ip_addr_any;
+
+#define IP_ANY_TYPE (&ip_addr_any)
+#define IP4_ADDR(ipaddr, a, b, c, d) ((ipaddr)->addr = htonl((uint32_t)(a) << 24 | (uint32_t)(b) << 16 | (uint32_t)(c) << 8 | (uint32_t)(d)))
+#define ip4_addr_get_u32(ipaddr) ((ipaddr)->addr)
+#define ip4_addr4(ipaddr) (((const uint8_t *)&(ipaddr)->addr)[3])
+#define ip_2_ip4(ipaddr) (ipaddr)
+#define ip_addr_copy(dest, src) ((dest) = (src))
+#define ip_addr_cmp(a, b) ((a)->addr == (b)->addr)
+#define lwip_htons(x) htons(x)
+
+const char *ipaddr_ntoa(const ip_addr_t *addr);
+#define ip4addr_ntoa ipaddr_ntoa
+
+#endif
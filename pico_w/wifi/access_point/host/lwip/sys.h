@@ -0,0 +1,17 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _HOST_LWIP_SYS_H_
+#define _HOST_LWIP_SYS_H_
+
+#include <stdlib.h>
+#include "lwip/ip_addr.h"
+
+u32_t sys_now(void);
+
+#define LWIP_RAND() ((u32_t)rand())
+
+#endif
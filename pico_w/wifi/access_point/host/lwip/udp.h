@@ -0,0 +1,51 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// A stand-in for lwIP's pbufs and UDP, which hands packets straight to the receive callback and
+// records what is sent. See host_lwip.h
+
+#ifndef _HOST_LWIP_UDP_H_
+#define _HOST_LWIP_UDP_H_
+
+#include "lwip/ip_addr.h"
+
+typedef enum {
+    PBUF_TRANSPORT,
+    PBUF_RAW,
+} pbuf_layer;
+
+typedef enum {
+    PBUF_RAM,
+    PBUF_REF,
+} pbuf_type;
+
+struct pbuf {
+    struct pbuf *next;
+    void *payload;
+    u16_t tot_len;
+    u16_t len;
+    pbuf_type type;
+};
+
+struct pbuf *pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type);
+u8_t pbuf_free(struct pbuf *p);
+u16_t pbuf_copy_partial(const struct pbuf *p, void *dataptr, u16_t len, u16_t offset);
+
+struct netif;
+struct udp_pcb;
+
+typedef void (*udp_recv_fn)(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port);
+
+struct udp_pcb *udp_new(void);
+void udp_remove(struct udp_pcb *pcb);
+err_t udp_bind(struct udp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port);
+void udp_recv(struct udp_pcb *pcb, udp_recv_fn recv, void *recv_arg);
+err_t udp_sendto(struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *dst_ip, u16_t dst_port);
+err_t udp_sendto_if(struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *dst_ip, u16_t dst_port, struct netif *netif);
+
+struct netif *ip_current_input_netif(void);
+
+#endif
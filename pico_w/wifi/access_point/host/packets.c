@@ -0,0 +1,109 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <string.h>
+
+#include "packets.h"
+
+#define DHCP_OPT_OFFSET 240
+#define DHCP_MSG_LEN 300 // what most clients send, padded with zeros
+
+size_t packet_dhcp(uint8_t *buf, uint8_t type, const uint8_t mac[6], const uint8_t *client_ip,
+                   const uint8_t *requested_ip, const uint8_t *server_ip) {
+    memset(buf, 0, DHCP_MSG_LEN);
+    buf[0] = 1; // BOOTREQUEST
+    buf[1] = 1; // ethernet
+    buf[2] = 6;
+    memcpy(buf + 4, mac + 2, 4); // xid
+    if (client_ip) {
+        memcpy(buf + 12, client_ip, 4);
+    }
+    memcpy(buf + 28, mac, 6);
+    static const uint8_t magic[] = { 99, 130, 83, 99 };
+    memcpy(buf + 236, magic, sizeof(magic));
+    uint8_t *opt = buf + DHCP_OPT_OFFSET;
+    *opt++ = 53;
+    *opt++ = 1;
+    *opt++ = type;
+    if (requested_ip) {
+        *opt++ = 50;
+        *opt++ = 4;
+        memcpy(opt, requested_ip, 4);
+        opt += 4;
+    }
+    if (server_ip) {
+        *opt++ = 54;
+        *opt++ = 4;
+        memcpy(opt, server_ip, 4);
+        opt += 4;
+    }
+    *opt++ = 255;
+    return DHCP_MSG_LEN;
+}
+
+uint8_t packet_dhcp_type(const uint8_t *buf, size_t len) {
+    for (size_t i = DHCP_OPT_OFFSET; i + 2 < len && buf[i] != 255; i += 2 + buf[i + 1]) {
+        if (buf[i] == 53) {
+            return buf[i + 2];
+        }
+    }
+    return 0;
+}
+
+const uint8_t *packet_dhcp_yiaddr(const uint8_t *buf) {
+    return buf + 16;
+}
+
+size_t packet_dns_query(uint8_t *buf, uint16_t id, const char *name, uint16_t type) {
+    uint8_t *ptr = buf;
+    *ptr++ = id >> 8;
+    *ptr++ = id;
+    *ptr++ = 0x01; // RD
+    *ptr++ = 0x00;
+    *ptr++ = 0;
+    *ptr++ = 1; // one question
+    memset(ptr, 0, 6);
+    ptr += 6;
+    while (*name) {
+        const char *dot = strchr(name, '.');
+        size_t len = dot ? (size_t)(dot - name) : strlen(name);
+        *ptr++ = len;
+        memcpy(ptr, name, len);
+        ptr += len;
+        name += len + (dot ? 1 : 0);
+    }
+    *ptr++ = 0;
+    *ptr++ = type >> 8;
+    *ptr++ = type;
+    *ptr++ = 0;
+    *ptr++ = 1; // IN
+    return ptr - buf;
+}
+
+size_t packet_dns_answer(uint8_t *buf, size_t query_len, const uint8_t addr[4], uint32_t ttl) {
+    buf[2] = 0x81; // QR, RD
+    buf[3] = 0x80; // RA
+    buf[7] = 1; // one answer
+    uint8_t *ptr = buf + query_len;
+    static const uint8_t answer[] = { 0xc0, 12, 0, DNS_TYPE_A, 0, 1 };
+    memcpy(ptr, answer, sizeof(answer));
+    ptr += sizeof(answer);
+    *ptr++ = ttl >> 24;
+    *ptr++ = ttl >> 16;
+    *ptr++ = ttl >> 8;
+    *ptr++ = ttl;
+    *ptr++ = 0;
+    *ptr++ = 4;
+    memcpy(ptr, addr, 4);
+    return ptr + 4 - buf;
+}
+
+int packet_dns_answers(const uint8_t *buf, size_t len) {
+    if (len < 12 || !(buf[2] & 0x80)) {
+        return -1;
+    }
+    return buf[6] << 8 | buf[7];
+}
@@ -0,0 +1,47 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _PACKETS_H_
+#define _PACKETS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PORT_DHCP_SERVER 67
+#define PORT_DHCP_CLIENT 68
+#define PORT_DNS 53
+
+#define DHCP_DISCOVER 1
+#define DHCP_OFFER 2
+#define DHCP_REQUEST 3
+#define DHCP_ACK 5
+#define DHCP_NAK 6
+#define DHCP_RELEASE 7
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_AAAA 28
+
+// Build a DHCP message from a client as it would arrive. requested_ip and server_ip are added as
+// options if not NULL, and client_ip goes in ciaddr. Returns the length
+size_t packet_dhcp(uint8_t *buf, uint8_t type, const uint8_t mac[6], const uint8_t *client_ip,
+                   const uint8_t *requested_ip, const uint8_t *server_ip);
+
+// The message type of a DHCP reply, or 0 if it hasn't got one
+uint8_t packet_dhcp_type(const uint8_t *buf, size_t len);
+
+// The address a DHCP reply offers
+const uint8_t *packet_dhcp_yiaddr(const uint8_t *buf);
+
+// Build a DNS query for one name. Returns the length
+size_t packet_dns_query(uint8_t *buf, uint16_t id, const char *name, uint16_t type);
+
+// Turn a query into the upstream server's answer to it, with one A record
+size_t packet_dns_answer(uint8_t *buf, size_t query_len, const uint8_t addr[4], uint32_t ttl);
+
+// The number of answers in a DNS response, or -1 if it isn't a response
+int packet_dns_answers(const uint8_t *buf, size_t len);
+
+#endif
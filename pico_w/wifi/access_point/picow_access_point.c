@@ -4,7 +4,9 @@
  * SPDX-License-Identifier: BSD-3-Clause
  */
 
+#include <ctype.h>
 #include <string.h>
+#include <strings.h>
 
 #include "pico/cyw43_arch.h"
 #include "pico/stdlib.h"
@@ -19,28 +21,84 @@
 #define DEBUG_printf printf
 #define POLL_TIME_S 5
 #define HTTP_GET "GET"
-#define HTTP_RESPONSE_HEADERS "HTTP/1.1 %d OK\nContent-Length: %d\nContent-Type: text/html; charset=utf-8\nConnection: close\n\n"
-#define LED_TEST_BODY "<html><body><h1>Hello from Pico.</h1><p>Led is %s</p><p><a href=\"?led=%d\">Turn led %s</a></body></html>"
+#define HTTP_VERSION_1_0 "HTTP/1.0"
+#define HTTP_CONNECTION "connection:"
+#define HTTP_CONTENT_LENGTH "content-length:"
+#define HTTP_RESPONSE_HEADERS "HTTP/1.1 %d OK\r\nContent-Length: %d\r\nContent-Type: text/html; charset=utf-8\r\n"
+#define HTTP_RESPONSE_REDIRECT "HTTP/1.1 302 Redirect\r\nLocation: http://%s" LED_TEST "\r\nContent-Length: 0\r\n"
+#define HTTP_RESPONSE_NOT_IMPLEMENTED "HTTP/1.1 501 Not Implemented\r\nContent-Length: 0\r\n"
+#define HTTP_KEEP_ALIVE "Connection: keep-alive\r\n\r\n"
+#define HTTP_CLOSE "Connection: close\r\n\r\n"
+#define LED_TEST_BODY(state, param, action) "<html><body><h1>Hello from Pico.</h1><p>Led is " state "</p><p><a href=\"?led=" param "\">Turn led " action "</a></body></html>"
 #define LED_PARAM "led=%d"
 #define LED_TEST "/ledtest"
 #define LED_GPIO 0
-#define HTTP_RESPONSE_REDIRECT "HTTP/1.1 302 Redirect\nLocation: http://%s" LED_TEST "\n\n"
+
+// Uncomment to look up names other than picow.local on a real DNS server, e.g. one reached as a station
+// #define DNS_UPSTREAM_SERVER "192.168.1.1"
+
+// Connections are allocated from a fixed pool, further connections are refused
+#define MAX_CONNECTIONS 4
+// Longest request line kept, the rest of a longer one is ignored
+#define HTTP_MAX_REQUEST 128
+// Longest header line kept, only the start of a header is needed
+#define HTTP_MAX_HEADER 32
+// Close a connection that has been idle for this many polls
+#define IDLE_POLLS 2
+// Leave room in the send queue for the pbufs of one response
+#define HTTP_RESPONSE_PBUFS 6
+
+// A complete response, built once and then sent from here without copying
+typedef struct HTTP_RESPONSE_T_ {
+    char headers[128];
+    int header_len;
+    const char *body;
+    int body_len;
+} HTTP_RESPONSE_T;
+
+enum {
+    HTTP_PARSE_REQUEST_LINE,
+    HTTP_PARSE_HEADERS,
+    HTTP_PARSE_BODY,
+};
+
+typedef struct TCP_CONNECT_STATE_T_ {
+    struct tcp_pcb *pcb; // NULL if this pool entry is free
+    struct TCP_SERVER_T_ *server;
+    struct pbuf *rx; // received data not yet parsed
+    const HTTP_RESPONSE_T *pending; // response waiting for room in the send queue
+    uint32_t unacked;
+    uint32_t body_remaining;
+    int parse_state;
+    int request_len;
+    int header_len;
+    int idle_polls;
+    bool keep_alive;
+    bool closing;
+    bool remote_closed; // the client has sent everything, but may still be waiting for responses
+    char request[HTTP_MAX_REQUEST];
+    char header[HTTP_MAX_HEADER];
+} TCP_CONNECT_STATE_T;
 
 typedef struct TCP_SERVER_T_ {
     struct tcp_pcb *server_pcb;
     bool complete;
     ip_addr_t gw;
+    TCP_CONNECT_STATE_T connections[MAX_CONNECTIONS];
+    HTTP_RESPONSE_T led_on;
+    HTTP_RESPONSE_T led_off;
+    HTTP_RESPONSE_T redirect;
+    HTTP_RESPONSE_T not_implemented;
 } TCP_SERVER_T;
 
-typedef struct TCP_CONNECT_STATE_T_ {
-    struct tcp_pcb *pcb;
-    int sent_len;
-    char headers[128];
-    char result[256];
-    int header_len;
-    int result_len;
-    ip_addr_t *gw;
-} TCP_CONNECT_STATE_T;
+static void tcp_release_client_connection(TCP_CONNECT_STATE_T *con_state) {
+    if (con_state->rx) {
+        pbuf_free(con_state->rx);
+    }
+    TCP_SERVER_T *state = con_state->server;
+    memset(con_state, 0, sizeof(TCP_CONNECT_STATE_T));
+    con_state->server = state;
+}
 
 static err_t tcp_close_client_connection(TCP_CONNECT_STATE_T *con_state, struct tcp_pcb *client_pcb, err_t close_err) {
     if (client_pcb) {
@@ -57,13 +115,18 @@ static err_t tcp_close_client_connection(TCP_CONNECT_STATE_T *con_state, struct
             close_err = ERR_ABRT;
         }
         if (con_state) {
-            free(con_state);
+            tcp_release_client_connection(con_state);
         }
     }
     return close_err;
 }
 
 static void tcp_server_close(TCP_SERVER_T *state) {
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (state->connections[i].pcb) {
+            tcp_close_client_connection(&state->connections[i], state->connections[i].pcb, ERR_OK);
+        }
+    }
     if (state->server_pcb) {
         tcp_arg(state->server_pcb, NULL);
         tcp_close(state->server_pcb);
@@ -71,19 +134,14 @@ static void tcp_server_close(TCP_SERVER_T *state) {
     }
 }
 
-static err_t tcp_server_sent(void *arg, struct tcp_pcb *pcb, u16_t len) {
-    TCP_CONNECT_STATE_T *con_state = (TCP_CONNECT_STATE_T*)arg;
-    DEBUG_printf("tcp_server_sent %u\n", len);
-    con_state->sent_len += len;
-    if (con_state->sent_len >= con_state->header_len + con_state->result_len) {
-        DEBUG_printf("all done\n");
-        return tcp_close_client_connection(con_state, pcb, ERR_OK);
-    }
-    return ERR_OK;
+static void http_response_init(HTTP_RESPONSE_T *response, int header_len, const char *body, int body_len) {
+    assert(header_len < sizeof(response->headers));
+    response->header_len = header_len;
+    response->body = body;
+    response->body_len = body_len;
 }
 
-static int test_server_content(const char *request, const char *params, char *result, size_t max_result_len) {
-    int len = 0;
+static const HTTP_RESPONSE_T *test_server_content(TCP_SERVER_T *state, const char *request, const char *params) {
     if (strncmp(request, LED_TEST, sizeof(LED_TEST) - 1) == 0) {
         // Get the state of the led
         bool value;
@@ -103,109 +161,240 @@ static int test_server_content(const char *request, const char *params, char *re
                 }
             }
         }
-        // Generate result
-        if (led_state) {
-            len = snprintf(result, max_result_len, LED_TEST_BODY, "ON", 0, "OFF");
-        } else {
-            len = snprintf(result, max_result_len, LED_TEST_BODY, "OFF", 1, "ON");
-        }
+        // Both pages are prebuilt
+        return led_state ? &state->led_on : &state->led_off;
     }
-    return len;
+    return NULL;
 }
 
-err_t tcp_server_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err) {
-    TCP_CONNECT_STATE_T *con_state = (TCP_CONNECT_STATE_T*)arg;
-    if (!p) {
-        DEBUG_printf("connection closed\n");
-        return tcp_close_client_connection(con_state, pcb, ERR_OK);
+// Queue a response, or return ERR_MEM if there isn't room for it yet
+static err_t http_send_response(TCP_CONNECT_STATE_T *con_state, const HTTP_RESPONSE_T *response) {
+    struct tcp_pcb *pcb = con_state->pcb;
+    const char *connection = con_state->keep_alive ? HTTP_KEEP_ALIVE : HTTP_CLOSE;
+    int connection_len = con_state->keep_alive ? sizeof(HTTP_KEEP_ALIVE) - 1 : sizeof(HTTP_CLOSE) - 1;
+    int len = response->header_len + connection_len + response->body_len;
+
+    // Only start a response if all of it fits, so a response is never left half queued
+    if (tcp_sndbuf(pcb) < len || tcp_sndqueuelen(pcb) + HTTP_RESPONSE_PBUFS > TCP_SND_QUEUELEN) {
+        return ERR_MEM;
     }
-    assert(con_state && con_state->pcb == pcb);
-    if (p->tot_len > 0) {
-        DEBUG_printf("tcp_server_recv %d err %d\n", p->tot_len, err);
-#if 0
-        for (struct pbuf *q = p; q != NULL; q = q->next) {
-            DEBUG_printf("in: %.*s\n", q->len, q->payload);
+
+    // The response is not copied, it stays where it is until it's acknowledged
+    err_t err = tcp_write(pcb, response->headers, response->header_len, TCP_WRITE_FLAG_MORE);
+    if (err == ERR_OK) {
+        err = tcp_write(pcb, connection, connection_len, response->body_len ? TCP_WRITE_FLAG_MORE : 0);
+    }
+    if (err == ERR_OK && response->body_len) {
+        err = tcp_write(pcb, response->body, response->body_len, 0);
+    }
+    if (err != ERR_OK) {
+        DEBUG_printf("failed to write response %d\n", err);
+        return err == ERR_MEM ? ERR_BUF : err;
+    }
+    con_state->unacked += len;
+    if (!con_state->keep_alive) {
+        con_state->closing = true;
+    }
+    return ERR_OK;
+}
+
+static const HTTP_RESPONSE_T *http_handle_request(TCP_CONNECT_STATE_T *con_state) {
+    TCP_SERVER_T *state = con_state->server;
+    con_state->request[con_state->request_len] = 0;
+    DEBUG_printf("Request: %s\n", con_state->request);
+
+    // Handle GET request
+    if (strncmp(HTTP_GET " ", con_state->request, sizeof(HTTP_GET)) != 0) {
+        con_state->keep_alive = false;
+        return &state->not_implemented;
+    }
+    char *request = con_state->request + sizeof(HTTP_GET); // + space
+    char *space = strchr(request, ' ');
+    if (space) {
+        *space = 0;
+    }
+    char *params = strchr(request, '?');
+    if (params) {
+        *params++ = 0;
+        if (!*params) {
+            params = NULL;
         }
-#endif
-        // Copy the request into the buffer
-        pbuf_copy_partial(p, con_state->headers, p->tot_len > sizeof(con_state->headers) - 1 ? sizeof(con_state->headers) - 1 : p->tot_len, 0);
-
-        // Handle GET request
-        if (strncmp(HTTP_GET, con_state->headers, sizeof(HTTP_GET) - 1) == 0) {
-            char *request = con_state->headers + sizeof(HTTP_GET); // + space
-            char *params = strchr(request, '?');
-            if (params) {
-                if (*params) {
-                    char *space = strchr(request, ' ');
-                    *params++ = 0;
-                    if (space) {
-                        *space = 0;
-                    }
-                } else {
-                    params = NULL;
-                }
-            }
+    }
 
-            // Generate content
-            con_state->result_len = test_server_content(request, params, con_state->result, sizeof(con_state->result));
-            DEBUG_printf("Request: %s?%s\n", request, params);
-            DEBUG_printf("Result: %d\n", con_state->result_len);
+    // Generate content, or redirect to it
+    const HTTP_RESPONSE_T *response = test_server_content(state, request, params);
+    if (!response) {
+        DEBUG_printf("Sending redirect\n");
+        response = &state->redirect;
+    }
+    return response;
+}
 
-            // Check we had enough buffer space
-            if (con_state->result_len > sizeof(con_state->result) - 1) {
-                DEBUG_printf("Too much result data %d\n", con_state->result_len);
-                return tcp_close_client_connection(con_state, pcb, ERR_CLSD);
-            }
+static void http_parse_header(TCP_CONNECT_STATE_T *con_state) {
+    char *header = con_state->header;
+    header[con_state->header_len] = 0;
+    for (char *c = header; *c && *c != ':'; c++) {
+        *c = tolower(*c);
+    }
+    if (strncmp(header, HTTP_CONNECTION, sizeof(HTTP_CONNECTION) - 1) == 0) {
+        const char *value = header + sizeof(HTTP_CONNECTION) - 1;
+        while (*value == ' ') {
+            value++;
+        }
+        if (strncasecmp(value, "close", 5) == 0) {
+            con_state->keep_alive = false;
+        } else if (strncasecmp(value, "keep-alive", 10) == 0) {
+            con_state->keep_alive = true;
+        }
+    } else if (strncmp(header, HTTP_CONTENT_LENGTH, sizeof(HTTP_CONTENT_LENGTH) - 1) == 0) {
+        con_state->body_remaining = strtoul(header + sizeof(HTTP_CONTENT_LENGTH) - 1, NULL, 10);
+    }
+}
 
-            // Generate web page
-            if (con_state->result_len > 0) {
-                con_state->header_len = snprintf(con_state->headers, sizeof(con_state->headers), HTTP_RESPONSE_HEADERS,
-                    200, con_state->result_len);
-                if (con_state->header_len > sizeof(con_state->headers) - 1) {
-                    DEBUG_printf("Too much header data %d\n", con_state->header_len);
-                    return tcp_close_client_connection(con_state, pcb, ERR_CLSD);
+// Parse received data a byte at a time, so a request can be split anywhere. Returns the number
+// of bytes used, which is less than len if a request is complete and its response is pending
+static int http_parse(TCP_CONNECT_STATE_T *con_state, const char *data, int len) {
+    int used = 0;
+    while (used < len && !con_state->pending && !con_state->closing) {
+        if (con_state->parse_state == HTTP_PARSE_BODY) {
+            // Skip any request body
+            uint32_t skip = MIN(con_state->body_remaining, (uint32_t)(len - used));
+            con_state->body_remaining -= skip;
+            used += skip;
+            if (!con_state->body_remaining) {
+                con_state->parse_state = HTTP_PARSE_REQUEST_LINE;
+            }
+            continue;
+        }
+        char c = data[used++];
+        if (con_state->parse_state == HTTP_PARSE_REQUEST_LINE) {
+            if (c == '\n') {
+                if (con_state->request_len == 0) {
+                    continue; // allow blank lines between requests
+                }
+                // HTTP/1.1 defaults to keep-alive
+                con_state->request[con_state->request_len] = 0;
+                con_state->keep_alive = !strstr(con_state->request, HTTP_VERSION_1_0);
+                con_state->body_remaining = 0;
+                con_state->header_len = 0;
+                con_state->parse_state = HTTP_PARSE_HEADERS;
+            } else if (c != '\r' && con_state->request_len < HTTP_MAX_REQUEST - 1) {
+                con_state->request[con_state->request_len++] = c;
+            }
+        } else {
+            if (c != '\n') {
+                if (c != '\r' && con_state->header_len < HTTP_MAX_HEADER - 1) {
+                    con_state->header[con_state->header_len++] = c;
                 }
-            } else {
-                // Send redirect
-                con_state->header_len = snprintf(con_state->headers, sizeof(con_state->headers), HTTP_RESPONSE_REDIRECT,
-                    ipaddr_ntoa(con_state->gw));
-                DEBUG_printf("Sending redirect %s", con_state->headers);
+                continue;
+            }
+            if (con_state->header_len) {
+                http_parse_header(con_state);
+                con_state->header_len = 0;
+                continue;
             }
+            // A blank line ends the request
+            con_state->pending = http_handle_request(con_state);
+            con_state->request_len = 0;
+            con_state->parse_state = con_state->body_remaining ? HTTP_PARSE_BODY : HTTP_PARSE_REQUEST_LINE;
+        }
+    }
+    return used;
+}
 
-            // Send the headers to the client
-            con_state->sent_len = 0;
-            err_t err = tcp_write(pcb, con_state->headers, con_state->header_len, 0);
+// Send any pending response then parse what we've received, for as long as there's room to reply
+static err_t http_process(TCP_CONNECT_STATE_T *con_state) {
+    struct tcp_pcb *pcb = con_state->pcb;
+    while (true) {
+        if (con_state->pending) {
+            err_t err = http_send_response(con_state, con_state->pending);
+            if (err == ERR_MEM) {
+                break; // wait for some data to be acknowledged
+            }
             if (err != ERR_OK) {
-                DEBUG_printf("failed to write header data %d\n", err);
                 return tcp_close_client_connection(con_state, pcb, err);
             }
-
-            // Send the body to the client
-            if (con_state->result_len) {
-                err = tcp_write(pcb, con_state->result, con_state->result_len, 0);
-                if (err != ERR_OK) {
-                    DEBUG_printf("failed to write result data %d\n", err);
-                    return tcp_close_client_connection(con_state, pcb, err);
-                }
-            }
+            con_state->pending = NULL;
         }
-        tcp_recved(pcb, p->tot_len);
+        if (con_state->closing && con_state->rx) {
+            // Nothing more will be answered on this connection
+            tcp_recved(pcb, con_state->rx->tot_len);
+            pbuf_free(con_state->rx);
+            con_state->rx = NULL;
+        }
+        if (!con_state->rx) {
+            break;
+        }
+        // Drop what's been parsed, and only then open the window for more
+        struct pbuf *q = con_state->rx;
+        int used = http_parse(con_state, q->payload, q->len);
+        con_state->rx = pbuf_free_header(q, used);
+        tcp_recved(pcb, used);
+    }
+    tcp_output(pcb);
+    // Once the client has finished sending, close after answering everything it sent
+    if ((con_state->closing || (con_state->remote_closed && !con_state->pending)) && !con_state->unacked) {
+        DEBUG_printf("all done\n");
+        return tcp_close_client_connection(con_state, pcb, ERR_OK);
     }
-    pbuf_free(p);
     return ERR_OK;
 }
 
+static err_t tcp_server_sent(void *arg, struct tcp_pcb *pcb, u16_t len) {
+    TCP_CONNECT_STATE_T *con_state = (TCP_CONNECT_STATE_T*)arg;
+    DEBUG_printf("tcp_server_sent %u\n", len);
+    con_state->unacked -= MIN(len, con_state->unacked);
+    con_state->idle_polls = 0;
+    return http_process(con_state);
+}
+
+err_t tcp_server_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err) {
+    TCP_CONNECT_STATE_T *con_state = (TCP_CONNECT_STATE_T*)arg;
+    if (!p) {
+        DEBUG_printf("connection closed by client\n");
+        con_state->remote_closed = true;
+        return http_process(con_state);
+    }
+    assert(con_state && con_state->pcb == pcb);
+    DEBUG_printf("tcp_server_recv %d err %d\n", p->tot_len, err);
+#if 0
+    for (struct pbuf *q = p; q != NULL; q = q->next) {
+        DEBUG_printf("in: %.*s\n", q->len, q->payload);
+    }
+#endif
+    con_state->idle_polls = 0;
+    if (con_state->closing) {
+        // Nothing more will be answered on this connection
+        tcp_recved(pcb, p->tot_len);
+        pbuf_free(p);
+        return ERR_OK;
+    }
+
+    // Keep the data until it's been parsed, which may wait until earlier responses have been sent
+    if (con_state->rx) {
+        pbuf_cat(con_state->rx, p);
+    } else {
+        con_state->rx = p;
+    }
+    return http_process(con_state);
+}
+
 static err_t tcp_server_poll(void *arg, struct tcp_pcb *pcb) {
     TCP_CONNECT_STATE_T *con_state = (TCP_CONNECT_STATE_T*)arg;
     DEBUG_printf("tcp_server_poll_fn\n");
-    return tcp_close_client_connection(con_state, pcb, ERR_OK); // Just disconnect clent?
+    if (++con_state->idle_polls >= IDLE_POLLS) {
+        DEBUG_printf("connection idle\n");
+        return tcp_close_client_connection(con_state, pcb, ERR_OK);
+    }
+    return http_process(con_state);
 }
 
 static void tcp_server_err(void *arg, err_t err) {
     TCP_CONNECT_STATE_T *con_state = (TCP_CONNECT_STATE_T*)arg;
-    if (err != ERR_ABRT) {
-        DEBUG_printf("tcp_client_err_fn %d\n", err);
-        tcp_close_client_connection(con_state, con_state->pcb, err);
+    DEBUG_printf("tcp_client_err_fn %d\n", err);
+    // The pcb has already been freed
+    if (con_state) {
+        tcp_release_client_connection(con_state);
     }
 }
 
@@ -215,16 +404,22 @@ static err_t tcp_server_accept(void *arg, struct tcp_pcb *client_pcb, err_t err)
         DEBUG_printf("failure in accept\n");
         return ERR_VAL;
     }
-    DEBUG_printf("client connected\n");
 
-    // Create the state for the connection
-    TCP_CONNECT_STATE_T *con_state = calloc(1, sizeof(TCP_CONNECT_STATE_T));
+    // Find a free connection
+    TCP_CONNECT_STATE_T *con_state = NULL;
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (!state->connections[i].pcb) {
+            con_state = &state->connections[i];
+            break;
+        }
+    }
     if (!con_state) {
-        DEBUG_printf("failed to allocate connect state\n");
-        return ERR_MEM;
+        DEBUG_printf("too many connections\n");
+        tcp_abort(client_pcb);
+        return ERR_ABRT;
     }
+    DEBUG_printf("client connected\n");
     con_state->pcb = client_pcb; // for checking
-    con_state->gw = &state->gw;
 
     // setup connection to client
     tcp_arg(client_pcb, con_state);
@@ -240,6 +435,21 @@ static bool tcp_server_open(void *arg, const char *ap_name) {
     TCP_SERVER_T *state = (TCP_SERVER_T*)arg;
     DEBUG_printf("starting server on port %d\n", TCP_PORT);
 
+    // Build the responses once, they're sent from here for every request
+    static const char led_on_body[] = LED_TEST_BODY("ON", "0", "OFF");
+    static const char led_off_body[] = LED_TEST_BODY("OFF", "1", "ON");
+    http_response_init(&state->led_on, snprintf(state->led_on.headers, sizeof(state->led_on.headers),
+        HTTP_RESPONSE_HEADERS, 200, (int)sizeof(led_on_body) - 1), led_on_body, sizeof(led_on_body) - 1);
+    http_response_init(&state->led_off, snprintf(state->led_off.headers, sizeof(state->led_off.headers),
+        HTTP_RESPONSE_HEADERS, 200, (int)sizeof(led_off_body) - 1), led_off_body, sizeof(led_off_body) - 1);
+    http_response_init(&state->redirect, snprintf(state->redirect.headers, sizeof(state->redirect.headers),
+        HTTP_RESPONSE_REDIRECT, ipaddr_ntoa(&state->gw)), NULL, 0);
+    http_response_init(&state->not_implemented, snprintf(state->not_implemented.headers, sizeof(state->not_implemented.headers),
+        HTTP_RESPONSE_NOT_IMPLEMENTED), NULL, 0);
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        state->connections[i].server = state;
+    }
+
     struct tcp_pcb *pcb = tcp_new_ip_type(IPADDR_TYPE_ANY);
     if (!pcb) {
         DEBUG_printf("failed to create pcb\n");
@@ -252,7 +462,7 @@ static bool tcp_server_open(void *arg, const char *ap_name) {
         return false;
     }
 
-    state->server_pcb = tcp_listen_with_backlog(pcb, 1);
+    state->server_pcb = tcp_listen_with_backlog(pcb, MAX_CONNECTIONS);
     if (!state->server_pcb) {
         DEBUG_printf("failed to listen\n");
         if (pcb) {
@@ -318,14 +528,26 @@ int main() {
 
     #undef IP
 
-    // Start the dhcp server
-    dhcp_server_t dhcp_server;
+    // Start the dhcp server. This is static as the lease table can be large
+    static dhcp_server_t dhcp_server;
     dhcp_server_init(&dhcp_server, &state->gw, &mask);
 
     // Start the dns server
-    dns_server_t dns_server;
+    static dns_server_t dns_server;
     dns_server_init(&dns_server, &state->gw);
 
+    // Give the access point a name. Without an upstream server any other name resolves to it too,
+    // so clients find the login page
+    dns_server_add_a(&dns_server, "picow.local", ip_2_ip4(&state->gw));
+#ifdef DNS_UPSTREAM_SERVER
+    // With an uplink, e.g. when also connected as a station, look up other names there instead
+    ip_addr_t upstream;
+    ipaddr_aton(DNS_UPSTREAM_SERVER, &upstream);
+    dns_server_set_upstream(&dns_server, &upstream);
+#else
+    dns_server_set_upstream(&dns_server, NULL);
+#endif
+
     if (!tcp_server_open(state, ap_name)) {
         DEBUG_printf("failed to open server\n");
         return 1;
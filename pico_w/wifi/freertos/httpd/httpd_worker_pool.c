@@ -0,0 +1,93 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdio.h>
+
+#include "pico/cyw43_arch.h"
+#include "lwip/pbuf.h"
+#include "lwip/tcpip.h"
+
+#include "FreeRTOS.h"
+#include "queue.h"
+#include "task.h"
+
+#include "httpd_worker_pool.h"
+
+typedef struct httpd_job_t_ {
+    httpd_worker_fn fn;
+    void *arg;
+    struct pbuf *p;
+} httpd_job_t;
+
+static QueueHandle_t job_queue;
+
+static void worker_task(__unused void *params) {
+    httpd_job_t job;
+    while (true) {
+        if (xQueueReceive(job_queue, &job, portMAX_DELAY) == pdTRUE) {
+            job.fn(job.arg, job.p);
+        }
+    }
+}
+
+#if configUSE_CORE_AFFINITY && configNUMBER_OF_CORES > 1
+// Runs in the task to be pinned
+static uint32_t pin_network_task(__unused void *param) {
+    vTaskCoreAffinitySet(NULL, 1 << HTTPD_NETWORK_CORE);
+    return 0;
+}
+
+#if !NO_SYS
+static void pin_tcpip_thread(void *param) {
+    pin_network_task(param);
+}
+#endif
+#endif
+
+bool httpd_worker_pool_init(void) {
+    job_queue = xQueueCreate(HTTPD_WORKER_QUEUE_LENGTH, sizeof(httpd_job_t));
+    if (!job_queue) {
+        return false;
+    }
+#if configUSE_CORE_AFFINITY && configNUMBER_OF_CORES > 1
+    // The async context task runs the Wi-Fi driver, and with NO_SYS=1 lwIP as well
+    async_context_execute_sync(cyw43_arch_async_context(), pin_network_task, NULL);
+#if !NO_SYS
+    tcpip_callback(pin_tcpip_thread, NULL);
+#endif
+#endif
+    for (int i = 0; i < HTTPD_WORKER_COUNT; i++) {
+        char name[configMAX_TASK_NAME_LEN];
+        snprintf(name, sizeof(name), "HttpdWorker%d", i);
+        // No core affinity, so the scheduler runs each one on whichever core is free
+        if (xTaskCreate(worker_task, name, HTTPD_WORKER_STACK_SIZE, NULL, HTTPD_WORKER_PRIORITY, NULL) != pdPASS) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool httpd_worker_run(httpd_worker_fn fn, void *arg, struct pbuf *p) {
+    httpd_job_t job = { .fn = fn, .arg = arg, .p = p };
+    // Never wait, the network context can't block
+    return xQueueSendToBack(job_queue, &job, 0) == pdTRUE;
+}
+
+void httpd_worker_network_lock(void) {
+#if NO_SYS
+    cyw43_arch_lwip_begin();
+#else
+    LOCK_TCPIP_CORE();
+#endif
+}
+
+void httpd_worker_network_unlock(void) {
+#if NO_SYS
+    cyw43_arch_lwip_end();
+#else
+    UNLOCK_TCPIP_CORE();
+#endif
+}
@@ -0,0 +1,56 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _HTTPD_WORKER_POOL_H_
+#define _HTTPD_WORKER_POOL_H_
+
+#include <stdbool.h>
+
+struct pbuf;
+
+// Runs slow httpd handlers on a pool of FreeRTOS tasks, so one slow request doesn't hold up the
+// network for every other client. The task doing the network work is pinned to
+// HTTPD_NETWORK_CORE and the workers are free to run on either core.
+//
+// Jobs are queued from the network context. A job can be given a pbuf, which is handed over as it
+// is rather than copied; the job then owns it and must free it with the network locked.
+
+#ifndef HTTPD_WORKER_COUNT
+#define HTTPD_WORKER_COUNT 2
+#endif
+
+#ifndef HTTPD_NETWORK_CORE
+#define HTTPD_NETWORK_CORE 0
+#endif
+
+#ifndef HTTPD_WORKER_PRIORITY
+#define HTTPD_WORKER_PRIORITY (tskIDLE_PRIORITY + 1UL)
+#endif
+
+#ifndef HTTPD_WORKER_STACK_SIZE
+#define HTTPD_WORKER_STACK_SIZE 1024
+#endif
+
+// Received data comes in pbufs from the pool, so there can't be more than PBUF_POOL_SIZE jobs with
+// a pbuf, which leaves a few for jobs without one
+#ifndef HTTPD_WORKER_QUEUE_LENGTH
+#define HTTPD_WORKER_QUEUE_LENGTH (PBUF_POOL_SIZE + 8)
+#endif
+
+typedef void (*httpd_worker_fn)(void *arg, struct pbuf *p);
+
+// Start the workers and pin the network task. Call this once the network is up
+bool httpd_worker_pool_init(void);
+
+// Queue a job from the network context. Returns false if the queue is full, in which case the
+// caller still owns p
+bool httpd_worker_run(httpd_worker_fn fn, void *arg, struct pbuf *p);
+
+// Jobs call these around calls into lwIP
+void httpd_worker_network_lock(void);
+void httpd_worker_network_unlock(void);
+
+#endif
@@ -20,6 +20,10 @@
 #define LWIP_HTTPD_SSI 1
 #define LWIP_HTTPD_SSI_MULTIPART 1
 
+// POST bodies are dealt with by workers, which open the TCP window again when they're done
+#define LWIP_HTTPD_SUPPORT_POST 1
+#define LWIP_HTTPD_POST_MANUAL_WND 1
+
 #if !NO_SYS
 #define TCPIP_THREAD_STACKSIZE 2048 // mDNS needs more stack
 #define DEFAULT_THREAD_STACKSIZE 1024
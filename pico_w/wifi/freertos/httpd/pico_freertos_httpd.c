@@ -11,10 +11,13 @@
 #include "lwip/apps/mdns.h"
 #include "lwip/init.h"
 #include "lwip/apps/httpd.h"
+#include "lwip/pbuf.h"
 
 #include "FreeRTOS.h"
 #include "task.h"
 
+#include "httpd_worker_pool.h"
+
 void httpd_init(void);
 
 static absolute_time_t wifi_connected_time;
@@ -26,6 +29,12 @@ static bool led_on = false;
 
 #define TEST_TASK_PRIORITY				( tskIDLE_PRIORITY + 1UL )
 
+#define POST_URI "/post"
+#define POST_RESULT_URI "/post.shtml"
+#define MAX_POSTS 4
+// Pretend each chunk of a POST takes a while to deal with, to show it doesn't hold up other clients
+#define POST_CHUNK_DELAY_MS 50
+
 #if LWIP_MDNS_RESPONDER
 static void srv_txt(struct mdns_service *service, void *txt_userdata)
 {
@@ -55,12 +64,20 @@ static size_t get_mac_ascii(int idx, size_t chr_off, size_t chr_len, char *dest_
     return dest - dest_in;
 }
 
+// Talking to the Wi-Fi chip takes a while, so do it on a worker
+static void led_job(__unused void *arg, __unused struct pbuf *p) {
+    cyw43_gpio_set(&cyw43_state, 0, led_on);
+}
+
+// CGI handlers have to return the page to show straight away, so just the slow part is left to a worker
 static const char *cgi_handler_test(int iIndex, int iNumParams, char *pcParam[], char *pcValue[]) {
     if (!strcmp(pcParam[0], "test")) {
         return "/test.shtml";
     } else if (strcmp(pcParam[0], "toggleled") == 0) {
         led_on = !led_on;
-        cyw43_gpio_set(&cyw43_state, 0, led_on);
+        if (!httpd_worker_run(led_job, NULL, NULL)) {
+            led_job(NULL, NULL);
+        }
     }
     return "/index.shtml";
 }
@@ -70,6 +87,152 @@ static tCGI cgi_handlers[] = {
     { "/index.shtml", cgi_handler_test },
 };
 
+// The body of a POST is handed to a worker in the pbufs it arrived in. The TCP window is only opened
+// again once the worker has dealt with them, which stops the client sending more than can be
+// queued. A POST's pbufs are chained together while a worker is busy with it, so they're dealt with
+// in order by one worker at a time.
+typedef struct POST_STATE_T_ {
+    bool in_use;
+    void *connection;
+    int content_len;
+    struct pbuf *pending;
+    bool busy; // a worker has it
+    bool finished; // httpd has finished with the connection
+    uint32_t len;
+    uint32_t crc;
+} POST_STATE_T;
+
+static POST_STATE_T post_states[MAX_POSTS];
+
+// The last POST to finish, for the SSI
+static uint32_t post_count;
+static uint32_t post_len;
+static uint32_t post_crc;
+
+static POST_STATE_T *find_post(void *connection) {
+    for (int i = 0; i < MAX_POSTS; i++) {
+        POST_STATE_T *post = &post_states[i];
+        if (post->in_use && !post->finished && post->connection == connection) {
+            return post;
+        }
+    }
+    return NULL;
+}
+
+static POST_STATE_T *new_post(void *connection) {
+    for (int i = 0; i < MAX_POSTS; i++) {
+        POST_STATE_T *post = &post_states[i];
+        if (!post->in_use) {
+            post->in_use = true;
+            post->connection = connection;
+            return post;
+        }
+    }
+    return NULL;
+}
+
+static void free_post(POST_STATE_T *post) {
+    if (post->pending) {
+        pbuf_free(post->pending);
+    }
+    memset(post, 0, sizeof(*post));
+}
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len) {
+    crc = ~crc;
+    while (len--) {
+        crc ^= *data++;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+static void post_job(void *arg, struct pbuf *p) {
+    POST_STATE_T *post = (POST_STATE_T *)arg;
+    while (p) {
+        for (struct pbuf *q = p; q; q = q->next) {
+            post->crc = crc32_update(post->crc, q->payload, q->len);
+        }
+        post->len += p->tot_len;
+        vTaskDelay(pdMS_TO_TICKS(POST_CHUNK_DELAY_MS));
+
+        httpd_worker_network_lock();
+        u16_t len = p->tot_len;
+        pbuf_free(p);
+        if (!post->finished) {
+            // This calls httpd_post_finished once all of the body has been dealt with
+            httpd_post_data_recved(post->connection, len);
+        }
+        if (post->finished) {
+            free_post(post);
+            p = NULL;
+        } else {
+            // Carry on with anything that arrived in the meantime
+            p = post->pending;
+            post->pending = NULL;
+            post->busy = p != NULL;
+        }
+        httpd_worker_network_unlock();
+    }
+}
+
+err_t httpd_post_begin(void *connection, const char *uri, const char *http_request, u16_t http_request_len,
+                       int content_len, char *response_uri, u16_t response_uri_len, u8_t *post_auto_wnd) {
+    if (strcmp(uri, POST_URI) != 0) {
+        return ERR_VAL;
+    }
+    POST_STATE_T *post = new_post(connection);
+    if (!post) {
+        return ERR_MEM;
+    }
+    post->content_len = content_len;
+    *post_auto_wnd = 0;
+    return ERR_OK;
+}
+
+err_t httpd_post_receive_data(void *connection, struct pbuf *p) {
+    POST_STATE_T *post = find_post(connection);
+    if (!post) {
+        pbuf_free(p);
+        return ERR_VAL;
+    }
+    if (post->busy) {
+        if (post->pending) {
+            pbuf_cat(post->pending, p);
+        } else {
+            post->pending = p;
+        }
+        return ERR_OK;
+    }
+    // This can't fail while every job with a pbuf holds one from the pool, see HTTPD_WORKER_QUEUE_LENGTH
+    if (!httpd_worker_run(post_job, post, p)) {
+        pbuf_free(p);
+        return ERR_MEM;
+    }
+    post->busy = true;
+    return ERR_OK;
+}
+
+// Called when the body has been dealt with, or if the connection is closed first
+void httpd_post_finished(void *connection, char *response_uri, u16_t response_uri_len) {
+    POST_STATE_T *post = find_post(connection);
+    if (!post) {
+        return;
+    }
+    if (post->len == (uint32_t)post->content_len) {
+        post_count++;
+        post_len = post->len;
+        post_crc = post->crc;
+    }
+    snprintf(response_uri, response_uri_len, "%s", POST_RESULT_URI);
+    post->finished = true;
+    if (!post->busy) {
+        free_post(post);
+    }
+}
+
 // Note that the buffer size is limited by LWIP_HTTPD_MAX_TAG_INSERT_LEN, so use LWIP_HTTPD_SSI_MULTIPART to return larger amounts of data
 u16_t ssi_example_ssi_handler(int iIndex, char *pcInsert, int iInsertLen
 #if LWIP_HTTPD_SSI_MULTIPART
@@ -105,6 +268,18 @@ u16_t ssi_example_ssi_handler(int iIndex, char *pcInsert, int iInsertLen
             break;
         }
 #endif
+        case 5: { // "postlen"
+            printed = snprintf(pcInsert, iInsertLen, "%u", (unsigned)post_len);
+            break;
+        }
+        case 6: { // "postcrc"
+            printed = snprintf(pcInsert, iInsertLen, "%08x", (unsigned)post_crc);
+            break;
+        }
+        case 7: { // "postcount"
+            printed = snprintf(pcInsert, iInsertLen, "%u", (unsigned)post_count);
+            break;
+        }
         default: { /* unknown tag */
             printed = 0;
             break;
@@ -120,6 +295,9 @@ static const char * ssi_tags[] = {
     "uptime",
     "ledstate",
     "table",
+    "postlen",
+    "postcrc",
+    "postcount",
 };
 
 void main_task(__unused void *params) {
@@ -158,6 +336,11 @@ void main_task(__unused void *params) {
 #endif
 #endif
 
+    if (!httpd_worker_pool_init()) {
+        printf("failed to start workers\n");
+        exit(1);
+    }
+
     printf("\nReady, running httpd at %s\n", ip4addr_ntoa(netif_ip4_addr(netif_list)));
     httpd_init();
 
@@ -11,6 +11,8 @@
 #include "lwip/ip4_addr.h"
 #include "lwip/apps/lwiperf.h"
 
+#include "iperf_udp.h"
+
 #include "FreeRTOS.h"
 #include "task.h"
 
@@ -25,6 +27,26 @@
 #error IPERF_SERVER_IP not defined
 #endif
 
+// Define IPERF_UDP=1 to test with UDP, which reports jitter and loss, e.g. "iperf -c <pico> -u -b 10M -i 1"
+#ifndef IPERF_UDP
+#define IPERF_UDP 0
+#endif
+
+#if IPERF_UDP
+// Settings for the client, the server gets these from the client
+#ifndef IPERF_UDP_RATE
+#define IPERF_UDP_RATE IPERF_UDP_DEFAULT_RATE_BPS
+#endif
+#ifndef IPERF_UDP_SIZE
+#define IPERF_UDP_SIZE IPERF_UDP_DEFAULT_DATAGRAM_SIZE
+#endif
+#ifndef IPERF_UDP_DURATION_S
+#define IPERF_UDP_DURATION_S 10
+#endif
+static iperf_udp_t iperf_udp;
+#endif
+
+#if !IPERF_UDP
 // Report IP results and exit
 static void iperf_report(void *arg, enum lwiperf_report_type report_type,
                          const ip_addr_t *local_addr, u16_t local_port, const ip_addr_t *remote_addr, u16_t remote_port,
@@ -38,6 +60,7 @@ static void iperf_report(void *arg, enum lwiperf_report_type report_type,
     printf("Completed iperf transfer of %d MBytes @ %.1f Mbits/sec\n", mbytes, mbits);
     printf("Total iperf megabytes since start %d Mbytes\n", total_iperf_megabytes);
 }
+#endif
 
 void blink_task(__unused void *params) {
     bool on = false;
@@ -73,7 +96,20 @@ void main_task(__unused void *params) {
     xTaskCreate(blink_task, "BlinkThread", configMINIMAL_STACK_SIZE, NULL, BLINK_TASK_PRIORITY, NULL);
 
     cyw43_arch_lwip_begin();
-#if CLIENT_TEST
+#if IPERF_UDP && CLIENT_TEST
+    printf("\nReady, running iperf UDP client\n");
+    ip_addr_t clientaddr;
+    ip4_addr_set_u32(&clientaddr, ipaddr_addr(xstr(IPERF_SERVER_IP)));
+    if (!iperf_udp_client_init(&iperf_udp, cyw43_arch_async_context(), &clientaddr, IPERF_UDP_DEFAULT_PORT,
+                               IPERF_UDP_RATE, IPERF_UDP_SIZE, IPERF_UDP_DURATION_S)) {
+        printf("failed to start iperf UDP client\n");
+    }
+#elif IPERF_UDP
+    printf("\nReady, running iperf UDP server at %s\n", ip4addr_ntoa(netif_ip4_addr(netif_list)));
+    if (!iperf_udp_server_init(&iperf_udp, cyw43_arch_async_context(), IPERF_UDP_DEFAULT_PORT)) {
+        printf("failed to start iperf UDP server\n");
+    }
+#elif CLIENT_TEST
     printf("\nReady, running iperf client\n");
     ip_addr_t clientaddr;
     ip4_addr_set_u32(&clientaddr, ipaddr_addr(xstr(IPERF_SERVER_IP)));
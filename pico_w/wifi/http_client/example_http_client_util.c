@@ -5,10 +5,17 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "pico/async_context.h"
 #include "lwip/altcp.h"
+#include "lwip/altcp_tcp.h"
 #include "lwip/altcp_tls.h"
+#include "lwip/dns.h"
+#include "lwip/sys.h"
+#if LWIP_ALTCP_TLS_MBEDTLS
+#include "mbedtls/ssl.h"
+#endif
 #include "example_http_client_util.h"
 
 #ifndef HTTP_INFO
@@ -100,6 +107,591 @@ static struct altcp_pcb *altcp_tls_alloc_sni(void *arg, u8_t ip_type) {
     return pcb;
 }
 
+// Connections kept open for keep_alive requests
+#ifndef HTTP_CLIENT_MAX_CONNECTIONS
+#define HTTP_CLIENT_MAX_CONNECTIONS 2
+#endif
+
+// TLS sessions saved so a new connection to the same server can skip most of the handshake
+#ifndef HTTP_CLIENT_MAX_SESSIONS
+#define HTTP_CLIENT_MAX_SESSIONS 2
+#endif
+
+// An idle connection is closed after this long
+#ifndef HTTP_CLIENT_IDLE_TIMEOUT_S
+#define HTTP_CLIENT_IDLE_TIMEOUT_S 30
+#endif
+
+// A request fails if nothing is received for this long
+#ifndef HTTP_CLIENT_TIMEOUT_S
+#define HTTP_CLIENT_TIMEOUT_S 30
+#endif
+
+#define HTTP_CLIENT_HOSTNAME_LEN 64
+#define HTTP_CLIENT_MAX_HEADERS_LEN 4096
+#define HTTP_CLIENT_POLL_INTERVAL 2 // in units of about 500ms, i.e. about a second
+
+typedef enum {
+    HTTP_CONN_FREE,
+    HTTP_CONN_RESOLVING,
+    HTTP_CONN_CONNECTING,
+    HTTP_CONN_IDLE,
+    HTTP_CONN_HEADERS, // request sent, waiting for the headers
+    HTTP_CONN_BODY,
+    HTTP_CONN_CHUNK_SIZE,
+    HTTP_CONN_CHUNK_DATA,
+    HTTP_CONN_CHUNK_END,
+    HTTP_CONN_TRAILER,
+} HTTP_CONN_STATE_T;
+
+typedef struct HTTP_CLIENT_CONNECTION {
+    struct altcp_pcb *pcb;
+    HTTP_CONN_STATE_T state;
+    char hostname[HTTP_CLIENT_HOSTNAME_LEN];
+    uint16_t port;
+    struct altcp_tls_config *tls_config;
+    EXAMPLE_HTTP_REQUEST_T *req;
+    bool reused; // the request was sent on a connection used before, which the server might have closed
+    bool session_saved;
+    bool close; // the server will close the connection after this response
+    bool length_known;
+    struct pbuf *hdr;
+    u32_t content_len;
+    u32_t remaining; // in the body or the current chunk
+    u32_t rx_content_len;
+    u32_t srv_res;
+    char line[16]; // chunk size
+    uint8_t line_len;
+    u32_t last_active_ms;
+} HTTP_CLIENT_CONNECTION_T;
+
+#if LWIP_ALTCP_TLS_MBEDTLS
+typedef struct HTTP_CLIENT_SESSION {
+    char hostname[HTTP_CLIENT_HOSTNAME_LEN];
+    uint16_t port;
+    struct altcp_tls_config *tls_config;
+    bool used;
+    mbedtls_ssl_session session;
+    u32_t last_used_ms;
+} HTTP_CLIENT_SESSION_T;
+#endif
+
+static HTTP_CLIENT_CONNECTION_T http_connections[HTTP_CLIENT_MAX_CONNECTIONS];
+#if LWIP_ALTCP_TLS_MBEDTLS
+static HTTP_CLIENT_SESSION_T http_sessions[HTTP_CLIENT_MAX_SESSIONS];
+#endif
+
+static err_t conn_open(HTTP_CLIENT_CONNECTION_T *conn, EXAMPLE_HTTP_REQUEST_T *req);
+
+static bool conn_matches(const HTTP_CLIENT_CONNECTION_T *conn, const EXAMPLE_HTTP_REQUEST_T *req, uint16_t port) {
+#if LWIP_ALTCP_TLS
+    if (conn->tls_config != req->tls_config) {
+        return false;
+    }
+#endif
+    return conn->port == port && strcmp(conn->hostname, req->hostname) == 0;
+}
+
+#if LWIP_ALTCP_TLS_MBEDTLS
+static HTTP_CLIENT_SESSION_T *find_session(const HTTP_CLIENT_CONNECTION_T *conn) {
+    for (int i = 0; i < HTTP_CLIENT_MAX_SESSIONS; i++) {
+        HTTP_CLIENT_SESSION_T *s = &http_sessions[i];
+        if (s->used && s->tls_config == conn->tls_config && s->port == conn->port && strcmp(s->hostname, conn->hostname) == 0) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+// Remember the session once the handshake is done, replacing the least recently used one
+static void save_session(HTTP_CLIENT_CONNECTION_T *conn) {
+    HTTP_CLIENT_SESSION_T *s = find_session(conn);
+    if (!s) {
+        s = &http_sessions[0];
+        for (int i = 0; i < HTTP_CLIENT_MAX_SESSIONS; i++) {
+            if (!http_sessions[i].used) {
+                s = &http_sessions[i];
+                break;
+            }
+            if ((s32_t)(http_sessions[i].last_used_ms - s->last_used_ms) < 0) {
+                s = &http_sessions[i];
+            }
+        }
+        strcpy(s->hostname, conn->hostname);
+        s->port = conn->port;
+        s->tls_config = conn->tls_config;
+    }
+    if (s->used) {
+        mbedtls_ssl_session_free(&s->session);
+    }
+    mbedtls_ssl_session_init(&s->session);
+    s->used = mbedtls_ssl_get_session(altcp_tls_context(conn->pcb), &s->session) == 0;
+    if (s->used) {
+        s->last_used_ms = sys_now();
+        conn->session_saved = true;
+        HTTP_DEBUG("saved tls session for %s\n", conn->hostname);
+    } else {
+        mbedtls_ssl_session_free(&s->session);
+    }
+}
+#endif
+
+static err_t conn_close(HTTP_CLIENT_CONNECTION_T *conn) {
+    err_t err = ERR_OK;
+    if (conn->pcb) {
+        altcp_arg(conn->pcb, NULL);
+        altcp_recv(conn->pcb, NULL);
+        altcp_err(conn->pcb, NULL);
+        altcp_poll(conn->pcb, NULL, 0);
+        err = altcp_close(conn->pcb);
+        if (err != ERR_OK) {
+            altcp_abort(conn->pcb);
+            err = ERR_ABRT;
+        }
+        conn->pcb = NULL;
+    }
+    if (conn->hdr) {
+        pbuf_free(conn->hdr);
+        conn->hdr = NULL;
+    }
+    conn->state = HTTP_CONN_FREE;
+    return err;
+}
+
+static void conn_finish(HTTP_CLIENT_CONNECTION_T *conn, httpc_result_t result, err_t err) {
+    EXAMPLE_HTTP_REQUEST_T *req = conn->req;
+    conn->req = NULL;
+    if (req) {
+        HTTP_DEBUG("result %d len %u server_response %u err %d\n", result, conn->rx_content_len, conn->srv_res, err);
+        req->complete = true;
+        req->result = result;
+        if (req->result_fn) {
+            req->result_fn(req->callback_arg, result, conn->rx_content_len, conn->srv_res, err);
+        }
+    }
+}
+
+// The request failed. If the server closed a connection we kept open before it saw the request,
+// it's made again on a new connection
+static err_t conn_fail(HTTP_CLIENT_CONNECTION_T *conn, httpc_result_t result, err_t err) {
+    EXAMPLE_HTTP_REQUEST_T *req = conn->req;
+    bool retry = req && conn->reused && conn->state == HTTP_CONN_HEADERS && !conn->hdr && result == HTTPC_RESULT_ERR_CLOSED;
+    err_t close_err = conn_close(conn);
+    if (retry) {
+        HTTP_DEBUG("connection to %s was closed, reconnecting\n", conn->hostname);
+        conn->req = NULL;
+        if (conn_open(conn, req) == ERR_OK) {
+            return close_err;
+        }
+        conn->req = req;
+    }
+    conn_finish(conn, result, err);
+    return close_err;
+}
+
+// The response is complete
+static err_t conn_complete(HTTP_CLIENT_CONNECTION_T *conn) {
+    err_t err = ERR_OK;
+#if LWIP_ALTCP_TLS_MBEDTLS
+    if (conn->tls_config && !conn->session_saved && conn->pcb) {
+        save_session(conn);
+    }
+#endif
+    if (conn->close || !conn->pcb) {
+        err = conn_close(conn);
+    } else {
+        conn->state = HTTP_CONN_IDLE;
+    }
+    conn_finish(conn, HTTPC_RESULT_OK, ERR_OK);
+    return err;
+}
+
+static err_t conn_send_request(HTTP_CLIENT_CONNECTION_T *conn) {
+    char request[256];
+    int len = snprintf(request, sizeof(request),
+        "GET %s HTTP/1.1\r\n"
+        "Host: %s\r\n"
+        "User-Agent: lwIP/pico\r\n"
+        "Accept: */*\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n", conn->req->url, conn->hostname);
+    if (len >= (int)sizeof(request)) {
+        return conn_fail(conn, HTTPC_RESULT_ERR_MEM, ERR_MEM);
+    }
+    conn->state = HTTP_CONN_HEADERS;
+    conn->close = false;
+    conn->length_known = false;
+    conn->content_len = HTTPC_CONTENT_LEN_INVALID;
+    conn->rx_content_len = 0;
+    conn->srv_res = 0;
+    conn->last_active_ms = sys_now();
+    err_t err = altcp_write(conn->pcb, request, (u16_t)len, TCP_WRITE_FLAG_COPY);
+    if (err == ERR_OK) {
+        err = altcp_output(conn->pcb);
+    }
+    if (err != ERR_OK) {
+        HTTP_ERROR("http request write failed %d\n", err);
+        return conn_fail(conn, HTTPC_RESULT_ERR_CLOSED, err);
+    }
+    return ERR_OK;
+}
+
+static bool header_is(const char *line, const char *name) {
+    return lwip_strnicmp(line, name, strlen(name)) == 0;
+}
+
+// Find what we need to know to read the body
+static void parse_headers(HTTP_CLIENT_CONNECTION_T *conn, struct pbuf *hdr, u16_t hdr_len) {
+    bool http_1_0 = false;
+    bool keep_alive = false;
+    bool chunked = false;
+    u16_t offset = 0;
+    while (offset < hdr_len) {
+        char line[128];
+        size_t len = 0;
+        char c;
+        while (offset < hdr_len && (c = (char)pbuf_get_at(hdr, offset++)) != '\n') {
+            if (len < sizeof(line) - 1 && c != '\r') {
+                line[len++] = c;
+            }
+        }
+        line[len] = 0;
+        if (conn->srv_res == 0) {
+            if (len >= 12 && header_is(line, "HTTP/1.")) {
+                http_1_0 = line[7] == '0';
+                conn->srv_res = (u32_t)atoi(line + 9);
+            }
+        } else if (header_is(line, "content-length:")) {
+            conn->content_len = strtoul(line + 15, NULL, 10);
+            conn->length_known = true;
+        } else if (header_is(line, "transfer-encoding:")) {
+            chunked = lwip_strnistr(line, "chunked", len) != NULL;
+        } else if (header_is(line, "connection:")) {
+            conn->close = lwip_strnistr(line, "close", len) != NULL;
+            keep_alive = lwip_strnistr(line, "keep-alive", len) != NULL;
+        }
+    }
+    if (http_1_0 && !keep_alive) {
+        conn->close = true;
+    }
+    if (chunked) {
+        conn->state = HTTP_CONN_CHUNK_SIZE;
+        conn->line_len = 0;
+    } else {
+        conn->state = HTTP_CONN_BODY;
+        if ((conn->srv_res >= 100 && conn->srv_res < 200) || conn->srv_res == 204 || conn->srv_res == 304) {
+            conn->content_len = 0;
+            conn->length_known = true;
+        }
+        if (!conn->length_known) {
+            conn->close = true; // the body ends when the connection is closed
+        }
+        conn->remaining = conn->content_len;
+    }
+}
+
+// Pass part of a pbuf to the request's receive function, which frees it
+static err_t deliver(HTTP_CLIENT_CONNECTION_T *conn, struct pbuf *p, u16_t offset, u16_t len) {
+    conn->rx_content_len += len;
+    EXAMPLE_HTTP_REQUEST_T *req = conn->req;
+    if (!len || !req || !req->recv_fn) {
+        return ERR_OK;
+    }
+    struct pbuf *q;
+    if (offset == 0 && len == p->tot_len) {
+        q = p;
+        pbuf_ref(q);
+    } else {
+        q = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
+        if (!q) {
+            return conn_fail(conn, HTTPC_RESULT_ERR_MEM, ERR_MEM);
+        }
+        u16_t copied = 0;
+        for (struct pbuf *seg = q; seg; seg = seg->next) {
+            copied += pbuf_copy_partial(p, seg->payload, seg->len, offset + copied);
+        }
+    }
+    if (req->recv_fn(req->callback_arg, conn->pcb, q, ERR_OK) != ERR_OK) {
+        return conn_fail(conn, HTTPC_RESULT_LOCAL_ABORT, ERR_ABRT);
+    }
+    return ERR_OK;
+}
+
+// Process the body, removing the chunk framing if there is any
+static err_t process_body(HTTP_CLIENT_CONNECTION_T *conn, struct pbuf *p) {
+    u16_t offset = 0;
+    while (offset < p->tot_len && conn->req) {
+        u16_t left = p->tot_len - offset;
+        err_t err = ERR_OK;
+        if (conn->state == HTTP_CONN_BODY || conn->state == HTTP_CONN_CHUNK_DATA) {
+            u16_t n = left;
+            if (conn->state == HTTP_CONN_CHUNK_DATA || conn->length_known) {
+                n = (u16_t)LWIP_MIN(conn->remaining, left);
+                conn->remaining -= n;
+            }
+            err = deliver(conn, p, offset, n);
+            offset += n;
+            if (err == ERR_OK && conn->req && conn->remaining == 0) {
+                if (conn->state == HTTP_CONN_CHUNK_DATA) {
+                    conn->state = HTTP_CONN_CHUNK_END;
+                } else if (conn->length_known) {
+                    return conn_complete(conn);
+                }
+            }
+        } else {
+            char c = (char)pbuf_get_at(p, offset++);
+            if (c == '\r') {
+                continue;
+            }
+            if (conn->state == HTTP_CONN_CHUNK_END) {
+                if (c == '\n') {
+                    conn->state = HTTP_CONN_CHUNK_SIZE;
+                    conn->line_len = 0;
+                }
+            } else if (conn->state == HTTP_CONN_CHUNK_SIZE) {
+                if (c != '\n') {
+                    if (conn->line_len < sizeof(conn->line) - 1) {
+                        conn->line[conn->line_len++] = c;
+                    }
+                } else {
+                    conn->line[conn->line_len] = 0;
+                    conn->remaining = strtoul(conn->line, NULL, 16);
+                    conn->line_len = 0;
+                    conn->state = conn->remaining ? HTTP_CONN_CHUNK_DATA : HTTP_CONN_TRAILER;
+                }
+            } else if (conn->state == HTTP_CONN_TRAILER) {
+                // The trailer ends with an empty line
+                if (c != '\n') {
+                    conn->line_len = 1;
+                } else if (conn->line_len) {
+                    conn->line_len = 0;
+                } else {
+                    return conn_complete(conn);
+                }
+            }
+        }
+        if (err != ERR_OK) {
+            return err;
+        }
+    }
+    return ERR_OK;
+}
+
+static err_t conn_recv(void *arg, struct altcp_pcb *pcb, struct pbuf *p, err_t err) {
+    HTTP_CLIENT_CONNECTION_T *conn = (HTTP_CLIENT_CONNECTION_T *)arg;
+    if (!p) {
+        // The server closed the connection, which ends a body without a length
+        if (conn->state == HTTP_CONN_BODY && !conn->length_known) {
+            conn->close = true;
+            return conn_complete(conn);
+        }
+        if (conn->req) {
+            return conn_fail(conn, HTTPC_RESULT_ERR_CLOSED, ERR_CLSD);
+        }
+        return conn_close(conn);
+    }
+    altcp_recved(pcb, p->tot_len);
+    conn->last_active_ms = sys_now();
+    if (!conn->req) {
+        pbuf_free(p);
+        return ERR_OK;
+    }
+    if (conn->state == HTTP_CONN_HEADERS) {
+        if (conn->hdr) {
+            pbuf_cat(conn->hdr, p);
+        } else {
+            conn->hdr = p;
+        }
+        u16_t end = pbuf_memfind(conn->hdr, "\r\n\r\n", 4, 0);
+        if (end == 0xFFFF) {
+            if (conn->hdr->tot_len > HTTP_CLIENT_MAX_HEADERS_LEN) {
+                return conn_fail(conn, HTTPC_RESULT_ERR_SVR_RESP, ERR_VAL);
+            }
+            return ERR_OK;
+        }
+        u16_t hdr_len = end + 4;
+        parse_headers(conn, conn->hdr, hdr_len);
+        EXAMPLE_HTTP_REQUEST_T *req = conn->req;
+        if (req->headers_fn && req->headers_fn(NULL, req->callback_arg, conn->hdr, hdr_len, conn->content_len) != ERR_OK) {
+            return conn_fail(conn, HTTPC_RESULT_LOCAL_ABORT, ERR_ABRT);
+        }
+        p = pbuf_free_header(conn->hdr, hdr_len);
+        conn->hdr = NULL;
+        if (conn->state == HTTP_CONN_BODY && conn->length_known && conn->content_len == 0) {
+            if (p) {
+                pbuf_free(p);
+            }
+            return conn_complete(conn);
+        }
+        if (!p) {
+            return ERR_OK;
+        }
+    }
+    err = process_body(conn, p);
+    pbuf_free(p);
+    return err;
+}
+
+static void conn_err(void *arg, err_t err) {
+    HTTP_CLIENT_CONNECTION_T *conn = (HTTP_CLIENT_CONNECTION_T *)arg;
+    conn->pcb = NULL; // already freed
+    if (conn->req) {
+        HTTP_DEBUG("http connection error %d\n", err);
+        conn_fail(conn, conn->state == HTTP_CONN_CONNECTING ? HTTPC_RESULT_ERR_CONNECT : HTTPC_RESULT_ERR_CLOSED, err);
+    } else {
+        conn_close(conn);
+    }
+}
+
+static err_t conn_poll(void *arg, struct altcp_pcb *pcb) {
+    HTTP_CLIENT_CONNECTION_T *conn = (HTTP_CLIENT_CONNECTION_T *)arg;
+    u32_t idle_ms = sys_now() - conn->last_active_ms;
+    if (conn->req && idle_ms >= HTTP_CLIENT_TIMEOUT_S * 1000) {
+        return conn_fail(conn, HTTPC_RESULT_ERR_TIMEOUT, ERR_TIMEOUT);
+    }
+    if (conn->state == HTTP_CONN_IDLE && idle_ms >= HTTP_CLIENT_IDLE_TIMEOUT_S * 1000) {
+        HTTP_DEBUG("closing idle connection to %s\n", conn->hostname);
+        return conn_close(conn);
+    }
+    return ERR_OK;
+}
+
+static err_t conn_connected(void *arg, struct altcp_pcb *pcb, err_t err) {
+    HTTP_CLIENT_CONNECTION_T *conn = (HTTP_CLIENT_CONNECTION_T *)arg;
+    if (err != ERR_OK) {
+        return conn_fail(conn, HTTPC_RESULT_ERR_CONNECT, err);
+    }
+    return conn_send_request(conn);
+}
+
+static void conn_connect(HTTP_CLIENT_CONNECTION_T *conn, const ip_addr_t *ipaddr) {
+    conn->state = HTTP_CONN_CONNECTING;
+    conn->last_active_ms = sys_now();
+    err_t err = altcp_connect(conn->pcb, ipaddr, conn->port, conn_connected);
+    if (err != ERR_OK) {
+        conn_fail(conn, HTTPC_RESULT_ERR_CONNECT, err);
+    }
+}
+
+static void conn_dns_found(const char *hostname, const ip_addr_t *ipaddr, void *arg) {
+    HTTP_CLIENT_CONNECTION_T *conn = (HTTP_CLIENT_CONNECTION_T *)arg;
+    if (conn->state != HTTP_CONN_RESOLVING || strcmp(conn->hostname, hostname) != 0) {
+        return; // closed while we were waiting
+    }
+    if (ipaddr) {
+        conn_connect(conn, ipaddr);
+    } else {
+        conn_fail(conn, HTTPC_RESULT_ERR_HOSTNAME, ERR_VAL);
+    }
+}
+
+// Make a new connection for the request
+static err_t conn_open(HTTP_CLIENT_CONNECTION_T *conn, EXAMPLE_HTTP_REQUEST_T *req) {
+    const uint16_t port = conn->port;
+    memset(conn, 0, sizeof(*conn));
+    snprintf(conn->hostname, sizeof(conn->hostname), "%s", req->hostname);
+    conn->port = port;
+    conn->req = req;
+#if LWIP_ALTCP_TLS
+    conn->tls_config = req->tls_config;
+    if (conn->tls_config) {
+        conn->pcb = altcp_tls_new(conn->tls_config, IPADDR_TYPE_ANY);
+        if (conn->pcb) {
+            mbedtls_ssl_set_hostname(altcp_tls_context(conn->pcb), conn->hostname);
+#if LWIP_ALTCP_TLS_MBEDTLS
+            HTTP_CLIENT_SESSION_T *s = find_session(conn);
+            if (s && mbedtls_ssl_set_session(altcp_tls_context(conn->pcb), &s->session) == 0) {
+                HTTP_DEBUG("resuming tls session for %s\n", conn->hostname);
+                s->last_used_ms = sys_now();
+            }
+#endif
+        }
+    } else
+#endif
+    {
+        conn->pcb = altcp_tcp_new_ip_type(IPADDR_TYPE_ANY);
+    }
+    if (!conn->pcb) {
+        HTTP_ERROR("Failed to allocate PCB\n");
+        conn->req = NULL;
+        conn->state = HTTP_CONN_FREE;
+        return ERR_MEM;
+    }
+    altcp_arg(conn->pcb, conn);
+    altcp_recv(conn->pcb, conn_recv);
+    altcp_err(conn->pcb, conn_err);
+    altcp_poll(conn->pcb, conn_poll, HTTP_CLIENT_POLL_INTERVAL);
+
+    conn->state = HTTP_CONN_RESOLVING;
+    conn->last_active_ms = sys_now();
+    ip_addr_t ipaddr;
+    err_t err = dns_gethostbyname(conn->hostname, &ipaddr, conn_dns_found, conn);
+    if (err == ERR_OK) {
+        conn_connect(conn, &ipaddr);
+    } else if (err != ERR_INPROGRESS) {
+        conn_close(conn);
+        conn->req = NULL;
+        return err;
+    }
+    return ERR_OK;
+}
+
+// Send the request on an idle connection to the same server, or make a new connection
+static err_t http_client_pool_request(EXAMPLE_HTTP_REQUEST_T *req, uint16_t port) {
+    if (strlen(req->hostname) >= HTTP_CLIENT_HOSTNAME_LEN) {
+        return ERR_ARG;
+    }
+    HTTP_CLIENT_CONNECTION_T *conn = NULL;
+    for (int i = 0; i < HTTP_CLIENT_MAX_CONNECTIONS; i++) {
+        if (http_connections[i].state == HTTP_CONN_IDLE && conn_matches(&http_connections[i], req, port)) {
+            conn = &http_connections[i];
+            conn->req = req;
+            conn->reused = true;
+            conn_send_request(conn); // errors are reported through result_fn
+            return ERR_OK;
+        }
+    }
+    // Use a free connection or close the least recently used idle one
+    for (int i = 0; i < HTTP_CLIENT_MAX_CONNECTIONS; i++) {
+        HTTP_CLIENT_CONNECTION_T *c = &http_connections[i];
+        if (c->state == HTTP_CONN_FREE) {
+            conn = c;
+            break;
+        }
+        if (c->state == HTTP_CONN_IDLE && (!conn || (s32_t)(c->last_active_ms - conn->last_active_ms) < 0)) {
+            conn = c;
+        }
+    }
+    if (!conn) {
+        HTTP_ERROR("no free http connection\n");
+        return ERR_MEM;
+    }
+    conn_close(conn);
+    conn->port = port;
+    return conn_open(conn, req);
+}
+
+void http_client_pool_close(async_context_t *context, struct altcp_tls_config *tls_config) {
+    async_context_acquire_lock_blocking(context);
+    for (int i = 0; i < HTTP_CLIENT_MAX_CONNECTIONS; i++) {
+        HTTP_CLIENT_CONNECTION_T *conn = &http_connections[i];
+        if (conn->state != HTTP_CONN_FREE && (!tls_config || conn->tls_config == tls_config)) {
+            conn_close(conn);
+            conn_finish(conn, HTTPC_RESULT_LOCAL_ABORT, ERR_ABRT);
+        }
+    }
+#if LWIP_ALTCP_TLS_MBEDTLS
+    for (int i = 0; i < HTTP_CLIENT_MAX_SESSIONS; i++) {
+        HTTP_CLIENT_SESSION_T *s = &http_sessions[i];
+        if (s->used && (!tls_config || s->tls_config == tls_config)) {
+            mbedtls_ssl_session_free(&s->session);
+            memset(s, 0, sizeof(*s));
+        }
+    }
+#endif
+    async_context_release_lock(context);
+}
+
 // Make a http request, complete when req->complete returns true
 int http_client_request_async(async_context_t *context, EXAMPLE_HTTP_REQUEST_T *req) {
 #if LWIP_ALTCP
@@ -115,6 +707,15 @@ int http_client_request_async(async_context_t *context, EXAMPLE_HTTP_REQUEST_T *
     const uint16_t default_port = 80;
 #endif
     req->complete = false;
+    if (req->keep_alive) {
+        async_context_acquire_lock_blocking(context);
+        err_t ret = http_client_pool_request(req, req->port ? req->port : default_port);
+        async_context_release_lock(context);
+        if (ret != ERR_OK) {
+            HTTP_ERROR("http request failed: %d", ret);
+        }
+        return ret;
+    }
     req->settings.headers_done_fn = req->headers_fn ? internal_header_fn : NULL;
     req->settings.result_fn = internal_result_fn;
     async_context_acquire_lock_blocking(context);
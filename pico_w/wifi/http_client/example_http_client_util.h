@@ -22,7 +22,7 @@ typedef struct EXAMPLE_HTTP_REQUEST {
      */
     const char *url;
     /*!
-     * Function to callback with headers, can be null
+     * Function to callback with headers, can be null. The connection passed is null for keep_alive requests
      * @see httpc_headers_done_fn
      */
     httpc_headers_done_fn headers_fn;
@@ -56,7 +56,12 @@ typedef struct EXAMPLE_HTTP_REQUEST {
     altcp_allocator_t tls_allocator;
 #endif
     /*!
-     * LwIP HTTP client settings
+     * Keep the connection open for the next request to the same host and port, and resume the
+     * TLS session if a new connection is needed. Call \em http_client_pool_close before freeing tls_config
+     */
+    bool keep_alive;
+    /*!
+     * LwIP HTTP client settings, not used for keep_alive requests
      */
     httpc_connection_t settings;
     /*!
@@ -71,6 +76,7 @@ typedef struct EXAMPLE_HTTP_REQUEST {
 } EXAMPLE_HTTP_REQUEST_T;
 
 struct async_context;
+struct altcp_tls_config;
 
 /*! \brief Perform a http request asynchronously
  *  \ingroup pico_lwip
@@ -97,6 +103,17 @@ int http_client_request_async(struct async_context *context, EXAMPLE_HTTP_REQUES
  */
 int http_client_request_sync(struct async_context *context, EXAMPLE_HTTP_REQUEST_T *req);
 
+/*! \brief Close connections kept open for keep_alive requests
+ *  \ingroup pico_lwip
+ *
+ * Close the idle connections made with a TLS configuration and forget the TLS sessions saved for it,
+ * which must be done before the configuration is freed
+ *
+ * @param context async context
+ * @param tls_config TLS configuration, or null to close all the idle connections and forget all the sessions
+ */
+void http_client_pool_close(struct async_context *context, struct altcp_tls_config *tls_config);
+
 /*! \brief A http header callback that can be passed to \em http_client_init or \em http_client_init_secure
  *  \ingroup pico_http_client
  *
@@ -3,4 +3,7 @@
 
 #include "mbedtls_config_examples_common.h"
 
+// Allow TLS sessions to be resumed with a ticket from the server, rather than a full handshake
+#define MBEDTLS_SSL_SESSION_TICKETS
+
 #endif
\ No newline at end of file
@@ -0,0 +1,93 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "pico/cyw43_arch.h"
+#include "pico/async_context.h"
+#include "lwip/altcp_tls.h"
+#include "example_http_client_util.h"
+
+// Times https requests to python_https_server.py running on HTTP_BENCHMARK_HOST
+#ifndef HTTP_BENCHMARK_PORT
+#define HTTP_BENCHMARK_PORT 4443
+#endif
+
+#define BENCHMARK_REQUESTS 10
+
+// Discard the body
+static err_t benchmark_recv_fn(__unused void *arg, __unused struct altcp_pcb *conn, struct pbuf *p, __unused err_t err) {
+    pbuf_free(p);
+    return ERR_OK;
+}
+
+// Make the requests, printing how long the first one took and the average of the others
+static int benchmark(const char *label, struct altcp_tls_config *tls_config, bool keep_alive, const char *url) {
+    async_context_t *context = cyw43_arch_async_context();
+    http_client_pool_close(context, tls_config); // so the first request needs a full handshake
+    int64_t first_us = 0;
+    int64_t total_us = 0;
+    int64_t max_us = 0;
+    for (int i = 0; i < BENCHMARK_REQUESTS; i++) {
+        EXAMPLE_HTTP_REQUEST_T req = {0};
+        req.hostname = HTTP_BENCHMARK_HOST;
+        req.port = HTTP_BENCHMARK_PORT;
+        req.url = url;
+        req.recv_fn = benchmark_recv_fn;
+        req.tls_config = tls_config;
+        req.keep_alive = keep_alive;
+        absolute_time_t start = get_absolute_time();
+        int result = http_client_request_sync(context, &req);
+        int64_t us = absolute_time_diff_us(start, get_absolute_time());
+        if (result != 0) {
+            printf("%s: request %d failed %d\n", label, i, result);
+            return result;
+        }
+        if (i == 0) {
+            first_us = us;
+        } else {
+            total_us += us;
+            max_us = MAX(max_us, us);
+        }
+    }
+    printf("%-16s first %6lld ms, then average %6lld ms max %6lld ms\n", label, first_us / 1000,
+           total_us / (BENCHMARK_REQUESTS - 1) / 1000, max_us / 1000);
+    return 0;
+}
+
+int main() {
+    stdio_init_all();
+    if (cyw43_arch_init()) {
+        printf("failed to initialise\n");
+        return 1;
+    }
+    cyw43_arch_enable_sta_mode();
+    if (cyw43_arch_wifi_connect_timeout_ms(WIFI_SSID, WIFI_PASSWORD, CYW43_AUTH_WPA2_AES_PSK, 30000)) {
+        printf("failed to connect\n");
+        return 1;
+    }
+
+    // The server's certificate is self signed, so it isn't verified
+    struct altcp_tls_config *tls_config = altcp_tls_create_config_client(NULL, 0);
+    if (!tls_config) {
+        panic("TLS config failed");
+    }
+
+    printf("%d requests to https://%s:%d\n", BENCHMARK_REQUESTS, HTTP_BENCHMARK_HOST, HTTP_BENCHMARK_PORT);
+    int result = 0;
+    // A new connection and a full handshake for every request
+    result += benchmark("new connection", tls_config, false, "/");
+    // A new connection for every request, as the server closes it, but the TLS session is resumed
+    result += benchmark("session resumed", tls_config, true, "/close");
+    // The connection is kept open
+    result += benchmark("keep-alive", tls_config, true, "/");
+
+    http_client_pool_close(cyw43_arch_async_context(), tls_config);
+    altcp_tls_free_config(tls_config);
+    cyw43_arch_deinit();
+    printf(result == 0 ? "Test passed\n" : "Test failed\n");
+    return 0;
+}
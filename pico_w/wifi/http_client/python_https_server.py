@@ -0,0 +1,61 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# A local https server for picow_http_client_benchmark. It supports HTTP/1.1 keep-alive and TLS
+# session resumption. Responses to paths starting /close end with "Connection: close".
+#
+# Make a certificate first, e.g.
+#   openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes -days 365 \
+#     -subj /CN=pico-test -keyout key.pem -out cert.pem
+#   ./python_https_server.py --cert cert.pem --key key.pem
+#
+
+import argparse
+import http.server
+import ssl
+
+BODY_SIZE = 256
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def do_GET(self):
+        body = b'x' * BODY_SIZE
+        self.send_response(200)
+        self.send_header('Content-Type', 'text/plain')
+        self.send_header('Content-Length', str(len(body)))
+        if self.path.startswith('/close'):
+            self.send_header('Connection', 'close')
+            self.close_connection = True
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, format, *args):
+        resumed = getattr(self.connection, 'session_reused', False)
+        print('%s %s%s' % (self.client_address[0], format % args, ' (resumed)' if resumed else ''))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Local https server for picow_http_client_benchmark')
+    parser.add_argument('--cert', default='cert.pem', help='certificate in PEM format')
+    parser.add_argument('--key', default='key.pem', help='private key in PEM format')
+    parser.add_argument('--port', type=int, default=4443, help='port to listen on')
+    parser.add_argument('--http', action='store_true', help='plain http without TLS')
+    args = parser.parse_args()
+
+    server = http.server.ThreadingHTTPServer(('', args.port), Handler)
+    if not args.http:
+        context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+        context.maximum_version = ssl.TLSVersion.TLSv1_2 # what the examples' mbedtls config supports
+        context.load_cert_chain(args.cert, args.key)
+        server.socket = context.wrap_socket(server.socket, server_side=True)
+    print('Listening on port %d' % args.port)
+    server.serve_forever()
+
+
+if __name__ == '__main__':
+    main()
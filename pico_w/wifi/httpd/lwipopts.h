@@ -22,7 +22,17 @@
 #define LWIP_HTTPD_SUPPORT_POST 1
 #define LWIP_HTTPD_SSI_INCLUDE_TAG 0
 
-// Generated file containing html data
+// Serve cached pages with their tags already expanded, see fs_open_custom. Only parse files
+// makefsdata.py has marked as having tags, and copy cached pages as they can be reassembled
+#define LWIP_HTTPD_CUSTOM_FILES 1
+#define LWIP_HTTPD_SSI_BY_FILE_EXTENSION 0
+#define HTTP_IS_DATA_VOLATILE(hs) (((hs)->ssi || (hs)->handle->is_custom_file) ? TCP_WRITE_FLAG_COPY : 0)
+
+// Look for If-None-Match in requests, so fs_open_custom can send a 304
+#define LWIP_HOOK_FILENAME "pico_httpd_hooks.h"
+
+// Generated file containing html data, with the headers built in by makefsdata.py
 #define HTTPD_FSDATA_FILE "pico_fsdata.inc"
+#define LWIP_HTTPD_DYNAMIC_HEADERS 0
 
 #endif
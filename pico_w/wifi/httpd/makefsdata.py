@@ -0,0 +1,190 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Generate the lwIP httpd file system from the files in a content directory, with the
+# HTTP headers built in so httpd sends them as they are.
+#
+# - Static files are gzip compressed if it makes them smaller, and sent with
+#   "Content-Encoding: gzip". Files named *.gz are assumed to be compressed already. There's no
+#   uncompressed copy, so clients must accept gzip, as all browsers do. Use --no-compress if not
+# - Static files get an ETag, the start of the hash of what is sent, and can be cached by
+#   the browser for --max-age seconds. A "304 Not Modified" response is added for each one, named
+#   "<file> <etag>", which pico_httpd.c sends when the browser asks with that etag in If-None-Match
+# - References to static files from pages have "?v=<etag>" added, httpd ignores this but
+#   the browser fetches a new copy whenever the file changes
+# - Pages (html and files with SSI tags) are sent with "Cache-Control: no-cache"
+# - Files containing SSI tags ("<!--#") are marked with FS_FILE_FLAGS_SSI, for
+#   LWIP_HTTPD_SSI_BY_FILE_EXTENSION=0, and are never compressed as httpd has to parse them
+#
+
+import argparse
+import gzip
+import hashlib
+import mimetypes
+import os
+import re
+
+SSI_LEAD_IN = b'<!--#'
+# Extensions httpd's g_pcSSIExtensions has that mimetypes doesn't know are html
+for extension in ('.shtm', '.ssi', '.stm'):
+    mimetypes.add_type('text/html', extension)
+COMPRESSIBLE_TYPES = ('text/', 'application/javascript', 'application/json', 'image/svg+xml')
+RESPONSES = {200: 'OK', 304: 'Not Modified', 404: 'File not found', 400: 'Bad Request', 501: 'Not Implemented'}
+SERVER = 'lwIP/pico'
+
+
+class File:
+    def __init__(self, root, path):
+        self.path = path
+        self.name = '/' + os.path.relpath(path, root).replace(os.sep, '/')
+        with open(path, 'rb') as f:
+            self.data = f.read()
+        self.content_type, self.encoding = mimetypes.guess_type(path)
+        if not self.content_type:
+            self.content_type = 'application/octet-stream'
+        self.ssi = SSI_LEAD_IN in self.data
+        self.page = self.ssi or self.content_type == 'text/html'
+        self.etag = None
+
+    def status(self):
+        code = 200
+        for response in RESPONSES:
+            if os.path.basename(self.path).startswith('%d.' % response):
+                code = response
+        return code
+
+    def compress(self):
+        if self.ssi or self.encoding or not self.content_type.startswith(COMPRESSIBLE_TYPES):
+            return
+        compressed = gzip.compress(self.data, 9, mtime=0)
+        if len(compressed) < len(self.data):
+            self.data = compressed
+            self.encoding = 'gzip'
+
+    def cacheable(self):
+        return not self.page and self.status() == 200
+
+    def headers(self, max_age, not_modified=False):
+        code = 304 if not_modified else self.status()
+        headers = ['HTTP/1.0 %d %s' % (code, RESPONSES[code]), 'Server: ' + SERVER]
+        if not not_modified:
+            if not self.ssi:
+                # The length of a file with SSI tags isn't known until it's sent
+                headers.append('Content-Length: %d' % len(self.data))
+            headers.append('Content-Type: ' + self.content_type)
+            if self.encoding:
+                headers.append('Content-Encoding: ' + self.encoding)
+        if not self.cacheable():
+            headers.append('Cache-Control: no-cache')
+        else:
+            headers.append('Cache-Control: public, max-age=%d' % max_age)
+            headers.append('ETag: "%s"' % self.etag)
+            if self.encoding:
+                headers.append('Vary: Accept-Encoding')
+        return ('\r\n'.join(headers) + '\r\n\r\n').encode()
+
+
+def ident(name):
+    return 'data_' + re.sub('[^A-Za-z0-9]', '_', name)
+
+
+def c_bytes(data):
+    lines = []
+    for i in range(0, len(data), 16):
+        lines.append(''.join('0x%02x,' % b for b in data[i:i + 16]))
+    return '\n'.join(lines)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Generate lwIP httpd fsdata with compressed, cacheable content')
+    parser.add_argument('-r', '--root', required=True, help='content directory, file names are relative to this')
+    parser.add_argument('-o', '--output', required=True, help='output file')
+    parser.add_argument('--max-age', type=int, default=31536000,
+                        help='seconds the browser can cache static files for (default %(default)s)')
+    parser.add_argument('--no-compress', action='store_true', help="don't compress static files")
+    parser.add_argument('files', nargs='+')
+    args = parser.parse_args()
+
+    files = [File(args.root, path) for path in args.files]
+
+    # Static files are finished first, so pages can refer to them by etag
+    for file in files:
+        if not file.page:
+            if not args.no_compress:
+                file.compress()
+            file.etag = hashlib.sha256(file.data).hexdigest()[:16]
+    for file in files:
+        if file.page:
+            for asset in files:
+                if asset.etag:
+                    for quote in (b'"', b"'"):
+                        file.data = file.data.replace(quote + asset.name.encode() + quote,
+                                                      quote + asset.name.encode() + b'?v=' + asset.etag.encode() + quote)
+            if not args.no_compress:
+                file.compress()
+
+    out = ['/* Generated by makefsdata.py, do not edit */',
+           '#include "lwip/apps/fs.h"',
+           '#include "lwip/def.h"',
+           '',
+           '#define file_NULL (struct fsdata_file *) NULL',
+           '',
+           '#ifndef FS_FILE_FLAGS_SSI',
+           '#define FS_FILE_FLAGS_SSI 0x08',
+           '#endif',
+           '#ifndef FSDATA_ALIGN_PRE',
+           '#define FSDATA_ALIGN_PRE',
+           '#endif',
+           '#ifndef FSDATA_ALIGN_POST',
+           '#define FSDATA_ALIGN_POST',
+           '#endif',
+           '']
+    entries = []
+    for file in files:
+        entries.append((file.name, file.headers(args.max_age) + file.data, file.ssi))
+        if file.cacheable():
+            # The name has a space in it, which can't be in a request, so only pico_httpd.c can open it
+            entries.append(('%s %s' % (file.name, file.etag), file.headers(args.max_age, not_modified=True), False))
+        print('%s: %d bytes%s' % (file.name, len(file.data), ', ' + file.encoding if file.encoding else ''))
+
+    prev = 'file_NULL'
+    total = 0
+    for file_name, data, ssi in entries:
+        # The name is padded so the headers and data are aligned
+        name = file_name.encode() + b'\0'
+        name += b'\0' * (-len(name) % 4)
+        headers = data[:data.index(b'\r\n\r\n') + 4]
+        out.append('static const unsigned char FSDATA_ALIGN_PRE %s[] FSDATA_ALIGN_POST = {' % ident(file_name))
+        out.append('/* %s (%d chars) */' % (file_name, len(name)))
+        out.append(c_bytes(name))
+        out.append('/* HTTP header */')
+        out.append('/* "%s" */' % headers.decode().replace('\r\n', '\\r\\n" "').replace('*/', '* /'))
+        out.append(c_bytes(data))
+        out.append('};')
+        out.append('')
+        ident_file = 'file_' + re.sub('[^A-Za-z0-9]', '_', file_name)
+        out.append('const struct fsdata_file %s[] = { {' % ident_file)
+        out.append('%s,' % prev)
+        out.append('%s,' % ident(file_name))
+        out.append('%s + %d,' % (ident(file_name), len(name)))
+        out.append('sizeof(%s) - %d,' % (ident(file_name), len(name)))
+        out.append('FS_FILE_FLAGS_HEADER_INCLUDED | FS_FILE_FLAGS_HEADER_PERSISTENT%s,' %
+                   (' | FS_FILE_FLAGS_SSI' if ssi else ''))
+        out.append('}};')
+        out.append('')
+        prev = ident_file
+        total += len(data)
+    out.append('#define FS_ROOT %s' % prev)
+    out.append('#define FS_NUMFILES %d' % len(entries))
+    out.append('')
+
+    with open(args.output, 'w') as f:
+        f.write('\n'.join(out))
+    print('%d files, %d bytes' % (len(files), total))
+
+
+if __name__ == '__main__':
+    main()
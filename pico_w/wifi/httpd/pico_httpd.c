@@ -11,6 +11,8 @@
 #include "lwip/apps/mdns.h"
 #include "lwip/init.h"
 #include "lwip/apps/httpd.h"
+#include "lwip/apps/fs.h"
+#include "lwip/tcp.h"
 
 void httpd_init(void);
 
@@ -60,12 +62,60 @@ static tCGI cgi_handlers[] = {
     { "/index.shtml", cgi_handler_test },
 };
 
-// Note that the buffer size is limited by LWIP_HTTPD_MAX_TAG_INSERT_LEN, so use LWIP_HTTPD_SSI_MULTIPART to return larger amounts of data
-u16_t ssi_example_ssi_handler(int iIndex, char *pcInsert, int iInsertLen
-#if LWIP_HTTPD_SSI_MULTIPART
-    , uint16_t current_tag_part, uint16_t *next_tag_part
-#endif
-) {
+// Be aware of LWIP_HTTPD_MAX_TAG_NAME_LEN
+static const char *ssi_tags[] = {
+    "status",
+    "welcome",
+    "uptime",
+    "ledstate",
+    "ledinv",
+    "table",
+};
+
+// Where the value of each tag comes from. A tag is only rendered again when the generation of its source changes
+enum {
+    SSI_SOURCE_CONST,
+    SSI_SOURCE_UPTIME,
+    SSI_SOURCE_LED,
+    SSI_SOURCE_COUNT
+};
+
+static const uint8_t ssi_tag_sources[] = {
+    SSI_SOURCE_CONST, // "status"
+    SSI_SOURCE_CONST, // "welcome"
+    SSI_SOURCE_UPTIME, // "uptime"
+    SSI_SOURCE_LED, // "ledstate"
+    SSI_SOURCE_LED, // "ledinv"
+    SSI_SOURCE_CONST, // "table"
+};
+static_assert(count_of(ssi_tag_sources) == count_of(ssi_tags), "");
+
+#define SSI_TAG_TABLE 5
+#define SSI_TAG_VALUE_LEN 24
+
+// Incremented whenever led_on changes
+static uint32_t led_generation = 1;
+
+static uint32_t ssi_generation(int source) {
+    switch (source) {
+        case SSI_SOURCE_UPTIME:
+            return (uint32_t)(absolute_time_diff_us(wifi_connected_time, get_absolute_time()) / 1000000) + 1;
+        case SSI_SOURCE_LED:
+            return led_generation;
+        default:
+            return 1;
+    }
+}
+
+typedef struct ssi_tag_cache {
+    uint32_t generation; // zero if never rendered
+    u16_t len;
+    char value[SSI_TAG_VALUE_LEN];
+} ssi_tag_cache_t;
+
+static ssi_tag_cache_t ssi_tag_cache[count_of(ssi_tags)];
+
+static u16_t ssi_render_tag(int iIndex, char *pcInsert, int iInsertLen) {
     size_t printed;
     switch (iIndex) {
         case 0: { // "status"
@@ -89,33 +139,45 @@ u16_t ssi_example_ssi_handler(int iIndex, char *pcInsert, int iInsertLen
             printed = snprintf(pcInsert, iInsertLen, "%s", led_on ? "OFF" : "ON");
             break;
         }
-#if LWIP_HTTPD_SSI_MULTIPART
-        case 5: { /* "table" */
-            printed = snprintf(pcInsert, iInsertLen, "<tr><td>This is table row number %d</td></tr>", current_tag_part + 1);
-            // Leave "next_tag_part" unchanged to indicate that all data has been returned for this tag
-            if (current_tag_part < 9) {
-                *next_tag_part = current_tag_part + 1;
-            }
-            break;
-        }
-#endif
         default: { // unknown tag
             printed = 0;
             break;
         }
     }
-  return (u16_t)printed;
+    return (u16_t)MIN(printed, (size_t)iInsertLen - 1);
 }
 
-// Be aware of LWIP_HTTPD_MAX_TAG_NAME_LEN
-static const char *ssi_tags[] = {
-    "status",
-    "welcome",
-    "uptime",
-    "ledstate",
-    "ledinv",
-    "table",
-};
+// Note that the buffer size is limited by LWIP_HTTPD_MAX_TAG_INSERT_LEN, so use LWIP_HTTPD_SSI_MULTIPART to return larger amounts of data
+u16_t ssi_example_ssi_handler(int iIndex, char *pcInsert, int iInsertLen
+#if LWIP_HTTPD_SSI_MULTIPART
+    , uint16_t current_tag_part, uint16_t *next_tag_part
+#endif
+) {
+#if LWIP_HTTPD_SSI_MULTIPART
+    if (iIndex == SSI_TAG_TABLE) { /* "table" */
+        size_t printed = snprintf(pcInsert, iInsertLen, "<tr><td>This is table row number %d</td></tr>", current_tag_part + 1);
+        // Leave "next_tag_part" unchanged to indicate that all data has been returned for this tag
+        if (current_tag_part < 9) {
+            *next_tag_part = current_tag_part + 1;
+        }
+        return (u16_t)printed;
+    }
+#endif
+    if (iIndex < 0 || iIndex >= count_of(ssi_tags)) {
+        return 0;
+    }
+
+    // Use the last value of the tag if its source hasn't changed
+    ssi_tag_cache_t *tag = &ssi_tag_cache[iIndex];
+    uint32_t generation = ssi_generation(ssi_tag_sources[iIndex]);
+    if (tag->generation != generation) {
+        tag->len = ssi_render_tag(iIndex, tag->value, sizeof(tag->value));
+        tag->generation = generation;
+    }
+    u16_t len = MIN(tag->len, iInsertLen);
+    memcpy(pcInsert, tag->value, len);
+    return len;
+}
 
 #if LWIP_HTTPD_SUPPORT_POST
 #define LED_STATE_BUFSIZE 4
@@ -164,7 +226,11 @@ err_t httpd_post_receive_data(void *connection, struct pbuf *p) {
         char buf[LED_STATE_BUFSIZE];
         char *val = httpd_param_value(p, "led_state=", buf, sizeof(buf));
         if (val) {
-            led_on = (strcmp(val, "ON") == 0) ? true : false;
+            bool new_led_on = (strcmp(val, "ON") == 0) ? true : false;
+            if (new_led_on != led_on) {
+                led_on = new_led_on;
+                led_generation++;
+            }
             cyw43_gpio_set(&cyw43_state, 0, led_on);
             ret = ERR_OK;
         }
@@ -182,6 +248,293 @@ void httpd_post_finished(void *connection, char *response_uri, u16_t response_ur
 }
 #endif
 
+#if LWIP_HTTPD_CUSTOM_FILES
+// Pages with SSI tags are assembled once and then served as they are until the source of one of their tags changes.
+// A page is left to httpd's SSI parser if it doesn't fit or uses a tag we can't expand here
+#define SSI_PAGE_CACHE_COUNT 3
+#define SSI_PAGE_CACHE_SIZE 1024
+#define SSI_PAGE_NAME_LEN 24
+#define SSI_PAGE_UNCACHED_COUNT 4
+#define SSI_LEAD_IN "<!--#"
+#define SSI_LEAD_OUT "-->"
+#define HTTP_CONTENT_LENGTH "Content-Length: %d\r\n\r\n"
+
+typedef struct ssi_page {
+    char name[SSI_PAGE_NAME_LEN]; // empty if unused
+    uint32_t generations[SSI_SOURCE_COUNT]; // of the sources when the page was assembled
+    uint32_t sources; // bit mask of the sources used by the page
+    uint32_t last_used;
+    int users; // connections sending the page, it can't be assembled again until this is zero
+    int len;
+    char data[SSI_PAGE_CACHE_SIZE];
+} ssi_page_t;
+
+// One page more than is cached, which a page is assembled into so a cached one is only replaced if that works
+static ssi_page_t ssi_page_cache[SSI_PAGE_CACHE_COUNT + 1];
+static int ssi_page_spare = SSI_PAGE_CACHE_COUNT;
+static uint32_t ssi_page_use_count;
+static bool fs_open_custom_nested; // while fs_open is looking for one of our files in the file system
+
+// Pages that couldn't be assembled, which are left to httpd rather than tried again
+static char ssi_page_uncached[SSI_PAGE_UNCACHED_COUNT][SSI_PAGE_NAME_LEN];
+static uint ssi_page_uncached_next;
+
+// makefsdata.py adds a 304 response for each static file, named "<file> <etag>"
+#define HTTP_ETAG_LEN 16
+#define HTTP_IF_NONE_MATCH "\r\nIf-None-Match: \""
+#define HTTP_NOT_MODIFIED_NAME_LEN 64
+
+// The etag in the segment lwIP is handling, httpd opens the file while it does if the request is complete
+static char http_if_none_match[HTTP_ETAG_LEN + 1];
+
+err_t pico_httpd_tcp_inpacket(struct tcp_pcb *pcb, struct tcp_hdr *hdr, u16_t optlen, u16_t opt1len, u8_t *opt2,
+                              struct pbuf *p) {
+    http_if_none_match[0] = 0;
+    if (pcb->local_port == HTTPD_SERVER_PORT) {
+        u16_t pos = pbuf_memfind(p, HTTP_IF_NONE_MATCH, sizeof(HTTP_IF_NONE_MATCH) - 1, 0);
+        char etag[HTTP_ETAG_LEN + 1];
+        if (pos != 0xFFFF && pbuf_copy_partial(p, etag, sizeof(etag), pos + sizeof(HTTP_IF_NONE_MATCH) - 1) == sizeof(etag) &&
+            etag[HTTP_ETAG_LEN] == '"') {
+            memcpy(http_if_none_match, etag, HTTP_ETAG_LEN);
+            http_if_none_match[HTTP_ETAG_LEN] = 0;
+        }
+    }
+    return ERR_OK;
+}
+
+// Send a 304 if the browser already has this version of a static file
+static bool http_open_not_modified(struct fs_file *file, const char *name) {
+    char not_modified[HTTP_NOT_MODIFIED_NAME_LEN];
+    if (!http_if_none_match[0] ||
+        snprintf(not_modified, sizeof(not_modified), "%s %s", name, http_if_none_match) >= sizeof(not_modified)) {
+        return false;
+    }
+    http_if_none_match[0] = 0;
+    fs_open_custom_nested = true;
+    err_t err = fs_open(file, not_modified);
+    fs_open_custom_nested = false;
+    return err == ERR_OK;
+}
+
+static bool ssi_page_current(const ssi_page_t *page) {
+    for (int source = 0; source < SSI_SOURCE_COUNT; source++) {
+        if ((page->sources & (1u << source)) && page->generations[source] != ssi_generation(source)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Expand the tags in a page into buf, returning its length or -1 if it can't be done here
+static int ssi_page_expand(ssi_page_t *page, const char *in, int in_len, char *buf, int buf_len) {
+    const char *in_end = in + in_len;
+    int len = 0;
+    while (in < in_end) {
+        const char *tag = memchr(in, SSI_LEAD_IN[0], in_end - in);
+        bool is_tag = tag && in_end - tag >= sizeof(SSI_LEAD_IN) - 1 && memcmp(tag, SSI_LEAD_IN, sizeof(SSI_LEAD_IN) - 1) == 0;
+        if (!tag) {
+            tag = in_end;
+        } else if (!is_tag) {
+            tag++; // copy up to and including the '<'
+        }
+        if (len + (tag - in) > buf_len) {
+            return -1;
+        }
+        memcpy(buf + len, in, tag - in);
+        len += tag - in;
+        in = tag;
+        if (!is_tag) {
+            continue;
+        }
+
+        // Find the tag in our list
+        const char *name = in + sizeof(SSI_LEAD_IN) - 1;
+        const char *name_end = name;
+        while (name_end < in_end && *name_end != '-' && *name_end != ' ') {
+            name_end++;
+        }
+        const char *end = name_end;
+        while (end < in_end && *end == ' ') {
+            end++;
+        }
+        if (in_end - end < sizeof(SSI_LEAD_OUT) - 1 || memcmp(end, SSI_LEAD_OUT, sizeof(SSI_LEAD_OUT) - 1) != 0) {
+            return -1;
+        }
+        int index = -1;
+        for (int i = 0; i < count_of(ssi_tags); i++) {
+            if (strlen(ssi_tags[i]) == name_end - name && memcmp(ssi_tags[i], name, name_end - name) == 0) {
+                index = i;
+                break;
+            }
+        }
+        if (index < 0) {
+            return -1;
+        }
+        page->sources |= 1u << ssi_tag_sources[index];
+
+        // Insert the value the same way httpd would, in parts if need be
+        char value[LWIP_HTTPD_MAX_TAG_INSERT_LEN];
+#if LWIP_HTTPD_SSI_MULTIPART
+        uint16_t part = 0;
+        do {
+            uint16_t next_part = HTTPD_LAST_TAG_PART;
+            u16_t value_len = ssi_example_ssi_handler(index, value, sizeof(value), part, &next_part);
+#else
+        {
+            u16_t value_len = ssi_example_ssi_handler(index, value, sizeof(value));
+#endif
+            if (len + value_len > buf_len) {
+                return -1;
+            }
+            memcpy(buf + len, value, value_len);
+            len += value_len;
+#if LWIP_HTTPD_SSI_MULTIPART
+            part = next_part;
+        } while (part != HTTPD_LAST_TAG_PART);
+#else
+        }
+#endif
+        in = end + sizeof(SSI_LEAD_OUT) - 1;
+    }
+    return len;
+}
+
+// Assemble a page with SSI tags from the file system. Returns false if it isn't one or can't be assembled here
+static bool ssi_page_assemble(ssi_page_t *page, const struct fs_file *file, const char *name) {
+    const char *headers_end = NULL;
+    for (const char *c = file->data; c + 4 <= file->data + file->len; c++) {
+        if (memcmp(c, "\r\n\r\n", 4) == 0) {
+            headers_end = c + 2;
+            break;
+        }
+    }
+    if (!headers_end) {
+        return false;
+    }
+
+    // The page's own headers without a length, as it could change, so add one. The body goes after room for them
+    int headers_len = headers_end - file->data;
+    int body_offset = headers_len + sizeof(HTTP_CONTENT_LENGTH) + 8;
+    if (body_offset >= sizeof(page->data)) {
+        return false;
+    }
+    page->sources = 0;
+    int body_len = ssi_page_expand(page, headers_end + 2, file->data + file->len - (headers_end + 2),
+        page->data + body_offset, sizeof(page->data) - body_offset);
+    if (body_len < 0) {
+        return false;
+    }
+    memcpy(page->data, file->data, headers_len);
+    int len = headers_len + snprintf(page->data + headers_len, body_offset - headers_len, HTTP_CONTENT_LENGTH, body_len);
+    memmove(page->data + len, page->data + body_offset, body_len);
+    page->len = len + body_len;
+    snprintf(page->name, sizeof(page->name), "%s", name);
+    for (int source = 0; source < SSI_SOURCE_COUNT; source++) {
+        page->generations[source] = ssi_generation(source);
+    }
+    return true;
+}
+
+static bool ssi_page_is_uncached(const char *name) {
+    for (int i = 0; i < SSI_PAGE_UNCACHED_COUNT; i++) {
+        if (strcmp(ssi_page_uncached[i], name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Look a page up in the cache, assembling it again if it's out of date or not there
+static ssi_page_t *ssi_page_get(const char *name) {
+    ssi_page_t *page = NULL;
+    for (int i = 0; i < count_of(ssi_page_cache); i++) {
+        ssi_page_t *p = &ssi_page_cache[i];
+        if (i != ssi_page_spare && p->name[0] && strcmp(p->name, name) == 0 && (!page || ssi_page_current(p))) {
+            page = p;
+        }
+    }
+    if (page && ssi_page_current(page)) {
+        return page;
+    }
+    if (ssi_page_is_uncached(name)) {
+        return NULL;
+    }
+
+    // Only files makefsdata.py found tags in are worth assembling, anything else is left to httpd untouched
+    struct fs_file file;
+    fs_open_custom_nested = true;
+    err_t err = fs_open(&file, name);
+    fs_open_custom_nested = false;
+    if (err != ERR_OK) {
+        return NULL;
+    }
+    if (!(file.flags & FS_FILE_FLAGS_SSI) || !(file.flags & FS_FILE_FLAGS_HEADER_INCLUDED)) {
+        fs_close(&file);
+        return NULL;
+    }
+
+    // Replace the out of date copy if no one is sending it, otherwise an empty slot or the least recently used one
+    ssi_page_t *slot = NULL;
+    if (page && !page->users) {
+        slot = page;
+    } else {
+        for (int i = 0; i < count_of(ssi_page_cache); i++) {
+            ssi_page_t *p = &ssi_page_cache[i];
+            if (i != ssi_page_spare && !p->users &&
+                (!slot || !p->name[0] || (slot->name[0] && p->last_used < slot->last_used))) {
+                slot = p;
+            }
+        }
+    }
+
+    // Assemble it in the spare page, and only then give up the slot
+    bool assembled = slot && ssi_page_assemble(&ssi_page_cache[ssi_page_spare], &file, name);
+    fs_close(&file);
+    if (!assembled) {
+        if (slot) {
+            snprintf(ssi_page_uncached[ssi_page_uncached_next], SSI_PAGE_NAME_LEN, "%s", name);
+            ssi_page_uncached_next = (ssi_page_uncached_next + 1) % SSI_PAGE_UNCACHED_COUNT;
+        }
+        return NULL;
+    }
+    page = &ssi_page_cache[ssi_page_spare];
+    slot->name[0] = 0;
+    ssi_page_spare = slot - ssi_page_cache;
+    return page;
+}
+
+int fs_open_custom(struct fs_file *file, const char *name) {
+    if (fs_open_custom_nested) {
+        return 0;
+    }
+    if (http_open_not_modified(file, name)) {
+        return 1;
+    }
+    if (strlen(name) >= SSI_PAGE_NAME_LEN) {
+        return 0;
+    }
+    ssi_page_t *page = ssi_page_get(name);
+    if (!page) {
+        return 0;
+    }
+    page->users++;
+    page->last_used = ++ssi_page_use_count;
+    file->data = page->data;
+    file->len = page->len;
+    file->index = page->len;
+    file->pextension = page;
+    file->flags = FS_FILE_FLAGS_HEADER_INCLUDED;
+    return 1;
+}
+
+void fs_close_custom(struct fs_file *file) {
+    ssi_page_t *page = (ssi_page_t *)file->pextension;
+    if (page) {
+        page->users--;
+    }
+}
+#endif
+
 int main() {
     stdio_init_all();
     if (cyw43_arch_init()) {
@@ -222,7 +575,9 @@ int main() {
 #endif
     cyw43_arch_lwip_end();
 #endif
-    // setup http server
+    // setup http server. The content is built by makefsdata.py with its headers, static files
+    // are sent compressed with an etag and can be cached by the browser, which gets a 304 when it
+    // asks whether its copy is still current. Pages are never cached
     cyw43_arch_lwip_begin();
     httpd_init();
     http_set_cgi_handlers(cgi_handlers, LWIP_ARRAYSIZE(cgi_handlers));
@@ -0,0 +1,22 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _PICO_HTTPD_HOOKS_H
+#define _PICO_HTTPD_HOOKS_H
+
+// lwIP hooks used by pico_httpd.c, see LWIP_HOOK_FILENAME in lwipopts.h
+
+struct tcp_pcb;
+struct tcp_hdr;
+struct pbuf;
+
+// httpd doesn't pass the request headers on, so look at each segment before lwIP handles it
+err_t pico_httpd_tcp_inpacket(struct tcp_pcb *pcb, struct tcp_hdr *hdr, u16_t optlen, u16_t opt1len, u8_t *opt2,
+                              struct pbuf *p);
+#define LWIP_HOOK_TCP_INPACKET_PCB(pcb, hdr, optlen, opt1len, opt2, p) \
+    pico_httpd_tcp_inpacket(pcb, hdr, optlen, opt1len, opt2, p)
+
+#endif
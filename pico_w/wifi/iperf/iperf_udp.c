@@ -0,0 +1,325 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/time.h"
+#include "lwip/udp.h"
+#include "lwip/def.h"
+
+#include "iperf_udp.h"
+
+#define DEBUG_printf(...)
+
+// Most datagrams a client sends at once when it's behind
+#define IPERF_UDP_MAX_BURST 8
+// The client repeats the end of test datagram until the server sends its report
+#define IPERF_UDP_FIN_TIME_MS 250
+#define IPERF_UDP_MAX_FIN 10
+// How much of the datagram after the header iperf reads as the client header, it's zero for a plain test
+#define IPERF_UDP_CLIENT_HEADER_SIZE 40
+#define IPERF_UDP_HEADER_VERSION1 0x80000000
+
+// Sent at the start of every datagram, in network order. The end of the test is sent with a negative id
+typedef struct iperf_udp_datagram_t_ {
+    int32_t id;
+    uint32_t tv_sec;
+    uint32_t tv_usec;
+} iperf_udp_datagram_t;
+
+// Sent by the server after the datagram header at the end of the test, in network order
+typedef struct iperf_udp_server_report_t_ {
+    int32_t flags;
+    int32_t total_len1;
+    int32_t total_len2;
+    int32_t stop_sec;
+    int32_t stop_usec;
+    int32_t error_cnt;
+    int32_t outorder_cnt;
+    int32_t datagrams;
+    int32_t jitter1;
+    int32_t jitter2;
+} iperf_udp_server_report_t;
+
+// Print a line like iperf does
+static void iperf_udp_print(const iperf_udp_t *iperf, uint64_t from_us, uint64_t to_us, const iperf_udp_stats_t *stats,
+                            uint32_t jitter_us, bool server) {
+    float secs = (to_us - from_us) / 1e6f;
+    printf("[%3s] %4.1f-%4.1f sec %8.1f KBytes %6.2f Mbits/sec", iperf->client ? "TX" : "RX",
+           (from_us - iperf->start_us) / 1e6f, (to_us - iperf->start_us) / 1e6f, stats->bytes / 1024.0f,
+           secs > 0 ? stats->bytes * 8 / secs / 1e6f : 0.0f);
+    if (server) {
+        uint32_t lost = stats->lost > stats->out_of_order ? stats->lost - stats->out_of_order : 0;
+        printf(" %7.3f ms %5u/%6u (%.2g%%)", jitter_us / 1000.0f, lost, stats->datagrams,
+               stats->datagrams ? 100.0f * lost / stats->datagrams : 0.0f);
+        if (stats->out_of_order) {
+            printf(" %u out of order", stats->out_of_order);
+        }
+    }
+    printf("\n");
+}
+
+static uint32_t iperf_udp_jitter_us(const iperf_udp_t *iperf) {
+    return iperf->jitter >> 4;
+}
+
+static void iperf_udp_interval(iperf_udp_t *iperf, uint64_t now_us) {
+    if (now_us - iperf->interval_start_us < IPERF_UDP_INTERVAL_MS * 1000ull) {
+        return;
+    }
+    iperf_udp_print(iperf, iperf->interval_start_us, now_us, &iperf->interval, iperf_udp_jitter_us(iperf), !iperf->client);
+    memset(&iperf->interval, 0, sizeof(iperf->interval));
+    iperf->interval_start_us = now_us;
+}
+
+static void iperf_udp_reply_report(iperf_udp_t *iperf, const iperf_udp_datagram_t *fin, const ip_addr_t *addr, u16_t port) {
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, sizeof(iperf_udp_datagram_t) + sizeof(iperf_udp_server_report_t), PBUF_RAM);
+    if (!p) {
+        return;
+    }
+    memcpy(p->payload, fin, sizeof(*fin));
+    iperf_udp_server_report_t *report = (iperf_udp_server_report_t *)((uint8_t *)p->payload + sizeof(*fin));
+    uint64_t stop_us = iperf->last_us - iperf->start_us;
+    uint32_t jitter_us = iperf_udp_jitter_us(iperf);
+    uint32_t lost = iperf->total.lost > iperf->total.out_of_order ? iperf->total.lost - iperf->total.out_of_order : 0;
+    report->flags = lwip_htonl(IPERF_UDP_HEADER_VERSION1);
+    report->total_len1 = lwip_htonl((uint32_t)(iperf->total.bytes >> 32));
+    report->total_len2 = lwip_htonl((uint32_t)iperf->total.bytes);
+    report->stop_sec = lwip_htonl((uint32_t)(stop_us / 1000000));
+    report->stop_usec = lwip_htonl((uint32_t)(stop_us % 1000000));
+    report->error_cnt = lwip_htonl(lost);
+    report->outorder_cnt = lwip_htonl(iperf->total.out_of_order);
+    report->datagrams = lwip_htonl(iperf->total.datagrams);
+    report->jitter1 = lwip_htonl(jitter_us / 1000000);
+    report->jitter2 = lwip_htonl(jitter_us % 1000000);
+    udp_sendto(iperf->pcb, p, addr, port);
+    pbuf_free(p);
+}
+
+static void iperf_udp_server_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port) {
+    iperf_udp_t *iperf = (iperf_udp_t *)arg;
+    uint64_t now_us = time_us_64();
+    iperf_udp_datagram_t hdr;
+    if (pbuf_copy_partial(p, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        pbuf_free(p);
+        return;
+    }
+    int32_t id = (int32_t)lwip_ntohl(hdr.id);
+    u16_t len = p->tot_len;
+    pbuf_free(p);
+
+    // The end of the test, which the client repeats until it gets our report
+    if (id < 0) {
+        if (iperf->running && ip_addr_cmp(addr, &iperf->remote_addr) && port == iperf->remote_port) {
+            iperf->running = false;
+            iperf->done = true;
+            iperf_udp_interval(iperf, now_us);
+            iperf_udp_print(iperf, iperf->start_us, iperf->last_us, &iperf->total, iperf_udp_jitter_us(iperf), true);
+        }
+        if (iperf->done) {
+            iperf_udp_reply_report(iperf, &hdr, addr, port);
+        }
+        return;
+    }
+
+    if (!iperf->running) {
+        memset(&iperf->total, 0, sizeof(iperf->total));
+        memset(&iperf->interval, 0, sizeof(iperf->interval));
+        ip_addr_copy(iperf->remote_addr, *addr);
+        iperf->remote_port = port;
+        iperf->running = true;
+        iperf->done = false;
+        iperf->packet_id = -1;
+        iperf->jitter = 0;
+        iperf->start_us = iperf->interval_start_us = now_us;
+        printf("UDP test from %s port %u\n", ipaddr_ntoa(addr), port);
+    } else if (!ip_addr_cmp(addr, &iperf->remote_addr) || port != iperf->remote_port) {
+        DEBUG_printf("Ignoring datagram from another client\n");
+        return;
+    }
+
+    // Jitter from the change in transit time, which doesn't need the clocks to be in step
+    int64_t transit_us = (int64_t)(now_us - ((uint64_t)lwip_ntohl(hdr.tv_sec) * 1000000 + lwip_ntohl(hdr.tv_usec)));
+    if (iperf->total.bytes) {
+        int64_t d = transit_us - iperf->last_transit_us;
+        if (d < 0) {
+            d = -d;
+        }
+        iperf->jitter += (uint32_t)d - ((iperf->jitter + 8) >> 4);
+    }
+    iperf->last_transit_us = transit_us;
+
+    // Count gaps in the sequence as lost, which is corrected if they turn up later
+    if (id != iperf->packet_id + 1) {
+        if (id < iperf->packet_id + 1) {
+            iperf->total.out_of_order++;
+            iperf->interval.out_of_order++;
+        } else {
+            iperf->total.lost += id - iperf->packet_id - 1;
+            iperf->interval.lost += id - iperf->packet_id - 1;
+        }
+    }
+    if (id > iperf->packet_id) {
+        iperf->interval.datagrams += id - iperf->packet_id;
+        iperf->packet_id = id;
+        iperf->total.datagrams = id + 1;
+    }
+    iperf->total.bytes += len;
+    iperf->interval.bytes += len;
+    iperf->last_us = now_us;
+    iperf_udp_interval(iperf, now_us);
+}
+
+bool iperf_udp_server_init(iperf_udp_t *iperf, async_context_t *context, u16_t port) {
+    memset(iperf, 0, sizeof(*iperf));
+    iperf->context = context;
+    iperf->pcb = udp_new_ip_type(IPADDR_TYPE_ANY);
+    if (!iperf->pcb) {
+        return false;
+    }
+    if (udp_bind(iperf->pcb, IP_ANY_TYPE, port) != ERR_OK) {
+        udp_remove(iperf->pcb);
+        iperf->pcb = NULL;
+        return false;
+    }
+    udp_recv(iperf->pcb, iperf_udp_server_recv, iperf);
+    return true;
+}
+
+static err_t iperf_udp_send(iperf_udp_t *iperf, int32_t id) {
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, iperf->datagram_size, PBUF_RAM);
+    if (!p) {
+        return ERR_MEM;
+    }
+    uint64_t now_us = time_us_64();
+    iperf_udp_datagram_t *hdr = (iperf_udp_datagram_t *)p->payload;
+    hdr->id = lwip_htonl(id);
+    hdr->tv_sec = lwip_htonl((uint32_t)(now_us / 1000000));
+    hdr->tv_usec = lwip_htonl((uint32_t)(now_us % 1000000));
+    // The rest of the payload doesn't matter, other than the client header being zero
+    memset(hdr + 1, 0, MIN(IPERF_UDP_CLIENT_HEADER_SIZE, iperf->datagram_size - sizeof(*hdr)));
+    err_t err = udp_sendto(iperf->pcb, p, &iperf->remote_addr, iperf->remote_port);
+    pbuf_free(p);
+    return err;
+}
+
+static void iperf_udp_client_work(async_context_t *context, async_at_time_worker_t *worker) {
+    iperf_udp_t *iperf = (iperf_udp_t *)worker->user_data;
+    uint64_t now_us = time_us_64();
+
+    if (iperf->done) {
+        return;
+    }
+    if (!iperf->running) {
+        // Waiting for the server's report
+        if (iperf->fin_count++ >= IPERF_UDP_MAX_FIN) {
+            printf("No report from the server\n");
+            iperf->done = true;
+            return;
+        }
+        iperf_udp_send(iperf, -iperf->packet_id);
+        async_context_add_at_time_worker_in_ms(context, worker, IPERF_UDP_FIN_TIME_MS);
+        return;
+    }
+
+    uint64_t elapsed_us = now_us - iperf->start_us;
+    if (elapsed_us >= iperf->duration_ms * 1000ull) {
+        iperf->running = false;
+        iperf->last_us = now_us;
+        iperf_udp_interval(iperf, now_us);
+        iperf_udp_print(iperf, iperf->start_us, now_us, &iperf->total, 0, false);
+        printf("Sent %d datagrams\n", iperf->packet_id);
+        if (!iperf->packet_id) {
+            // The end of the test is sent as -packet_id, which would look like the first datagram.
+            // The server never saw a test, so there's no report to wait for
+            iperf->done = true;
+            return;
+        }
+        iperf->fin_count = 0;
+        async_context_add_at_time_worker_in_ms(context, worker, 0);
+        return;
+    }
+
+    // Send the datagrams that are due by now, a few at a time so other work isn't held up
+    uint64_t bits_per_datagram = 8ull * iperf->datagram_size;
+    int64_t due = (int64_t)(elapsed_us * iperf->rate_bps / (bits_per_datagram * 1000000)) + 1;
+    for (int i = 0; i < IPERF_UDP_MAX_BURST && iperf->packet_id < due; i++) {
+        if (iperf_udp_send(iperf, iperf->packet_id) != ERR_OK) {
+            break; // try again next time
+        }
+        iperf->packet_id++;
+        iperf->total.bytes += iperf->datagram_size;
+        iperf->interval.bytes += iperf->datagram_size;
+    }
+    iperf_udp_interval(iperf, now_us);
+
+    // Come back when the next one is due
+    uint64_t next_us = iperf->start_us + iperf->packet_id * bits_per_datagram * 1000000 / iperf->rate_bps;
+    async_context_add_at_time_worker_at(context, worker, from_us_since_boot(MAX(next_us, now_us)));
+}
+
+static void iperf_udp_client_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port) {
+    iperf_udp_t *iperf = (iperf_udp_t *)arg;
+    iperf_udp_server_report_t report;
+    if (!iperf->running && !iperf->done &&
+        pbuf_copy_partial(p, &report, sizeof(report), sizeof(iperf_udp_datagram_t)) == sizeof(report) &&
+        (lwip_ntohl(report.flags) & IPERF_UDP_HEADER_VERSION1)) {
+        iperf->done = true;
+        async_context_remove_at_time_worker(iperf->context, &iperf->worker);
+
+        // Print the server's view of the test
+        iperf_udp_stats_t stats = {
+            .bytes = (uint64_t)lwip_ntohl(report.total_len1) << 32 | lwip_ntohl(report.total_len2),
+            .datagrams = lwip_ntohl(report.datagrams),
+            .lost = lwip_ntohl(report.error_cnt),
+        };
+        uint64_t stop_us = (uint64_t)lwip_ntohl(report.stop_sec) * 1000000 + lwip_ntohl(report.stop_usec);
+        uint32_t jitter_us = lwip_ntohl(report.jitter1) * 1000000 + lwip_ntohl(report.jitter2);
+        printf("Server report:\n");
+        iperf_udp_print(iperf, iperf->start_us, iperf->start_us + stop_us, &stats, jitter_us, true);
+        if (lwip_ntohl(report.outorder_cnt)) {
+            printf("%u datagrams received out of order\n", (unsigned)lwip_ntohl(report.outorder_cnt));
+        }
+    }
+    pbuf_free(p);
+}
+
+bool iperf_udp_client_init(iperf_udp_t *iperf, async_context_t *context, const ip_addr_t *addr, u16_t port,
+                           uint32_t rate_bps, uint16_t datagram_size, uint32_t duration_s) {
+    memset(iperf, 0, sizeof(*iperf));
+    iperf->context = context;
+    iperf->client = true;
+    ip_addr_copy(iperf->remote_addr, *addr);
+    iperf->remote_port = port;
+    iperf->rate_bps = rate_bps;
+    iperf->datagram_size = MAX(datagram_size, sizeof(iperf_udp_datagram_t) + sizeof(iperf_udp_server_report_t));
+    iperf->duration_ms = duration_s * 1000;
+    iperf->pcb = udp_new_ip_type(IPADDR_TYPE_ANY);
+    if (!iperf->pcb) {
+        return false;
+    }
+    udp_recv(iperf->pcb, iperf_udp_client_recv, iperf);
+
+    printf("Sending UDP to %s port %u at %u bits/sec in %u byte datagrams\n", ipaddr_ntoa(addr), port,
+           (unsigned)rate_bps, iperf->datagram_size);
+    iperf->running = true;
+    iperf->start_us = iperf->interval_start_us = time_us_64();
+    iperf->worker.do_work = iperf_udp_client_work;
+    iperf->worker.user_data = iperf;
+    async_context_add_at_time_worker_in_ms(context, &iperf->worker, 0);
+    return true;
+}
+
+void iperf_udp_deinit(iperf_udp_t *iperf) {
+    if (iperf->client) {
+        async_context_remove_at_time_worker(iperf->context, &iperf->worker);
+    }
+    if (iperf->pcb) {
+        udp_remove(iperf->pcb);
+        iperf->pcb = NULL;
+    }
+}
@@ -0,0 +1,65 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _IPERF_UDP_H_
+#define _IPERF_UDP_H_
+
+#include "pico/async_context.h"
+#include "lwip/ip_addr.h"
+
+// UDP tests compatible with iperf 2, e.g. "iperf -s -u -i 1" or "iperf -c <pico> -u -b 1M -i 1"
+
+#define IPERF_UDP_DEFAULT_PORT 5001
+#define IPERF_UDP_DEFAULT_DATAGRAM_SIZE 1470
+#define IPERF_UDP_DEFAULT_RATE_BPS 1000000
+#define IPERF_UDP_INTERVAL_MS 1000
+
+typedef struct iperf_udp_stats_t_ {
+    uint64_t bytes;
+    uint32_t datagrams; // expected, from the sequence numbers
+    uint32_t lost;
+    uint32_t out_of_order;
+} iperf_udp_stats_t;
+
+typedef struct iperf_udp_t_ {
+    struct udp_pcb *pcb;
+    async_context_t *context;
+    async_at_time_worker_t worker;
+    ip_addr_t remote_addr;
+    u16_t remote_port;
+    bool client;
+    bool running;
+    bool done;
+
+    // client settings
+    uint32_t rate_bps;
+    uint16_t datagram_size;
+    uint32_t duration_ms;
+    int fin_count;
+
+    // progress of the test
+    int32_t packet_id;
+    uint64_t start_us;
+    uint64_t last_us;
+    uint64_t interval_start_us;
+    iperf_udp_stats_t total;
+    iperf_udp_stats_t interval;
+
+    // jitter as in RFC 1889, in 1/16 us
+    uint32_t jitter;
+    int64_t last_transit_us;
+} iperf_udp_t;
+
+// Receive a test from an iperf client, printing the jitter and loss every interval and at the end
+bool iperf_udp_server_init(iperf_udp_t *iperf, async_context_t *context, u16_t port);
+
+// Send to an iperf server at rate_bps for duration_s, then print the server's report
+bool iperf_udp_client_init(iperf_udp_t *iperf, async_context_t *context, const ip_addr_t *addr, u16_t port,
+                           uint32_t rate_bps, uint16_t datagram_size, uint32_t duration_s);
+
+void iperf_udp_deinit(iperf_udp_t *iperf);
+
+#endif
@@ -11,6 +11,8 @@
 #include "lwip/ip4_addr.h"
 #include "lwip/apps/lwiperf.h"
 
+#include "iperf_udp.h"
+
 #ifndef USE_LED
 #define USE_LED 1
 #endif
@@ -19,6 +21,25 @@
 #error IPERF_SERVER_IP not defined
 #endif
 
+// Define IPERF_UDP=1 to test with UDP, which reports jitter and loss, e.g. "iperf -c <pico> -u -b 10M -i 1"
+#ifndef IPERF_UDP
+#define IPERF_UDP 0
+#endif
+
+#if IPERF_UDP
+// Settings for the client, the server gets these from the client
+#ifndef IPERF_UDP_RATE
+#define IPERF_UDP_RATE IPERF_UDP_DEFAULT_RATE_BPS
+#endif
+#ifndef IPERF_UDP_SIZE
+#define IPERF_UDP_SIZE IPERF_UDP_DEFAULT_DATAGRAM_SIZE
+#endif
+#ifndef IPERF_UDP_DURATION_S
+#define IPERF_UDP_DURATION_S 10
+#endif
+static iperf_udp_t iperf_udp;
+#endif
+
 #if USE_LED
 // Invert led
 static void led_worker_fn(async_context_t *context, async_at_time_worker_t *worker) {
@@ -30,6 +51,7 @@ static void led_worker_fn(async_context_t *context, async_at_time_worker_t *work
 }
 #endif
 
+#if !IPERF_UDP
 // Report IP results and exit
 static void iperf_report(void *arg, enum lwiperf_report_type report_type,
                          const ip_addr_t *local_addr, u16_t local_port, const ip_addr_t *remote_addr, u16_t remote_port,
@@ -46,6 +68,7 @@ static void iperf_report(void *arg, enum lwiperf_report_type report_type,
     printf("packets in %u packets out %u\n", CYW43_STAT_GET(PACKET_IN_COUNT), CYW43_STAT_GET(PACKET_OUT_COUNT));
 #endif
 }
+#endif
 
 // Note: This is called from an interrupt handler
 void key_pressed_func(void *param) {
@@ -74,7 +97,20 @@ int main() {
     }
 
     cyw43_arch_lwip_begin();
-#if CLIENT_TEST
+#if IPERF_UDP && CLIENT_TEST
+    printf("\nReady, running iperf UDP client\n");
+    ip_addr_t clientaddr;
+    ip4_addr_set_u32(&clientaddr, ipaddr_addr(xstr(IPERF_SERVER_IP)));
+    if (!iperf_udp_client_init(&iperf_udp, cyw43_arch_async_context(), &clientaddr, IPERF_UDP_DEFAULT_PORT,
+                               IPERF_UDP_RATE, IPERF_UDP_SIZE, IPERF_UDP_DURATION_S)) {
+        printf("failed to start iperf UDP client\n");
+    }
+#elif IPERF_UDP
+    printf("\nReady, running iperf UDP server at %s\n", ip4addr_ntoa(netif_ip4_addr(netif_list)));
+    if (!iperf_udp_server_init(&iperf_udp, cyw43_arch_async_context(), IPERF_UDP_DEFAULT_PORT)) {
+        printf("failed to start iperf UDP server\n");
+    }
+#elif CLIENT_TEST
     printf("\nReady, running iperf client\n");
     ip_addr_t clientaddr;
     ip4_addr_set_u32(&clientaddr, ipaddr_addr(xstr(IPERF_SERVER_IP)));
@@ -110,6 +146,11 @@ int main() {
         sleep_ms(1000);
 #endif
     }
+#if IPERF_UDP
+    cyw43_arch_lwip_begin();
+    iperf_udp_deinit(&iperf_udp);
+    cyw43_arch_lwip_end();
+#endif
     cyw43_arch_disable_sta_mode();
 
     cyw43_arch_deinit();
@@ -0,0 +1,93 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Encodes some batches of samples with sample_batch.c, for sample_batch_round_trip.py to decode with
+// sample_batch_decode.py. Each batch is printed on a line as
+//   <number of decimals> <payload in hex> <time ms>:<value>...
+// with the samples that were added to it, and so should come back out.
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "sample_batch.h"
+
+typedef struct {
+    uint64_t time_ms;
+    int32_t value;
+} sample_t;
+
+#define COUNT_OF(a) (sizeof(a) / sizeof((a)[0]))
+
+// readings of a tenth of a degree, going down as well as up and below zero
+static const sample_t temperatures[] = {
+    { 1000, 215 }, { 2000, 214 }, { 3000, 214 }, { 4000, 190 }, { 5500, 230 }, { 6500, -40 }, { 7500, -41 },
+    { 7500, 300 },
+};
+
+// the largest changes in value either way, which wrap, and the largest gaps in time
+static const sample_t extremes[] = {
+    { 0, INT32_MIN }, { 0, INT32_MAX }, { 1, INT32_MIN }, { 2, 0 }, { 3, INT32_MAX }, { UINT64_MAX, -1 },
+};
+
+// the first sample at its largest, which takes SAMPLE_BATCH_MAX_SAMPLE_SIZE
+static const sample_t largest[] = {
+    { UINT64_MAX, INT32_MIN },
+};
+
+static void print_batch(const sample_batch_t *batch, uint8_t decimals, const sample_t *samples, int count) {
+    printf("%u ", decimals);
+    for (size_t i = 0; i < batch->len; i++) {
+        printf("%02x", batch->buf[i]);
+    }
+    for (int i = 0; i < count; i++) {
+        printf(" %" PRIu64 ":%" PRId32, samples[i].time_ms, samples[i].value);
+    }
+    printf("\n");
+}
+
+// Returns how many samples fitted in the batch
+static int encode(uint8_t decimals, const sample_t *samples, int count, size_t size) {
+    uint8_t buf[256];
+    sample_batch_t batch;
+    sample_batch_init(&batch, buf, size, decimals);
+    int added = 0;
+    while (added < count && sample_batch_add(&batch, samples[added].time_ms, samples[added].value)) {
+        added++;
+    }
+    print_batch(&batch, decimals, samples, added);
+    return added;
+}
+
+int main(void) {
+    int failures = 0;
+    failures += encode(1, temperatures, COUNT_OF(temperatures), 256) != COUNT_OF(temperatures);
+    failures += encode(0, extremes, COUNT_OF(extremes), 256) != COUNT_OF(extremes);
+    failures += encode(3, largest, COUNT_OF(largest), SAMPLE_BATCH_HEADER_SIZE + SAMPLE_BATCH_MAX_SAMPLE_SIZE) != 1;
+
+    // a full batch of changes of every size, which stops at the first sample that doesn't fit
+    sample_t walk[100];
+    uint32_t seed = 1;
+    uint64_t time_ms = 0;
+    int32_t value = 0;
+    for (int i = 0; i < (int)COUNT_OF(walk); i++) {
+        seed = seed * 1103515245 + 12345;
+        time_ms += seed >> (seed % 32);
+        value = (int32_t)((uint32_t)value + (seed >> (seed % 31)) * (i & 1 ? 1u : -1u));
+        walk[i].time_ms = time_ms;
+        walk[i].value = value;
+    }
+    int added = encode(2, walk, COUNT_OF(walk), 200);
+    failures += added == 0 || added == COUNT_OF(walk);
+
+    // a sample before the last one is refused
+    sample_t backwards[] = { { 2000, 1 }, { 1999, 2 } };
+    failures += encode(0, backwards, COUNT_OF(backwards), 256) != 1;
+
+    if (failures) {
+        fprintf(stderr, "%d batches did not take the expected samples\n", failures);
+    }
+    return failures != 0;
+}
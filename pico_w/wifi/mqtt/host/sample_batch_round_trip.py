@@ -0,0 +1,40 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Checks that sample_batch_decode.py gets back the samples which sample_batch_encode put in each batch
+#   ./sample_batch_round_trip.py build/sample_batch_encode
+#
+
+import os
+import subprocess
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+import sample_batch_decode  # noqa: E402
+
+
+def main():
+    output = subprocess.run(sys.argv[1:2], stdout=subprocess.PIPE, check=True, text=True).stdout
+    batches = 0
+    failures = 0
+    for line in output.splitlines():
+        fields = line.split()
+        decimals = int(fields[0])
+        expected = []
+        for sample in fields[2:]:
+            time_ms, value = sample.split(':')
+            expected.append((int(time_ms), int(value) / 10 ** decimals))
+        decoded = sample_batch_decode.decode(bytes.fromhex(fields[1]))
+        if decoded != expected:
+            print('Batch %s decoded as %s, expected %s' % (fields[1], decoded, expected))
+            failures += 1
+        batches += 1
+    print('%d of %d batches decoded correctly' % (batches - failures, batches))
+    sys.exit(failures != 0 or not batches)
+
+
+if __name__ == '__main__':
+    main()
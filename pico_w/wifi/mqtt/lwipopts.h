@@ -27,7 +27,10 @@
 #define TCP_WND  16384
 #endif // MQTT_CERT_INC
 
-// This defaults to 4
-#define MQTT_REQ_MAX_IN_FLIGHT 5
+// This defaults to 4. Allow for the subscriptions and the window of queued messages (MQTT_QUEUE_WINDOW)
+#define MQTT_REQ_MAX_IN_FLIGHT 10
+
+// This defaults to 256, make room for a window of queued messages
+#define MQTT_OUTPUT_RINGBUF_SIZE 1024
 
 #endif
@@ -7,6 +7,8 @@
 //
 // Created by elliot on 25/05/24.
 //
+#include <math.h>
+
 #include "pico/stdlib.h"
 #include "pico/cyw43_arch.h"
 #include "pico/unique_id.h"
@@ -18,6 +20,9 @@
 #include "lwip/dns.h"
 #include "lwip/altcp_tls.h"
 
+#include "mqtt_queue.h"
+#include "sample_batch.h"
+
 // Temperature
 #ifndef TEMPERATURE_UNITS
 #define TEMPERATURE_UNITS 'C' // Set to 'F' for Fahrenheit
@@ -46,6 +51,10 @@ typedef struct {
     bool connect_done;
     int subscribe_count;
     bool stop_client;
+    mqtt_queue_t queue;
+    sample_batch_t batch;
+    uint64_t batch_start_ms;
+    uint8_t batch_buf[MQTT_QUEUE_MAX_PAYLOAD];
 } MQTT_CLIENT_DATA_T;
 
 #ifndef DEBUG_printf
@@ -64,12 +73,33 @@ typedef struct {
 #define ERROR_printf printf
 #endif
 
+// Readings are published in batches on the /temperature/batch topic, see sample_batch.h.
+// A batch is published when it's full or MQTT_BATCH_TIME_S after its first reading.
+// Set this to 0 to publish each reading as text on the /temperature topic instead
+#ifndef MQTT_BATCH_TIME_S
+#define MQTT_BATCH_TIME_S 60
+#endif
+
 // how often to measure our temperature
-#define TEMP_WORKER_TIME_S 10
+#ifndef TEMP_WORKER_TIME_MS
+#if MQTT_BATCH_TIME_S
+#define TEMP_WORKER_TIME_MS 1000
+#else
+#define TEMP_WORKER_TIME_MS 10000
+#endif
+#endif
+
+// readings are sent in hundredths of a degree
+#define TEMPERATURE_DECIMALS 2
 
 // keep alive in seconds
 #define MQTT_KEEP_ALIVE_S 60
 
+// how long to wait before connecting again after losing the connection
+#ifndef MQTT_RECONNECT_TIME_S
+#define MQTT_RECONNECT_TIME_S 5
+#endif
+
 // qos passed to mqtt_subscribe
 // At most once (QoS 0)
 // At least once (QoS 1)
@@ -92,6 +122,19 @@ typedef struct {
 #define MQTT_UNIQUE_TOPIC 0
 #endif
 
+// Topics published through the queue, which keeps the index of the topic with each message
+enum {
+    QUEUE_TOPIC_TEMPERATURE,
+    QUEUE_TOPIC_TEMPERATURE_BATCH,
+    QUEUE_TOPIC_COUNT
+};
+static char temperature_topic[MQTT_TOPIC_LEN];
+static char temperature_batch_topic[MQTT_TOPIC_LEN];
+static const char *const queue_topics[QUEUE_TOPIC_COUNT] = {
+    [QUEUE_TOPIC_TEMPERATURE] = temperature_topic,
+    [QUEUE_TOPIC_TEMPERATURE_BATCH] = temperature_batch_topic,
+};
+
 /* References for this implementation:
  * raspberry-pi-pico-c-sdk.pdf, Section '4.1.1. hardware_adc'
  * pico-examples/adc/adc_console/adc_console.c */
@@ -139,9 +182,37 @@ static void control_led(MQTT_CLIENT_DATA_T *state, bool on) {
     mqtt_publish(state->mqtt_client_inst, full_topic(state, "/led/state"), message, strlen(message), MQTT_PUBLISH_QOS, MQTT_PUBLISH_RETAIN, pub_request_cb, state);
 }
 
+// Readings are queued in flash and published when the server is reachable
+#if MQTT_BATCH_TIME_S
+static void publish_batch(MQTT_CLIENT_DATA_T *state) {
+    if (!sample_batch_empty(&state->batch)) {
+        INFO_printf("Publishing %d readings in %zu bytes to %s\n", state->batch.count, state->batch.len,
+                    queue_topics[QUEUE_TOPIC_TEMPERATURE_BATCH]);
+        mqtt_queue_add(&state->queue, QUEUE_TOPIC_TEMPERATURE_BATCH, state->batch.buf, state->batch.len);
+        sample_batch_reset(&state->batch);
+    }
+}
+
+static void publish_temperature(MQTT_CLIENT_DATA_T *state) {
+    uint64_t now_ms = time_us_64() / 1000;
+    int32_t temperature = (int32_t)lroundf(read_onboard_temperature(TEMPERATURE_UNITS) * 100);
+    if (sample_batch_empty(&state->batch)) {
+        state->batch_start_ms = now_ms;
+    }
+    if (!sample_batch_add(&state->batch, now_ms, temperature)) {
+        // It's full, start another
+        publish_batch(state);
+        state->batch_start_ms = now_ms;
+        sample_batch_add(&state->batch, now_ms, temperature);
+    }
+    if (now_ms - state->batch_start_ms >= MQTT_BATCH_TIME_S * 1000) {
+        publish_batch(state);
+    }
+}
+#else
 static void publish_temperature(MQTT_CLIENT_DATA_T *state) {
     static float old_temperature;
-    const char *temperature_key = full_topic(state, "/temperature");
+    const char *temperature_key = queue_topics[QUEUE_TOPIC_TEMPERATURE];
     float temperature = read_onboard_temperature(TEMPERATURE_UNITS);
     if (temperature != old_temperature) {
         old_temperature = temperature;
@@ -149,9 +220,10 @@ static void publish_temperature(MQTT_CLIENT_DATA_T *state) {
         char temp_str[16];
         snprintf(temp_str, sizeof(temp_str), "%.2f", temperature);
         INFO_printf("Publishing %s to %s\n", temp_str, temperature_key);
-        mqtt_publish(state->mqtt_client_inst, temperature_key, temp_str, strlen(temp_str), MQTT_PUBLISH_QOS, MQTT_PUBLISH_RETAIN, pub_request_cb, state);
+        mqtt_queue_add(&state->queue, QUEUE_TOPIC_TEMPERATURE, temp_str, strlen(temp_str));
     }
 }
+#endif
 
 static void sub_request_cb(void *arg, err_t err) {
     MQTT_CLIENT_DATA_T* state = (MQTT_CLIENT_DATA_T*)arg;
@@ -221,10 +293,17 @@ static void mqtt_incoming_publish_cb(void *arg, const char *topic, u32_t tot_len
 static void temperature_worker_fn(async_context_t *context, async_at_time_worker_t *worker) {
     MQTT_CLIENT_DATA_T* state = (MQTT_CLIENT_DATA_T*)worker->user_data;
     publish_temperature(state);
-    async_context_add_at_time_worker_in_ms(context, worker, TEMP_WORKER_TIME_S * 1000);
+    async_context_add_at_time_worker_in_ms(context, worker, TEMP_WORKER_TIME_MS);
 }
 static async_at_time_worker_t temperature_worker = { .do_work = temperature_worker_fn };
 
+static void start_client(MQTT_CLIENT_DATA_T *state);
+
+static void reconnect_worker_fn(async_context_t *context, async_at_time_worker_t *worker) {
+    start_client((MQTT_CLIENT_DATA_T*)worker->user_data);
+}
+static async_at_time_worker_t reconnect_worker = { .do_work = reconnect_worker_fn };
+
 static void mqtt_connection_cb(mqtt_client_t *client, void *arg, mqtt_connection_status_t status) {
     MQTT_CLIENT_DATA_T* state = (MQTT_CLIENT_DATA_T*)arg;
     if (status == MQTT_CONNECT_ACCEPTED) {
@@ -236,12 +315,15 @@ static void mqtt_connection_cb(mqtt_client_t *client, void *arg, mqtt_connection
             mqtt_publish(state->mqtt_client_inst, state->mqtt_client_info.will_topic, "1", 1, MQTT_WILL_QOS, true, pub_request_cb, state);
         }
 
-        // Publish temperature every 10 sec if it's changed
-        temperature_worker.user_data = state;
-        async_context_add_at_time_worker_in_ms(cyw43_arch_async_context(), &temperature_worker, 0);
-    } else if (status == MQTT_CONNECT_DISCONNECTED) {
-        if (!state->connect_done) {
-            panic("Failed to connect to mqtt server");
+        // Publish anything queued while we were disconnected
+        mqtt_queue_connected(&state->queue);
+    } else if (status == MQTT_CONNECT_DISCONNECTED || status == MQTT_CONNECT_TIMEOUT) {
+        // Keep queueing readings and try again later, unless we were asked to stop
+        mqtt_queue_disconnected(&state->queue);
+        if (!state->stop_client) {
+            ERROR_printf("Lost connection to mqtt server, retrying in %d seconds\n", MQTT_RECONNECT_TIME_S);
+            reconnect_worker.user_data = state;
+            async_context_add_at_time_worker_in_ms(cyw43_arch_async_context(), &reconnect_worker, MQTT_RECONNECT_TIME_S * 1000);
         }
     }
     else {
@@ -258,16 +340,16 @@ static void start_client(MQTT_CLIENT_DATA_T *state) {
     INFO_printf("Warning: Not using TLS\n");
 #endif
 
-    state->mqtt_client_inst = mqtt_client_new();
-    if (!state->mqtt_client_inst) {
-        panic("MQTT client instance creation error");
-    }
     INFO_printf("IP address of this device %s\n", ipaddr_ntoa(&(netif_list->ip_addr)));
     INFO_printf("Connecting to mqtt server at %s\n", ipaddr_ntoa(&state->mqtt_server_address));
 
     cyw43_arch_lwip_begin();
     if (mqtt_client_connect(state->mqtt_client_inst, &state->mqtt_server_address, port, mqtt_connection_cb, state, &state->mqtt_client_info) != ERR_OK) {
-        panic("MQTT broker connection error");
+        ERROR_printf("MQTT broker connection error, retrying in %d seconds\n", MQTT_RECONNECT_TIME_S);
+        reconnect_worker.user_data = state;
+        async_context_add_at_time_worker_in_ms(cyw43_arch_async_context(), &reconnect_worker, MQTT_RECONNECT_TIME_S * 1000);
+        cyw43_arch_lwip_end();
+        return;
     }
 #if LWIP_ALTCP && LWIP_ALTCP_TLS
     // This is important for MBEDTLS_SSL_SERVER_NAME_INDICATION
@@ -349,12 +431,27 @@ int main(void) {
 #endif
 #endif
 
+    state.mqtt_client_inst = mqtt_client_new();
+    if (!state.mqtt_client_inst) {
+        panic("MQTT client instance creation error");
+    }
+
+    // Readings that weren't published before a reset are still in flash
+    strncpy(temperature_topic, full_topic(&state, "/temperature"), sizeof(temperature_topic));
+    strncpy(temperature_batch_topic, full_topic(&state, "/temperature/batch"), sizeof(temperature_batch_topic));
+    sample_batch_init(&state.batch, state.batch_buf, sizeof(state.batch_buf), TEMPERATURE_DECIMALS);
+    mqtt_queue_init(&state.queue, cyw43_arch_async_context(), state.mqtt_client_inst, queue_topics, QUEUE_TOPIC_COUNT);
+
     cyw43_arch_enable_sta_mode();
     if (cyw43_arch_wifi_connect_timeout_ms(WIFI_SSID, WIFI_PASSWORD, CYW43_AUTH_WPA2_AES_PSK, 30000)) {
         panic("Failed to connect");
     }
     INFO_printf("\nConnected to Wifi\n");
 
+    // Read the temperature and queue it
+    temperature_worker.user_data = &state;
+    async_context_add_at_time_worker_in_ms(cyw43_arch_async_context(), &temperature_worker, 0);
+
     // We are not in a callback so locking is needed when calling lwip
     // Make a DNS request for the MQTT server IP address
     cyw43_arch_lwip_begin();
@@ -368,11 +465,14 @@ int main(void) {
         panic("dns request failed");
     }
 
-    while (!state.connect_done || mqtt_client_is_connected(state.mqtt_client_inst)) {
+    while (!state.stop_client || mqtt_client_is_connected(state.mqtt_client_inst)) {
         cyw43_arch_poll();
         cyw43_arch_wait_for_work_until(make_timeout_time_ms(10000));
     }
 
+    cyw43_arch_lwip_begin();
+    mqtt_queue_flush(&state.queue);
+    cyw43_arch_lwip_end();
     INFO_printf("mqtt client exiting\n");
     return 0;
 }
@@ -0,0 +1,314 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/flash.h"
+#include "hardware/flash.h"
+
+#include "mqtt_queue.h"
+
+#ifndef DEBUG_printf
+#define DEBUG_printf(...)
+#endif
+
+#ifndef ERROR_printf
+#define ERROR_printf printf
+#endif
+
+#define MQTT_QUEUE_NOT_ACKED 0xffffffff
+#define MQTT_QUEUE_EMPTY 0xffffffff
+
+static_assert(sizeof(mqtt_queue_record_t) == MQTT_QUEUE_RECORD_SIZE, "");
+static_assert(offsetof(mqtt_queue_record_t, payload) == MQTT_QUEUE_HEADER_SIZE, "");
+static_assert(FLASH_PAGE_SIZE % MQTT_QUEUE_RECORD_SIZE == 0, "MQTT_QUEUE_RECORD_SIZE must divide FLASH_PAGE_SIZE");
+
+typedef struct {
+    uint32_t offset;
+    const uint8_t *data; // NULL to erase a sector
+} mqtt_queue_flash_op_t;
+
+// This function will be called when it's safe to write to flash
+static void call_flash_op(void *param) {
+    const mqtt_queue_flash_op_t *op = (const mqtt_queue_flash_op_t *)param;
+    if (op->data) {
+        flash_range_program(op->offset, op->data, FLASH_PAGE_SIZE);
+    } else {
+        flash_range_erase(op->offset, FLASH_SECTOR_SIZE);
+    }
+}
+
+static void flash_op(uint32_t offset, const uint8_t *data) {
+    mqtt_queue_flash_op_t op = { .offset = offset, .data = data };
+    int rc = flash_safe_execute(call_flash_op, &op, UINT32_MAX);
+    if (rc != PICO_OK) {
+        ERROR_printf("mqtt queue: flash operation failed %d\n", rc);
+    }
+}
+
+static uint32_t record_offset(uint32_t seq) {
+    return MQTT_QUEUE_FLASH_OFFSET + (seq % MQTT_QUEUE_RECORDS) * MQTT_QUEUE_RECORD_SIZE;
+}
+
+static uint32_t page_start(uint32_t seq) {
+    return seq - seq % MQTT_QUEUE_RECORDS_PER_PAGE;
+}
+
+static const mqtt_queue_record_t *flash_record(uint32_t seq) {
+    return (const mqtt_queue_record_t *)(XIP_BASE + record_offset(seq));
+}
+
+// The page being added to is read from ram, as it might not be written yet
+static mqtt_queue_record_t *page_record(uint8_t *page, uint32_t seq) {
+    return (mqtt_queue_record_t *)(page + (seq % MQTT_QUEUE_RECORDS_PER_PAGE) * MQTT_QUEUE_RECORD_SIZE);
+}
+
+static const mqtt_queue_record_t *queue_record(mqtt_queue_t *queue, uint32_t seq) {
+    if (page_start(seq) == queue->page_seq) {
+        return page_record(queue->page, seq);
+    }
+    return flash_record(seq);
+}
+
+static bool record_acked(mqtt_queue_t *queue, uint32_t seq) {
+    if (queue_record(queue, seq)->acked != MQTT_QUEUE_NOT_ACKED) {
+        return true;
+    }
+    return queue->ack_pending && page_start(seq) == queue->ack_page_seq &&
+           page_record(queue->ack_page, seq)->acked != MQTT_QUEUE_NOT_ACKED;
+}
+
+static void flush_acks(mqtt_queue_t *queue) {
+    if (queue->ack_pending) {
+        flash_op(record_offset(queue->ack_page_seq), queue->ack_page);
+        queue->ack_pending = false;
+    }
+}
+
+static void flush_page(mqtt_queue_t *queue) {
+    if (queue->page_dirty) {
+        flash_op(record_offset(queue->page_seq), queue->page);
+        queue->page_dirty = false;
+    }
+}
+
+static void schedule(mqtt_queue_t *queue, uint32_t ms) {
+    async_context_remove_at_time_worker(queue->context, &queue->worker);
+    async_context_add_at_time_worker_in_ms(queue->context, &queue->worker, ms);
+}
+
+// Record that the broker has the message. The acknowledgements for a page are written together,
+// with all the other bits left as ones so the messages aren't changed
+static void ack_record(mqtt_queue_t *queue, uint32_t seq) {
+    if (seq - queue->tail >= queue->head - queue->tail) {
+        return; // dropped while it was in flight
+    }
+    if (page_start(seq) == queue->page_seq) {
+        page_record(queue->page, seq)->acked = 0;
+        queue->page_dirty = true;
+    } else {
+        if (queue->ack_pending && page_start(seq) != queue->ack_page_seq) {
+            flush_acks(queue);
+        }
+        if (!queue->ack_pending) {
+            memset(queue->ack_page, 0xff, sizeof(queue->ack_page));
+            queue->ack_page_seq = page_start(seq);
+            queue->ack_pending = true;
+        }
+        page_record(queue->ack_page, seq)->acked = 0;
+    }
+    while (queue->tail != queue->head && record_acked(queue, queue->tail)) {
+        queue->tail++;
+    }
+    if (queue->next - queue->tail > queue->head - queue->tail) {
+        queue->next = queue->tail;
+    }
+}
+
+static bool record_in_flight(mqtt_queue_t *queue, uint32_t seq) {
+    for (int i = 0; i < MQTT_QUEUE_WINDOW; i++) {
+        if (queue->in_flight[i].used && queue->in_flight[i].seq == seq) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void drain(mqtt_queue_t *queue);
+
+static void publish_cb(void *arg, err_t err) {
+    mqtt_queue_in_flight_t *in_flight = (mqtt_queue_in_flight_t *)arg;
+    mqtt_queue_t *queue = in_flight->queue;
+    if (!in_flight->used) {
+        return;
+    }
+    in_flight->used = false;
+    queue->in_flight_count--;
+    if (err == ERR_OK) {
+        ack_record(queue, in_flight->seq);
+    } else {
+        // Publish it again
+        DEBUG_printf("mqtt queue: publish %u failed %d\n", in_flight->seq, err);
+        if (in_flight->seq - queue->tail < queue->next - queue->tail) {
+            queue->next = in_flight->seq;
+        }
+    }
+    drain(queue);
+}
+
+// Publish the next messages, up to the window size
+static void drain(mqtt_queue_t *queue) {
+    if (!queue->client || !mqtt_client_is_connected(queue->client)) {
+        return;
+    }
+    while (queue->in_flight_count < MQTT_QUEUE_WINDOW && queue->next != queue->head) {
+        uint32_t seq = queue->next;
+        if (record_acked(queue, seq) || record_in_flight(queue, seq)) {
+            queue->next++;
+            continue;
+        }
+        mqtt_queue_in_flight_t *in_flight = NULL;
+        for (int i = 0; i < MQTT_QUEUE_WINDOW; i++) {
+            if (!queue->in_flight[i].used) {
+                in_flight = &queue->in_flight[i];
+                break;
+            }
+        }
+        const mqtt_queue_record_t *record = queue_record(queue, seq);
+        err_t err = mqtt_publish(queue->client, queue->topics[record->topic], record->payload, record->len,
+                                 1, 0, publish_cb, in_flight);
+        if (err != ERR_OK) {
+            // Probably out of buffer space, try again when something is acknowledged
+            if (queue->in_flight_count == 0) {
+                schedule(queue, 100);
+            }
+            break;
+        }
+        queue->next++;
+        in_flight->queue = queue;
+        in_flight->seq = seq;
+        in_flight->used = true;
+        queue->in_flight_count++;
+    }
+}
+
+static void worker_fn(async_context_t *context, async_at_time_worker_t *worker) {
+    mqtt_queue_t *queue = (mqtt_queue_t *)worker->user_data;
+    mqtt_queue_flush(queue);
+    drain(queue);
+}
+
+void mqtt_queue_init(mqtt_queue_t *queue, async_context_t *context, mqtt_client_t *client,
+                     const char *const *topics, int num_topics) {
+    memset(queue, 0, sizeof(*queue));
+    queue->context = context;
+    queue->client = client;
+    queue->topics = topics;
+    queue->num_topics = num_topics;
+    queue->worker.do_work = worker_fn;
+    queue->worker.user_data = queue;
+
+    // The newest message is the one with the highest sequence number
+    bool found = false;
+    for (uint32_t i = 0; i < MQTT_QUEUE_RECORDS; i++) {
+        const mqtt_queue_record_t *record = flash_record(i);
+        if (record->seq != MQTT_QUEUE_EMPTY && record->seq % MQTT_QUEUE_RECORDS == i &&
+            record->len <= MQTT_QUEUE_MAX_PAYLOAD && record->topic < num_topics) {
+            if (!found || record->seq - queue->head < UINT32_MAX / 2) {
+                queue->head = record->seq + 1;
+            }
+            found = true;
+        }
+    }
+
+    // Everything since the oldest message that wasn't acknowledged is left to publish
+    queue->tail = queue->head;
+    if (found) {
+        for (uint32_t n = 1; n <= MQTT_QUEUE_RECORDS && n <= queue->head; n++) {
+            const mqtt_queue_record_t *record = flash_record(queue->head - n);
+            if (record->seq != queue->head - n || record->len > MQTT_QUEUE_MAX_PAYLOAD || record->topic >= num_topics) {
+                break;
+            }
+            if (record->acked == MQTT_QUEUE_NOT_ACKED) {
+                queue->tail = record->seq;
+            }
+        }
+    }
+    queue->next = queue->tail;
+
+    // Carry on adding to the last page
+    queue->page_seq = page_start(queue->head);
+    memcpy(queue->page, flash_record(queue->page_seq), FLASH_PAGE_SIZE);
+    if (queue->head % MQTT_QUEUE_RECORDS_PER_PAGE == 0) {
+        memset(queue->page, 0xff, sizeof(queue->page));
+    }
+    printf("mqtt queue: %u messages to publish\n", mqtt_queue_count(queue));
+}
+
+bool mqtt_queue_add(mqtt_queue_t *queue, int topic, const void *payload, uint16_t len) {
+    if (len > MQTT_QUEUE_MAX_PAYLOAD || topic < 0 || topic >= queue->num_topics) {
+        return false;
+    }
+    uint32_t seq = queue->head;
+    if (seq % MQTT_QUEUE_RECORDS_PER_PAGE == 0) {
+        // Start a new page, making room for it by dropping the oldest sector if needed
+        flush_page(queue);
+        if (seq % MQTT_QUEUE_RECORDS_PER_SECTOR == 0) {
+            if (queue->ack_pending && record_offset(queue->ack_page_seq) / FLASH_SECTOR_SIZE == record_offset(seq) / FLASH_SECTOR_SIZE) {
+                queue->ack_pending = false;
+            }
+            flash_op(record_offset(seq) - record_offset(seq) % FLASH_SECTOR_SIZE, NULL);
+            if (seq + MQTT_QUEUE_RECORDS_PER_SECTOR - queue->tail > MQTT_QUEUE_RECORDS) {
+                uint32_t oldest = seq + MQTT_QUEUE_RECORDS_PER_SECTOR - MQTT_QUEUE_RECORDS;
+                queue->dropped += oldest - queue->tail;
+                ERROR_printf("mqtt queue: full, dropped %u messages\n", oldest - queue->tail);
+                queue->tail = oldest;
+                if (queue->next - queue->tail > queue->head - queue->tail) {
+                    queue->next = queue->tail;
+                }
+            }
+        }
+        queue->page_seq = seq;
+        memset(queue->page, 0xff, sizeof(queue->page));
+    }
+    mqtt_queue_record_t *record = page_record(queue->page, seq);
+    record->seq = seq;
+    record->topic = (uint8_t)topic;
+    record->len = len;
+    memcpy(record->payload, payload, len);
+    queue->page_dirty = true;
+    queue->head++;
+
+    if (queue->head % MQTT_QUEUE_RECORDS_PER_PAGE == 0) {
+        flush_page(queue);
+    } else {
+        schedule(queue, MQTT_QUEUE_FLUSH_MS);
+    }
+    drain(queue);
+    return true;
+}
+
+void mqtt_queue_connected(mqtt_queue_t *queue) {
+    drain(queue);
+}
+
+void mqtt_queue_disconnected(mqtt_queue_t *queue) {
+    // The client forgets its requests without calling back
+    for (int i = 0; i < MQTT_QUEUE_WINDOW; i++) {
+        queue->in_flight[i].used = false;
+    }
+    queue->in_flight_count = 0;
+    queue->next = queue->tail;
+    mqtt_queue_flush(queue);
+}
+
+void mqtt_queue_flush(mqtt_queue_t *queue) {
+    flush_page(queue);
+    flush_acks(queue);
+}
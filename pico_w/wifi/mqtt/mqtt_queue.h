@@ -0,0 +1,113 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _MQTT_QUEUE_H_
+#define _MQTT_QUEUE_H_
+
+#include "pico/async_context.h"
+#include "hardware/flash.h"
+#include "lwip/apps/mqtt.h"
+
+// Messages waiting to be published are kept in a ring of flash sectors, so they survive the
+// broker being unreachable and the device being reset. Each message is published with QoS 1
+// and kept until the broker acknowledges it. Up to MQTT_QUEUE_WINDOW messages are published
+// without waiting for the previous one to be acknowledged.
+
+// Number of flash sectors used for the queue, at the end of flash by default
+#ifndef MQTT_QUEUE_FLASH_SECTORS
+#define MQTT_QUEUE_FLASH_SECTORS 8
+#endif
+
+#ifndef MQTT_QUEUE_FLASH_OFFSET
+#define MQTT_QUEUE_FLASH_OFFSET (PICO_FLASH_SIZE_BYTES - MQTT_QUEUE_FLASH_SECTORS * FLASH_SECTOR_SIZE)
+#endif
+
+// Space used by each message including its header, this must divide FLASH_PAGE_SIZE
+#ifndef MQTT_QUEUE_RECORD_SIZE
+#define MQTT_QUEUE_RECORD_SIZE 64
+#endif
+
+// Number of messages published but not yet acknowledged
+#ifndef MQTT_QUEUE_WINDOW
+#define MQTT_QUEUE_WINDOW 4
+#endif
+
+// A partly filled page of messages is written to flash after this long
+#ifndef MQTT_QUEUE_FLUSH_MS
+#define MQTT_QUEUE_FLUSH_MS 1000
+#endif
+
+#define MQTT_QUEUE_HEADER_SIZE 12
+#define MQTT_QUEUE_MAX_PAYLOAD (MQTT_QUEUE_RECORD_SIZE - MQTT_QUEUE_HEADER_SIZE)
+#define MQTT_QUEUE_RECORDS_PER_PAGE (FLASH_PAGE_SIZE / MQTT_QUEUE_RECORD_SIZE)
+#define MQTT_QUEUE_RECORDS_PER_SECTOR (FLASH_SECTOR_SIZE / MQTT_QUEUE_RECORD_SIZE)
+#define MQTT_QUEUE_RECORDS (MQTT_QUEUE_FLASH_SECTORS * MQTT_QUEUE_RECORDS_PER_SECTOR)
+
+// A message as it's kept in flash. Erased flash is all ones, so the acknowledgement can be
+// written over a message without erasing it
+typedef struct mqtt_queue_record_t_ {
+    uint32_t seq;
+    uint32_t acked;
+    uint8_t topic; // index into the topics given to mqtt_queue_init
+    uint8_t reserved;
+    uint16_t len;
+    uint8_t payload[MQTT_QUEUE_MAX_PAYLOAD];
+} mqtt_queue_record_t;
+
+typedef struct mqtt_queue_t_ mqtt_queue_t;
+
+typedef struct mqtt_queue_in_flight_t_ {
+    mqtt_queue_t *queue;
+    uint32_t seq;
+    bool used;
+} mqtt_queue_in_flight_t;
+
+struct mqtt_queue_t_ {
+    mqtt_client_t *client;
+    async_context_t *context;
+    async_at_time_worker_t worker;
+    const char *const *topics;
+    int num_topics;
+
+    uint32_t head; // sequence number of the next message added
+    uint32_t tail; // oldest message not acknowledged
+    uint32_t next; // next message to publish
+    uint32_t dropped;
+    mqtt_queue_in_flight_t in_flight[MQTT_QUEUE_WINDOW];
+    int in_flight_count;
+
+    // The page messages are added to, written to flash when it's full or after MQTT_QUEUE_FLUSH_MS
+    uint32_t page_seq;
+    bool page_dirty;
+    uint8_t page[FLASH_PAGE_SIZE];
+
+    // Acknowledgements not yet written to flash, for one page of messages
+    uint32_t ack_page_seq;
+    bool ack_pending;
+    uint8_t ack_page[FLASH_PAGE_SIZE];
+};
+
+// Find the messages left in flash and start publishing them with client once it's connected
+void mqtt_queue_init(mqtt_queue_t *queue, async_context_t *context, mqtt_client_t *client,
+                     const char *const *topics, int num_topics);
+
+// Add a message to the queue, the oldest message is dropped if it's full
+bool mqtt_queue_add(mqtt_queue_t *queue, int topic, const void *payload, uint16_t len);
+
+// Start publishing messages once the client has connected
+void mqtt_queue_connected(mqtt_queue_t *queue);
+
+// The client lost its connection, messages that weren't acknowledged will be published again
+void mqtt_queue_disconnected(mqtt_queue_t *queue);
+
+// Write everything to flash now
+void mqtt_queue_flush(mqtt_queue_t *queue);
+
+static inline uint32_t mqtt_queue_count(const mqtt_queue_t *queue) {
+    return queue->head - queue->tail;
+}
+
+#endif
@@ -0,0 +1,63 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// This has no dependencies on the SDK, so it can be built on a host too
+
+#include "sample_batch.h"
+
+static size_t put_varint(uint8_t *out, uint64_t value) {
+    size_t len = 0;
+    while (value >= 0x80) {
+        out[len++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[len++] = (uint8_t)value;
+    return len;
+}
+
+static uint32_t zigzag(int32_t value) {
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+void sample_batch_init(sample_batch_t *batch, uint8_t *buf, size_t size, uint8_t decimals) {
+    batch->buf = buf;
+    batch->size = size;
+    buf[0] = SAMPLE_BATCH_VERSION;
+    buf[1] = decimals;
+    sample_batch_reset(batch);
+}
+
+void sample_batch_reset(sample_batch_t *batch) {
+    batch->len = SAMPLE_BATCH_HEADER_SIZE;
+    batch->count = 0;
+    batch->last_time_ms = 0;
+    batch->last_value = 0;
+}
+
+bool sample_batch_add(sample_batch_t *batch, uint64_t time_ms, int32_t value) {
+    uint8_t sample[SAMPLE_BATCH_MAX_SAMPLE_SIZE];
+    size_t len;
+    if (batch->count == 0) {
+        len = put_varint(sample, time_ms);
+        len += put_varint(sample + len, zigzag(value));
+    } else {
+        if (time_ms < batch->last_time_ms) {
+            return false;
+        }
+        len = put_varint(sample, time_ms - batch->last_time_ms);
+        len += put_varint(sample + len, zigzag((int32_t)((uint32_t)value - (uint32_t)batch->last_value)));
+    }
+    if (batch->len + len > batch->size) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        batch->buf[batch->len++] = sample[i];
+    }
+    batch->count++;
+    batch->last_time_ms = time_ms;
+    batch->last_value = value;
+    return true;
+}
@@ -0,0 +1,59 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _SAMPLE_BATCH_H_
+#define _SAMPLE_BATCH_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Packs timestamped readings into one compact binary payload, so many readings can be sent in
+// a single message. Values are fixed point integers with a number of decimal places.
+//
+// The format is
+//   byte    version, SAMPLE_BATCH_VERSION
+//   byte    number of decimal places in the values
+//   varint  timestamp of the first sample in ms
+//   svarint value of the first sample
+// then for each following sample
+//   varint  ms since the previous sample
+//   svarint change in value from the previous sample
+//
+// A varint is 7 bits per byte, least significant first, with the top bit set on all but the
+// last byte. An svarint is a varint of the zigzag encoded value, so small changes either way
+// take one byte. There's no count, the samples continue to the end of the payload.
+// sample_batch_decode.py decodes this on a host.
+
+#define SAMPLE_BATCH_VERSION 1
+#define SAMPLE_BATCH_HEADER_SIZE 2
+
+// Space a sample can take in the worst case
+#define SAMPLE_BATCH_MAX_SAMPLE_SIZE 15
+
+typedef struct sample_batch_t_ {
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+    int count;
+    uint64_t last_time_ms;
+    int32_t last_value;
+} sample_batch_t;
+
+// Start an empty batch in buf
+void sample_batch_init(sample_batch_t *batch, uint8_t *buf, size_t size, uint8_t decimals);
+
+// Add a sample, returns false if the batch is full. Samples must be added in time order
+bool sample_batch_add(sample_batch_t *batch, uint64_t time_ms, int32_t value);
+
+// Start again after the batch has been sent
+void sample_batch_reset(sample_batch_t *batch);
+
+static inline bool sample_batch_empty(const sample_batch_t *batch) {
+    return batch->count == 0;
+}
+
+#endif
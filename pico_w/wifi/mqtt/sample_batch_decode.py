@@ -0,0 +1,67 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Decode a batch of samples published by mqtt_client, see sample_batch.h for the format, e.g.
+#   mosquitto_sub -h $MQTT_SERVER -t '/temperature/batch' -C 1 -N | ./sample_batch_decode.py
+#
+
+import argparse
+import sys
+
+SAMPLE_BATCH_VERSION = 1
+
+
+def get_varint(data, pos):
+    value = 0
+    shift = 0
+    while True:
+        if pos >= len(data):
+            raise ValueError('truncated varint')
+        b = data[pos]
+        pos += 1
+        value |= (b & 0x7f) << shift
+        if not b & 0x80:
+            return value, pos
+        shift += 7
+
+
+def unzigzag(value):
+    return (value >> 1) ^ -(value & 1)
+
+
+def decode(data):
+    """Returns a list of (time in ms, value) tuples"""
+    if len(data) < 2 or data[0] != SAMPLE_BATCH_VERSION:
+        raise ValueError('not a sample batch')
+    decimals = data[1]
+    pos = 2
+    time_ms = 0
+    value = 0
+    samples = []
+    while pos < len(data):
+        delta_ms, pos = get_varint(data, pos)
+        delta, pos = get_varint(data, pos)
+        time_ms += delta_ms
+        # the values are int32 and the changes between them wrap
+        value = (value + unzigzag(delta) + 2 ** 31) % 2 ** 32 - 2 ** 31
+        samples.append((time_ms, value / 10 ** decimals))
+    return samples
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode a binary sample batch')
+    parser.add_argument('-x', '--hex', help='payload as hex, rather than binary on stdin')
+    args = parser.parse_args()
+
+    data = bytes.fromhex(args.hex) if args.hex else sys.stdin.buffer.read()
+    samples = decode(data)
+    for time_ms, value in samples:
+        print('%10.3f %g' % (time_ms / 1000, value))
+    print('%d samples in %d bytes' % (len(samples), len(data)))
+
+
+if __name__ == '__main__':
+    main()
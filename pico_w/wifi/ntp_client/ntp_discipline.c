@@ -0,0 +1,370 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/time.h"
+#include "lwip/dns.h"
+#include "lwip/pbuf.h"
+#include "lwip/udp.h"
+
+#include "ntp_discipline.h"
+
+#ifndef DEBUG_printf
+#define DEBUG_printf(...)
+#endif
+
+#define NTP_MSG_LEN 48
+#define NTP_PORT 123
+#define NTP_DELTA 2208988800u // seconds between 1 Jan 1900 and 1 Jan 1970
+#define NTP_DNS_WAIT_MS 2000
+#define NTP_BURST_INTERVAL_MS 2000 // public servers might ignore requests that are closer together
+#define NTP_MAX_FREQ_PPB 500000
+#define NTP_MAX_SLEW_PPM 500
+#define NTP_GOOD_POLLS 4 // before the interval between polls is increased
+#define NTP_STEPOUT_POLLS 3 // a big error is ignored until it has been seen this often
+
+// How much of the slew has been added by local_us
+static int64_t clock_slew(const ntp_discipline_clock_t *clock, uint64_t local_us) {
+    int64_t elapsed = (int64_t)(local_us - clock->base_local_us);
+    if (elapsed <= 0) {
+        return 0;
+    }
+    int64_t max_slew = elapsed * NTP_MAX_SLEW_PPM / 1000000;
+    return clock->slew_us < 0 ? MAX(clock->slew_us, -max_slew) : MIN(clock->slew_us, max_slew);
+}
+
+static int64_t clock_read(const ntp_discipline_clock_t *clock, uint64_t local_us) {
+    int64_t elapsed = (int64_t)(local_us - clock->base_local_us);
+    return clock->base_us + elapsed + elapsed * clock->freq_ppb / 1000000000 + clock_slew(clock, local_us);
+}
+
+uint64_t ntp_discipline_time_us_at(ntp_discipline_t *ntp, uint64_t local_us) {
+    critical_section_enter_blocking(&ntp->lock);
+    ntp_discipline_clock_t clock = ntp->clock;
+    bool synced = ntp->synced;
+    critical_section_exit(&ntp->lock);
+    return synced ? (uint64_t)clock_read(&clock, local_us) : 0;
+}
+
+uint64_t ntp_discipline_time_us(ntp_discipline_t *ntp) {
+    return ntp_discipline_time_us_at(ntp, time_us_64());
+}
+
+int32_t ntp_discipline_freq_ppb(ntp_discipline_t *ntp) {
+    critical_section_enter_blocking(&ntp->lock);
+    int32_t freq_ppb = (int32_t)ntp->clock.freq_ppb;
+    critical_section_exit(&ntp->lock);
+    return freq_ppb;
+}
+
+// Run the clock at freq_ppb from now on, getting to target_us by stepping or slewing. A clock that's
+// ahead is always slewed, and the frequency correction and slew are small enough that it still moves on
+static void clock_set(ntp_discipline_t *ntp, uint64_t now_us, int64_t target_us, int64_t freq_ppb) {
+    ntp_discipline_clock_t clock = { .base_local_us = now_us, .freq_ppb = freq_ppb };
+    int64_t error_us = ntp->synced ? target_us - clock_read(&ntp->clock, now_us) : 0;
+    if (!ntp->synced || error_us > NTP_DISCIPLINE_STEP_US) {
+        clock.base_us = target_us;
+        ntp->steps++;
+    } else {
+        clock.base_us = target_us - error_us;
+        clock.slew_us = error_us;
+    }
+    critical_section_enter_blocking(&ntp->lock);
+    ntp->clock = clock;
+    ntp->synced = true;
+    critical_section_exit(&ntp->lock);
+}
+
+// Fit a line to the offsets to find the frequency error and the offset now. Answers that took
+// longer than the quickest are less accurate, so they count for less
+static void fit_history(const ntp_discipline_t *ntp, uint64_t now_us, int64_t *offset_us, int64_t *freq_ppb) {
+    const ntp_discipline_sample_t *first = &ntp->history[0];
+    uint32_t min_delay_us = first->delay_us;
+    for (int i = 1; i < ntp->history_count; i++) {
+        min_delay_us = MIN(min_delay_us, ntp->history[i].delay_us);
+    }
+    double weight[NTP_DISCIPLINE_HISTORY];
+    double sum_w = 0;
+    double mean_x = 0;
+    double mean_y = 0;
+    for (int i = 0; i < ntp->history_count; i++) {
+        double excess = (double)(ntp->history[i].delay_us - min_delay_us) / NTP_DISCIPLINE_TARGET_US;
+        weight[i] = 1 / (1 + excess * excess);
+        sum_w += weight[i];
+        mean_x += weight[i] * (double)(int64_t)(ntp->history[i].local_us - first->local_us);
+        mean_y += weight[i] * (double)(ntp->history[i].offset_us - first->offset_us);
+    }
+    mean_x /= sum_w;
+    mean_y /= sum_w;
+    double sxx = 0;
+    double sxy = 0;
+    for (int i = 0; i < ntp->history_count; i++) {
+        double dx = (double)(int64_t)(ntp->history[i].local_us - first->local_us) - mean_x;
+        double dy = (double)(ntp->history[i].offset_us - first->offset_us) - mean_y;
+        sxx += weight[i] * dx * dx;
+        sxy += weight[i] * dx * dy;
+    }
+    // Keep the current frequency until the polls are spread over long enough to measure it
+    double slope = (double)ntp->clock.freq_ppb / 1e9;
+    double span_s = (double)(int64_t)(ntp->history[ntp->history_count - 1].local_us - first->local_us) / 1e6;
+    if (ntp->history_count >= 3 && span_s >= NTP_DISCIPLINE_MIN_POLL_S) {
+        slope = sxy / sxx;
+    }
+    *freq_ppb = (int64_t)(slope * 1e9);
+    if (*freq_ppb > NTP_MAX_FREQ_PPB) {
+        *freq_ppb = NTP_MAX_FREQ_PPB;
+    } else if (*freq_ppb < -NTP_MAX_FREQ_PPB) {
+        *freq_ppb = -NTP_MAX_FREQ_PPB;
+    }
+    double x_now = (double)(int64_t)(now_us - first->local_us);
+    *offset_us = first->offset_us + (int64_t)(mean_y + slope * (x_now - mean_x));
+}
+
+static void add_history(ntp_discipline_t *ntp, const ntp_discipline_sample_t *sample) {
+    if (ntp->history_count == NTP_DISCIPLINE_HISTORY) {
+        memmove(&ntp->history[0], &ntp->history[1], sizeof(ntp->history[0]) * (NTP_DISCIPLINE_HISTORY - 1));
+        ntp->history_count--;
+    }
+    ntp->history[ntp->history_count++] = *sample;
+}
+
+// The server's time minus the clock's, when the sample was taken
+static int64_t sample_error(const ntp_discipline_t *ntp, const ntp_discipline_sample_t *sample) {
+    return (int64_t)sample->local_us + sample->offset_us - clock_read(&ntp->clock, sample->local_us);
+}
+
+// Pick the best answer from this poll and steer the clock with it
+static void update_clock(ntp_discipline_t *ntp) {
+    ntp->polls++;
+    ntp->last_servers = 0;
+
+    // Servers whose time is too far from the median are ignored, as long as there are enough to tell
+    int64_t errors[NTP_DISCIPLINE_MAX_SERVERS];
+    int count = 0;
+    for (int i = 0; i < ntp->num_servers; i++) {
+        if (ntp->servers[i].have_sample) {
+            int64_t error = ntp->synced ? sample_error(ntp, &ntp->servers[i].best) : ntp->servers[i].best.offset_us;
+            int j = count++;
+            for (; j > 0 && errors[j - 1] > error; j--) {
+                errors[j] = errors[j - 1];
+            }
+            errors[j] = error;
+        }
+    }
+    if (count == 0) {
+        DEBUG_printf("ntp: no answers\n");
+        return;
+    }
+    int64_t median = errors[count / 2];
+    const ntp_discipline_sample_t *best = NULL;
+    for (int i = 0; i < ntp->num_servers; i++) {
+        const ntp_discipline_server_t *server = &ntp->servers[i];
+        if (!server->have_sample) {
+            continue;
+        }
+        int64_t error = ntp->synced ? sample_error(ntp, &server->best) : server->best.offset_us;
+        int64_t diff = error > median ? error - median : median - error;
+        if (count >= 3 && diff > server->best.delay_us / 2 + NTP_DISCIPLINE_TARGET_US) {
+            DEBUG_printf("ntp: ignoring %s, %lld us from the others\n", server->hostname, diff);
+            continue;
+        }
+        ntp->last_servers++;
+        if (!best || server->best.delay_us < best->delay_us) {
+            best = &server->best;
+        }
+    }
+
+    int64_t error = ntp->synced ? sample_error(ntp, best) : 0;
+    ntp->last_error_us = error;
+    ntp->last_delay_us = best->delay_us;
+    // A clock that's ahead can take a long time to slew back, so judge it by where it's heading
+    if (ntp->synced) {
+        error -= ntp->clock.slew_us - clock_slew(&ntp->clock, best->local_us);
+    }
+    if (ntp->synced && (error > NTP_DISCIPLINE_STEP_US || error < -NTP_DISCIPLINE_STEP_US)) {
+        // Ignore a big error a few times in case it's a glitch, then start again
+        ntp->good_polls = 0;
+        ntp->poll_s = NTP_DISCIPLINE_MIN_POLL_S;
+        if (++ntp->bad_polls < NTP_STEPOUT_POLLS) {
+            return;
+        }
+        ntp->history_count = 0;
+    }
+    ntp->bad_polls = 0;
+    add_history(ntp, best);
+
+    uint64_t now_us = time_us_64();
+    int64_t offset_us;
+    int64_t freq_ppb;
+    fit_history(ntp, now_us, &offset_us, &freq_ppb);
+    clock_set(ntp, now_us, (int64_t)now_us + offset_us, freq_ppb);
+
+    // Poll less often while the clock is staying close enough
+    int64_t abs_error = error < 0 ? -error : error;
+    if (abs_error < NTP_DISCIPLINE_TARGET_US / 2) {
+        if (++ntp->good_polls >= NTP_GOOD_POLLS && ntp->history_count >= 3 && ntp->poll_s < NTP_DISCIPLINE_MAX_POLL_S) {
+            ntp->poll_s *= 2;
+            ntp->good_polls = 0;
+        }
+    } else {
+        ntp->good_polls = 0;
+        if (abs_error > NTP_DISCIPLINE_TARGET_US && ntp->poll_s > NTP_DISCIPLINE_MIN_POLL_S) {
+            ntp->poll_s /= 2;
+        }
+    }
+}
+
+static void put_be64(uint8_t *buf, uint64_t value) {
+    for (int i = 7; i >= 0; i--) {
+        buf[i] = (uint8_t)value;
+        value >>= 8;
+    }
+}
+
+static uint64_t get_be64(const uint8_t *buf) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value = value << 8 | buf[i];
+    }
+    return value;
+}
+
+// Convert an NTP timestamp to microseconds since 1970
+static int64_t ntp_to_us(const uint8_t *buf) {
+    uint64_t ntp = get_be64(buf);
+    uint32_t seconds = (uint32_t)(ntp >> 32) - NTP_DELTA;
+    return (int64_t)seconds * 1000000 + (int64_t)(((ntp & 0xffffffff) * 1000000) >> 32);
+}
+
+static void send_request(ntp_discipline_t *ntp, ntp_discipline_server_t *server) {
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, NTP_MSG_LEN, PBUF_RAM);
+    if (!p) {
+        return;
+    }
+    uint8_t *req = (uint8_t *)p->payload;
+    memset(req, 0, NTP_MSG_LEN);
+    req[0] = 0x23; // version 4, client
+    // The server copies the transmit time to the originate time of its answer. It can be any value,
+    // so local time is used to save converting it
+    server->sent_us = time_us_64();
+    put_be64(req + 40, server->sent_us);
+    udp_sendto(ntp->pcb, p, &server->address, NTP_PORT);
+    pbuf_free(p);
+}
+
+static void handle_answer(ntp_discipline_server_t *server, const uint8_t *msg, uint64_t received_us) {
+    uint8_t leap = msg[0] >> 6;
+    uint8_t mode = msg[0] & 0x7;
+    uint8_t stratum = msg[1];
+    if (mode != 4 || stratum == 0 || stratum > 15 || leap == 3 || get_be64(msg + 24) != server->sent_us) {
+        return; // not synchronised, a kiss of death or not an answer to the last request
+    }
+    uint64_t sent_us = server->sent_us;
+    server->sent_us = 0;
+    int64_t server_received_us = ntp_to_us(msg + 32);
+    int64_t server_sent_us = ntp_to_us(msg + 40);
+    int64_t delay_us = (int64_t)(received_us - sent_us) - (server_sent_us - server_received_us);
+    ntp_discipline_sample_t sample = {
+        .local_us = sent_us + (received_us - sent_us) / 2,
+        .offset_us = ((server_received_us - (int64_t)sent_us) + (server_sent_us - (int64_t)received_us)) / 2,
+        .delay_us = delay_us > 0 ? (uint32_t)delay_us : 0,
+    };
+    DEBUG_printf("ntp: %s offset %lld us delay %u us\n", server->hostname, sample.offset_us, sample.delay_us);
+    if (!server->have_sample || sample.delay_us < server->best.delay_us) {
+        server->best = sample;
+        server->have_sample = true;
+    }
+}
+
+static void ntp_recv(void *arg, __unused struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port) {
+    uint64_t received_us = time_us_64();
+    ntp_discipline_t *ntp = (ntp_discipline_t *)arg;
+    uint8_t msg[NTP_MSG_LEN];
+    if (port == NTP_PORT && pbuf_copy_partial(p, msg, NTP_MSG_LEN, 0) == NTP_MSG_LEN) {
+        for (int i = 0; i < ntp->num_servers; i++) {
+            ntp_discipline_server_t *server = &ntp->servers[i];
+            if (server->resolved && server->sent_us && ip_addr_cmp(addr, &server->address)) {
+                handle_answer(server, msg, received_us);
+                break;
+            }
+        }
+    }
+    pbuf_free(p);
+}
+
+static void dns_found(const char *hostname, const ip_addr_t *ipaddr, void *arg) {
+    ntp_discipline_server_t *server = (ntp_discipline_server_t *)arg;
+    if (ipaddr && strcmp(hostname, server->hostname) == 0) {
+        server->address = *ipaddr;
+        server->resolved = true;
+    }
+}
+
+// Each poll looks up the servers, sends each of them a burst of requests and then uses the answers
+static void worker_fn(async_context_t *context, async_at_time_worker_t *worker) {
+    ntp_discipline_t *ntp = (ntp_discipline_t *)worker->user_data;
+    uint32_t next_ms = NTP_BURST_INTERVAL_MS;
+    if (ntp->phase == 0) {
+        for (int i = 0; i < ntp->num_servers; i++) {
+            ntp_discipline_server_t *server = &ntp->servers[i];
+            server->resolved = false;
+            server->have_sample = false;
+            server->sent_us = 0;
+            // Look the servers up every time, as pools hand out different servers
+            if (dns_gethostbyname(server->hostname, &server->address, dns_found, server) == ERR_OK) {
+                server->resolved = true;
+            }
+        }
+        next_ms = NTP_DNS_WAIT_MS;
+    } else if (ntp->phase <= NTP_DISCIPLINE_BURST) {
+        for (int i = 0; i < ntp->num_servers; i++) {
+            if (ntp->servers[i].resolved) {
+                send_request(ntp, &ntp->servers[i]);
+            }
+        }
+    } else {
+        update_clock(ntp);
+        ntp->phase = 0;
+        async_context_add_at_time_worker_in_ms(context, worker, ntp->poll_s * 1000);
+        return;
+    }
+    ntp->phase++;
+    async_context_add_at_time_worker_in_ms(context, worker, next_ms);
+}
+
+bool ntp_discipline_start(ntp_discipline_t *ntp, async_context_t *context, const char *const *servers, int num_servers) {
+    memset(ntp, 0, sizeof(*ntp));
+    critical_section_init(&ntp->lock);
+    ntp->context = context;
+    ntp->num_servers = MIN(num_servers, NTP_DISCIPLINE_MAX_SERVERS);
+    for (int i = 0; i < ntp->num_servers; i++) {
+        ntp->servers[i].hostname = servers[i];
+    }
+    ntp->poll_s = NTP_DISCIPLINE_MIN_POLL_S;
+    ntp->worker.do_work = worker_fn;
+    ntp->worker.user_data = ntp;
+
+    async_context_acquire_lock_blocking(context);
+    ntp->pcb = udp_new_ip_type(IPADDR_TYPE_ANY);
+    if (ntp->pcb) {
+        udp_recv(ntp->pcb, ntp_recv, ntp);
+        async_context_add_at_time_worker_in_ms(context, &ntp->worker, 0);
+    }
+    async_context_release_lock(context);
+    return ntp->pcb != NULL;
+}
+
+void ntp_discipline_stop(ntp_discipline_t *ntp) {
+    async_context_acquire_lock_blocking(ntp->context);
+    async_context_remove_at_time_worker(ntp->context, &ntp->worker);
+    if (ntp->pcb) {
+        udp_remove(ntp->pcb);
+        ntp->pcb = NULL;
+    }
+    async_context_release_lock(ntp->context);
+}
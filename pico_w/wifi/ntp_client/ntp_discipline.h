@@ -0,0 +1,132 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _NTP_DISCIPLINE_H_
+#define _NTP_DISCIPLINE_H_
+
+#include "pico/async_context.h"
+#include "pico/sync.h"
+#include "lwip/ip_addr.h"
+
+struct udp_pcb;
+
+// Keeps a software clock in step with NTP servers in the background.
+//
+// Each poll, every server is sent a burst of requests and the answer with the shortest round trip
+// is kept, as it's least affected by queueing in the network. Servers that disagree with the
+// others are ignored and the answer with the shortest round trip of the rest is used. The offset
+// between the servers' time and time_us_64 is fitted to a line over the last few polls, which
+// gives the frequency error of the crystal. The clock runs at the corrected frequency and any
+// error in its phase is slewed out gradually. A clock that's far behind is stepped forwards, but
+// one that's ahead is only ever slowed down, so it never goes backwards once it has been set.
+// While the clock stays well within NTP_DISCIPLINE_TARGET_US the interval between polls doubles, up to
+// NTP_DISCIPLINE_MAX_POLL_S.
+
+#ifndef NTP_DISCIPLINE_MAX_SERVERS
+#define NTP_DISCIPLINE_MAX_SERVERS 4
+#endif
+
+// Requests sent to each server every poll
+#ifndef NTP_DISCIPLINE_BURST
+#define NTP_DISCIPLINE_BURST 4
+#endif
+
+// Interval between polls, in seconds. The minimum is what public servers expect
+#ifndef NTP_DISCIPLINE_MIN_POLL_S
+#define NTP_DISCIPLINE_MIN_POLL_S 64
+#endif
+
+#ifndef NTP_DISCIPLINE_MAX_POLL_S
+#define NTP_DISCIPLINE_MAX_POLL_S (64 * 256)
+#endif
+
+// The error the interval between polls is adjusted to stay within
+#ifndef NTP_DISCIPLINE_TARGET_US
+#define NTP_DISCIPLINE_TARGET_US 500
+#endif
+
+// The clock is stepped rather than slewed if it's behind by more than this. If it's ahead it's
+// always slewed, which takes 2000 times as long as the error
+#ifndef NTP_DISCIPLINE_STEP_US
+#define NTP_DISCIPLINE_STEP_US 128000
+#endif
+
+// Number of polls used to work out the frequency
+#ifndef NTP_DISCIPLINE_HISTORY
+#define NTP_DISCIPLINE_HISTORY 8
+#endif
+
+typedef struct ntp_discipline_sample_t_ {
+    uint64_t local_us; // time_us_64 at the middle of the round trip
+    int64_t offset_us; // server time minus local time
+    uint32_t delay_us;
+} ntp_discipline_sample_t;
+
+typedef struct ntp_discipline_server_t_ {
+    const char *hostname;
+    ip_addr_t address;
+    bool resolved;
+    uint64_t sent_us; // echoed back by the server, to match the answer to the request
+    ntp_discipline_sample_t best; // shortest round trip in this poll
+    bool have_sample;
+} ntp_discipline_server_t;
+
+// The clock is base_us at local time base_local_us, plus the frequency correction, plus slew_us
+// added at no more than 500 ppm
+typedef struct ntp_discipline_clock_t_ {
+    uint64_t base_local_us;
+    int64_t base_us;
+    int64_t freq_ppb;
+    int64_t slew_us;
+} ntp_discipline_clock_t;
+
+typedef struct ntp_discipline_t_ {
+    async_context_t *context;
+    struct udp_pcb *pcb;
+    async_at_time_worker_t worker;
+    ntp_discipline_server_t servers[NTP_DISCIPLINE_MAX_SERVERS];
+    int num_servers;
+    int phase;
+
+    critical_section_t lock; // for reading the clock from anywhere
+    ntp_discipline_clock_t clock;
+    bool synced;
+
+    ntp_discipline_sample_t history[NTP_DISCIPLINE_HISTORY];
+    int history_count;
+    uint32_t poll_s;
+    int good_polls;
+    int bad_polls;
+
+    // Status of the last poll
+    int64_t last_error_us; // the server's time minus the clock's
+    uint32_t last_delay_us;
+    int last_servers; // servers that were used
+    uint32_t polls;
+    uint32_t steps;
+} ntp_discipline_t;
+
+// Start keeping the clock in step with the given servers, which must stay in scope
+bool ntp_discipline_start(ntp_discipline_t *ntp, async_context_t *context, const char *const *servers, int num_servers);
+
+// Stop sending requests, the clock keeps running at the corrected frequency
+void ntp_discipline_stop(ntp_discipline_t *ntp);
+
+// Returns true once the clock has been set
+static inline bool ntp_discipline_synced(const ntp_discipline_t *ntp) {
+    return ntp->synced;
+}
+
+// Returns the time of an earlier time_us_64 reading in microseconds since 1970, or 0 if not synced
+uint64_t ntp_discipline_time_us_at(ntp_discipline_t *ntp, uint64_t local_us);
+
+// Returns the time now in microseconds since 1970, or 0 if not synced
+uint64_t ntp_discipline_time_us(ntp_discipline_t *ntp);
+
+// Returns the current frequency correction in parts per billion
+int32_t ntp_discipline_freq_ppb(ntp_discipline_t *ntp);
+
+#endif
@@ -0,0 +1,88 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <time.h>
+
+#include "pico/stdlib.h"
+#include "pico/cyw43_arch.h"
+
+#include "ntp_discipline.h"
+
+#define STATUS_TIME_MS (10 * 1000)
+
+static const char *const ntp_servers[] = {
+    "0.pool.ntp.org",
+    "1.pool.ntp.org",
+    "2.pool.ntp.org",
+    "3.pool.ntp.org",
+};
+
+static ntp_discipline_t ntp;
+
+static void print_status(void) {
+    if (!ntp_discipline_synced(&ntp)) {
+        printf("waiting for ntp\n");
+        return;
+    }
+    uint64_t now_us = ntp_discipline_time_us(&ntp);
+    time_t secs = (time_t)(now_us / 1000000);
+    struct tm *utc = gmtime(&secs);
+    printf("%02d/%02d/%04d %02d:%02d:%02d.%03u offset %lldus freq %ldppb poll %us delay %uus servers %d\n",
+           utc->tm_mday, utc->tm_mon + 1, utc->tm_year + 1900, utc->tm_hour, utc->tm_min, utc->tm_sec,
+           (unsigned)(now_us / 1000 % 1000), (long long)ntp.last_error_us, (long)ntp_discipline_freq_ppb(&ntp),
+           (unsigned)ntp.poll_s, (unsigned)ntp.last_delay_us, ntp.last_servers);
+}
+
+// Runs the clock until 'q' is pressed
+static void run_ntp_discipline(void) {
+    if (!ntp_discipline_start(&ntp, cyw43_arch_async_context(), ntp_servers, count_of(ntp_servers))) {
+        printf("failed to start ntp\n");
+        return;
+    }
+    printf("Press 'q' to quit\n");
+    absolute_time_t status_time = make_timeout_time_ms(STATUS_TIME_MS);
+    while(true) {
+        int key = getchar_timeout_us(0);
+        if (key == 'q' || key == 'Q') {
+            break;
+        }
+        if (absolute_time_diff_us(get_absolute_time(), status_time) <= 0) {
+            print_status();
+            status_time = delayed_by_ms(status_time, STATUS_TIME_MS);
+        }
+#if PICO_CYW43_ARCH_POLL
+        // if you are using pico_cyw43_arch_poll, then you must poll periodically from your
+        // main loop (not from a timer interrupt) to check for Wi-Fi driver or lwIP work that needs to be done.
+        cyw43_arch_poll();
+        cyw43_arch_wait_for_work_until(status_time);
+#else
+        // if you are not using pico_cyw43_arch_poll, then WiFI driver and lwIP work
+        // is done via interrupt in the background. This sleep is just an example of some (blocking)
+        // work you might be doing.
+        sleep_ms(100);
+#endif
+    }
+    ntp_discipline_stop(&ntp);
+}
+
+int main() {
+    stdio_init_all();
+
+    if (cyw43_arch_init()) {
+        printf("failed to initialise\n");
+        return 1;
+    }
+
+    cyw43_arch_enable_sta_mode();
+
+    if (cyw43_arch_wifi_connect_timeout_ms(WIFI_SSID, WIFI_PASSWORD, CYW43_AUTH_WPA2_AES_PSK, 30000)) {
+        printf("failed to connect\n");
+        return 1;
+    }
+    run_ntp_discipline();
+    cyw43_arch_deinit();
+    return 0;
+}
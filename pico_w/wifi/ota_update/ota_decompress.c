@@ -0,0 +1,81 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "ota_decompress.h"
+
+#define OTA_DECOMPRESS_MIN_MATCH 3
+#define OTA_DECOMPRESS_LONG_MATCH 15
+
+void ota_decompress_init(OTA_DECOMPRESS_T *d, uint32_t size, ota_decompress_output_fn output_fn, void *output_arg) {
+    memset(d, 0, sizeof(*d));
+    d->size = size;
+    d->output_fn = output_fn;
+    d->output_arg = output_arg;
+}
+
+// Add a byte to the window, passing on each block once it's full
+static int ota_decompress_put(OTA_DECOMPRESS_T *d, uint8_t byte) {
+    d->window[d->pos % OTA_DECOMPRESS_WINDOW_SIZE] = byte;
+    d->pos++;
+    if (d->pos % OTA_DECOMPRESS_BLOCK_SIZE == 0) {
+        return d->output_fn(d->output_arg, &d->window[(d->pos - OTA_DECOMPRESS_BLOCK_SIZE) % OTA_DECOMPRESS_WINDOW_SIZE],
+                            OTA_DECOMPRESS_BLOCK_SIZE);
+    }
+    if (d->pos == d->size) {
+        uint32_t len = d->pos % OTA_DECOMPRESS_BLOCK_SIZE;
+        return d->output_fn(d->output_arg, &d->window[(d->pos - len) % OTA_DECOMPRESS_WINDOW_SIZE], len);
+    }
+    return 0;
+}
+
+int ota_decompress_update(OTA_DECOMPRESS_T *d, const uint8_t *in, uint32_t len) {
+    while (len && !ota_decompress_done(d)) {
+        if (!d->flag_bits) {
+            d->flags = *in++;
+            len--;
+            d->flag_bits = 8;
+            continue;
+        }
+        if (d->flags & 1) {
+            int rc = ota_decompress_put(d, *in++);
+            len--;
+            if (rc) {
+                return rc;
+            }
+        } else {
+            d->token[d->token_len++] = *in++;
+            len--;
+            if (d->token_len < 2) {
+                continue;
+            }
+            uint16_t token = d->token[0] | (d->token[1] << 8);
+            uint32_t length = (token & 0xf) + OTA_DECOMPRESS_MIN_MATCH;
+            if ((token & 0xf) == OTA_DECOMPRESS_LONG_MATCH) {
+                if (d->token_len < 3) {
+                    continue;
+                }
+                length += d->token[2];
+            }
+            uint32_t distance = (token >> 4) + 1;
+            d->token_len = 0;
+            if (distance > d->pos) {
+                return -1;
+            }
+            while (length-- && !ota_decompress_done(d)) {
+                int rc = ota_decompress_put(d, d->window[(d->pos - distance) % OTA_DECOMPRESS_WINDOW_SIZE]);
+                if (rc) {
+                    return rc;
+                }
+            }
+        }
+        d->flags >>= 1;
+        d->flag_bits--;
+    }
+    return 0;
+}
@@ -0,0 +1,81 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef OTA_DECOMPRESS_H
+#define OTA_DECOMPRESS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Streaming decompressor for OTA images compressed by python_ota_update.py --compress.
+ *
+ * The format is a simple LZSS. Each flag byte describes the next eight items, least significant
+ * bit first. A set bit is a literal byte, and a clear bit is a little endian 16 bit match token
+ * containing the distance minus one in the top 12 bits and the length minus three in the bottom
+ * 4 bits. A length field of 15 is followed by a byte which is added to a length of 18.
+ *
+ * Output is produced in OTA_DECOMPRESS_BLOCK_SIZE blocks from a window of twice that size, so
+ * matches can refer back up to OTA_DECOMPRESS_MAX_DISTANCE bytes. No memory is allocated.
+ */
+#define OTA_DECOMPRESS_BLOCK_SIZE 4096
+#define OTA_DECOMPRESS_WINDOW_SIZE (2 * OTA_DECOMPRESS_BLOCK_SIZE)
+#define OTA_DECOMPRESS_MAX_DISTANCE 4096
+
+/*! \brief Function called with each block of decompressed output
+ *
+ * @param arg argument passed to ota_decompress_init
+ * @param data decompressed data
+ * @param len length of the data, which is OTA_DECOMPRESS_BLOCK_SIZE except for the final block
+ * @return zero to continue, or an error which is returned from ota_decompress_update
+ */
+typedef int (*ota_decompress_output_fn)(void *arg, const uint8_t *data, uint32_t len);
+
+/*! \brief Decompressor state
+ */
+typedef struct OTA_DECOMPRESS_T_ {
+    uint8_t window[OTA_DECOMPRESS_WINDOW_SIZE];
+    uint32_t pos;
+    uint32_t size;
+    uint8_t flags;
+    uint8_t flag_bits;
+    uint8_t token[3];
+    uint8_t token_len;
+    ota_decompress_output_fn output_fn;
+    void *output_arg;
+} OTA_DECOMPRESS_T;
+
+/*! \brief Start decompressing
+ *
+ * @param d decompressor state
+ * @param size number of bytes of decompressed output expected
+ * @param output_fn function to call with decompressed data
+ * @param output_arg argument to pass to output_fn
+ */
+void ota_decompress_init(OTA_DECOMPRESS_T *d, uint32_t size, ota_decompress_output_fn output_fn, void *output_arg);
+
+/*! \brief Decompress some more data
+ *
+ * The input can be split at any point. Once all the expected output has been produced, the last
+ * partial block is passed to the output function and any remaining input is ignored
+ *
+ * @param d decompressor state
+ * @param in compressed data
+ * @param len length of the compressed data
+ * @return zero on success, or an error
+ */
+int ota_decompress_update(OTA_DECOMPRESS_T *d, const uint8_t *in, uint32_t len);
+
+/*! \brief Check if decompression has finished
+ *
+ * @param d decompressor state
+ * @return true if all the expected output has been produced
+ */
+static inline bool ota_decompress_done(const OTA_DECOMPRESS_T *d) {
+    return d->pos >= d->size;
+}
+
+#endif
@@ -14,6 +14,9 @@
 #include "boot/picobin.h"
 #include "boot/picoboot.h"
 #include "boot/uf2.h"
+#include "pico/flash.h"
+
+#include "ota_decompress.h"
 
 #include "lwip/pbuf.h"
 #include "lwip/tcp.h"
@@ -26,10 +29,68 @@
 
 #define FLASH_SECTOR_ERASE_SIZE 4096u
 
+// A streaming update starts with an OTA_STREAM_HEADER_T rather than a UF2 block, and the
+// host then sends the UF2 blocks as fast as the TCP window allows. They are queued in
+// OTA_STREAM_BUF_COUNT buffers which are programmed from the main loop, so the network keeps
+// receiving while flash is being written.
+//
+// A delta update also starts with a header. The server replies with the sha256 of each 4K sector
+// of the target partition and of the running partition, covering the size of the new image. The
+// host then sends one op per sector, followed by the contents of just the sectors which are in
+// neither partition already. Sectors which match the target are left alone, and sectors which
+// match the running partition are copied from it.
+//
+// A compressed update sends the image itself rather than UF2 blocks, compressed in the format
+// described in ota_decompress.h. It is decompressed a sector at a time as it arrives.
+#define OTA_STREAM_MAGIC 0x5341544fu // "OTAS"
+#define OTA_MODE_LOCKSTEP 0
+#define OTA_MODE_STREAM 1
+#define OTA_MODE_DELTA 2
+#define OTA_MODE_COMPRESSED 3
+#define OTA_DELTA_OP_SKIP 0
+#define OTA_DELTA_OP_COPY 1
+#define OTA_DELTA_OP_DATA 2
+#define OTA_DELTA_MAX_SECTORS (PICO_FLASH_SIZE_BYTES / FLASH_SECTOR_ERASE_SIZE)
+#define OTA_DELTA_OPS_SIZE(state) (((state)->delta_sectors + 3) & ~3u)
+#define OTA_STREAM_BUF_SIZE 4096
+#define OTA_STREAM_BUF_COUNT 4
+#define OTA_STREAM_BLOCK_PAYLOAD 256
+
+typedef struct OTA_STREAM_HEADER_T_ {
+    uint32_t magic;
+    uint32_t mode;
+    uint32_t num_blocks;
+    uint32_t family_id;
+    uint32_t target_addr; // of the first block
+    uint32_t image_size;
+    uint32_t payload_size; // compressed size
+    // sha256 of the image as it will appear in flash, from the first block's target address
+    // to the end of the last block, with any gaps left erased (0xff)
+    uint8_t image_hash[SHA256_RESULT_BYTES];
+} OTA_STREAM_HEADER_T;
+
+// Sent back to the host once the streamed image has been verified
+typedef struct OTA_STREAM_RESULT_T_ {
+    int32_t status;
+    uint8_t image_hash[SHA256_RESULT_BYTES];
+} OTA_STREAM_RESULT_T;
+
+// Sent for each sector at the start of a delta update
+typedef struct OTA_DELTA_SECTOR_HASH_T_ {
+    uint8_t target_hash[SHA256_RESULT_BYTES];
+    uint8_t running_hash[SHA256_RESULT_BYTES];
+} OTA_DELTA_SECTOR_HASH_T;
+
+typedef struct OTA_STREAM_BUF_T_ {
+    __attribute__((aligned(4))) uint8_t data[OTA_STREAM_BUF_SIZE];
+    uint32_t len;
+} OTA_STREAM_BUF_T;
+
 typedef struct TCP_UPDATE_SERVER_T_ {
     struct tcp_pcb *server_pcb;
     struct tcp_pcb *client_pcb;
     bool complete;
+    int status;
     __attribute__((aligned(4))) uint8_t buffer_sent[SHA256_RESULT_BYTES];
     __attribute__((aligned(4))) uint8_t buffer_recv[BUF_SIZE];
     int sent_len;
@@ -41,6 +102,34 @@ typedef struct TCP_UPDATE_SERVER_T_ {
     int32_t write_offset;
     uint32_t write_size;
     uint32_t highest_erased_sector;
+    // streaming mode
+    int mode;
+    bool mode_known;
+    OTA_STREAM_HEADER_T header;
+    uint32_t header_len;
+    uint32_t stream_total;
+    uint32_t stream_received;
+    uint32_t progress_at_poll;
+    struct pbuf *rx_pbuf;
+    OTA_STREAM_BUF_T bufs[OTA_STREAM_BUF_COUNT];
+    uint32_t buf_head; // next buffer to fill, written by lwIP
+    uint32_t buf_tail; // next buffer to program, written by the main loop
+    uint32_t first_target_addr;
+    uint32_t last_target_addr;
+    uint32_t image_size;
+    uint32_t erase_next; // next storage address to erase
+    uint32_t erase_limit;
+    bool finishing; // set while the image is verified and the result sent, which can take a while
+    bool verified;
+    // delta and compressed modes
+    bool target_known;
+    uint32_t delta_sectors;
+    uint32_t delta_hashes_sent;
+    uint32_t delta_ops_len;
+    uint32_t delta_next;
+    uint8_t delta_ops[OTA_DELTA_MAX_SECTORS];
+    OTA_DECOMPRESS_T decompress;
+    uint32_t decompress_offset;
 } TCP_UPDATE_SERVER_T;
 
 typedef struct uf2_block uf2_block_t;
@@ -57,6 +146,66 @@ static TCP_UPDATE_SERVER_T* tcp_update_server_init(void) {
 
 static __attribute__((aligned(4))) uint8_t workarea[4 * 1024];
 
+typedef struct OTA_FLASH_OP_T_ {
+    cflash_flags_t flags;
+    uint32_t addr;
+    uint32_t size;
+    void *buf;
+    int ret;
+} OTA_FLASH_OP_T;
+
+// This function will be called when it's safe to call rom_flash_op
+static void call_rom_flash_op(void *param) {
+    OTA_FLASH_OP_T *op = (OTA_FLASH_OP_T*)param;
+    op->ret = rom_flash_op(op->flags, op->addr, op->size, op->buf);
+}
+
+// Perform a flash operation. flash_safe_execute disables interrupts so that no code runs from
+// flash while it is inaccessible
+static int ota_flash_op_aspace(uint32_t op_value, uint32_t aspace, uint32_t addr, uint32_t size, void *buf) {
+    OTA_FLASH_OP_T op = {
+        .addr = addr,
+        .size = size,
+        .buf = buf,
+    };
+    op.flags.flags =
+        (op_value << CFLASH_OP_LSB) |
+        (CFLASH_SECLEVEL_VALUE_SECURE << CFLASH_SECLEVEL_LSB) |
+        (aspace << CFLASH_ASPACE_LSB);
+    int rc = flash_safe_execute(call_rom_flash_op, &op, UINT32_MAX);
+    if (rc != PICO_OK) {
+        return rc;
+    }
+    return op.ret;
+}
+
+// Perform a flash operation on the storage address space, i.e. without address translation
+static int ota_flash_op(uint32_t op_value, uint32_t addr, uint32_t size, void *buf) {
+    return ota_flash_op_aspace(op_value, CFLASH_ASPACE_VALUE_STORAGE, addr, size, buf);
+}
+
+// Work out where an image for this family and starting at this address is going
+static void ota_setup_target(TCP_UPDATE_SERVER_T *state, uint32_t family_id, uint32_t target_addr) {
+    state->family_id = family_id;
+
+    resident_partition_t uf2_target_partition;
+    rom_flash_flush_cache();
+    rom_get_uf2_target_partition(workarea, sizeof(workarea), state->family_id, &uf2_target_partition);
+    printf("Code Target partition is %lx %lx\n", uf2_target_partition.permissions_and_location, uf2_target_partition.permissions_and_flags);
+
+    uint16_t first_sector_number = (uf2_target_partition.permissions_and_location & PICOBIN_PARTITION_LOCATION_FIRST_SECTOR_BITS) >> PICOBIN_PARTITION_LOCATION_FIRST_SECTOR_LSB;
+    uint16_t last_sector_number = (uf2_target_partition.permissions_and_location & PICOBIN_PARTITION_LOCATION_LAST_SECTOR_BITS) >> PICOBIN_PARTITION_LOCATION_LAST_SECTOR_LSB;
+    uint32_t code_start_addr = first_sector_number * 0x1000;
+    uint32_t code_end_addr = (last_sector_number + 1) * 0x1000;
+    uint32_t code_size = code_end_addr - code_start_addr;
+    printf("Start %lx, End %lx, Size %lx\n", code_start_addr, code_end_addr, code_size);
+
+    state->flash_update = code_start_addr + XIP_BASE;
+    state->write_offset = code_start_addr + XIP_BASE - target_addr;
+    state->write_size = code_size;
+    DEBUG_printf("Write Offset %lx, Size %lx\n", state->write_offset, state->write_size);
+}
+
 static err_t tcp_update_server_close(void *arg) {
     TCP_UPDATE_SERVER_T *state = (TCP_UPDATE_SERVER_T*)arg;
     err_t err = ERR_OK;
@@ -79,6 +228,10 @@ static err_t tcp_update_server_close(void *arg) {
         tcp_close(state->server_pcb);
         state->server_pcb = NULL;
     }
+    if (state->rx_pbuf) {
+        pbuf_free(state->rx_pbuf);
+        state->rx_pbuf = NULL;
+    }
     return err;
 }
 
@@ -89,6 +242,7 @@ static err_t tcp_update_server_result(void *arg, int status) {
     } else {
         DEBUG_printf("test failed %d\n", status);
     }
+    state->status = status;
     state->complete = true;
     return tcp_update_server_close(arg);
 }
@@ -126,6 +280,89 @@ err_t tcp_update_server_send_data(void *arg, struct tcp_pcb *tpcb)
     return ERR_OK;
 }
 
+// Move received data into free stream buffers. Only data that has been queued is acknowledged
+// with tcp_recved, so the TCP window closes if flash programming falls behind
+static err_t ota_stream_fill(TCP_UPDATE_SERVER_T *state) {
+    cyw43_arch_lwip_check();
+    while (state->rx_pbuf) {
+        uint16_t consumed;
+        if (state->header_len < sizeof(state->header)) {
+            consumed = pbuf_copy_partial(state->rx_pbuf, (uint8_t*)&state->header + state->header_len,
+                                         sizeof(state->header) - state->header_len, 0);
+            state->header_len += consumed;
+            if (state->header_len == sizeof(state->header)) {
+                if (state->header.mode == OTA_MODE_STREAM && state->header.num_blocks) {
+                    state->stream_total = state->header.num_blocks * sizeof(uf2_block_t);
+                    DEBUG_printf("Streaming %lu blocks\n", state->header.num_blocks);
+                } else if (state->header.mode == OTA_MODE_DELTA && state->header.image_size &&
+                           state->header.image_size <= OTA_DELTA_MAX_SECTORS * FLASH_SECTOR_ERASE_SIZE) {
+                    state->mode = OTA_MODE_DELTA;
+                    state->delta_sectors = (state->header.image_size + FLASH_SECTOR_ERASE_SIZE - 1) / FLASH_SECTOR_ERASE_SIZE;
+                    DEBUG_printf("Delta update of %lu sectors\n", state->delta_sectors);
+                } else if (state->header.mode == OTA_MODE_COMPRESSED && state->header.image_size &&
+                           state->header.payload_size) {
+                    state->mode = OTA_MODE_COMPRESSED;
+                    state->stream_total = state->header.payload_size;
+                    DEBUG_printf("Compressed update of %lu bytes\n", state->stream_total);
+                } else {
+                    DEBUG_printf("bad stream header mode %lu blocks %lu\n", state->header.mode, state->header.num_blocks);
+                    return tcp_update_server_result(state, -1);
+                }
+            }
+        } else if (state->mode == OTA_MODE_DELTA && state->delta_ops_len < OTA_DELTA_OPS_SIZE(state)) {
+            // One op per sector, padded to a multiple of four bytes
+            consumed = MIN(OTA_DELTA_OPS_SIZE(state) - state->delta_ops_len, state->rx_pbuf->tot_len);
+            for (uint16_t i = 0; i < consumed; i++, state->delta_ops_len++) {
+                uint8_t op = pbuf_get_at(state->rx_pbuf, i);
+                if (state->delta_ops_len < state->delta_sectors) {
+                    state->delta_ops[state->delta_ops_len] = op;
+                    if (op == OTA_DELTA_OP_DATA) {
+                        state->stream_total += FLASH_SECTOR_ERASE_SIZE;
+                    }
+                }
+            }
+            if (state->delta_ops_len == OTA_DELTA_OPS_SIZE(state)) {
+                DEBUG_printf("Delta update needs %lu bytes\n", state->stream_total);
+            }
+        } else {
+            if (state->buf_head - state->buf_tail == OTA_STREAM_BUF_COUNT) {
+                // All buffers are waiting to be programmed
+                break;
+            }
+            OTA_STREAM_BUF_T *buf = &state->bufs[state->buf_head % OTA_STREAM_BUF_COUNT];
+            uint32_t want = MIN(OTA_STREAM_BUF_SIZE - buf->len, state->stream_total - state->stream_received);
+            consumed = pbuf_copy_partial(state->rx_pbuf, buf->data + buf->len, MIN(want, state->rx_pbuf->tot_len), 0);
+            buf->len += consumed;
+            state->stream_received += consumed;
+            if (buf->len == OTA_STREAM_BUF_SIZE || state->stream_received == state->stream_total) {
+                state->buf_head++;
+            }
+            if (!consumed) {
+                // Anything beyond the advertised image size is ignored
+                consumed = state->rx_pbuf->tot_len;
+            }
+        }
+        tcp_recved(state->client_pcb, consumed);
+        state->rx_pbuf = pbuf_free_header(state->rx_pbuf, consumed);
+    }
+    return ERR_OK;
+}
+
+static err_t tcp_update_server_recv_stream(TCP_UPDATE_SERVER_T *state, struct pbuf *p) {
+    if (state->finishing) {
+        // The stream has ended or been abandoned, so there's nowhere for more data to go
+        tcp_recved(state->client_pcb, p->tot_len);
+        pbuf_free(p);
+        return ERR_OK;
+    }
+    if (state->rx_pbuf) {
+        pbuf_cat(state->rx_pbuf, p);
+    } else {
+        state->rx_pbuf = p;
+    }
+    return ota_stream_fill(state);
+}
+
 err_t tcp_update_server_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err) {
     TCP_UPDATE_SERVER_T *state = (TCP_UPDATE_SERVER_T*)arg;
     if (!p) {
@@ -135,6 +372,28 @@ err_t tcp_update_server_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, er
     // can use this method to cause an assertion in debug mode, if this method is called when
     // cyw43_arch_lwip_begin IS needed
     cyw43_arch_lwip_check();
+
+    // The host either sends UF2 blocks straight away, or a stream header first. Hold on to what
+    // has arrived until there is enough to tell which
+    if (!state->mode_known) {
+        if (state->rx_pbuf) {
+            pbuf_cat(state->rx_pbuf, p);
+            p = state->rx_pbuf;
+            state->rx_pbuf = NULL;
+        }
+        if (p->tot_len < sizeof(uint32_t)) {
+            state->rx_pbuf = p;
+            return ERR_OK;
+        }
+        uint32_t magic;
+        pbuf_copy_partial(p, &magic, sizeof(magic), 0);
+        state->mode = magic == OTA_STREAM_MAGIC ? OTA_MODE_STREAM : OTA_MODE_LOCKSTEP;
+        state->mode_known = true;
+    }
+    if (state->mode != OTA_MODE_LOCKSTEP) {
+        return tcp_update_server_recv_stream(state, p);
+    }
+
     if (p->tot_len > 0) {
         DEBUG_printf("tcp_update_server_recv %d/%d err %d\n", p->tot_len, state->recv_len, err);
 
@@ -156,24 +415,7 @@ err_t tcp_update_server_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, er
 
             if (state->num_blocks == 0) {
                 state->num_blocks = block->num_blocks;
-                state->family_id = block->file_size; // or familyID;
-
-                resident_partition_t uf2_target_partition;
-                rom_flash_flush_cache();
-                rom_get_uf2_target_partition(workarea, sizeof(workarea), state->family_id, &uf2_target_partition);
-                printf("Code Target partition is %lx %lx\n", uf2_target_partition.permissions_and_location, uf2_target_partition.permissions_and_flags);
-
-                uint16_t first_sector_number = (uf2_target_partition.permissions_and_location & PICOBIN_PARTITION_LOCATION_FIRST_SECTOR_BITS) >> PICOBIN_PARTITION_LOCATION_FIRST_SECTOR_LSB;
-                uint16_t last_sector_number = (uf2_target_partition.permissions_and_location & PICOBIN_PARTITION_LOCATION_LAST_SECTOR_BITS) >> PICOBIN_PARTITION_LOCATION_LAST_SECTOR_LSB;
-                uint32_t code_start_addr = first_sector_number * 0x1000;
-                uint32_t code_end_addr = (last_sector_number + 1) * 0x1000;
-                uint32_t code_size = code_end_addr - code_start_addr;
-                printf("Start %lx, End %lx, Size %lx\n", code_start_addr, code_end_addr, code_size);
-
-                state->flash_update = code_start_addr + XIP_BASE;
-                state->write_offset = code_start_addr + XIP_BASE - block->target_addr;
-                state->write_size = code_size;
-                DEBUG_printf("Write Offset %lx, Size %lx\n", state->write_offset, state->write_size);
+                ota_setup_target(state, block->file_size, block->target_addr); // or familyID;
             }
 
             if (state->blocks_done != block->block_no) {
@@ -187,25 +429,16 @@ err_t tcp_update_server_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, er
             DEBUG_printf("tcp_update_server_recv buffer ok\n");
 
             // Write to flash
-            struct cflash_flags flags;
-            int8_t ret;
+            int ret;
             (void)ret;
             if (block->target_addr / FLASH_SECTOR_ERASE_SIZE > state->highest_erased_sector) {
-                flags.flags =
-                    (CFLASH_OP_VALUE_ERASE << CFLASH_OP_LSB) | 
-                    (CFLASH_SECLEVEL_VALUE_SECURE << CFLASH_SECLEVEL_LSB) |
-                    (CFLASH_ASPACE_VALUE_STORAGE << CFLASH_ASPACE_LSB);
-                ret = rom_flash_op(flags,
+                ret = ota_flash_op(CFLASH_OP_VALUE_ERASE,
                     block->target_addr + state->write_offset,
                     FLASH_SECTOR_ERASE_SIZE, NULL);
                 state->highest_erased_sector = block->target_addr / FLASH_SECTOR_ERASE_SIZE;
                 DEBUG_printf("Checked Erase Returned %d, start %x, size %x, highest erased %x\n", ret, block->target_addr + state->write_offset, FLASH_SECTOR_ERASE_SIZE, state->highest_erased_sector);
             }
-            flags.flags =
-                (CFLASH_OP_VALUE_PROGRAM << CFLASH_OP_LSB) | 
-                (CFLASH_SECLEVEL_VALUE_SECURE << CFLASH_SECLEVEL_LSB) |
-                (CFLASH_ASPACE_VALUE_STORAGE << CFLASH_ASPACE_LSB);
-            ret = rom_flash_op(flags,
+            ret = ota_flash_op(CFLASH_OP_VALUE_PROGRAM,
                 block->target_addr + state->write_offset,
                 256, (void*)block->data);
             DEBUG_printf("Checked Program Returned %d, start %x, size %x\n", ret, block->target_addr + state->write_offset, 256);
@@ -235,8 +468,355 @@ err_t tcp_update_server_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, er
     return ERR_OK;
 }
 
+// Program one streamed block, erasing any sectors it needs that have not been erased ahead of time
+static int ota_stream_program_block(TCP_UPDATE_SERVER_T *state, const uf2_block_t *block) {
+    if (block->magic_start0 != UF2_MAGIC_START0 || block->magic_start1 != UF2_MAGIC_START1 ||
+        block->magic_end != UF2_MAGIC_END) {
+        DEBUG_printf("bad block magic\n");
+        return -1;
+    }
+    if (state->blocks_done == 0) {
+        state->num_blocks = block->num_blocks;
+        ota_setup_target(state, block->file_size, block->target_addr);
+        if (state->num_blocks != state->header.num_blocks) {
+            DEBUG_printf("block count mismatch - header %lu, uf2 %d\n", state->header.num_blocks, state->num_blocks);
+            return -1;
+        }
+        state->first_target_addr = block->target_addr;
+        state->erase_next = state->flash_update;
+        // Assume the blocks are contiguous when deciding how far ahead to erase
+        state->erase_limit = state->flash_update + MIN(state->write_size,
+            (state->num_blocks * OTA_STREAM_BLOCK_PAYLOAD + FLASH_SECTOR_ERASE_SIZE - 1) & ~(FLASH_SECTOR_ERASE_SIZE - 1));
+    } else if (block->target_addr < state->last_target_addr + OTA_STREAM_BLOCK_PAYLOAD) {
+        DEBUG_printf("streamed blocks must be in ascending address order\n");
+        return -1;
+    }
+    if (state->blocks_done != block->block_no) {
+        DEBUG_printf("block number mismatch - expected %d, got %d\n", state->blocks_done, block->block_no);
+        return -1;
+    }
+    if (state->family_id != block->file_size) {
+        DEBUG_printf("family id mismatch\n");
+        return -1;
+    }
+    uint32_t offset = block->target_addr - state->first_target_addr;
+    if (offset + OTA_STREAM_BLOCK_PAYLOAD > state->write_size) {
+        DEBUG_printf("block outside partition\n");
+        return -1;
+    }
+    uint32_t addr = state->flash_update + offset;
+    while (addr >= state->erase_next) {
+        int ret = ota_flash_op(CFLASH_OP_VALUE_ERASE, state->erase_next, FLASH_SECTOR_ERASE_SIZE, NULL);
+        if (ret) {
+            DEBUG_printf("erase failed %d\n", ret);
+            return ret;
+        }
+        state->erase_next += FLASH_SECTOR_ERASE_SIZE;
+    }
+    int ret = ota_flash_op(CFLASH_OP_VALUE_PROGRAM, addr, OTA_STREAM_BLOCK_PAYLOAD, (void*)block->data);
+    if (ret) {
+        DEBUG_printf("program failed %d\n", ret);
+        return ret;
+    }
+    state->last_target_addr = block->target_addr;
+    state->image_size = offset + OTA_STREAM_BLOCK_PAYLOAD;
+    state->blocks_done++;
+    return 0;
+}
+
+// Read back the whole image from flash and check it against the hash the host sent
+static int ota_stream_verify(TCP_UPDATE_SERVER_T *state, sha256_result_t *result) {
+    pico_sha256_state_t sha_state;
+    int rc = pico_sha256_start_blocking(&sha_state, SHA256_BIG_ENDIAN, true); // using some DMA system resources
+    hard_assert(rc == PICO_OK);
+    for (uint32_t offset = 0; offset < state->image_size; offset += sizeof(workarea)) {
+        uint32_t len = MIN(sizeof(workarea), state->image_size - offset);
+        int ret = ota_flash_op(CFLASH_OP_VALUE_READ, state->flash_update + offset, len, workarea);
+        if (ret) {
+            DEBUG_printf("read back failed %d\n", ret);
+            pico_sha256_finish(&sha_state, result);
+            return ret;
+        }
+        pico_sha256_update_blocking(&sha_state, workarea, len);
+    }
+    pico_sha256_finish(&sha_state, result);
+    return memcmp(result->bytes, state->header.image_hash, SHA256_RESULT_BYTES) ? -1 : 0;
+}
+
+static void ota_stream_finish(TCP_UPDATE_SERVER_T *state, int status) {
+    OTA_STREAM_RESULT_T result = { .status = status };
+    // Reading the image back takes longer than the poll interval, so stop the poll from timing out
+    cyw43_arch_lwip_begin();
+    state->finishing = true;
+    cyw43_arch_lwip_end();
+    if (status == 0) {
+        status = ota_stream_verify(state, (sha256_result_t*)result.image_hash);
+        result.status = status;
+        printf("Image verification %s\n", status ? "failed" : "ok");
+    }
+    state->verified = true;
+    cyw43_arch_lwip_begin();
+    if (state->complete) {
+        // The connection was lost, so the host never gets the result. Don't boot the new image
+        DEBUG_printf("connection closed before the result was sent\n");
+    } else if (state->client_pcb) {
+        // tcp_close will send this before closing the connection
+        tcp_write(state->client_pcb, &result, sizeof(result), TCP_WRITE_FLAG_COPY);
+        tcp_output(state->client_pcb);
+        tcp_update_server_result(state, status);
+    } else {
+        tcp_update_server_result(state, -1);
+    }
+    cyw43_arch_lwip_end();
+}
+
+// Find the target partition for a delta or compressed update from the stream header. Returns
+// false if the update has been abandoned
+static bool ota_header_setup_target(TCP_UPDATE_SERVER_T *state) {
+    ota_setup_target(state, state->header.family_id, state->header.target_addr);
+    if (state->header.image_size > state->write_size) {
+        DEBUG_printf("image too big for partition\n");
+        ota_stream_finish(state, -1);
+        return false;
+    }
+    state->image_size = state->header.image_size;
+    state->target_known = true;
+    return true;
+}
+
+// Hash a sector, read from the given flash address space. The hash is left as zeros if the sector
+// can't be read, e.g. if it is beyond the end of the running partition
+static void ota_delta_hash_sector(uint32_t aspace, uint32_t addr, uint8_t *hash) {
+    memset(hash, 0, SHA256_RESULT_BYTES);
+    if (ota_flash_op_aspace(CFLASH_OP_VALUE_READ, aspace, addr, FLASH_SECTOR_ERASE_SIZE, workarea)) {
+        return;
+    }
+    pico_sha256_state_t sha_state;
+    int rc = pico_sha256_start_blocking(&sha_state, SHA256_BIG_ENDIAN, true); // using some DMA system resources
+    hard_assert(rc == PICO_OK);
+    pico_sha256_update_blocking(&sha_state, workarea, FLASH_SECTOR_ERASE_SIZE);
+    sha256_result_t result;
+    pico_sha256_finish(&sha_state, &result);
+    memcpy(hash, result.bytes, SHA256_RESULT_BYTES);
+}
+
+// Called from the main loop to send the sector hashes for a delta update, then to update each
+// sector as the host has asked. Returns false if there was nothing to do
+static bool ota_delta_work(TCP_UPDATE_SERVER_T *state) {
+    if (!state->target_known) {
+        return ota_header_setup_target(state);
+    }
+
+    if (state->delta_hashes_sent < state->delta_sectors) {
+        cyw43_arch_lwip_begin();
+        bool have_space = state->client_pcb && tcp_sndbuf(state->client_pcb) >= sizeof(OTA_DELTA_SECTOR_HASH_T);
+        cyw43_arch_lwip_end();
+        if (!have_space) {
+            return false;
+        }
+        // The running image is linked at the same address as the new one, so find it by address translation
+        OTA_DELTA_SECTOR_HASH_T hashes;
+        uint32_t offset = state->delta_hashes_sent * FLASH_SECTOR_ERASE_SIZE;
+        ota_delta_hash_sector(CFLASH_ASPACE_VALUE_STORAGE, state->flash_update + offset, hashes.target_hash);
+        ota_delta_hash_sector(CFLASH_ASPACE_VALUE_RUNTIME, state->header.target_addr + offset, hashes.running_hash);
+        state->delta_hashes_sent++;
+
+        err_t err = ERR_CONN;
+        cyw43_arch_lwip_begin();
+        if (state->client_pcb) {
+            err = tcp_write(state->client_pcb, &hashes, sizeof(hashes), TCP_WRITE_FLAG_COPY);
+            if (state->delta_hashes_sent == state->delta_sectors ||
+                tcp_sndbuf(state->client_pcb) < sizeof(OTA_DELTA_SECTOR_HASH_T)) {
+                tcp_output(state->client_pcb);
+            }
+        }
+        cyw43_arch_lwip_end();
+        if (err != ERR_OK) {
+            DEBUG_printf("Failed to write hashes %d\n", err);
+            ota_stream_finish(state, -1);
+        }
+        return true;
+    }
+
+    if (state->delta_ops_len < OTA_DELTA_OPS_SIZE(state)) {
+        // Waiting for the host to decide what to do
+        return false;
+    }
+
+    if (state->delta_next < state->delta_sectors) {
+        uint32_t offset = state->delta_next * FLASH_SECTOR_ERASE_SIZE;
+        uint8_t op = state->delta_ops[state->delta_next];
+        OTA_STREAM_BUF_T *buf = NULL;
+        const uint8_t *data = NULL;
+        int ret = 0;
+        if (op == OTA_DELTA_OP_COPY) {
+            ret = ota_flash_op_aspace(CFLASH_OP_VALUE_READ, CFLASH_ASPACE_VALUE_RUNTIME,
+                                      state->header.target_addr + offset, FLASH_SECTOR_ERASE_SIZE, workarea);
+            data = workarea;
+        } else if (op == OTA_DELTA_OP_DATA) {
+            cyw43_arch_lwip_begin();
+            bool have_buffer = state->buf_tail != state->buf_head;
+            cyw43_arch_lwip_end();
+            if (!have_buffer) {
+                return false;
+            }
+            buf = &state->bufs[state->buf_tail % OTA_STREAM_BUF_COUNT];
+            data = buf->data;
+        } else if (op != OTA_DELTA_OP_SKIP) {
+            DEBUG_printf("bad delta op %u\n", op);
+            ret = -1;
+        }
+        if (!ret && data) {
+            ret = ota_flash_op(CFLASH_OP_VALUE_ERASE, state->flash_update + offset, FLASH_SECTOR_ERASE_SIZE, NULL);
+            if (!ret) {
+                ret = ota_flash_op(CFLASH_OP_VALUE_PROGRAM, state->flash_update + offset, FLASH_SECTOR_ERASE_SIZE, (void*)data);
+            }
+        }
+        if (buf) {
+            cyw43_arch_lwip_begin();
+            buf->len = 0;
+            state->buf_tail++;
+            ota_stream_fill(state);
+            cyw43_arch_lwip_end();
+        }
+        if (ret) {
+            ota_stream_finish(state, ret);
+        } else {
+            state->delta_next++;
+        }
+        return true;
+    }
+
+    ota_stream_finish(state, 0);
+    return true;
+}
+
+// Called by the decompressor with each sector of the image
+static int ota_decompress_output(void *arg, const uint8_t *data, uint32_t len) {
+    TCP_UPDATE_SERVER_T *state = (TCP_UPDATE_SERVER_T*)arg;
+    if (state->decompress_offset + FLASH_SECTOR_ERASE_SIZE > state->write_size) {
+        return -1;
+    }
+    if (len < FLASH_SECTOR_ERASE_SIZE) {
+        // Leave the rest of the last sector erased
+        memcpy(workarea, data, len);
+        memset(workarea + len, 0xff, FLASH_SECTOR_ERASE_SIZE - len);
+        data = workarea;
+    }
+    uint32_t addr = state->flash_update + state->decompress_offset;
+    int ret = ota_flash_op(CFLASH_OP_VALUE_ERASE, addr, FLASH_SECTOR_ERASE_SIZE, NULL);
+    if (!ret) {
+        ret = ota_flash_op(CFLASH_OP_VALUE_PROGRAM, addr, FLASH_SECTOR_ERASE_SIZE, (void*)data);
+    }
+    state->decompress_offset += FLASH_SECTOR_ERASE_SIZE;
+    return ret;
+}
+
+// Called from the main loop to decompress queued stream buffers into flash. Returns false if
+// there was nothing to do
+static bool ota_compressed_work(TCP_UPDATE_SERVER_T *state) {
+    if (!state->target_known) {
+        if (!ota_header_setup_target(state)) {
+            return false;
+        }
+        ota_decompress_init(&state->decompress, state->header.image_size, ota_decompress_output, state);
+        return true;
+    }
+    cyw43_arch_lwip_begin();
+    bool have_buffer = state->buf_tail != state->buf_head;
+    cyw43_arch_lwip_end();
+    if (!have_buffer) {
+        return false;
+    }
+    OTA_STREAM_BUF_T *buf = &state->bufs[state->buf_tail % OTA_STREAM_BUF_COUNT];
+    int ret = ota_decompress_update(&state->decompress, buf->data, buf->len);
+    cyw43_arch_lwip_begin();
+    buf->len = 0;
+    state->buf_tail++;
+    ota_stream_fill(state);
+    bool received_all = state->stream_received == state->stream_total && state->buf_tail == state->buf_head;
+    cyw43_arch_lwip_end();
+    if (ret) {
+        DEBUG_printf("decompression failed %d\n", ret);
+        ota_stream_finish(state, ret);
+    } else if (ota_decompress_done(&state->decompress)) {
+        ota_stream_finish(state, 0);
+    } else if (received_all) {
+        DEBUG_printf("compressed data ended early\n");
+        ota_stream_finish(state, -1);
+    }
+    return true;
+}
+
+// Called from the main loop to program any queued stream buffers, or to erase ahead of the write
+// pointer while waiting for the network. Returns false if there was nothing to do
+static bool ota_stream_work(TCP_UPDATE_SERVER_T *state) {
+    if (state->mode == OTA_MODE_LOCKSTEP || state->verified || state->complete) {
+        return false;
+    }
+    if (state->mode == OTA_MODE_DELTA) {
+        return ota_delta_work(state);
+    }
+    if (state->mode == OTA_MODE_COMPRESSED) {
+        return ota_compressed_work(state);
+    }
+    cyw43_arch_lwip_begin();
+    bool have_buffer = state->buf_tail != state->buf_head;
+    cyw43_arch_lwip_end();
+
+    if (have_buffer) {
+        // This buffer belongs to the main loop until buf_tail moves on
+        OTA_STREAM_BUF_T *buf = &state->bufs[state->buf_tail % OTA_STREAM_BUF_COUNT];
+        if (buf->len % sizeof(uf2_block_t)) {
+            DEBUG_printf("partial uf2 block\n");
+            ota_stream_finish(state, -1);
+            return true;
+        }
+        for (uint32_t i = 0; i < buf->len; i += sizeof(uf2_block_t)) {
+            int ret = ota_stream_program_block(state, (const uf2_block_t*)(buf->data + i));
+            if (ret) {
+                ota_stream_finish(state, ret);
+                return true;
+            }
+        }
+        cyw43_arch_lwip_begin();
+        buf->len = 0;
+        state->buf_tail++;
+        // Make room for anything lwIP is holding for us
+        ota_stream_fill(state);
+        cyw43_arch_lwip_end();
+        if (state->blocks_done >= state->num_blocks) {
+            ota_stream_finish(state, 0);
+        }
+        return true;
+    }
+    if (state->blocks_done > 0 && state->erase_next < state->erase_limit) {
+        // Nothing to program, so get the next sector ready
+        int ret = ota_flash_op(CFLASH_OP_VALUE_ERASE, state->erase_next, FLASH_SECTOR_ERASE_SIZE, NULL);
+        if (ret) {
+            ota_stream_finish(state, ret);
+        } else {
+            state->erase_next += FLASH_SECTOR_ERASE_SIZE;
+        }
+        return true;
+    }
+    return false;
+}
+
 static err_t tcp_update_server_poll(void *arg, struct tcp_pcb *tpcb) {
+    TCP_UPDATE_SERVER_T *state = (TCP_UPDATE_SERVER_T*)arg;
     DEBUG_printf("tcp_update_server_poll_fn\n");
+    uint32_t progress = state->stream_received + state->blocks_done + state->delta_hashes_sent + state->delta_next +
+                        state->decompress_offset;
+    if (state->finishing) {
+        // ota_stream_finish sends the result and closes the connection
+        return ERR_OK;
+    }
+    if (state->mode != OTA_MODE_LOCKSTEP && progress != state->progress_at_poll) {
+        // Still making progress
+        state->progress_at_poll = progress;
+        return ERR_OK;
+    }
     return tcp_update_server_result(arg, -1); // no response is an error?
 }
 
@@ -349,16 +929,29 @@ int main() {
     }
 
     bool led_state = false;
+    absolute_time_t led_time = make_timeout_time_ms(250);
     while(!state->complete) {
+        // Program or erase flash for a streaming update
+        if (!ota_stream_work(state)) {
+            sleep_ms(1);
+        }
         // Do your application code here
-        led_state = !led_state;
-        cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, led_state);
-        sleep_ms(250);
+        if (time_reached(led_time)) {
+            led_state = !led_state;
+            cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, led_state);
+            led_time = make_timeout_time_ms(250);
+        }
     }
 
     cyw43_arch_deinit();
-    ret = rom_reboot(REBOOT2_FLAG_REBOOT_TYPE_FLASH_UPDATE, 1000, state->flash_update, 0);
-    printf("Done - rebooting for a flash update boot %d\n", ret);
+    if (state->mode != OTA_MODE_LOCKSTEP && state->status != 0) {
+        // A streamed image is only used if it was verified
+        ret = rom_reboot(REBOOT2_FLAG_REBOOT_TYPE_NORMAL, 1000, 0, 0);
+        printf("Update failed %d - rebooting %d\n", state->status, ret);
+    } else {
+        ret = rom_reboot(REBOOT2_FLAG_REBOOT_TYPE_FLASH_UPDATE, 1000, state->flash_update, 0);
+        printf("Done - rebooting for a flash update boot %d\n", ret);
+    }
     free(state);
     sleep_ms(2000);
     return 0;
@@ -1,33 +1,229 @@
 #!/usr/bin/python
 
+import argparse
 import socket
-import sys
+import struct
 import hashlib
 
-# Check server ip address set
-if len(sys.argv) < 2:
-    raise RuntimeError('pass IP address of the server')
-
-# Check file is set
-if len(sys.argv) < 3:
-    raise RuntimeError('pass UF2 file for update')
+parser = argparse.ArgumentParser(description='Push a UF2 image to the picow_ota_update example')
+parser.add_argument('address', help='IP address of the server')
+parser.add_argument('file', help='UF2 file for update')
+parser.add_argument('--stream', action='store_true',
+                    help='stream the image without waiting for each chunk to be acknowledged '
+                         '(requires a server which supports streaming)')
+parser.add_argument('--delta', action='store_true',
+                    help='only send the flash sectors which differ from those already on the device '
+                         '(requires a server which supports delta updates)')
+parser.add_argument('--compress', action='store_true',
+                    help='send the image compressed rather than as UF2 blocks '
+                         '(requires a server which supports compressed updates)')
+args = parser.parse_args()
 
 # Set the server address here like 1.2.3.4
-SERVER_ADDR = sys.argv[1]
+SERVER_ADDR = args.address
 
 # These constants should match the server
 BUF_SIZE = 2048
 UF2_BLOCK = 512
 SERVER_PORT = 4242
+OTA_STREAM_MAGIC = 0x5341544f
+OTA_MODE_STREAM = 1
+OTA_MODE_DELTA = 2
+OTA_MODE_COMPRESSED = 3
+OTA_DELTA_OP_SKIP = 0
+OTA_DELTA_OP_COPY = 1
+OTA_DELTA_OP_DATA = 2
+FLASH_SECTOR_SIZE = 4096
+OTA_STREAM_HEADER = struct.Struct('<7I')
+
+# These should match ota_decompress.h
+OTA_LZ_MAX_DISTANCE = 4096
+OTA_LZ_MAX_LENGTH = 18 + 255
+OTA_LZ_MAX_CHAIN = 32
+
+# uf2 block header and payload
+UF2_HEADER = struct.Struct('<8I')
+UF2_MAGIC_START0 = 0x0A324655
+UF2_MAGIC_START1 = 0x9E5D5157
+
+
+def recv_exact(sock, size):
+    read_buf = b''
+    while len(read_buf) < size:
+        buf = sock.recv(size - len(read_buf))
+        if not buf:
+            raise RuntimeError('connection closed after %d of %d bytes' % (len(read_buf), size))
+        read_buf += buf
+    return read_buf
+
+
+def build_image(data):
+    # The image as the server will find it in flash, from the first block's target address
+    # to the end of the last block, with any gaps left erased
+    blocks = []
+    for i in range(len(data) // UF2_BLOCK):
+        magic0, magic1, flags, target_addr, payload_size, block_no, num_blocks, family_id = \
+            UF2_HEADER.unpack_from(data, i * UF2_BLOCK)
+        if magic0 != UF2_MAGIC_START0 or magic1 != UF2_MAGIC_START1:
+            raise RuntimeError('bad uf2 block %d' % i)
+        payload = data[i * UF2_BLOCK + UF2_HEADER.size:i * UF2_BLOCK + UF2_HEADER.size + 256]
+        blocks.append((target_addr, family_id, payload))
+    base = blocks[0][0]
+    image = bytearray(b'\xff' * (blocks[-1][0] + 256 - base))
+    for target_addr, family_id, payload in blocks:
+        if target_addr < base:
+            raise RuntimeError('uf2 blocks must be in ascending address order for streaming')
+        image[target_addr - base:target_addr - base + 256] = payload
+    return base, blocks[0][1], image
+
+
+def stream_header(mode, data, base, family_id, image, payload_size=0):
+    return OTA_STREAM_HEADER.pack(OTA_STREAM_MAGIC, mode, len(data) // UF2_BLOCK, family_id, base, len(image),
+                                  payload_size) + hashlib.sha256(image).digest()
+
+
+def common_length(data, a, b, limit):
+    # Length of the common prefix of data[a:] and data[b:], up to limit
+    lo, hi = 0, limit
+    while lo < hi:
+        mid = (lo + hi + 1) // 2
+        if data[a:a + mid] == data[b:b + mid]:
+            lo = mid
+        else:
+            hi = mid - 1
+    return lo
+
+
+def compress(data):
+    # LZSS in the format described in ota_decompress.h
+    out = bytearray()
+    chains = {}
+    flags_pos = 0
+    bit = 8
+    i = 0
+    while i < len(data):
+        if bit == 8:
+            flags_pos = len(out)
+            out.append(0)
+            bit = 0
+        best_len, best_dist = 0, 0
+        limit = min(OTA_LZ_MAX_LENGTH, len(data) - i)
+        for j in reversed(chains.get(bytes(data[i:i + 3]), [])[-OTA_LZ_MAX_CHAIN:]):
+            if i - j > OTA_LZ_MAX_DISTANCE:
+                break
+            length = common_length(data, i, j, limit)
+            if length > best_len:
+                best_len, best_dist = length, i - j
+                if length == limit:
+                    break
+        if best_len >= 3:
+            out += struct.pack('<H', ((best_dist - 1) << 4) | min(best_len - 3, 15))
+            if best_len >= 18:
+                out.append(best_len - 18)
+        else:
+            best_len = 1
+            out[flags_pos] |= 1 << bit
+            out.append(data[i])
+        for k in range(i, i + best_len):
+            chains.setdefault(bytes(data[k:k + 3]), []).append(k)
+        i += best_len
+        bit += 1
+    return out
+
+
+def recv_result(sock, digest):
+    # The server verifies the image in flash then returns its status and hash
+    status, = struct.unpack('<i', recv_exact(sock, 4))
+    remote_digest = recv_exact(sock, 32)
+    if status != 0:
+        raise RuntimeError('server reported error %d' % status)
+    if remote_digest != digest:
+        raise RuntimeError('image hash mismatch')
+
+
+def send_lockstep(sock, data):
+    print("Len data", len(data), f"/{BUF_SIZE}", len(data) / BUF_SIZE)
+
+    while (len(data) % BUF_SIZE != 0):
+        data.extend([0] * UF2_BLOCK)
+
+    print("Len data now", len(data), f"/{BUF_SIZE}", len(data) / BUF_SIZE)
+
+    # Repeat test for a number of iterations
+    for i in range(len(data) // BUF_SIZE):
+        print("I", i, "of", len(data) // BUF_SIZE, ' '*10, end='\r')
+        uf2_buf = data[i*BUF_SIZE:(i+1)*BUF_SIZE]
+
+        # Send the data back to the server
+        write_len = sock.send(uf2_buf)
+        if write_len != BUF_SIZE:
+            raise RuntimeError('wrong amount of data written')
+
+        if i < (len(data) // BUF_SIZE) - 1:
+            # Read 32 bytes from the server
+            read_buf = recv_exact(sock, 32)
+
+            # Check the hash matches
+            h = hashlib.new('sha256')
+            h.update(uf2_buf)
+            if read_buf != h.digest():
+                raise RuntimeError('buffer mismatch')
+
+
+def send_stream(sock, data):
+    base, family_id, image = build_image(data)
+    print("Streaming", len(data) // UF2_BLOCK, "blocks")
+
+    sock.sendall(stream_header(OTA_MODE_STREAM, data, base, family_id, image))
+    sock.sendall(data)
+    recv_result(sock, hashlib.sha256(image).digest())
+
+
+def send_delta(sock, data):
+    base, family_id, image = build_image(data)
+    num_sectors = (len(image) + FLASH_SECTOR_SIZE - 1) // FLASH_SECTOR_SIZE
+    sock.sendall(stream_header(OTA_MODE_DELTA, data, base, family_id, image))
+
+    # The server replies with the hash of each sector in the partition being updated and in the running partition
+    sector_hashes = recv_exact(sock, num_sectors * 64)
+    padded = image + b'\xff' * (num_sectors * FLASH_SECTOR_SIZE - len(image))
+    ops = bytearray()
+    sectors = []
+    for i in range(num_sectors):
+        sector = padded[i * FLASH_SECTOR_SIZE:(i + 1) * FLASH_SECTOR_SIZE]
+        digest = hashlib.sha256(sector).digest()
+        if digest == sector_hashes[i * 64:i * 64 + 32]:
+            ops.append(OTA_DELTA_OP_SKIP)
+        elif digest == sector_hashes[i * 64 + 32:i * 64 + 64]:
+            ops.append(OTA_DELTA_OP_COPY)
+        else:
+            ops.append(OTA_DELTA_OP_DATA)
+            sectors.append(sector)
+    print("Delta update of", num_sectors, "sectors:", ops.count(OTA_DELTA_OP_SKIP), "unchanged,",
+          ops.count(OTA_DELTA_OP_COPY), "copied,", len(sectors), "sent")
+
+    while len(ops) % 4 != 0:
+        ops.append(0)
+    sock.sendall(ops + b''.join(sectors))
+    recv_result(sock, hashlib.sha256(image).digest())
+
+
+def send_compressed(sock, data):
+    base, family_id, image = build_image(data)
+    compressed = compress(image)
+    print("Compressed", len(data), "bytes of UF2 to", len(compressed))
+
+    sock.sendall(stream_header(OTA_MODE_COMPRESSED, data, base, family_id, image, len(compressed)))
+    sock.sendall(compressed)
+    recv_result(sock, hashlib.sha256(image).digest())
+
 
 # Open socket to the server
 sock = socket.socket()
 addr = (SERVER_ADDR, SERVER_PORT)
 sock.connect(addr)
 
-file = sys.argv[2]
-
-with open(file, 'rb') as f:
+with open(args.file, 'rb') as f:
     data = f.read()
 
 data = bytearray(data)
@@ -35,42 +231,14 @@ data = bytearray(data)
 # Skip abs block
 data = data[UF2_BLOCK:]
 
-print("Len data", len(data), f"/{BUF_SIZE}", len(data) / BUF_SIZE)
-
-while (len(data) % BUF_SIZE != 0):
-    data.extend([0] * UF2_BLOCK)
-
-print("Len data now", len(data), f"/{BUF_SIZE}", len(data) / BUF_SIZE)
-
-# Repeat test for a number of iterations
-for i in range(len(data) // BUF_SIZE):
-    print("I", i, "of", len(data) // BUF_SIZE, ' '*10, end='\r')
-    uf2_buf = data[i*BUF_SIZE:(i+1)*BUF_SIZE]
-
-    # Send the data back to the server
-    write_len = sock.send(uf2_buf)
-    if write_len != BUF_SIZE:
-        raise RuntimeError('wrong amount of data written')
-
-    if i < (len(data) // BUF_SIZE) - 1:
-        # Read 32 bytes from the server
-        total_size = 32
-        read_buf = b''
-        while total_size > 0:
-            buf = sock.recv(32)
-            # print('read %d bytes from server' % len(buf))
-            total_size -= len(buf)
-            read_buf += buf
-
-        # Check size of data received
-        if len(read_buf) != 32:
-            raise RuntimeError('wrong amount of data read %d', len(read_buf))
-
-        # Check the hash matches
-        h = hashlib.new('sha256')
-        h.update(uf2_buf)
-        if read_buf != h.digest():
-            raise RuntimeError('buffer mismatch')
+if args.compress:
+    send_compressed(sock, data)
+elif args.delta:
+    send_delta(sock, data)
+elif args.stream:
+    send_stream(sock, data)
+else:
+    send_lockstep(sock, data)
 
 # All done
 sock.close()
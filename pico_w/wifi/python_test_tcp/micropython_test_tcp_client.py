@@ -1,4 +1,5 @@
 import network
+import random
 import utime as time
 import usocket as socket
 
@@ -51,21 +52,22 @@ sock.connect(addr)
 
 # repeat test for a number of iterations
 for test_iteration in range(TEST_ITERATIONS):
-    
-    # Read BUF_SIZE bytes from the server
-    read_buf = sock.read(BUF_SIZE)
-    print('read %d bytes from server' % len(read_buf))
 
-    # Check size of data received
-    if len(read_buf) != BUF_SIZE:
-        raise RuntimeError('wrong amount of data read')
-
-    # Send the data back to the server
-    write_len = sock.write(read_buf)
+    # Send BUF_SIZE bytes to the server
+    write_buf = bytes(random.getrandbits(8) for i in range(BUF_SIZE))
+    write_len = sock.write(write_buf)
     print('written %d bytes to server' % write_len)
     if write_len != BUF_SIZE:
         raise RuntimeError('wrong amount of data written')
 
+    # Read them back from the server
+    read_buf = sock.read(BUF_SIZE)
+    print('read %d bytes from server' % len(read_buf))
+
+    # Check the data received
+    if read_buf != write_buf:
+        raise RuntimeError('buffer mismatch')
+
 # All done
 sock.close()
 print("test completed")
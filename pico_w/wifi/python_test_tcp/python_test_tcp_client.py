@@ -1,47 +1,69 @@
 #!/usr/bin/python
 
+import argparse
+import os
 import socket
-import sys
+import threading
+import time
 
-# Check server ip address set
-if len(sys.argv) < 2:
-    raise RuntimeError('pass IP address of the server')
+parser = argparse.ArgumentParser(description='Send data to the picow_tcp_server example and check it is echoed back')
+parser.add_argument('address', help='IP address of the server')
+parser.add_argument('-c', '--connections', type=int, default=1, help='number of connections to make at once')
+parser.add_argument('-n', '--iterations', type=int, default=10, help='number of buffers to send on each connection')
+args = parser.parse_args()
 
 # Set the server address here like 1.2.3.4
-SERVER_ADDR = sys.argv[1]
+SERVER_ADDR = args.address
 
 # These constants should match the server
 BUF_SIZE = 2048
 SERVER_PORT = 4242
-TEST_ITERATIONS = 10
-
-# Open socket to the server
-sock = socket.socket()
-addr = (SERVER_ADDR, SERVER_PORT)
-sock.connect(addr)
-
-# Repeat test for a number of iterations
-for test_iteration in range(TEST_ITERATIONS):
-
-    # Read BUF_SIZE bytes from the server
-    total_size = BUF_SIZE
-    read_buf = b''
-    while total_size > 0:
-        buf = sock.recv(BUF_SIZE)
-        print('read %d bytes from server' % len(buf))
-        total_size -= len(buf)
-        read_buf += buf
-
-    # Check size of data received
-    if len(read_buf) != BUF_SIZE:
-        raise RuntimeError('wrong amount of data read %d', len(read_buf))
-
-    # Send the data back to the server
-    write_len = sock.send(read_buf)
-    print('written %d bytes to server' % write_len)
-    if write_len != BUF_SIZE:
-        raise RuntimeError('wrong amount of data written')
+
+
+def run_test(index, results):
+    # Open socket to the server
+    sock = socket.socket()
+    addr = (SERVER_ADDR, SERVER_PORT)
+    sock.connect(addr)
+    start = time.monotonic()
+
+    # Repeat test for a number of iterations
+    for test_iteration in range(args.iterations):
+
+        # Send BUF_SIZE bytes to the server
+        write_buf = os.urandom(BUF_SIZE)
+        sock.sendall(write_buf)
+
+        # Read them back
+        read_buf = b''
+        while len(read_buf) < BUF_SIZE:
+            buf = sock.recv(BUF_SIZE - len(read_buf))
+            if not buf:
+                raise RuntimeError('connection %d closed' % index)
+            read_buf += buf
+
+        # Check the data matches
+        if read_buf != write_buf:
+            raise RuntimeError('buffer mismatch on connection %d' % index)
+
+    elapsed = time.monotonic() - start
+    sock.close()
+    results[index] = elapsed
+    print('connection %d: %d bytes echoed in %.2fs, %.1f kbit/s' %
+          (index, BUF_SIZE * args.iterations, elapsed, BUF_SIZE * args.iterations * 8 / elapsed / 1000))
+
+
+results = [None] * args.connections
+threads = [threading.Thread(target=run_test, args=(i, results)) for i in range(args.connections)]
+start = time.monotonic()
+for thread in threads:
+    thread.start()
+for thread in threads:
+    thread.join()
+elapsed = time.monotonic() - start
 
 # All done
-sock.close()
-print("test completed")
+if None in results:
+    raise RuntimeError('test failed')
+total = BUF_SIZE * args.iterations * args.connections
+print("test completed, %d bytes echoed in %.2fs, %.1f kbit/s" % (total, elapsed, total * 8 / elapsed / 1000))
@@ -14,47 +14,89 @@
 #include "lwip/tcp.h"
 
 #define TCP_PORT 4242
-#define DEBUG_printf printf
-#define BUF_SIZE 2048
-#define TEST_ITERATIONS 10
+#define DEBUG_printf(...)
 #define POLL_TIME_S 5
+#define STATS_TIME_S 5
+
+// Connections are allocated from a fixed pool, further connections are refused
+#define MAX_CONNECTIONS 4
+// Close a connection that has been idle for this many polls
+#define IDLE_POLLS 6
+// Received pbufs are held until the data echoed from them has been acknowledged. Limit how many
+// of the pool are held, so there are always some left to receive those acknowledgements
+#define MAX_HELD_PBUFS (PBUF_POOL_SIZE - 8)
+
+typedef struct TCP_CONNECTION_T_ {
+    struct tcp_pcb *pcb; // NULL if this pool entry is free
+    struct TCP_SERVER_T_ *server;
+    struct pbuf *rx; // data received and not yet acknowledged by the client, sent back from here
+    u16_t queued; // bytes at the start of rx that have been queued to send
+    u16_t held_pbufs;
+    bool remote_closed; // the client has sent everything, close once it has all been echoed
+    int idle_polls;
+    uint64_t bytes;
+    uint64_t stats_bytes;
+    absolute_time_t start_time;
+} TCP_CONNECTION_T;
 
 typedef struct TCP_SERVER_T_ {
     struct tcp_pcb *server_pcb;
-    struct tcp_pcb *client_pcb;
     bool complete;
-    uint8_t buffer_sent[BUF_SIZE];
-    uint8_t buffer_recv[BUF_SIZE];
-    int sent_len;
-    int recv_len;
-    int run_count;
+    int held_pbufs;
+    int connection_count;
+    TCP_CONNECTION_T connections[MAX_CONNECTIONS];
+    absolute_time_t stats_time;
 } TCP_SERVER_T;
 
 static TCP_SERVER_T* tcp_server_init(void) {
     TCP_SERVER_T *state = calloc(1, sizeof(TCP_SERVER_T));
     if (!state) {
-        DEBUG_printf("failed to allocate state\n");
+        printf("failed to allocate state\n");
         return NULL;
     }
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        state->connections[i].server = state;
+    }
     return state;
 }
 
+static void tcp_connection_free(TCP_CONNECTION_T *con) {
+    TCP_SERVER_T *state = con->server;
+    if (con->rx) {
+        pbuf_free(con->rx);
+    }
+    state->held_pbufs -= con->held_pbufs;
+    state->connection_count--;
+    printf("Client disconnected after %llu bytes, %d connected\n", con->bytes, state->connection_count);
+    memset(con, 0, sizeof(TCP_CONNECTION_T));
+    con->server = state;
+}
+
+static err_t tcp_connection_close(TCP_CONNECTION_T *con) {
+    err_t err = ERR_OK;
+    struct tcp_pcb *pcb = con->pcb;
+    tcp_arg(pcb, NULL);
+    tcp_poll(pcb, NULL, 0);
+    tcp_sent(pcb, NULL);
+    tcp_recv(pcb, NULL);
+    tcp_err(pcb, NULL);
+    err = tcp_close(pcb);
+    if (err != ERR_OK) {
+        DEBUG_printf("close failed %d, calling abort\n", err);
+        tcp_abort(pcb);
+        err = ERR_ABRT;
+    }
+    tcp_connection_free(con);
+    return err;
+}
+
 static err_t tcp_server_close(void *arg) {
     TCP_SERVER_T *state = (TCP_SERVER_T*)arg;
     err_t err = ERR_OK;
-    if (state->client_pcb != NULL) {
-        tcp_arg(state->client_pcb, NULL);
-        tcp_poll(state->client_pcb, NULL, 0);
-        tcp_sent(state->client_pcb, NULL);
-        tcp_recv(state->client_pcb, NULL);
-        tcp_err(state->client_pcb, NULL);
-        err = tcp_close(state->client_pcb);
-        if (err != ERR_OK) {
-            DEBUG_printf("close failed %d, calling abort\n", err);
-            tcp_abort(state->client_pcb);
-            err = ERR_ABRT;
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (state->connections[i].pcb) {
+            err = tcp_connection_close(&state->connections[i]);
         }
-        state->client_pcb = NULL;
     }
     if (state->server_pcb) {
         tcp_arg(state->server_pcb, NULL);
@@ -67,143 +109,183 @@ static err_t tcp_server_close(void *arg) {
 static err_t tcp_server_result(void *arg, int status) {
     TCP_SERVER_T *state = (TCP_SERVER_T*)arg;
     if (status == 0) {
-        DEBUG_printf("test success\n");
+        printf("server stopped\n");
     } else {
-        DEBUG_printf("test failed %d\n", status);
+        printf("server failed %d\n", status);
     }
     state->complete = true;
     return tcp_server_close(arg);
 }
 
-static err_t tcp_server_sent(void *arg, struct tcp_pcb *tpcb, u16_t len) {
-    TCP_SERVER_T *state = (TCP_SERVER_T*)arg;
-    DEBUG_printf("tcp_server_sent %u\n", len);
-    state->sent_len += len;
-
-    if (state->sent_len >= BUF_SIZE) {
-
-        // We should get the data back from the client
-        state->recv_len = 0;
-        DEBUG_printf("Waiting for buffer from client\n");
+// Queue as much of the received data as will fit to be sent back. It isn't copied, the segments
+// refer to the received pbufs, which are kept until the data has been acknowledged
+static err_t tcp_connection_send(TCP_CONNECTION_T *con) {
+    struct tcp_pcb *pcb = con->pcb;
+    u16_t offset = con->queued;
+    struct pbuf *q = con->rx;
+    while (q && offset >= q->len) {
+        offset -= q->len;
+        q = q->next;
     }
-
-    return ERR_OK;
-}
-
-err_t tcp_server_send_data(void *arg, struct tcp_pcb *tpcb)
-{
-    TCP_SERVER_T *state = (TCP_SERVER_T*)arg;
-    for(int i=0; i< BUF_SIZE; i++) {
-        state->buffer_sent[i] = rand();
+    while (q) {
+        u16_t len = MIN(q->len - offset, tcp_sndbuf(pcb));
+        if (len == 0 || tcp_sndqueuelen(pcb) >= TCP_SND_QUEUELEN - 1) {
+            break;
+        }
+        bool more = len < q->len - offset || q->next;
+        err_t err = tcp_write(pcb, (const uint8_t *)q->payload + offset, len, more ? TCP_WRITE_FLAG_MORE : 0);
+        if (err == ERR_MEM) {
+            break;
+        }
+        if (err != ERR_OK) {
+            DEBUG_printf("Failed to write data %d\n", err);
+            return err;
+        }
+        con->queued += len;
+        offset += len;
+        if (offset == q->len) {
+            q = q->next;
+            offset = 0;
+        }
     }
+    return tcp_output(pcb);
+}
 
-    state->sent_len = 0;
-    DEBUG_printf("Writing %ld bytes to client\n", BUF_SIZE);
-    // this method is callback from lwIP, so cyw43_arch_lwip_begin is not required, however you
-    // can use this method to cause an assertion in debug mode, if this method is called when
-    // cyw43_arch_lwip_begin IS needed
-    cyw43_arch_lwip_check();
-    err_t err = tcp_write(tpcb, state->buffer_sent, BUF_SIZE, TCP_WRITE_FLAG_COPY);
-    if (err != ERR_OK) {
-        DEBUG_printf("Failed to write data %d\n", err);
-        return tcp_server_result(arg, -1);
+static err_t tcp_server_sent(void *arg, struct tcp_pcb *tpcb, u16_t len) {
+    TCP_CONNECTION_T *con = (TCP_CONNECTION_T*)arg;
+    DEBUG_printf("tcp_server_sent %u\n", len);
+    con->bytes += len;
+    con->queued -= len;
+    con->idle_polls = 0;
+
+    // Free what's been acknowledged, and only then let the client send more
+    u16_t held = con->rx ? pbuf_clen(con->rx) : 0;
+    con->rx = pbuf_free_header(con->rx, len);
+    u16_t freed = held - (con->rx ? pbuf_clen(con->rx) : 0);
+    con->held_pbufs -= freed;
+    con->server->held_pbufs -= freed;
+    tcp_recved(tpcb, len);
+
+    err_t err = tcp_connection_send(con);
+    if (err != ERR_OK || (con->remote_closed && !con->rx)) {
+        return tcp_connection_close(con);
     }
     return ERR_OK;
 }
 
 err_t tcp_server_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err) {
-    TCP_SERVER_T *state = (TCP_SERVER_T*)arg;
+    TCP_CONNECTION_T *con = (TCP_CONNECTION_T*)arg;
     if (!p) {
-        return tcp_server_result(arg, -1);
+        // The rest of the echo can still be sent, rx is only empty once it has all been acknowledged
+        DEBUG_printf("Client closed connection\n");
+        con->remote_closed = true;
+        if (!con->rx) {
+            return tcp_connection_close(con);
+        }
+        return ERR_OK;
     }
     // this method is callback from lwIP, so cyw43_arch_lwip_begin is not required, however you
     // can use this method to cause an assertion in debug mode, if this method is called when
     // cyw43_arch_lwip_begin IS needed
     cyw43_arch_lwip_check();
-    if (p->tot_len > 0) {
-        DEBUG_printf("tcp_server_recv %d/%d err %d\n", p->tot_len, state->recv_len, err);
-
-        // Receive the buffer
-        const uint16_t buffer_left = BUF_SIZE - state->recv_len;
-        state->recv_len += pbuf_copy_partial(p, state->buffer_recv + state->recv_len,
-                                             p->tot_len > buffer_left ? buffer_left : p->tot_len, 0);
-        tcp_recved(tpcb, p->tot_len);
-    }
-    pbuf_free(p);
-
-    // Have we have received the whole buffer
-    if (state->recv_len == BUF_SIZE) {
+    DEBUG_printf("tcp_server_recv %d err %d\n", p->tot_len, err);
 
-        // check it matches
-        if (memcmp(state->buffer_sent, state->buffer_recv, BUF_SIZE) != 0) {
-            DEBUG_printf("buffer mismatch\n");
-            return tcp_server_result(arg, -1);
-        }
-        DEBUG_printf("tcp_server_recv buffer ok\n");
-
-        // Test complete?
-        state->run_count++;
-        if (state->run_count >= TEST_ITERATIONS) {
-            tcp_server_result(arg, 0);
-            return ERR_OK;
-        }
+    // Refuse the data if too many pbufs are held. lwIP keeps it and offers it again later
+    u16_t clen = pbuf_clen(p);
+    if (con->server->held_pbufs + clen > MAX_HELD_PBUFS) {
+        DEBUG_printf("Too many pbufs held\n");
+        return ERR_MEM;
+    }
+    con->held_pbufs += clen;
+    con->server->held_pbufs += clen;
+    con->idle_polls = 0;
 
-        // Send another buffer
-        return tcp_server_send_data(arg, state->client_pcb);
+    // Keep the chain to send back
+    if (con->rx) {
+        pbuf_cat(con->rx, p);
+    } else {
+        con->rx = p;
+    }
+    err = tcp_connection_send(con);
+    if (err != ERR_OK) {
+        return tcp_connection_close(con);
     }
     return ERR_OK;
 }
 
 static err_t tcp_server_poll(void *arg, struct tcp_pcb *tpcb) {
+    TCP_CONNECTION_T *con = (TCP_CONNECTION_T*)arg;
     DEBUG_printf("tcp_server_poll_fn\n");
-    return tcp_server_result(arg, -1); // no response is an error?
+    if (++con->idle_polls >= IDLE_POLLS) {
+        printf("Client idle\n");
+        return tcp_connection_close(con);
+    }
+    return ERR_OK;
 }
 
 static void tcp_server_err(void *arg, err_t err) {
-    if (err != ERR_ABRT) {
-        DEBUG_printf("tcp_client_err_fn %d\n", err);
-        tcp_server_result(arg, err);
+    TCP_CONNECTION_T *con = (TCP_CONNECTION_T*)arg;
+    DEBUG_printf("tcp_client_err_fn %d\n", err);
+    // The pcb has already been freed
+    if (con) {
+        tcp_connection_free(con);
     }
 }
 
 static err_t tcp_server_accept(void *arg, struct tcp_pcb *client_pcb, err_t err) {
     TCP_SERVER_T *state = (TCP_SERVER_T*)arg;
     if (err != ERR_OK || client_pcb == NULL) {
-        DEBUG_printf("Failure in accept\n");
-        tcp_server_result(arg, err);
+        printf("Failure in accept\n");
         return ERR_VAL;
     }
-    DEBUG_printf("Client connected\n");
 
-    state->client_pcb = client_pcb;
-    tcp_arg(client_pcb, state);
+    // Find a free connection
+    TCP_CONNECTION_T *con = NULL;
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (!state->connections[i].pcb) {
+            con = &state->connections[i];
+            break;
+        }
+    }
+    if (!con) {
+        printf("Too many connections\n");
+        tcp_abort(client_pcb);
+        return ERR_ABRT;
+    }
+    con->pcb = client_pcb;
+    con->start_time = get_absolute_time();
+    state->connection_count++;
+    printf("Client connected, %d connected\n", state->connection_count);
+
+    tcp_arg(client_pcb, con);
     tcp_sent(client_pcb, tcp_server_sent);
     tcp_recv(client_pcb, tcp_server_recv);
     tcp_poll(client_pcb, tcp_server_poll, POLL_TIME_S * 2);
     tcp_err(client_pcb, tcp_server_err);
+    tcp_nagle_disable(client_pcb);
 
-    return tcp_server_send_data(arg, state->client_pcb);
+    return ERR_OK;
 }
 
 static bool tcp_server_open(void *arg) {
     TCP_SERVER_T *state = (TCP_SERVER_T*)arg;
-    DEBUG_printf("Starting server at %s on port %u\n", ip4addr_ntoa(netif_ip4_addr(netif_list)), TCP_PORT);
+    printf("Starting server at %s on port %u\n", ip4addr_ntoa(netif_ip4_addr(netif_list)), TCP_PORT);
 
     struct tcp_pcb *pcb = tcp_new_ip_type(IPADDR_TYPE_ANY);
     if (!pcb) {
-        DEBUG_printf("failed to create pcb\n");
+        printf("failed to create pcb\n");
         return false;
     }
 
     err_t err = tcp_bind(pcb, NULL, TCP_PORT);
     if (err) {
-        DEBUG_printf("failed to bind to port %u\n", TCP_PORT);
+        printf("failed to bind to port %u\n", TCP_PORT);
         return false;
     }
 
-    state->server_pcb = tcp_listen_with_backlog(pcb, 1);
+    state->server_pcb = tcp_listen_with_backlog(pcb, MAX_CONNECTIONS);
     if (!state->server_pcb) {
-        DEBUG_printf("failed to listen\n");
+        printf("failed to listen\n");
         if (pcb) {
             tcp_close(pcb);
         }
@@ -216,15 +298,48 @@ static bool tcp_server_open(void *arg) {
     return true;
 }
 
+// Print the throughput of each connection and the total since the last time
+static void tcp_server_stats(TCP_SERVER_T *state) {
+    absolute_time_t now = get_absolute_time();
+    int64_t interval_us = absolute_time_diff_us(state->stats_time, now);
+    if (interval_us < STATS_TIME_S * 1000000ll) {
+        return;
+    }
+    state->stats_time = now;
+
+    uint64_t total_bytes = 0;
+    cyw43_arch_lwip_begin();
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        TCP_CONNECTION_T *con = &state->connections[i];
+        if (!con->pcb) {
+            continue;
+        }
+        uint64_t bytes = con->bytes - con->stats_bytes;
+        con->stats_bytes = con->bytes;
+        total_bytes += bytes;
+        int64_t connected_us = absolute_time_diff_us(con->start_time, now);
+        printf("  %s:%u %llu kbit/s, %llu bytes in %llu s\n", ipaddr_ntoa(&con->pcb->remote_ip), con->pcb->remote_port,
+            bytes * 8000 / interval_us, con->bytes, connected_us / 1000000);
+    }
+    cyw43_arch_lwip_end();
+    if (state->connection_count) {
+        printf("%d clients, %llu kbit/s echoed\n", state->connection_count, total_bytes * 8000 / interval_us);
+    }
+}
+
 void run_tcp_server_test(void) {
     TCP_SERVER_T *state = tcp_server_init();
     if (!state) {
         return;
     }
-    if (!tcp_server_open(state)) {
+    cyw43_arch_lwip_begin();
+    bool ok = tcp_server_open(state);
+    cyw43_arch_lwip_end();
+    if (!ok) {
         tcp_server_result(state, -1);
         return;
     }
+    state->stats_time = get_absolute_time();
     while(!state->complete) {
         // the following #ifdef is only here so this same example can be used in multiple modes;
         // you do not need it in your code
@@ -241,6 +356,7 @@ void run_tcp_server_test(void) {
         // work you might be doing.
         sleep_ms(1000);
 #endif
+        tcp_server_stats(state);
     }
     free(state);
 }
@@ -265,4 +381,4 @@ int main() {
     run_tcp_server_test();
     cyw43_arch_deinit();
     return 0;
-}
\ No newline at end of file
+}
@@ -1,6 +1,11 @@
 #ifndef MBEDTLS_CONFIG_TLS_CLIENT_H
 #define MBEDTLS_CONFIG_TLS_CLIENT_H
 
+// The configuration is chosen with TLS_CLIENT_MBEDTLS_CONFIG when running cmake
+#if TLS_CLIENT_MBEDTLS_CONFIG_P256
+#include "mbedtls_config_p256.h"
+#else
 #include "mbedtls_config_examples_common.h"
+#endif
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,83 @@
+#ifndef MBEDTLS_CONFIG_P256_H
+#define MBEDTLS_CONFIG_P256_H
+
+// A smaller and faster configuration than mbedtls_config_examples_common.h for a client talking to
+// servers with ECDSA certificates. Only TLS 1.2 with ECDHE-ECDSA key exchange and AES-GCM is
+// supported. Servers with RSA certificates or certificates signed with SHA-384 are not.
+//
+// If TLS_CLIENT_MBEDTLS_CONFIG_SMALL is set, less RAM is used at the cost of a slower handshake.
+
+/* Workaround for some mbedtls source files using INT_MAX without including limits.h */
+#include <limits.h>
+
+// Entropy comes from mbedtls_hardware_poll in pico_mbedtls, which uses pico_rand (the TRNG on RP2350)
+#define MBEDTLS_NO_PLATFORM_ENTROPY
+#define MBEDTLS_ENTROPY_HARDWARE_ALT
+
+#define MBEDTLS_ALLOW_PRIVATE_ACCESS
+#define MBEDTLS_HAVE_TIME
+#define MBEDTLS_PLATFORM_MS_TIME_ALT
+
+// Key exchange with P-256. P-384 is only needed to parse and check certificates with P-384 keys,
+// like the intermediate CA of the example's server. Remove it if your CAs use P-256
+#define MBEDTLS_ECP_DP_SECP256R1_ENABLED
+#define MBEDTLS_ECP_DP_SECP384R1_ENABLED
+#define MBEDTLS_ECP_NIST_OPTIM
+#define MBEDTLS_KEY_EXCHANGE_ECDHE_ECDSA_ENABLED
+#define MBEDTLS_SSL_CIPHERSUITES MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256
+
+#if LIB_PICO_SHA256
+// Enable hardware acceleration
+#define MBEDTLS_SHA256_ALT
+#elif TLS_CLIENT_MBEDTLS_CONFIG_SMALL
+#define MBEDTLS_SHA256_SMALLER
+#endif
+
+#if TLS_CLIENT_MBEDTLS_CONFIG_SMALL
+// Keep the AES tables in flash and use a smaller table of points for ECC
+#define MBEDTLS_AES_ROM_TABLES
+#define MBEDTLS_AES_FEWER_TABLES
+#define MBEDTLS_ECP_WINDOW_SIZE 2
+#define MBEDTLS_ECP_FIXED_POINT_OPTIM 0
+#endif
+
+// Big enough for P-384
+#define MBEDTLS_MPI_MAX_SIZE 48
+
+// The client only sends short requests. The server can send records of up to 16KB, so the size of
+// the input buffer can't be reduced unless the server supports the max_fragment_length extension
+#define MBEDTLS_SSL_OUT_CONTENT_LEN 1024
+#ifndef MBEDTLS_SSL_IN_CONTENT_LEN
+#define MBEDTLS_SSL_IN_CONTENT_LEN 16384
+#endif
+
+#define MBEDTLS_AES_C
+#define MBEDTLS_ASN1_PARSE_C
+#define MBEDTLS_ASN1_WRITE_C
+#define MBEDTLS_BIGNUM_C
+#define MBEDTLS_CIPHER_C
+#define MBEDTLS_CTR_DRBG_C
+#define MBEDTLS_ECDH_C
+#define MBEDTLS_ECDSA_C
+#define MBEDTLS_ECP_C
+#define MBEDTLS_ENTROPY_C
+#define MBEDTLS_ERROR_C
+#define MBEDTLS_GCM_C
+#define MBEDTLS_MD_C
+#define MBEDTLS_OID_C
+#define MBEDTLS_PK_C
+#define MBEDTLS_PK_PARSE_C
+#define MBEDTLS_PLATFORM_C
+#define MBEDTLS_SHA256_C
+#define MBEDTLS_SSL_CLI_C
+#define MBEDTLS_SSL_PROTO_TLS1_2
+#define MBEDTLS_SSL_SERVER_NAME_INDICATION
+#define MBEDTLS_SSL_TLS_C
+#define MBEDTLS_X509_CRT_PARSE_C
+#define MBEDTLS_X509_USE_C
+
+// The following is needed to parse a certificate
+#define MBEDTLS_PEM_PARSE_C
+#define MBEDTLS_BASE64_C
+
+#endif
@@ -14,6 +14,8 @@
 #include "lwip/altcp_tls.h"
 #include "lwip/dns.h"
 
+#include "tls_handshake_stats.h"
+
 typedef struct TLS_CLIENT_T_ {
     struct altcp_pcb *pcb;
     bool complete;
@@ -49,8 +51,10 @@ static err_t tls_client_connected(void *arg, struct altcp_pcb *pcb, err_t err) {
     TLS_CLIENT_T *state = (TLS_CLIENT_T*)arg;
     if (err != ERR_OK) {
         printf("connect failed %d\n", err);
+        tls_handshake_stats_end(false);
         return tls_client_close(state);
     }
+    tls_handshake_stats_end(true);
 
     printf("connected to server, sending request\n");
     err = altcp_write(state->pcb, state->http_request, strlen(state->http_request), TCP_WRITE_FLAG_COPY);
@@ -65,6 +69,7 @@ static err_t tls_client_connected(void *arg, struct altcp_pcb *pcb, err_t err) {
 static err_t tls_client_poll(void *arg, struct altcp_pcb *pcb) {
     TLS_CLIENT_T *state = (TLS_CLIENT_T*)arg;
     printf("timed out\n");
+    tls_handshake_stats_end(false);
     state->error = PICO_ERROR_TIMEOUT;
     return tls_client_close(arg);
 }
@@ -72,6 +77,7 @@ static err_t tls_client_poll(void *arg, struct altcp_pcb *pcb) {
 static void tls_client_err(void *arg, err_t err) {
     TLS_CLIENT_T *state = (TLS_CLIENT_T*)arg;
     printf("tls_client_err %d\n", err);
+    tls_handshake_stats_end(false);
     tls_client_close(state);
     state->error = PICO_ERROR_GENERIC;
 }
@@ -108,6 +114,7 @@ static void tls_client_connect_to_server_ip(const ip_addr_t *ipaddr, TLS_CLIENT_
     u16_t port = 443;
 
     printf("connecting to server IP %s port %d\n", ipaddr_ntoa(ipaddr), port);
+    tls_handshake_stats_start();
     err = altcp_connect(state->pcb, ipaddr, port, tls_client_connected);
     if (err != ERR_OK)
     {
@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/time.h"
+#include "mbedtls/ecdh.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/x509_crt.h"
+
+#include "tls_handshake_stats.h"
+
+typedef enum {
+    STATS_OTHER, // the rest of mbedtls_ssl_handshake, hashing, key derivation, encryption...
+    STATS_ECDHE,
+    STATS_SIGNATURE,
+    STATS_CERT_PARSE,
+    STATS_CERT_VERIFY, // checking the certificate chain, apart from the signatures
+    STATS_COUNT
+} stats_category_t;
+
+static const char *const category_names[STATS_COUNT] = {
+    "other tls", "ecdhe", "signature verify", "certificate parse", "certificate verify"
+};
+
+#define STATS_MAX_DEPTH 4
+
+static struct {
+    bool active;
+    uint64_t start_us;
+    uint64_t mbedtls_us; // time in mbedtls, so the rest is waiting for the network
+    uint64_t us[STATS_COUNT];
+    uint32_t calls[STATS_COUNT];
+    size_t heap_start;
+    size_t heap_peak;
+
+    // Time in a wrapped function excludes the time in wrapped functions it calls
+    int depth;
+    stats_category_t category[STATS_MAX_DEPTH];
+    uint64_t enter_us[STATS_MAX_DEPTH];
+    uint64_t child_us[STATS_MAX_DEPTH];
+} stats;
+
+// The peak is only sampled when a wrapped function is entered or left
+static void sample_heap(void) {
+    size_t used = mallinfo().uordblks;
+    if (used > stats.heap_peak) {
+        stats.heap_peak = used;
+    }
+}
+
+static void enter(stats_category_t category) {
+    if (!stats.active || stats.depth == STATS_MAX_DEPTH) {
+        return;
+    }
+    sample_heap();
+    stats.category[stats.depth] = category;
+    stats.child_us[stats.depth] = 0;
+    stats.enter_us[stats.depth++] = time_us_64();
+}
+
+static void leave(void) {
+    if (!stats.active || stats.depth == 0) {
+        return;
+    }
+    uint64_t us = time_us_64() - stats.enter_us[--stats.depth];
+    stats_category_t category = stats.category[stats.depth];
+    stats.us[category] += us - stats.child_us[stats.depth];
+    stats.calls[category]++;
+    if (stats.depth) {
+        stats.child_us[stats.depth - 1] += us;
+    } else {
+        stats.mbedtls_us += us;
+    }
+    sample_heap();
+}
+
+void tls_handshake_stats_start(void) {
+    memset(&stats, 0, sizeof(stats));
+    stats.active = true;
+    stats.heap_start = stats.heap_peak = mallinfo().uordblks;
+    stats.start_us = time_us_64();
+}
+
+void tls_handshake_stats_end(bool complete) {
+    if (!stats.active) {
+        return;
+    }
+    stats.active = false;
+    uint64_t total_us = time_us_64() - stats.start_us;
+    printf("handshake %s in %u ms\n", complete ? "complete" : "failed", (uint32_t)(total_us / 1000));
+    printf("  %-20s %6u ms\n", "network wait", (uint32_t)((total_us - stats.mbedtls_us) / 1000));
+    for (int i = STATS_COUNT - 1; i >= 0; i--) {
+        printf("  %-20s %6u ms in %u calls\n", category_names[i], (uint32_t)(stats.us[i] / 1000), stats.calls[i]);
+    }
+    printf("  heap peak %u bytes, %u more than at the start\n", (uint32_t)stats.heap_peak,
+           (uint32_t)(stats.heap_peak - stats.heap_start));
+}
+
+// Wrappers for the linker's --wrap option
+
+int __real_mbedtls_ssl_handshake(mbedtls_ssl_context *ssl);
+int __wrap_mbedtls_ssl_handshake(mbedtls_ssl_context *ssl) {
+    enter(STATS_OTHER);
+    int ret = __real_mbedtls_ssl_handshake(ssl);
+    leave();
+    return ret;
+}
+
+int __real_mbedtls_ecdh_make_public(mbedtls_ecdh_context *ctx, size_t *olen, unsigned char *buf, size_t blen,
+                                    int (*f_rng)(void *, unsigned char *, size_t), void *p_rng);
+int __wrap_mbedtls_ecdh_make_public(mbedtls_ecdh_context *ctx, size_t *olen, unsigned char *buf, size_t blen,
+                                    int (*f_rng)(void *, unsigned char *, size_t), void *p_rng) {
+    enter(STATS_ECDHE);
+    int ret = __real_mbedtls_ecdh_make_public(ctx, olen, buf, blen, f_rng, p_rng);
+    leave();
+    return ret;
+}
+
+int __real_mbedtls_ecdh_calc_secret(mbedtls_ecdh_context *ctx, size_t *olen, unsigned char *buf, size_t blen,
+                                    int (*f_rng)(void *, unsigned char *, size_t), void *p_rng);
+int __wrap_mbedtls_ecdh_calc_secret(mbedtls_ecdh_context *ctx, size_t *olen, unsigned char *buf, size_t blen,
+                                    int (*f_rng)(void *, unsigned char *, size_t), void *p_rng) {
+    enter(STATS_ECDHE);
+    int ret = __real_mbedtls_ecdh_calc_secret(ctx, olen, buf, blen, f_rng, p_rng);
+    leave();
+    return ret;
+}
+
+// Verifies the server's signature of the key exchange
+int __real_mbedtls_pk_verify_restartable(mbedtls_pk_context *ctx, mbedtls_md_type_t md_alg,
+                                         const unsigned char *hash, size_t hash_len,
+                                         const unsigned char *sig, size_t sig_len, mbedtls_pk_restart_ctx *rs_ctx);
+int __wrap_mbedtls_pk_verify_restartable(mbedtls_pk_context *ctx, mbedtls_md_type_t md_alg,
+                                         const unsigned char *hash, size_t hash_len,
+                                         const unsigned char *sig, size_t sig_len, mbedtls_pk_restart_ctx *rs_ctx) {
+    enter(STATS_SIGNATURE);
+    int ret = __real_mbedtls_pk_verify_restartable(ctx, md_alg, hash, hash_len, sig, sig_len, rs_ctx);
+    leave();
+    return ret;
+}
+
+// Verifies the signatures in the certificate chain
+int __real_mbedtls_pk_verify_ext(mbedtls_pk_type_t type, const void *options, mbedtls_pk_context *ctx,
+                                 mbedtls_md_type_t md_alg, const unsigned char *hash, size_t hash_len,
+                                 const unsigned char *sig, size_t sig_len);
+int __wrap_mbedtls_pk_verify_ext(mbedtls_pk_type_t type, const void *options, mbedtls_pk_context *ctx,
+                                 mbedtls_md_type_t md_alg, const unsigned char *hash, size_t hash_len,
+                                 const unsigned char *sig, size_t sig_len) {
+    enter(STATS_SIGNATURE);
+    int ret = __real_mbedtls_pk_verify_ext(type, options, ctx, md_alg, hash, hash_len, sig, sig_len);
+    leave();
+    return ret;
+}
+
+int __real_mbedtls_x509_crt_parse_der(mbedtls_x509_crt *chain, const unsigned char *buf, size_t buflen);
+int __wrap_mbedtls_x509_crt_parse_der(mbedtls_x509_crt *chain, const unsigned char *buf, size_t buflen) {
+    enter(STATS_CERT_PARSE);
+    int ret = __real_mbedtls_x509_crt_parse_der(chain, buf, buflen);
+    leave();
+    return ret;
+}
+
+int __real_mbedtls_x509_crt_verify_restartable(mbedtls_x509_crt *crt, mbedtls_x509_crt *trust_ca, mbedtls_x509_crl *ca_crl,
+                                               const mbedtls_x509_crt_profile *profile, const char *cn, uint32_t *flags,
+                                               int (*f_vrfy)(void *, mbedtls_x509_crt *, int, uint32_t *), void *p_vrfy,
+                                               mbedtls_x509_crt_restart_ctx *rs_ctx);
+int __wrap_mbedtls_x509_crt_verify_restartable(mbedtls_x509_crt *crt, mbedtls_x509_crt *trust_ca, mbedtls_x509_crl *ca_crl,
+                                               const mbedtls_x509_crt_profile *profile, const char *cn, uint32_t *flags,
+                                               int (*f_vrfy)(void *, mbedtls_x509_crt *, int, uint32_t *), void *p_vrfy,
+                                               mbedtls_x509_crt_restart_ctx *rs_ctx) {
+    enter(STATS_CERT_VERIFY);
+    int ret = __real_mbedtls_x509_crt_verify_restartable(crt, trust_ca, ca_crl, profile, cn, flags, f_vrfy, p_vrfy, rs_ctx);
+    leave();
+    return ret;
+}
@@ -0,0 +1,22 @@
+/*
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _TLS_HANDSHAKE_STATS_H_
+#define _TLS_HANDSHAKE_STATS_H_
+
+#include <stdbool.h>
+
+// Measures where the time goes in a TLS handshake. The mbedtls functions that do the expensive
+// work are wrapped with the linker's --wrap option (see CMakeLists.txt), so the time spent in
+// them can be separated from the time spent waiting for the server.
+
+// Start measuring, call this just before connecting
+void tls_handshake_stats_start(void);
+
+// Stop measuring and print the results, if a handshake was being measured
+void tls_handshake_stats_end(bool complete);
+
+#endif
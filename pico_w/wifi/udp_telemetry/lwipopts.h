@@ -0,0 +1,14 @@
+#ifndef _LWIPOPTS_H
+#define _LWIPOPTS_H
+
+// Generally you would define your own explicit list of lwIP options
+// (see https://www.nongnu.org/lwip/2_1_x/group__lwip__opts.html)
+//
+// This example uses a common include to avoid repetition
+
+// The telemetry datagrams are allocated from the lwIP heap
+#define MEM_SIZE                    16000
+
+#include "lwipopts_examples_common.h"
+
+#endif
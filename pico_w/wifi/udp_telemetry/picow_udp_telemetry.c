@@ -0,0 +1,135 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdlib.h>
+
+#include "pico/stdlib.h"
+#include "pico/cyw43_arch.h"
+#include "hardware/adc.h"
+
+#include "telemetry_stream.h"
+
+// Run telemetry_receiver.py on this host
+#ifndef TELEMETRY_SERVER_IP
+#error Need to define TELEMETRY_SERVER_IP
+#endif
+#define TELEMETRY_PORT 4446
+
+// Readings of the temperature sensor per second
+#ifndef TELEMETRY_SAMPLE_RATE
+#define TELEMETRY_SAMPLE_RATE 50000
+#endif
+#define SAMPLE_WORKER_MS 1
+#define STATUS_TIME_MS 1000
+
+typedef struct TELEMETRY_T_ {
+    telemetry_stream_t stream;
+    async_at_time_worker_t sample_worker;
+    uint64_t start_us;
+    uint64_t sample_count;
+} TELEMETRY_T;
+
+// Take the samples that are due since the worker last ran. They're given the time they were due,
+// rather than when they were read, which is the same apart from the worker's latency
+static void sample_worker_fn(async_context_t *context, async_at_time_worker_t *worker) {
+    TELEMETRY_T *state = (TELEMETRY_T *)worker->user_data;
+    uint64_t due = (time_us_64() - state->start_us) * TELEMETRY_SAMPLE_RATE / 1000000;
+    while (state->sample_count < due) {
+        uint16_t sample = adc_read();
+        telemetry_stream_add(&state->stream, state->start_us + state->sample_count * 1000000 / TELEMETRY_SAMPLE_RATE,
+                             &sample);
+        state->sample_count++;
+    }
+    async_context_add_at_time_worker_in_ms(context, worker, SAMPLE_WORKER_MS);
+}
+
+static void print_status(TELEMETRY_T *state, uint32_t *last_samples) {
+    uint32_t samples = state->stream.samples;
+    printf("%u samples/s, %u datagrams, %u samples dropped, %u send errors\n",
+           (unsigned)((samples - *last_samples) * 1000ull / STATUS_TIME_MS), (unsigned)state->stream.seq,
+           (unsigned)state->stream.dropped, (unsigned)state->stream.send_errors);
+    *last_samples = samples;
+}
+
+static void run_udp_telemetry(void) {
+    TELEMETRY_T *state = calloc(1, sizeof(TELEMETRY_T));
+    if (!state) {
+        printf("failed to allocate state\n");
+        return;
+    }
+    ip_addr_t addr;
+    ipaddr_aton(TELEMETRY_SERVER_IP, &addr);
+    if (!telemetry_stream_init(&state->stream, cyw43_arch_async_context(), &addr, TELEMETRY_PORT, sizeof(uint16_t))) {
+        printf("failed to start telemetry\n");
+        free(state);
+        return;
+    }
+
+    adc_init();
+    adc_set_temp_sensor_enabled(true);
+    adc_select_input(4);
+
+    printf("Streaming %u samples/s to %s port %u\n", TELEMETRY_SAMPLE_RATE, TELEMETRY_SERVER_IP, TELEMETRY_PORT);
+    printf("Press 'q' to quit\n");
+    state->start_us = time_us_64();
+    state->sample_worker.do_work = sample_worker_fn;
+    state->sample_worker.user_data = state;
+    async_context_add_at_time_worker_in_ms(cyw43_arch_async_context(), &state->sample_worker, 0);
+
+    uint32_t last_samples = 0;
+    absolute_time_t status_time = make_timeout_time_ms(STATUS_TIME_MS);
+    while(true) {
+        int key = getchar_timeout_us(0);
+        if (key == 'q' || key == 'Q') {
+            break;
+        }
+        if (absolute_time_diff_us(get_absolute_time(), status_time) <= 0) {
+            print_status(state, &last_samples);
+            status_time = delayed_by_ms(status_time, STATUS_TIME_MS);
+        }
+#if PICO_CYW43_ARCH_POLL
+        // if you are using pico_cyw43_arch_poll, then you must poll periodically from your
+        // main loop (not from a timer interrupt) to check for Wi-Fi driver or lwIP work that needs to be done.
+        // The sampling and sending is done by workers, which are run from here too
+        cyw43_arch_poll();
+        cyw43_arch_wait_for_work_until(status_time);
+#else
+        // if you are not using pico_cyw43_arch_poll, then WiFI driver and lwIP work
+        // is done via interrupt in the background, along with the sampling and sending.
+        sleep_ms(100);
+#endif
+    }
+
+    async_context_acquire_lock_blocking(cyw43_arch_async_context());
+    async_context_remove_at_time_worker(cyw43_arch_async_context(), &state->sample_worker);
+    async_context_release_lock(cyw43_arch_async_context());
+    telemetry_stream_deinit(&state->stream);
+    free(state);
+}
+
+int main() {
+    stdio_init_all();
+
+    if (cyw43_arch_init()) {
+        printf("failed to initialise\n");
+        return 1;
+    }
+
+    cyw43_arch_enable_sta_mode();
+
+    printf("Connecting to Wi-Fi...\n");
+    if (cyw43_arch_wifi_connect_timeout_ms(WIFI_SSID, WIFI_PASSWORD, CYW43_AUTH_WPA2_AES_PSK, 30000)) {
+        printf("failed to connect.\n");
+        return 1;
+    } else {
+        printf("Connected.\n");
+    }
+    // Power saving adds latency to every send
+    cyw43_wifi_pm(&cyw43_state, CYW43_NONE_PM);
+    run_udp_telemetry();
+    cyw43_arch_deinit();
+    return 0;
+}
@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Receives the datagrams sent by picow_udp_telemetry, see telemetry_stream.h for the format, and
+# reports the rate and loss every interval, e.g.
+#   ./telemetry_receiver.py --port 4446
+#
+
+import argparse
+import socket
+import struct
+import time
+
+TELEMETRY_STREAM_VERSION = 1
+HEADER = struct.Struct('!BBHIIIIIHH')
+
+
+class Stats:
+    def __init__(self):
+        self.datagrams = 0
+        self.samples = 0
+        self.bytes = 0
+        self.lost = 0
+        self.out_of_order = 0
+        self.dropped = 0
+
+
+def print_stats(name, stats, secs):
+    secs = max(secs, 1e-6)
+    lost = max(stats.lost, 0)  # late arrivals can take it below zero for an interval
+    expected = stats.datagrams + lost
+    print('%s %8.0f samples/s %6.0f datagrams/s %6.2f Mbits/s lost %d/%d (%.2g%%) out of order %d sender dropped %d'
+          % (name, stats.samples / secs, stats.datagrams / secs, stats.bytes * 8 / secs / 1e6, lost, expected,
+             100 * lost / expected if expected else 0, stats.out_of_order, stats.dropped), flush=True)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Receive telemetry datagrams')
+    parser.add_argument('-p', '--port', type=int, default=4446)
+    parser.add_argument('-i', '--interval', type=float, default=1.0, help='seconds between reports')
+    args = parser.parse_args()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1 << 20)
+    sock.bind(('', args.port))
+    sock.settimeout(args.interval)
+    print('Listening on port %d' % args.port)
+
+    total = Stats()
+    interval = Stats()
+    next_seq = None
+    last_dropped = 0
+    start = interval_start = None
+    try:
+        while True:
+            try:
+                data, addr = sock.recvfrom(65536)
+            except socket.timeout:
+                data = None
+            now = time.monotonic()
+            if data:
+                if len(data) < HEADER.size:
+                    continue
+                (version, _, sample_size, seq, time_hi, time_lo, span_us, dropped, count,
+                 _) = HEADER.unpack_from(data)
+                if version != TELEMETRY_STREAM_VERSION or len(data) < HEADER.size + count * sample_size:
+                    print('bad datagram from %s' % addr[0])
+                    continue
+                if next_seq is None or seq == 0:
+                    # the first datagram, or the sender has started again
+                    if next_seq is not None:
+                        print('sender restarted')
+                    next_seq = seq
+                    last_dropped = dropped
+                    start = interval_start = now
+                for stats in (total, interval):
+                    if seq >= next_seq:
+                        stats.lost += seq - next_seq
+                    else:
+                        # it was counted as lost when the gap was seen
+                        stats.lost -= 1
+                        stats.out_of_order += 1
+                    stats.datagrams += 1
+                    stats.samples += count
+                    stats.bytes += len(data)
+                    stats.dropped += max(dropped - last_dropped, 0)
+                next_seq = max(next_seq, seq + 1)
+                last_dropped = max(last_dropped, dropped)
+            if interval_start is not None and now - interval_start >= args.interval:
+                print_stats('%7.1f-%7.1f s' % (interval_start - start, now - start), interval, now - interval_start)
+                interval = Stats()
+                interval_start = now
+    except KeyboardInterrupt:
+        if start is not None:
+            print_stats('total          ', total, time.monotonic() - start)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,171 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <string.h>
+
+#include "pico/time.h"
+#include "lwip/pbuf.h"
+#include "lwip/udp.h"
+#include "lwip/def.h"
+
+#include "telemetry_stream.h"
+
+#define DEBUG_printf(...)
+
+static inline int pool_index(int i) {
+    return i % TELEMETRY_STREAM_POOL_SIZE;
+}
+
+// Get a datagram ready to be filled or sent again. Returns false if lwIP still has hold of it,
+// which happens if it was queued waiting for an ARP reply
+static bool reset_datagram(telemetry_stream_t *stream, int i) {
+    struct pbuf *p = stream->pool[i];
+    if (p->ref != 1) {
+        return false;
+    }
+    // lwIP leaves the headers it added in front of the payload, even if the send failed
+    if ((uint8_t *)p->payload != stream->payload[i]) {
+        pbuf_remove_header(p, stream->payload[i] - (uint8_t *)p->payload);
+    }
+    return true;
+}
+
+static void queue_datagram(telemetry_stream_t *stream) {
+    int i = pool_index(stream->send + stream->queued);
+    telemetry_header_t *header = (telemetry_header_t *)stream->payload[i];
+    header->version = TELEMETRY_STREAM_VERSION;
+    header->reserved = 0;
+    header->sample_size = lwip_htons(stream->sample_size);
+    header->seq = lwip_htonl(stream->seq++);
+    header->time_us_hi = lwip_htonl((uint32_t)(stream->first_time_us >> 32));
+    header->time_us_lo = lwip_htonl((uint32_t)stream->first_time_us);
+    header->span_us = lwip_htonl((uint32_t)(stream->last_time_us - stream->first_time_us));
+    header->dropped = lwip_htonl(stream->dropped);
+    header->count = lwip_htons(stream->count);
+    header->reserved2 = 0;
+
+    // Just the samples that were added are sent. This is our own single pbuf, so the length can be
+    // set directly rather than with pbuf_realloc, which would give the rest of the memory back
+    struct pbuf *p = stream->pool[i];
+    p->len = p->tot_len = sizeof(telemetry_header_t) + stream->count * stream->sample_size;
+
+    stream->queued++;
+    stream->count = 0;
+    async_context_set_work_pending(stream->context, &stream->send_worker);
+}
+
+static void send_worker_fn(__unused async_context_t *context, async_when_pending_worker_t *worker) {
+    telemetry_stream_t *stream = (telemetry_stream_t *)worker->user_data;
+    while (stream->queued > 0) {
+        int i = stream->send;
+        err_t err = udp_sendto(stream->pcb, stream->pool[i], &stream->addr, stream->port);
+        if (err != ERR_OK) {
+            // It's gone, the receiver will see a gap in the sequence
+            DEBUG_printf("telemetry send failed %d\n", err);
+            stream->send_errors++;
+        }
+        stream->send = pool_index(i + 1);
+        stream->queued--;
+    }
+}
+
+static void flush_worker_fn(async_context_t *context, async_at_time_worker_t *worker) {
+    telemetry_stream_t *stream = (telemetry_stream_t *)worker->user_data;
+    if (stream->count > 0 && time_us_64() - stream->fill_start_us >= TELEMETRY_STREAM_FLUSH_MS * 1000) {
+        queue_datagram(stream);
+    }
+    async_context_add_at_time_worker_in_ms(context, worker, TELEMETRY_STREAM_FLUSH_MS / 2);
+}
+
+bool telemetry_stream_add(telemetry_stream_t *stream, uint64_t time_us, const void *sample) {
+    int i = pool_index(stream->send + stream->queued);
+    if (stream->count == 0) {
+        if (stream->queued == TELEMETRY_STREAM_POOL_SIZE || !reset_datagram(stream, i)) {
+            stream->dropped++;
+            return false;
+        }
+        stream->first_time_us = time_us;
+        stream->fill_start_us = time_us_64();
+    }
+    memcpy(stream->payload[i] + sizeof(telemetry_header_t) + stream->count * stream->sample_size, sample,
+           stream->sample_size);
+    stream->count++;
+    stream->last_time_us = time_us;
+    stream->samples++;
+    if (stream->count == stream->max_samples) {
+        queue_datagram(stream);
+    }
+    return true;
+}
+
+void telemetry_stream_flush(telemetry_stream_t *stream) {
+    if (stream->count > 0) {
+        queue_datagram(stream);
+    }
+}
+
+bool telemetry_stream_init(telemetry_stream_t *stream, async_context_t *context, const ip_addr_t *addr, u16_t port,
+                           uint16_t sample_size) {
+    memset(stream, 0, sizeof(*stream));
+    if (sample_size == 0 || sample_size > TELEMETRY_STREAM_DATAGRAM_SIZE - sizeof(telemetry_header_t)) {
+        return false;
+    }
+    stream->context = context;
+    ip_addr_copy(stream->addr, *addr);
+    stream->port = port;
+    stream->sample_size = sample_size;
+    stream->max_samples = (TELEMETRY_STREAM_DATAGRAM_SIZE - sizeof(telemetry_header_t)) / sample_size;
+    stream->send_worker.do_work = send_worker_fn;
+    stream->send_worker.user_data = stream;
+    stream->flush_worker.do_work = flush_worker_fn;
+    stream->flush_worker.user_data = stream;
+
+    async_context_acquire_lock_blocking(context);
+    bool ok = true;
+    // PBUF_TRANSPORT leaves room for the headers, so lwIP doesn't need to allocate any more to send them
+    for (int i = 0; i < TELEMETRY_STREAM_POOL_SIZE && ok; i++) {
+        stream->pool[i] = pbuf_alloc(PBUF_TRANSPORT, TELEMETRY_STREAM_DATAGRAM_SIZE, PBUF_RAM);
+        if (stream->pool[i]) {
+            stream->payload[i] = (uint8_t *)stream->pool[i]->payload;
+        } else {
+            ok = false;
+        }
+    }
+    if (ok) {
+        stream->pcb = udp_new_ip_type(IPADDR_TYPE_ANY);
+        ok = stream->pcb != NULL;
+    }
+    if (ok) {
+        async_context_add_when_pending_worker(context, &stream->send_worker);
+        async_context_add_at_time_worker_in_ms(context, &stream->flush_worker, TELEMETRY_STREAM_FLUSH_MS / 2);
+    }
+    async_context_release_lock(context);
+    if (!ok) {
+        telemetry_stream_deinit(stream);
+    }
+    return ok;
+}
+
+void telemetry_stream_deinit(telemetry_stream_t *stream) {
+    if (!stream->context) {
+        return;
+    }
+    async_context_acquire_lock_blocking(stream->context);
+    async_context_remove_at_time_worker(stream->context, &stream->flush_worker);
+    async_context_remove_when_pending_worker(stream->context, &stream->send_worker);
+    if (stream->pcb) {
+        udp_remove(stream->pcb);
+        stream->pcb = NULL;
+    }
+    for (int i = 0; i < TELEMETRY_STREAM_POOL_SIZE; i++) {
+        if (stream->pool[i]) {
+            pbuf_free(stream->pool[i]);
+            stream->pool[i] = NULL;
+        }
+    }
+    async_context_release_lock(stream->context);
+    stream->context = NULL;
+}
@@ -0,0 +1,97 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _TELEMETRY_STREAM_H_
+#define _TELEMETRY_STREAM_H_
+
+#include "pico/async_context.h"
+#include "lwip/ip_addr.h"
+
+struct pbuf;
+struct udp_pcb;
+
+// Streams fixed size binary samples over UDP, packing as many into each datagram as will fit.
+// The datagrams are allocated once, up front, and are used in turn: one is filled while the
+// others wait to be sent. A full datagram is sent by a worker on the async context, and one that
+// isn't full is sent after TELEMETRY_STREAM_FLUSH_MS so that slow streams aren't held up.
+//
+// Each datagram starts with a telemetry_header_t in network order, followed by count samples of
+// sample_size bytes, as given to telemetry_stream_add. The sequence number goes up by one for each
+// datagram, so the receiver can count the ones that are lost, and dropped counts the samples the
+// sender threw away because all the datagrams were waiting to be sent.
+// telemetry_receiver.py receives them on a host.
+
+#define TELEMETRY_STREAM_VERSION 1
+
+// Largest UDP payload that doesn't need to be fragmented on a 1500 byte MTU
+#ifndef TELEMETRY_STREAM_DATAGRAM_SIZE
+#define TELEMETRY_STREAM_DATAGRAM_SIZE 1472
+#endif
+
+// Number of datagrams allocated
+#ifndef TELEMETRY_STREAM_POOL_SIZE
+#define TELEMETRY_STREAM_POOL_SIZE 8
+#endif
+
+// Longest a sample waits in a datagram that isn't full
+#ifndef TELEMETRY_STREAM_FLUSH_MS
+#define TELEMETRY_STREAM_FLUSH_MS 20
+#endif
+
+typedef struct telemetry_header_t_ {
+    uint8_t version;
+    uint8_t reserved;
+    uint16_t sample_size;
+    uint32_t seq;
+    uint32_t time_us_hi; // time_us_64 of the first sample
+    uint32_t time_us_lo;
+    uint32_t span_us; // from the first sample to the last
+    uint32_t dropped;
+    uint16_t count;
+    uint16_t reserved2;
+} telemetry_header_t;
+
+typedef struct telemetry_stream_t_ {
+    async_context_t *context;
+    struct udp_pcb *pcb;
+    ip_addr_t addr;
+    u16_t port;
+    uint16_t sample_size;
+    uint16_t max_samples;
+    async_when_pending_worker_t send_worker;
+    async_at_time_worker_t flush_worker;
+
+    // Datagrams from send to send + queued - 1 are waiting to be sent, the next one is being filled
+    struct pbuf *pool[TELEMETRY_STREAM_POOL_SIZE];
+    uint8_t *payload[TELEMETRY_STREAM_POOL_SIZE]; // lwIP moves p->payload when it adds its headers
+    int send;
+    int queued;
+    uint16_t count; // samples in the datagram being filled
+    uint64_t first_time_us;
+    uint64_t last_time_us;
+    uint64_t fill_start_us;
+
+    // Totals since the start
+    uint32_t seq;
+    uint32_t samples;
+    uint32_t dropped;
+    uint32_t send_errors;
+} telemetry_stream_t;
+
+// Start streaming samples of sample_size bytes to addr and port
+bool telemetry_stream_init(telemetry_stream_t *stream, async_context_t *context, const ip_addr_t *addr, u16_t port,
+                           uint16_t sample_size);
+
+// Add a sample taken at time_us. This must be called with the async context lock held, e.g. from a
+// worker. Returns false if the sample was dropped because all the datagrams are waiting to be sent
+bool telemetry_stream_add(telemetry_stream_t *stream, uint64_t time_us, const void *sample);
+
+// Send the samples added so far without waiting for the datagram to fill up
+void telemetry_stream_flush(telemetry_stream_t *stream);
+
+void telemetry_stream_deinit(telemetry_stream_t *stream);
+
+#endif
@@ -13,6 +13,7 @@
 #include "hardware/pio.h"
 #include "hardware/dma.h"
 #include "hardware/irq.h"
+#include "multicore_parallel.h"
 #include "ws2812.pio.h"
 
 #define FRAC_BITS 4
@@ -156,10 +157,10 @@ typedef struct {
     uint frac_brightness; // 256 = *1.0;
 } strip_t;
 
-// takes 8 bit color values, multiply by brightness and store in bit planes
-void transform_strips(strip_t **strips, uint num_strips, value_bits_t *values, uint value_length,
+// takes 8 bit color values from value_start up to value_end, multiply by brightness and store in bit planes
+void transform_strips(strip_t **strips, uint num_strips, value_bits_t *values, uint value_start, uint value_end,
                        uint frac_brightness) {
-    for (uint v = 0; v < value_length; v++) {
+    for (uint v = value_start; v < value_end; v++) {
         memset(&values[v], 0, sizeof(values[v]));
         for (uint i = 0; i < num_strips; i++) {
             if (v < strips[i]->data_len) {
@@ -207,6 +208,19 @@ strip_t *strips[] = {
         &strip1,
 };
 
+typedef struct {
+    uint frac_brightness;
+    value_bits_t *state;
+    const value_bits_t *old_state;
+} frame_t;
+
+// transform and dither the values from start up to end, on whichever core parallel_for gives them to
+void update_values(uint start, uint end, void *user_data) {
+    const frame_t *frame = (const frame_t *) user_data;
+    transform_strips(strips, count_of(strips), colors, start, end, frame->frac_brightness);
+    dither_values(colors + start, frame->state + start, frame->old_state + start, end - start);
+}
+
 // bit plane content dma channel
 #define DMA_CHANNEL 0
 // chain channel for configuring main dma channel to output from disjoint 8 word fragments of memory
@@ -299,6 +313,9 @@ int main() {
 
     sem_init(&reset_delay_complete_sem, 1, 1); // initially posted so we don't block first time
     dma_init(pio, sm);
+
+    // the second core does half the work of preparing each frame
+    parallel_init();
     int t = 0;
     while (1) {
         int pat = rand() % count_of(pattern_table);
@@ -308,6 +325,7 @@ int main() {
         puts(dir == 1 ? "(forward)" : dir ? "(backward)" : "(still)");
         int brightness = 0;
         uint current = 0;
+        uint64_t parallel_us = 0;
         for (int i = 0; i < 1000; ++i) {
             current_strip_out = strip0.data;
             current_strip_4color = false;
@@ -316,8 +334,23 @@ int main() {
             current_strip_4color = true;
             pattern_table[pat].pat(NUM_PIXELS, t);
 
-            transform_strips(strips, count_of(strips), colors, NUM_PIXELS * 4, brightness);
-            dither_values(colors, states[current], states[current ^ 1], NUM_PIXELS * 4);
+            frame_t frame = {
+                    .frac_brightness = brightness,
+                    .state = states[current],
+                    .old_state = states[current ^ 1],
+            };
+            if (!i) {
+                // once per pattern, see how long one core takes to do the lot (the result is the same either way)
+                uint64_t start_us = time_us_64();
+                update_values(0, NUM_PIXELS * 4, &frame);
+                printf("Preparing a frame takes %u us on one core", (uint) (time_us_64() - start_us));
+            }
+            uint64_t start_us = time_us_64();
+            parallel_for(0, NUM_PIXELS * 4, update_values, &frame);
+            parallel_us += time_us_64() - start_us;
+            if (!i) {
+                printf(", %u us on two\n", (uint) parallel_us);
+            }
             sem_acquire_blocking(&reset_delay_complete_sem);
             output_strips_dma(states[current], NUM_PIXELS * 4);
 
@@ -326,6 +359,7 @@ int main() {
             brightness++;
             if (brightness == (0x20 << FRAC_BITS)) brightness = 0;
         }
+        printf("Average time on two cores %u us\n", (uint) (parallel_us / 1000));
         memset(&states, 0, sizeof(states)); // clear out errors
     }
 
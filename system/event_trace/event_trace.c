@@ -0,0 +1,88 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdio.h>
+
+#include "pico/stdlib.h"
+#include "hardware/clocks.h"
+
+#include "event_trace.h"
+
+static_assert((EVENT_TRACE_RECORDS & (EVENT_TRACE_RECORDS - 1)) == 0, "EVENT_TRACE_RECORDS must be a power of 2");
+
+event_trace_buffer_t event_trace_buffers[NUM_CORES];
+volatile bool event_trace_enabled;
+
+// The timestamp and the time in microseconds at the same moment, for each core, so the host can put
+// the cores' timestamps on the same timeline
+static struct {
+    bool valid;
+    uint32_t time;
+    uint64_t time_us;
+} sync[NUM_CORES];
+
+// When recording was stopped, which is after the last event on every core. The timestamps wrap, so
+// the host needs a time this close to the events to know which wrap they're in, and when the trace
+// is drained may be long after
+static uint64_t stop_us;
+
+static const char type_chars[] = { 'B', 'E', 'I' };
+
+void event_trace_init(void) {
+    uint core = get_core_num();
+#if defined(__riscv)
+    // make sure the cycle counter is counting
+    riscv_clear_csr(mcountinhibit, 1);
+#elif PICO_RP2350
+    m33_hw->demcr |= M33_DEMCR_TRCENA_BITS;
+    m33_hw->dwt_ctrl |= M33_DWT_CTRL_CYCCNTENA_BITS;
+#endif
+    uint32_t save = save_and_disable_interrupts();
+    sync[core].time = event_trace_time();
+    sync[core].time_us = time_us_64();
+    restore_interrupts(save);
+    sync[core].valid = true;
+}
+
+void event_trace_start(void) {
+    event_trace_enabled = false;
+    for (uint core = 0; core < NUM_CORES; core++) {
+        event_trace_buffers[core].head = 0;
+    }
+    stop_us = 0;
+    __mem_fence_release();
+    event_trace_enabled = true;
+}
+
+void event_trace_stop(void) {
+    event_trace_enabled = false;
+    __mem_fence_release();
+    stop_us = time_us_64();
+}
+
+void event_trace_drain(void) {
+#if defined(__riscv) || PICO_RP2350
+    uint32_t hz = clock_get_hz(clk_sys);
+#else
+    uint32_t hz = 1000000;
+#endif
+    uint64_t now_us = time_us_64();
+    printf("TRACE 1 %u %llu %llu\n", hz, now_us, stop_us ? stop_us : now_us);
+    for (uint core = 0; core < NUM_CORES; core++) {
+        const event_trace_buffer_t *buffer = &event_trace_buffers[core];
+        if (!sync[core].valid) {
+            continue;
+        }
+        uint32_t head = buffer->head;
+        uint32_t count = MIN(head, EVENT_TRACE_RECORDS);
+        printf("CORE %u %u %llu %u\n", core, sync[core].time, sync[core].time_us, head - count);
+        for (uint32_t i = head - count; i != head; i++) {
+            const event_trace_record_t *record = &buffer->records[i & (EVENT_TRACE_RECORDS - 1)];
+            printf("%u %c %u %s\n", core, type_chars[record->site->type], record->time, record->site->name);
+        }
+    }
+    printf("TRACE END\n");
+}
@@ -0,0 +1,127 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _EVENT_TRACE_H_
+#define _EVENT_TRACE_H_
+
+#include "pico.h"
+
+// Records timestamped events into a ring buffer for each core, to see when interrupt handlers and
+// other code actually run. Each core only writes to its own buffer, with interrupts disabled for a
+// few instructions, so recording an event needs no locks and takes a few tens of cycles. The buffers
+// can then be printed to stdio with event_trace_drain, and event_trace_to_json.py turns the output
+// into a Chrome trace, which chrome://tracing or https://ui.perfetto.dev can show.
+//
+// Link with event_trace to record events, or with just event_trace_headers to build with the
+// EVENT_TRACE_ macros compiled out.
+//
+// The timestamps are CPU cycles where the core has a cycle counter (RP2350), or microseconds (RP2040).
+
+#ifndef EVENT_TRACE
+#define EVENT_TRACE 0
+#endif
+
+// Events kept for each core, must be a power of 2
+#ifndef EVENT_TRACE_RECORDS
+#define EVENT_TRACE_RECORDS 1024
+#endif
+
+enum event_trace_type {
+    EVENT_TRACE_TYPE_BEGIN,
+    EVENT_TRACE_TYPE_END,
+    EVENT_TRACE_TYPE_INSTANT,
+};
+
+// One of these is made for each place an event is recorded, so a record only needs a pointer to it
+typedef struct event_trace_site {
+    const char *name;
+    enum event_trace_type type;
+} event_trace_site_t;
+
+typedef struct event_trace_record {
+    uint32_t time;
+    const event_trace_site_t *site;
+} event_trace_record_t;
+
+typedef struct event_trace_buffer {
+    uint32_t head;
+    event_trace_record_t records[EVENT_TRACE_RECORDS];
+} event_trace_buffer_t;
+
+#if EVENT_TRACE
+
+#include "hardware/sync.h"
+#if defined(__riscv)
+#include "hardware/riscv.h"
+#elif PICO_RP2350
+#include "hardware/structs/m33.h"
+#else
+#include "hardware/timer.h"
+#endif
+
+extern event_trace_buffer_t event_trace_buffers[NUM_CORES];
+extern volatile bool event_trace_enabled;
+
+static __force_inline uint32_t event_trace_time(void) {
+#if defined(__riscv)
+    return riscv_read_csr(mcycle);
+#elif PICO_RP2350
+    return m33_hw->dwt_cyccnt;
+#else
+    return time_us_32();
+#endif
+}
+
+static __force_inline void event_trace_record(const event_trace_site_t *site) {
+    if (event_trace_enabled) {
+        event_trace_buffer_t *buffer = &event_trace_buffers[get_core_num()];
+        uint32_t save = save_and_disable_interrupts();
+        event_trace_record_t *record = &buffer->records[buffer->head++ & (EVENT_TRACE_RECORDS - 1)];
+        record->time = event_trace_time();
+        record->site = site;
+        restore_interrupts(save);
+    }
+}
+
+#define event_trace_site_record(NAME, TYPE) do { \
+    static const event_trace_site_t event_trace_site__ = { .name = (NAME), .type = (TYPE) }; \
+    event_trace_record(&event_trace_site__); \
+} while (0)
+
+// Record the start or end of something, such as an interrupt handler. NAME must be a string literal,
+// and each BEGIN should be matched by an END with the same name on the same core
+#define EVENT_TRACE_BEGIN(NAME) event_trace_site_record(NAME, EVENT_TRACE_TYPE_BEGIN)
+#define EVENT_TRACE_END(NAME) event_trace_site_record(NAME, EVENT_TRACE_TYPE_END)
+
+// Record something that happened at a point in time
+#define EVENT_TRACE_INSTANT(NAME) event_trace_site_record(NAME, EVENT_TRACE_TYPE_INSTANT)
+
+// Set up the timestamps on the calling core. Call from each core that records events
+void event_trace_init(void);
+
+// Start recording events on all cores, from empty buffers
+void event_trace_start(void);
+
+// Stop recording events, keeping the most recent EVENT_TRACE_RECORDS for each core
+void event_trace_stop(void);
+
+// Print the events recorded on each core, oldest first. Stop recording first
+void event_trace_drain(void);
+
+#else
+
+#define EVENT_TRACE_BEGIN(NAME) ((void)0)
+#define EVENT_TRACE_END(NAME) ((void)0)
+#define EVENT_TRACE_INSTANT(NAME) ((void)0)
+
+static inline void event_trace_init(void) {}
+static inline void event_trace_start(void) {}
+static inline void event_trace_stop(void) {}
+static inline void event_trace_drain(void) {}
+
+#endif
+
+#endif
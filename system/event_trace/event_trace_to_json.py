@@ -0,0 +1,114 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Turns the output of event_trace_drain into a Chrome trace, which chrome://tracing or
+# https://ui.perfetto.dev can show. Other output is ignored, so the whole serial log can be given.
+# If it holds more than one trace, each is written to its own file, e.g. trace.json, trace_1.json...
+#   ./event_trace_to_json.py minicom.log trace.json
+#
+
+import argparse
+import json
+import os
+import sys
+
+WRAP = 1 << 32
+STOP_SLACK_US = 1000
+
+
+def core_events(core, hz, stop_us, sync_time, sync_us, records):
+    # The timestamps are 32 bit and wrap, so unwrap them going forwards, then work out how many
+    # times they had wrapped before the first one from the time recording stopped, which must be
+    # after the last one. A record being made as recording stopped can be a little later, and the
+    # tick rate is rounded, so allow some slack
+    times = []
+    offset = 0
+    previous = None
+    for _, time, _ in records:
+        if previous is not None and time < previous:
+            offset += WRAP
+        times.append(time + offset)
+        previous = time
+    if not times:
+        return []
+    ticks_per_us = hz / 1e6
+    elapsed = int((stop_us - sync_us + STOP_SLACK_US) * ticks_per_us)
+    last = (times[-1] - sync_time) % WRAP
+    wraps = max(0, (elapsed - last) // WRAP)
+    base = (times[-1] - sync_time) - (last + wraps * WRAP)
+
+    events = []
+    for (kind, _, name), time in zip(records, times):
+        event = {
+            'name': name,
+            'ph': kind.lower() if kind == 'I' else kind,
+            'ts': sync_us + (time - sync_time - base) / ticks_per_us,
+            'pid': 0,
+            'tid': core,
+        }
+        if kind == 'I':
+            event['s'] = 't'
+        events.append(event)
+    return events
+
+
+def read_traces(lines):
+    trace = None
+    for line in lines:
+        fields = line.split()
+        if not fields:
+            continue
+        if fields[0] == 'TRACE' and len(fields) >= 4 and fields[1] == '1':
+            # older traces don't have the time recording stopped, so make do with the drain time
+            trace = {'hz': int(fields[2]), 'stop_us': int(fields[4] if len(fields) >= 5 else fields[3]), 'cores': {}}
+            core = None
+        elif trace is None:
+            continue
+        elif fields[0] == 'TRACE' and fields[1:2] == ['END']:
+            yield trace
+            trace = None
+        elif fields[0] == 'CORE' and len(fields) >= 5:
+            core = {'sync_time': int(fields[2]), 'sync_us': int(fields[3]), 'dropped': int(fields[4]), 'records': []}
+            trace['cores'][int(fields[1])] = core
+        elif core is not None and len(fields) >= 4 and fields[1] in ('B', 'E', 'I'):
+            # the name is the rest of the line, as it can have spaces in it
+            fields = line.rstrip('\r\n').split(' ', 3)
+            try:
+                core['records'].append((fields[1], int(fields[2]), fields[3]))
+            except ValueError:
+                pass
+
+
+def to_json(trace):
+    events = []
+    for number, core in sorted(trace['cores'].items()):
+        events.append({'name': 'thread_name', 'ph': 'M', 'pid': 0, 'tid': number, 'args': {'name': 'core %d' % number}})
+        events += core_events(number, trace['hz'], trace['stop_us'], core['sync_time'], core['sync_us'], core['records'])
+    return {'traceEvents': events, 'displayTimeUnit': 'ns'}
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Convert event_trace output to a Chrome trace')
+    parser.add_argument('log', type=argparse.FileType('r', errors='replace'), help='serial output containing the trace')
+    parser.add_argument('output', nargs='?', default='trace.json', help='trace to write')
+    args = parser.parse_args()
+
+    root, ext = os.path.splitext(args.output)
+    count = 0
+    for trace in read_traces(args.log):
+        output = args.output if not count else '%s_%d%s' % (root, count, ext)
+        with open(output, 'w') as f:
+            json.dump(to_json(trace), f)
+        records = sum(len(core['records']) for core in trace['cores'].values())
+        dropped = sum(core['dropped'] for core in trace['cores'].values())
+        print('Wrote %d events to %s (%d older ones were overwritten)' % (records, output, dropped))
+        count += 1
+    if not count:
+        sys.exit('No traces found')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,121 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "hardware/adc.h"
+#include "hardware/timer.h"
+
+#include "dma_sampler.h"
+
+// Unlike periodic_sampler, which takes an interrupt and a queue spin lock for every sample, this
+// has the DMA take the samples at a rate set by a DMA timer, and only interrupts once per block.
+//
+// First it samples the microsecond timer, which shows how evenly spaced the samples are, then it
+// samples ADC input 0 (GPIO 26) and prints some statistics about the blocks.
+
+#define TIMER_SAMPLE_RATE_HZ 200000
+#define ADC_SAMPLE_RATE_HZ 100000
+
+#define BLOCK_SAMPLES 1024
+#define BLOCK_COUNT 8
+
+#define ADC_PIN 26
+
+static uint32_t timer_buffer[BLOCK_SAMPLES * BLOCK_COUNT];
+static uint16_t adc_buffer[BLOCK_SAMPLES * BLOCK_COUNT];
+
+// Called from the DMA interrupt handler for each block, so keep it short
+static volatile uint32_t blocks_filled;
+static void block_filled(__unused dma_sampler_t *sampler, __unused const void *block) {
+    blocks_filled++;
+}
+
+static void sample_timer(void) {
+    dma_sampler_t sampler;
+    dma_sampler_init(&sampler, &timer_hw->timerawl, DMA_SIZE_32, timer_buffer, BLOCK_SAMPLES, BLOCK_COUNT, NULL, NULL);
+    uint32_t rate_hz = dma_sampler_start(&sampler, TIMER_SAMPLE_RATE_HZ);
+    printf("Sampling the timer at %u Hz\n", rate_hz);
+
+    uint32_t min_delta = UINT32_MAX, max_delta = 0;
+    uint32_t last = 0;
+    bool first = true;
+    for (int blocks = 0; blocks < 50;) {
+        const uint32_t *block = dma_sampler_get_block(&sampler);
+        if (!block) {
+            tight_loop_contents();
+            continue;
+        }
+        for (int i = 0; i < BLOCK_SAMPLES; i++) {
+            if (!first) {
+                uint32_t delta = block[i] - last;
+                min_delta = MIN(min_delta, delta);
+                max_delta = MAX(max_delta, delta);
+            }
+            first = false;
+            last = block[i];
+        }
+        dma_sampler_release_block(&sampler);
+        blocks++;
+    }
+    dma_sampler_stop(&sampler);
+    printf("Time between samples %u to %u us, expected %.1f us, %u overruns\n", min_delta, max_delta,
+           1000000.0f / rate_hz, sampler.overruns);
+}
+
+static void sample_adc(void) {
+    adc_init();
+    adc_gpio_init(ADC_PIN);
+    adc_select_input(ADC_PIN - 26);
+    // Convert as fast as possible and leave the DMA to pick up the latest result at the rate it wants
+    adc_set_clkdiv(0);
+    adc_run(true);
+
+    dma_sampler_t sampler;
+    dma_sampler_init(&sampler, &adc_hw->result, DMA_SIZE_16, adc_buffer, BLOCK_SAMPLES, BLOCK_COUNT, block_filled, NULL);
+    uint32_t rate_hz = dma_sampler_start(&sampler, ADC_SAMPLE_RATE_HZ);
+    printf("Sampling ADC %d at %u Hz in blocks of %d\n", ADC_PIN - 26, rate_hz, BLOCK_SAMPLES);
+
+    absolute_time_t next_report = make_timeout_time_ms(1000);
+    uint32_t blocks = 0;
+    uint64_t sum = 0;
+    uint16_t min_value = UINT16_MAX, max_value = 0;
+    for (int seconds = 0; seconds < 5;) {
+        const uint16_t *block = dma_sampler_get_block(&sampler);
+        if (block) {
+            for (int i = 0; i < BLOCK_SAMPLES; i++) {
+                sum += block[i];
+                min_value = MIN(min_value, block[i]);
+                max_value = MAX(max_value, block[i]);
+            }
+            dma_sampler_release_block(&sampler);
+            blocks++;
+        }
+        if (time_reached(next_report)) {
+            printf("%u blocks (%u filled in total), mean %u, min %u, max %u, %u overruns\n", blocks, blocks_filled,
+                   blocks ? (uint)(sum / (blocks * BLOCK_SAMPLES)) : 0, min_value, max_value, sampler.overruns);
+            blocks = 0;
+            sum = 0;
+            min_value = UINT16_MAX;
+            max_value = 0;
+            next_report = delayed_by_ms(next_report, 1000);
+            seconds++;
+        }
+    }
+    dma_sampler_stop(&sampler);
+    adc_run(false);
+}
+
+int main() {
+    stdio_init_all();
+    printf("DMA paced sampler\n");
+
+    sample_timer();
+    sample_adc();
+
+    printf("Done\n");
+    return 0;
+}
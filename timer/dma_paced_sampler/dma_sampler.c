@@ -0,0 +1,163 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "pico/stdlib.h"
+#include "hardware/clocks.h"
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+
+#include "dma_sampler.h"
+
+// the sampler each claimed channel belongs to, for the interrupt handler
+static dma_sampler_t *channel_samplers[NUM_DMA_CHANNELS];
+static uint active_samplers;
+
+static inline uint8_t *block_address(dma_sampler_t *sampler, uint32_t block) {
+    return sampler->buffer + (block % sampler->block_count) * (sampler->block_samples << sampler->sample_size);
+}
+
+static void __isr dma_sampler_irq_handler(void) {
+    for (uint channel = 0; channel < NUM_DMA_CHANNELS; channel++) {
+        dma_sampler_t *sampler = channel_samplers[channel];
+        if (sampler && dma_irqn_get_channel_status(DMA_SAMPLER_IRQ, channel)) {
+            dma_irqn_acknowledge_channel(DMA_SAMPLER_IRQ, channel);
+            // The control channel has already restarted the data channel, and its read address is
+            // at the table entry after the block being filled now. Take every block up to that one,
+            // as a late interrupt may be for more than one block, or for none if a previous
+            // interrupt has already seen the block this one was raised for
+            uintptr_t next_entry = dma_channel_hw_addr(sampler->channels[1])->read_addr;
+            uint filling = (next_entry - (uintptr_t)sampler->block_addrs) / sizeof(sampler->block_addrs[0]);
+            uint32_t new_blocks = (filling - sampler->blocks_written) % sampler->block_count;
+            while (new_blocks--) {
+                uint32_t block = sampler->blocks_written;
+                sampler->blocks_written = block + 1;
+                if (sampler->callback) {
+                    sampler->callback(sampler, block_address(sampler, block));
+                }
+            }
+        }
+    }
+}
+
+void dma_sampler_init(dma_sampler_t *sampler, const volatile void *src, enum dma_channel_transfer_size sample_size,
+                      void *buffer, uint block_samples, uint block_count, dma_sampler_block_callback_t callback,
+                      void *user_data) {
+    hard_assert(block_count >= 2 && block_count <= DMA_SAMPLER_MAX_BLOCKS && !(block_count & (block_count - 1)));
+    sampler->src = src;
+    sampler->sample_size = sample_size;
+    sampler->buffer = (uint8_t *)buffer;
+    sampler->block_samples = block_samples;
+    sampler->block_count = block_count;
+    sampler->callback = callback;
+    sampler->user_data = user_data;
+}
+
+// Find the fraction of clk_sys closest to rate_hz, with both parts fitting in 16 bits, from the
+// continued fraction of rate_hz / clk_sys
+static void rate_to_fraction(uint32_t rate_hz, uint32_t clk_hz, uint16_t *num, uint16_t *den) {
+    uint32_t p0 = 0, q0 = 1, p1 = 1, q1 = 0;
+    uint32_t a = rate_hz, b = clk_hz;
+    while (b) {
+        uint32_t term = a / b;
+        uint32_t p2 = term * p1 + p0;
+        uint32_t q2 = term * q1 + q0;
+        if (p2 > 0xffff || q2 > 0xffff) {
+            break;
+        }
+        p0 = p1; q0 = q1;
+        p1 = p2; q1 = q2;
+        uint32_t r = a % b;
+        a = b;
+        b = r;
+    }
+    if (!p1 || !q1) {
+        // slower than the timer can go
+        p1 = 1;
+        q1 = 0xffff;
+    }
+    *num = (uint16_t)p1;
+    *den = (uint16_t)q1;
+}
+
+uint32_t dma_sampler_start(dma_sampler_t *sampler, uint32_t rate_hz) {
+    uint32_t clk_hz = clock_get_hz(clk_sys);
+    if (rate_hz > clk_hz) {
+        rate_hz = clk_hz;
+    }
+    uint16_t num, den;
+    rate_to_fraction(rate_hz, clk_hz, &num, &den);
+    sampler->rate_hz = (uint32_t)(((uint64_t)clk_hz * num) / den);
+
+    sampler->timer = (uint)dma_claim_unused_timer(true);
+    dma_timer_set_fraction(sampler->timer, num, den);
+    sampler->channels[0] = (uint)dma_claim_unused_channel(true);
+    sampler->channels[1] = (uint)dma_claim_unused_channel(true);
+    sampler->blocks_written = 0;
+    sampler->blocks_read = 0;
+    sampler->overruns = 0;
+
+    if (!active_samplers++) {
+        irq_add_shared_handler(dma_get_irq_num(DMA_SAMPLER_IRQ), dma_sampler_irq_handler, DMA_SAMPLER_IRQ_PRIORITY);
+        irq_set_enabled(dma_get_irq_num(DMA_SAMPLER_IRQ), true);
+    }
+
+    // each entry is the block to fill after the one before it, so the last one wraps to block 0
+    for (uint i = 0; i < sampler->block_count; i++) {
+        sampler->block_addrs[i] = block_address(sampler, i + 1);
+    }
+
+    uint data_channel = sampler->channels[0];
+    uint control_channel = sampler->channels[1];
+    dma_channel_config config = dma_channel_get_default_config(data_channel);
+    channel_config_set_transfer_data_size(&config, sampler->sample_size);
+    channel_config_set_read_increment(&config, false);
+    channel_config_set_write_increment(&config, true);
+    channel_config_set_dreq(&config, dma_get_timer_dreq(sampler->timer));
+    channel_config_set_chain_to(&config, control_channel);
+    dma_channel_configure(data_channel, &config, block_address(sampler, 0), (const void *)sampler->src,
+                          sampler->block_samples, false);
+
+    // Write the next block's address to the data channel's write address trigger, which restarts it
+    // with the transfer count reloaded. The read address wraps around the table
+    config = dma_channel_get_default_config(control_channel);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_32);
+    channel_config_set_read_increment(&config, true);
+    channel_config_set_write_increment(&config, false);
+    uint table_size = sampler->block_count * sizeof(sampler->block_addrs[0]);
+    channel_config_set_ring(&config, false, (uint)__builtin_ctz(table_size));
+    dma_channel_configure(control_channel, &config, &dma_hw->ch[data_channel].al2_write_addr_trig,
+                          sampler->block_addrs, 1, false);
+
+    channel_samplers[data_channel] = sampler;
+    dma_irqn_set_channel_enabled(DMA_SAMPLER_IRQ, data_channel, true);
+    dma_channel_start(data_channel);
+    return sampler->rate_hz;
+}
+
+void dma_sampler_stop(dma_sampler_t *sampler) {
+    // Stop the data channel chaining to the control channel, then abort the control channel before
+    // the data channel, otherwise either could restart the data channel after it's been aborted
+    uint data_channel = sampler->channels[0];
+    dma_channel_config config = dma_get_channel_config(data_channel);
+    channel_config_set_chain_to(&config, data_channel);
+    dma_channel_set_config(data_channel, &config, false);
+    dma_irqn_set_channel_enabled(DMA_SAMPLER_IRQ, data_channel, false);
+    channel_samplers[data_channel] = NULL;
+    for (uint i = 2; i--;) {
+        uint channel = sampler->channels[i];
+        dma_channel_abort(channel);
+        dma_irqn_acknowledge_channel(DMA_SAMPLER_IRQ, channel);
+        dma_channel_unclaim(channel);
+    }
+    dma_timer_unclaim(sampler->timer);
+
+    if (!--active_samplers) {
+        irq_remove_handler(dma_get_irq_num(DMA_SAMPLER_IRQ), dma_sampler_irq_handler);
+        if (!irq_has_shared_handler(dma_get_irq_num(DMA_SAMPLER_IRQ))) {
+            irq_set_enabled(dma_get_irq_num(DMA_SAMPLER_IRQ), false);
+        }
+    }
+}
@@ -0,0 +1,95 @@
+/**
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _DMA_SAMPLER_H_
+#define _DMA_SAMPLER_H_
+
+#include "pico/types.h"
+#include "hardware/dma.h"
+
+// Samples a peripheral register at a fixed rate into a ring of blocks, without the CPU. A DMA timer
+// paces a data channel which fills one block at a time. When a block is full the data channel
+// chains to a control channel, which writes the address of the next block from a table back into
+// the data channel and so restarts it. The DMA runs on by itself however late the interrupt is, and
+// the CPU only gets an interrupt per block to count the blocks that have been filled, so the cost
+// per block is the same whatever the sample rate.
+
+#ifndef DMA_SAMPLER_IRQ
+#define DMA_SAMPLER_IRQ 0
+#endif
+
+// Most blocks a sampler can have. The control channel reads the table of block addresses as a ring,
+// which must be a power of two in size and aligned to that size
+#ifndef DMA_SAMPLER_MAX_BLOCKS
+#define DMA_SAMPLER_MAX_BLOCKS 16
+#endif
+
+#ifndef DMA_SAMPLER_IRQ_PRIORITY
+#define DMA_SAMPLER_IRQ_PRIORITY PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY
+#endif
+
+struct dma_sampler;
+
+// Called from the DMA interrupt handler each time a block has been filled
+typedef void (*dma_sampler_block_callback_t)(struct dma_sampler *sampler, const void *block);
+
+typedef struct dma_sampler {
+    // set by dma_sampler_init
+    const volatile void *src;
+    enum dma_channel_transfer_size sample_size;
+    uint8_t *buffer;
+    uint block_samples;
+    uint block_count;
+    dma_sampler_block_callback_t callback;
+    void *user_data;
+    // the data channel then the control channel, claimed by dma_sampler_start
+    uint channels[2];
+    uint8_t *block_addrs[DMA_SAMPLER_MAX_BLOCKS] __attribute__((aligned(DMA_SAMPLER_MAX_BLOCKS * sizeof(uint8_t *))));
+    uint timer;
+    uint32_t rate_hz;
+    // blocks filled by the DMA, and taken by dma_sampler_get_block, ever
+    volatile uint32_t blocks_written;
+    uint32_t blocks_read;
+    uint32_t overruns;
+} dma_sampler_t;
+
+// Set up a sampler to read samples of sample_size from src into buffer, which holds block_count
+// blocks of block_samples each. block_count must be a power of two from 2 to DMA_SAMPLER_MAX_BLOCKS.
+// callback may be NULL
+void dma_sampler_init(dma_sampler_t *sampler, const volatile void *src, enum dma_channel_transfer_size sample_size,
+                      void *buffer, uint block_samples, uint block_count, dma_sampler_block_callback_t callback,
+                      void *user_data);
+
+// Start sampling at as close to rate_hz as the DMA timer can get, and return the actual rate. The
+// rate can be from clk_sys / 65535 to clk_sys, though the source may not keep up at the top end
+uint32_t dma_sampler_start(dma_sampler_t *sampler, uint32_t rate_hz);
+
+// Stop sampling and free the DMA channels and timer
+void dma_sampler_stop(dma_sampler_t *sampler);
+
+// Get the oldest block that has been filled but not taken yet, or NULL if there isn't one. If the
+// DMA has filled every block since the last one was taken, the blocks that have been overwritten are
+// skipped and counted as overruns. The block must be released before the DMA gets round to it again
+static inline const void *dma_sampler_get_block(dma_sampler_t *sampler) {
+    uint32_t written = sampler->blocks_written;
+    if (written == sampler->blocks_read) {
+        return NULL;
+    }
+    // the block after the last one written is being filled now
+    if (written - sampler->blocks_read > sampler->block_count - 1) {
+        sampler->overruns += written - sampler->blocks_read - (sampler->block_count - 1);
+        sampler->blocks_read = written - (sampler->block_count - 1);
+    }
+    uint block = sampler->blocks_read % sampler->block_count;
+    return sampler->buffer + block * (sampler->block_samples << sampler->sample_size);
+}
+
+// Give back the block returned by dma_sampler_get_block
+static inline void dma_sampler_release_block(dma_sampler_t *sampler) {
+    sampler->blocks_read++;
+}
+
+#endif